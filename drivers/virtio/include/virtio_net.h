@@ -33,13 +33,37 @@
 
 /* Provided device drvier features on PacketNgin */
 const uint32_t feature_table[] = {
+	VIRTIO_NET_F_CSUM,
+	VIRTIO_NET_F_GUEST_CSUM,
 	VIRTIO_NET_F_MAC,
+	VIRTIO_NET_F_GUEST_TSO4,
+	VIRTIO_NET_F_GUEST_TSO6,
+	VIRTIO_NET_F_HOST_TSO4,
+	VIRTIO_NET_F_HOST_TSO6,
+	VIRTIO_NET_F_HOST_ECN,
 	VIRTIO_NET_F_MRG_RXBUF, 
 	VIRTIO_NET_F_CTRL_VQ,
+	VIRTIO_NET_F_MQ,
+	VIRTIO_F_VERSION_1,
+	VIRTIO_F_RING_PACKED,
+	VIRTIO_RING_F_EVENT_IDX,
+};
+
+/* Features used only along with another: { feature, feature it needs } */
+const uint32_t feature_depends[][2] = {
+	{ VIRTIO_NET_F_GUEST_TSO4, VIRTIO_NET_F_GUEST_CSUM },
+	{ VIRTIO_NET_F_GUEST_TSO6, VIRTIO_NET_F_GUEST_CSUM },
+	{ VIRTIO_NET_F_GUEST_TSO4, VIRTIO_NET_F_MRG_RXBUF },	// 64KB frames are merged from receive buffers
+	{ VIRTIO_NET_F_GUEST_TSO6, VIRTIO_NET_F_MRG_RXBUF },
+	{ VIRTIO_NET_F_HOST_TSO4, VIRTIO_NET_F_CSUM },
+	{ VIRTIO_NET_F_HOST_TSO6, VIRTIO_NET_F_CSUM },
+	{ VIRTIO_NET_F_HOST_ECN, VIRTIO_NET_F_HOST_TSO4 },
+	{ VIRTIO_F_RING_PACKED, VIRTIO_F_VERSION_1 },		// Packed rings are of the modern interface
 };
 
 typedef struct {
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM	1	// Use csum_start, csum_offset
+#define VIRTIO_NET_HDR_F_DATA_VALID	2	// Checksum is valid (rx only)
 	uint8_t flags;
 #define VIRTIO_NET_HDR_GSO_NONE		0	// Not a GSO frame
 #define VIRTIO_NET_HDR_GSO_TCPV4	1	// GSO frame, IPv4 TCP (TSO)
@@ -59,6 +83,8 @@ typedef struct {
 	uint8_t mac[6];
 	/* See VIRTIO_NET_F_STATUS and VIRTIO_NET_S_* above */
 	uint16_t status;
+	/* Most rx/tx queue pairs the device has (if VIRTIO_NET_F_MQ) */
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed)) VirtIONetConfig;
 
 /* Packet Structure that PacketNgin uses */
@@ -77,7 +103,7 @@ typedef struct {
 typedef struct {
 	uint8_t class;
 	uint8_t cmd;
-	uint8_t cmd_specific_data;
+	uint8_t cmd_specific_data[2];	/* 1 byte for RX commands, 2 for MQ */
 	uint8_t ack;
 } __attribute__((packed)) VirtIONetCtrlPacket;
 
@@ -140,4 +166,17 @@ typedef struct {
 #define VIRTIO_NET_CTRL_VLAN_ADD        0
 #define VIRTIO_NET_CTRL_VLAN_DEL        1
 
+/*
+ * Control receive steering of several queue pairs
+ *
+ * The VQ_PAIRS_SET command expects an out entry containing the 2 byte
+ * number of queue pairs to use, between 1 and max_virtqueue_pairs of the
+ * configuration. Packets of a flow are received on the pair they were last
+ * sent from. Available with the VIRTIO_NET_F_MQ feature.
+ */
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN		1
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX		0x8000
+
 #endif /* _VIRTIO_NET_H_ */
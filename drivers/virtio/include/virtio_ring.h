@@ -33,6 +33,7 @@
  * SUCH DAMAGE. 
  */ 
 #include <stdint.h> 
+#include <driver/virtio_packed.h>
 
 /* This marks a buffer as continuing via the next field. */ 
 #define VRING_DESC_F_NEXT       	1 
@@ -127,6 +128,7 @@ typedef struct {
  * Note: for virtio PCI, align is 4096. 
  */ 
 
+/* Queue types, which are also the queue indexes of a single queue pair device */
 #define VIRTIO_RX_QUEUE_IDX 	0
 #define VIRTIO_TX_QUEUE_IDX 	1
 #define VIRTIO_CTRL_QUEUE_IDX 	2
@@ -134,12 +136,20 @@ typedef struct {
 typedef struct {
 	/* Queue index */
 	uint16_t index;
+	/* Queue type (VIRTIO_XXX_QUEUE_IDX) */
+	uint16_t type;
 
 	/* Actual memory layout for this queue */
 	Vring vring;
 
+	/* Packed ring instead, when VIRTIO_F_RING_PACKED is negotiated */
+	bool packed;
+	VringPacked packed_ring;
+
 	/* I/O Address for kick */
 	uint32_t ioaddr;
+	/* Notify register for kick of a modern device, NULL for legacy */
+	volatile uint16_t* notify;
 
 	/* Size of queue */
 	uint32_t size;
@@ -153,6 +163,12 @@ typedef struct {
 	/* Last used index we've seen. */
 	uint16_t last_used_idx;
 
+	/* Device tells when it is to be notified (VIRTIO_RING_F_EVENT_IDX) */
+	bool event;
+	/* Notifications sent, and left out as the device didn't wait for them */
+	uint64_t kicks;
+	uint64_t kicks_avoided;
+
 	/* Tokens for callbacks. For PacketNgin, it's only used by send queue */
 	void *data[];
 } VirtQueue;
@@ -165,10 +181,26 @@ static inline void vring_init(Vring* vr, uint32_t num, void* p, uint64_t align)
 				sizeof(uint16_t) + align - 1) & ~(align - 1)); 
 } 
 
+/* Including used_event and avail_event (VIRTIO_RING_F_EVENT_IDX) */
 static inline uint32_t vring_size(uint32_t num, unsigned long align) { 
 	return ((sizeof(VringDesc)*num + 
-		sizeof(uint16_t) * (2 + num) + align - 1) & ~(align - 1)) +
-		sizeof(uint16_t) * 2 + sizeof(VringUsedElem) * num;
+		sizeof(uint16_t) * (3 + num) + align - 1) & ~(align - 1)) +
+		sizeof(uint16_t) * 3 + sizeof(VringUsedElem) * num;
 } 
 
+/* Whether new_idx passed event_idx since old_idx, so the other side waits for a notification */
+static inline int vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+	return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/* Used index the device interrupts at, after the avail ring (VIRTIO_RING_F_EVENT_IDX) */
+static inline volatile uint16_t* vring_used_event(Vring* vr) {
+	return &vr->avail->ring[vr->num];
+}
+
+/* Avail index the device is to be notified at, after the used ring (VIRTIO_RING_F_EVENT_IDX) */
+static inline volatile uint16_t* vring_avail_event(Vring* vr) {
+	return (volatile uint16_t*)&vr->used->ring[vr->num];
+}
+
 #endif /* __VIRTIO_RING_H__ */
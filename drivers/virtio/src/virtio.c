@@ -5,22 +5,25 @@
 #include <port.h>
 #include <pci.h>
 #include <driver/nicdev.h>
+#include <driver/virtio_modern.h>
 #include <vnic.h>
 #include <timer.h>
+#include <mp.h>
 #include <net/vlan.h>
 #include <net/ether.h>
+#include <net/ip.h>
 // Virtio driver header
 #include "virtio.h"
 #include "virtio_config.h"
 #include "virtio_ring.h"
 #include "virtio_net.h"
 
-#define VNET_HDR_LEN		12
+#define VNET_HDR_LEN		12 // With num_buffers (VIRTIO_NET_F_MRG_RXBUF), 10 without
 #define MAX_DEVICE_COUNT	8
 #define PAGE_SIZE		4096
 #define MAX_BUF_SIZE		1526 // MTU + VNET_HDR_LEN
-
-#define BUDGET_SIZE		64
+#define MAX_FRAME_SIZE		9216 // Largest frame merged from several receive buffers (jumbo)
+#define MAX_GSO_FRAME_SIZE	65535 // Largest TCP frame to be segmented (VIRTIO_NET_F_GUEST_TSO4/6), as much as a Packet holds
 
 //extern int printf (const char *__restrict __format, ...);
 
@@ -29,6 +32,8 @@ typedef struct {
 	uint64_t features;
 	uint32_t ioaddr;
 	uint8_t status;
+	bool modern;		// VirtI/O 1.0 device through memory BARs (VIRTIO_F_VERSION_1), port I/O at ioaddr otherwise
+	VirtIOModern mmio;
 
 	/* Specified structure */
 	  /* VirtI/O over PCI */
@@ -38,41 +43,162 @@ typedef struct {
 } VirtIODevice;
 
 typedef struct {
+	struct _VirtNetPriv* priv;
+	uint16_t index;		// Queue pair index, which is the queue of the NICDevice
+	VirtQueue *rvq, *svq;
+	Packet** rx_packets;	// VNIC pool packet posted in each rx descriptor, NULL for the driver's own buffer
+	VirtIONetHDR* tx_hdrs;	// Header of each transmit descriptor pair
+	Packet* rx_frame;	// Frame merged from several receive buffers when no VNIC buffer has room for it
+	Packet* rx_segment;	// Segment of a TCP frame of the host when no VNIC buffer has room for it
+} VirtNetQueue;
+
+typedef struct _VirtNetPriv {
 	VirtIODevice vdev;
-	VirtQueue *rvq, *svq, *cvq;
+	VirtQueue *cvq;
 	NICDevice* priv;
+	uint16_t queue_count;	// Queue pairs in use, 1 without VIRTIO_NET_F_MQ
+	uint16_t hdr_len;	// Bytes of VirtIONetHDR before each frame
+	bool gso;		// The host sends TCP frames for the driver to segment (VIRTIO_NET_F_GUEST_TSO4/6)
+	bool ecn;		// The host segments TCP frames with CWR set (VIRTIO_NET_F_HOST_ECN)
+	VirtNetQueue queues[NICDEV_MAX_QUEUE_COUNT];
 } VirtNetPriv;
 
-/* Pseudo header used by add_buf for transmit */
-// TODO: Partial checksum, GSO needs to be implemented. At that time, real virtio header replaces it
-static void* pseudo_vnet_hdr;
-
 /* Check whether device used avail buffer */
 static inline bool hasUsedIdx(VirtQueue* vq) {
+	if(vq->packed)
+		return vring_packed_is_used(&vq->packed_ring, 0);
+
 	return vq->vring.used->idx != vq->last_used_idx;
 }
 
+/*
+ * Descriptor of the buffer offset after the next used one, for queues whose
+ * buffers are a descriptor each and used in the order they are posted.
+ */
+static inline uint32_t used_index(VirtQueue* vq, uint16_t offset) {
+	if(vq->packed)
+		return (vq->packed_ring.next_used + offset) % vq->size;
+
+	return (uint16_t)(vq->last_used_idx + offset) % vq->vring.num;
+}
+
+/* Bytes the device wrote to the buffer offset after the next used one */
+static inline uint32_t used_len(VirtQueue* vq, uint16_t offset) {
+	if(vq->packed)
+		return vq->packed_ring.desc[used_index(vq, offset)].len;
+
+	return vq->vring.used->ring[used_index(vq, offset)].len;
+}
+
+/* Whether the device used count buffers of a descriptor each */
+static inline bool has_used(VirtQueue* vq, uint16_t count) {
+	if(vq->packed)
+		return vring_packed_is_used(&vq->packed_ring, count - 1);
+
+	return (uint16_t)(vq->vring.used->idx - vq->last_used_idx) >= count;
+}
+
 /* Let other side know about buffer changed */
 static void kick(VirtQueue* vq) {
-	// Data in guest OS need to be set before we update avail ring index
-	asm volatile("sfence" ::: "memory"); // wmb()
-
-	vq->vring.avail->idx += vq->num_added;
+	// Packed ring buffers are available as soon as they are added
+	uint16_t old = 0;
+	if(!vq->packed) {
+		// Data in guest OS need to be set before we update avail ring index
+		asm volatile("sfence" ::: "memory"); // wmb()
+
+		old = vq->vring.avail->idx;
+		vq->vring.avail->idx = old + vq->num_added;
+	}
 	vq->num_added = 0;
 
 	// Need to update avail index before notify otherside
 	asm volatile("mfence" ::: "memory"); // mb()
 
-	// We force to notify here in that VRING_USED_F_NO_NOTIFY is simply an optimzation
-	port_out16(vq->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+	// A device busy with the queue tells it doesn't wait for a notification, each of which is a VM exit
+	if(vq->event) {
+		bool need = vq->packed ? vring_packed_need_kick(&vq->packed_ring) :
+				vring_need_event(*vring_avail_event(&vq->vring), vq->vring.avail->idx, old);
+		if(!need) {
+			vq->kicks_avoided++;
+			return;
+		}
+	}
+	vq->kicks++;
+
+	// Without it we force to notify here in that VRING_USED_F_NO_NOTIFY is simply an optimzation
+	if(vq->notify)
+		*vq->notify = vq->index;
+	else
+		port_out16(vq->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+}
+
+/*
+ * Add a buffer to a packed ring; data is indexed by ID. Receive buffers are
+ * a descriptor each and their ID is the descriptor, the one they are always
+ * posted in as they are used in order. A transmit pair's ID is its header.
+ */
+static int add_buf_packed(VirtQueue* vq, void* buffer, uint32_t len, VirtIONetHDR* hdr, uint16_t hdr_len) {
+	VringPacked* vr = &vq->packed_ring;
+	uint64_t addr[3];
+	uint32_t lens[3];
+	uint16_t flags[3] = { 0, };
+	uint16_t count;
+	uint16_t id;
+
+	switch(vq->type) {
+		case VIRTIO_RX_QUEUE_IDX :
+			id = vr->next_avail;
+			addr[0] = (uint64_t)buffer;
+			lens[0] = len;
+			flags[0] = VRING_PACKED_DESC_F_WRITE;
+			count = 1;
+			vq->num_free--;
+			break;
+
+		case VIRTIO_TX_QUEUE_IDX :
+			id = vr->next_avail / 2;
+			Packet* packet = (Packet*)buffer;
+			addr[0] = (uint64_t)hdr;
+			lens[0] = hdr_len;
+			addr[1] = (uint64_t)(packet->buffer + packet->start);
+			lens[1] = len;
+			count = 2;
+			vq->num_free--;
+			break;
+
+		case VIRTIO_CTRL_QUEUE_IDX :
+			id = vr->next_avail;
+			VirtIONetCtrlPacket* ctrl = (VirtIONetCtrlPacket*)buffer;
+			addr[0] = (uint64_t)ctrl;
+			lens[0] = 2;
+			addr[1] = (uint64_t)ctrl->cmd_specific_data;
+			lens[1] = len;
+			addr[2] = (uint64_t)&ctrl->ack;
+			lens[2] = 1;
+			flags[2] = VRING_PACKED_DESC_F_WRITE;
+			count = 3;
+			break;
+
+		default :
+			return -1;
+	}
+
+	vq->data[id] = buffer;
+	vring_packed_add(vr, id, addr, lens, flags, count);
+	vq->num_added++;
+
+	return 0;
 }
 
 /* Add available buffer which host OS can use */
 static int add_buf(VirtQueue* vq, void* buffer, uint32_t len) {
+	if(vq->packed)
+		return add_buf_packed(vq, buffer, len, NULL, 0);
+
 	uint32_t head = vq->free_head;
 	Vring* vr = &vq->vring;
 
-	switch(vq->index) {
+	switch(vq->type) {
 		case VIRTIO_RX_QUEUE_IDX : 
 			vq->free_head = (vq->free_head + 1) % vr->num;
 
@@ -99,18 +225,18 @@ static int add_buf(VirtQueue* vq, void* buffer, uint32_t len) {
 		case VIRTIO_CTRL_QUEUE_IDX : 
 			vq->free_head = (vq->free_head + 3) % vr->num;
 
+			// Header, command specific data of len bytes and ack
+			VirtIONetCtrlPacket* ctrl = (VirtIONetCtrlPacket*)buffer;
 			vr->desc[head].flags = VRING_DESC_F_NEXT;
-			vr->desc[head].addr = (uint64_t)buffer;
+			vr->desc[head].addr = (uint64_t)ctrl;
 			vr->desc[head].len = 2;
 
-			uint8_t* ptr = (uint8_t*)buffer;
-
 			vr->desc[head + 1].flags = VRING_DESC_F_NEXT;
-			vr->desc[head + 1].addr = (uint64_t)&ptr[2];
-			vr->desc[head + 1].len = 1;
+			vr->desc[head + 1].addr = (uint64_t)ctrl->cmd_specific_data;
+			vr->desc[head + 1].len = len;
 
 			vr->desc[head + 2].flags = VRING_DESC_F_WRITE;
-			vr->desc[head + 2].addr = (uint64_t)&ptr[3];
+			vr->desc[head + 2].addr = (uint64_t)&ctrl->ack;
 			vr->desc[head + 2].len = 1;
 
 			break;
@@ -132,6 +258,17 @@ static int add_buf(VirtQueue* vq, void* buffer, uint32_t len) {
 
 /* Get used buffer which host OS used */
 static void* get_buf(VirtQueue* vq, uint32_t* len) {
+	if(vq->packed) {
+		uint16_t id;
+		if(!vring_packed_get(&vq->packed_ring, &id, len))
+			return NULL;
+
+		vq->num_free++;
+		vq->last_used_idx++;
+
+		return vq->data[id];
+	}
+
 	if(!hasUsedIdx(vq)) {
 		return NULL;
 	}
@@ -152,8 +289,13 @@ static void* get_buf(VirtQueue* vq, uint32_t* len) {
 }
 
 /* Get virtio configuration */
-static void get_config(uint32_t ioaddr, uint32_t offset, void *buf, uint32_t len) {
-	void* ioaddr_offset = (void*)(uint64_t)(ioaddr + 20 + offset);
+static void get_config(VirtIODevice* vdev, uint32_t offset, void *buf, uint32_t len) {
+	if(vdev->modern) {
+		virtio_modern_get_config(&vdev->mmio, offset, buf, len);
+		return;
+	}
+
+	void* ioaddr_offset = (void*)(uint64_t)(vdev->ioaddr + 20 + offset);
 
 	uint8_t *ptr = buf;
 	for (uint32_t i = 0; i < len; i++) 
@@ -162,21 +304,33 @@ static void get_config(uint32_t ioaddr, uint32_t offset, void *buf, uint32_t len
 
 /* Check whether virtio device has specific features */
 static bool device_has_feature(const VirtIODevice* vdev, uint32_t fbit) {
-	if(fbit > 32) {
-		printf("Feature bit needs to be under 32\n");
+	if(fbit >= 64) {
+		printf("Feature bit needs to be under 64\n");
 		return 0;
 	}
 
 	return 1UL & (vdev->features >> fbit);
 }
 
+/* Add status to virtio configuration status space */
+static void add_status(VirtIODevice* vdev, uint8_t status) {
+	vdev->status |= status;
+	if(vdev->modern)
+		virtio_modern_set_status(&vdev->mmio, vdev->status);
+	else
+		port_out8(vdev->ioaddr + VIRTIO_PCI_STATUS, vdev->status);
+}
+
 /* Synchronize and determine features with host */
 static int synchronize_features(VirtIODevice* vdev) {
 	uint64_t device_features;
 	uint64_t driver_features;
 
-	// Figure out what features device supports
-	device_features = port_in32(vdev->ioaddr + VIRTIO_PCI_HOST_FEATURES);	
+	// Figure out what features device supports; legacy devices have 32 feature bits
+	if(vdev->modern)
+		device_features = virtio_modern_get_features(&vdev->mmio);
+	else
+		device_features = port_in32(vdev->ioaddr + VIRTIO_PCI_HOST_FEATURES);	
 
 	// Features supported by both device and driver
 	uint32_t fbit;
@@ -185,55 +339,75 @@ static int synchronize_features(VirtIODevice* vdev) {
 
 	for(int i = 0; i < count; i++) {
 		fbit = feature_table[i];
-		if(fbit > 32) {
-			printf("We only support 32 feature bits\n");
+		if(fbit >= 64) {
+			printf("We only support 64 feature bits\n");
 			return -1;
 		}
 		driver_features |= (1ULL << fbit);
 	}
 	driver_features &= device_features;
 
+	count = sizeof(feature_depends) / sizeof(feature_depends[0]);
+	for(int i = 0; i < count; i++) {
+		if(!(driver_features & (1ULL << feature_depends[i][1])))
+			driver_features &= ~(1ULL << feature_depends[i][0]);
+	}
+
 	// Finally determine features that we are going to use 
-	port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, driver_features);
+	if(!vdev->modern) {
+		port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, driver_features);
+		vdev->features |= driver_features;
+
+		return 0;
+	}
+
+	// A modern device may refuse them
+	virtio_modern_set_features(&vdev->mmio, driver_features);
+	add_status(vdev, VIRTIO_CONFIG_S_FEATURES_OK);
+	if(!(virtio_modern_get_status(&vdev->mmio) & VIRTIO_CONFIG_S_FEATURES_OK))
+		return -2;
+
 	vdev->features |= driver_features;
 
 	return 0;
 }
 
-/* Add status to virtio configuration status space */
-static void add_status(VirtIODevice* vdev, uint8_t status) {
-	vdev->status |= status;
-	port_out8(vdev->ioaddr + VIRTIO_PCI_STATUS, vdev->status);
-}
+/* Prepare headers in the empty send buffers */
+static int prepare_send_buf(VirtQueue* vq, VirtIONetHDR* hdrs, uint32_t num, uint16_t hdr_len) {
+	// Packed ring descriptors are written whole as each packet is added
+	if(vq->packed)
+		return 0;
 
-/* Prepare pseudo header in the empty send buffers */
-static int prepare_send_buf(VirtQueue* vq, uint32_t num) {
-	// Add virtio_net_hdr - virtio_net_hdr is always 0, so we just use pseudo header
+	// Each descriptor pair has a header of its own for the offloads of its packet
 	Vring* vr = &vq->vring;
 	for(uint32_t i = 0; i < num / 2; i++) {
-		vr->desc[2 * i].addr = (uint64_t)pseudo_vnet_hdr;
+		vr->desc[2 * i].addr = (uint64_t)&hdrs[i];
 		vr->desc[2 * i].flags = VRING_DESC_F_NEXT;
-		vr->desc[2 * i].len = VNET_HDR_LEN;
+		vr->desc[2 * i].len = hdr_len;
 	}
 
 	return 0;
 }
 
+/* Bytes of a ring of num descriptors, rounded up to pages */
+static uint32_t ring_size(uint32_t num, bool packed) {
+	uint32_t size = packed ? vring_packed_size(num) : vring_size(num, VIRTIO_PCI_VRING_ALIGN);
+
+	return (size + PAGE_SIZE) & ~PAGE_SIZE;
+}
+
+/* Driver's own receive buffer of a descriptor, which follows the vring */
+static void* recv_buf(VirtQueue* vq, uint32_t index) {
+	void* ring = vq->packed ? (void*)vq->packed_ring.desc : (void*)vq->vring.desc;
+
+	return ring + ring_size(vq->size, vq->packed) + PAGE_SIZE * index;
+}
+
 /* Prepare in the empty receive buffers */
 static int prepare_recv_buf(VirtQueue* vq, uint32_t num) {
-	void* buffer[num]; 
-	//int size = PAGE_ALIGN(vring_size(num, VIRTIO_PCI_VRING_ALIGN)); // check
-	int size = (vring_size(num, VIRTIO_PCI_VRING_ALIGN) + PAGE_SIZE) & ~PAGE_SIZE;
-
 	for(uint32_t i = 0; i < num; i++) {
-		buffer[i] = (void*)((uint64_t)vq->vring.desc + size + PAGE_SIZE * i);
-		if(!buffer[i]) {
-			return -1;
-		}
-
-		if(add_buf(vq, buffer[i], MAX_BUF_SIZE))
+		if(add_buf(vq, recv_buf(vq, i), MAX_BUF_SIZE))
 			return -2;
-
 	}
 
 	// Notify otherside of new buffer
@@ -242,67 +416,151 @@ static int prepare_recv_buf(VirtQueue* vq, uint32_t num) {
 	return 0;
 }
 
-/* Initializing function for virtqueues */
-static int init_vq(VirtIODevice* vdev, uint32_t index, VirtQueue* vqs[]) {
-	// Select the queue we're interested in
-	port_out16(vdev->ioaddr + VIRTIO_PCI_QUEUE_SEL, index);
+/*
+ * Point a receive descriptor to a buffer from a VNIC pool, so that a frame
+ * can be handed to the VNIC without a copy, or back to the driver's own buffer.
+ * Receive descriptors are never chained, so descriptor index is the ring slot.
+ */
+static void post_recv_buf(VirtNetQueue* queue, uint32_t index, Packet* packet) {
+	VirtQueue* vq = queue->rvq;
+	void* buffer = packet ? packet->buffer + packet->start - queue->priv->hdr_len : recv_buf(vq, index);
+
+	if(vq->packed)
+		vq->packed_ring.desc[index].addr = (uint64_t)buffer;
+	else
+		vq->vring.desc[index].addr = (uint64_t)buffer;
+	vq->data[index] = buffer;
+	queue->rx_packets[index] = packet;
+}
 
+static void refill_recv_buf(VirtNetQueue* queue, uint32_t index) {
+	Packet* packet = nicdev_rx_alloc(queue->priv->priv, queue->index, MAX_BUF_SIZE);
+	if(packet && packet->start < VNET_HDR_LEN)
+		packet->start = VNET_HDR_LEN;
+
+	post_recv_buf(queue, index, packet);
+}
+
+/*
+ * Post a receive buffer again once its frame is taken. A split ring has it
+ * in the avail ring already, and a packed ring has it written anew in the
+ * descriptor it is always posted in.
+ */
+static void repost_recv_buf(VirtQueue* vq, uint32_t index) {
+	if(vq->packed) {
+		uint64_t addr = (uint64_t)vq->data[index];
+		uint32_t len = MAX_BUF_SIZE;
+		uint16_t flags = VRING_PACKED_DESC_F_WRITE;
+		vring_packed_add(&vq->packed_ring, index, &addr, &len, &flags, 1);
+	}
+
+	vq->num_added++;
+}
+
+/* Initializing function for virtqueues */
+static VirtQueue* init_vq(VirtIODevice* vdev, uint32_t index, uint16_t type) {
 	// Check if queue is either not available or already active
-	int num = port_in32(vdev->ioaddr + VIRTIO_PCI_QUEUE_NUM);
-	if (!num || port_in32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN))
-		return -1;
+	int num;
+	if(vdev->modern) {
+		num = virtio_modern_queue_size(&vdev->mmio, index);
+		if(!num)
+			return NULL;
+	} else {
+		// Select the queue we're interested in
+		port_out16(vdev->ioaddr + VIRTIO_PCI_QUEUE_SEL, index);
+
+		num = port_in32(vdev->ioaddr + VIRTIO_PCI_QUEUE_NUM);
+		if (!num || port_in32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN))
+			return NULL;
+	}
 
 	//int size = PAGE_ALIGN(vring_size(num, VIRTIO_PCI_VRING_ALIGN)); // check
-	int size = (vring_size(num, VIRTIO_PCI_VRING_ALIGN) + PAGE_SIZE) & ~PAGE_SIZE;
-
-	// Alloc and initialize virtqueue 
-	vqs[index] = gmalloc(sizeof(VirtQueue) + sizeof(void*) * num /* For token data */);
-	memset(vqs[index], 0, sizeof(VirtQueue) + sizeof(void*) * num); 
-	vqs[index]->size = num;
-	vqs[index]->last_used_idx = 0;
-	vqs[index]->num_added = 0;
-	vqs[index]->index = index;
-	vqs[index]->ioaddr = vdev->ioaddr;
+	bool packed = device_has_feature(vdev, VIRTIO_F_RING_PACKED);
+	int size = ring_size(num, packed);
 
 	// Assign vring memory space. It must be aligned by page size (4096)
 	if(size > 0x200000 /* 2MB */) {
 		printf("VirtQueue size is over 2MB\n");
-		return -2;
+		return NULL;
 	}
 
+	// Alloc and initialize virtqueue 
+	VirtQueue* vq = gmalloc(sizeof(VirtQueue) + sizeof(void*) * num /* For token data */);
+	if(!vq)
+		return NULL;
+	memset(vq, 0, sizeof(VirtQueue) + sizeof(void*) * num); 
+	vq->size = num;
+	vq->last_used_idx = 0;
+	vq->num_added = 0;
+	vq->index = index;
+	vq->type = type;
+	vq->ioaddr = vdev->ioaddr;
+	vq->packed = packed;
+	vq->event = device_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+
 	void* queue = bmalloc(1);
 	if(!queue) {
 		printf("Queue bmalloc failed\n");
-		return -3;
+		gfree(vq);
+		return NULL;
 	}
 	memset(queue, 0x0, 0x200000); 
 
-	// Activate the queue
-	port_out32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN, (uint32_t)(uint64_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+	// Put everything in free lists; a packet to send takes a descriptor pair
+	vq->num_free = type == VIRTIO_TX_QUEUE_IDX ? num / 2 : num;
+	vq->free_head = 0;
+
+	if(packed) {
+		// Descriptors each buffer ID is made of
+		uint16_t* chain = gmalloc(sizeof(uint16_t) * num);
+		if(!chain) {
+			bfree(queue);
+			gfree(vq);
+			return NULL;
+		}
 
-	// Create the vring 
-	vring_init(&vqs[index]->vring, num, queue, VIRTIO_PCI_VRING_ALIGN);
+		vring_packed_init(&vq->packed_ring, num, queue, chain);
+
+		// We don't have interrupt handler. Tell otherside not to interrupt us
+		vq->packed_ring.driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
 
-	// We don't have interrupt handler. Tell otherside not to interrupt us
-	vqs[index]->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+		vq->notify = virtio_modern_queue_enable(&vdev->mmio, index, num, (uint64_t)vq->packed_ring.desc,
+				(uint64_t)vq->packed_ring.driver, (uint64_t)vq->packed_ring.device);
 
-	// Put everything in free lists 
-	vqs[index]->num_free = num;
-	vqs[index]->free_head = 0;
+		return vq;
+	}
+
+	// Create the vring 
+	vring_init(&vq->vring, num, queue, VIRTIO_PCI_VRING_ALIGN);
+
+	// We don't have interrupt handler. Tell otherside not to interrupt us; with EVENT_IDX used_event
+	// is left at 0, so it interrupts once every 65536 buffers at most
+	vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 
 	for(int i = 0; i < num; i++) {
-		vqs[index]->vring.desc[i].next = i + 1;
+		vq->vring.desc[i].next = i + 1;
 	}
 
-	return 0;
+	// Activate the queue
+	if(vdev->modern)
+		vq->notify = virtio_modern_queue_enable(&vdev->mmio, index, num, (uint64_t)vq->vring.desc,
+				(uint64_t)vq->vring.avail, (uint64_t)vq->vring.used);
+	else
+		port_out32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN, (uint32_t)(uint64_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+
+	return vq;
 }
 
 /* Probing function for PCI device */
 static int virtio_pci_probe(VirtIODevice* vdev) {
+	// Modern interface is used when the device has one, which the legacy only device doesn't
+	vdev->modern = virtio_modern_probe(vdev->dev, &vdev->mmio);
+
 	// Read I/O address
-	vdev->ioaddr = pci_read32(vdev->dev, PCI_BASE_ADDRESS_0) & ~3;
+	vdev->ioaddr = pci_read32(vdev->dev, PCI_BASE_ADDRESS_0);
+	vdev->ioaddr = vdev->ioaddr & PCI_BASE_ADDRESS_SPACE_IO ? vdev->ioaddr & ~3 : 0;
 
-	if(!vdev->ioaddr) 
+	if(!vdev->ioaddr && !vdev->modern) 
 		return -1;
 
 	// Enable device
@@ -320,45 +578,109 @@ static int virtio_pci_probe(VirtIODevice* vdev) {
 	return 0;
 }
 
+/* Packet of the driver's own to put a frame together in */
+static Packet* rx_scratch(uint32_t size) {
+	Packet* packet = gmalloc(sizeof(Packet) + size);
+	if(packet) {
+		bzero(packet, sizeof(Packet));
+		packet->size = size;
+	}
+
+	return packet;
+}
+
+/* Probing function for a receive and transmit queue pair */
+static int virtnet_probe_queue(VirtNetPriv* priv, uint16_t index) {
+	VirtIODevice* vdev = &priv->vdev;
+	VirtNetQueue* queue = &priv->queues[index];
+	queue->priv = priv;
+	queue->index = index;
+
+	// Pair N is made of receive queue 2N and transmit queue 2N + 1
+	queue->rvq = init_vq(vdev, 2 * index, VIRTIO_RX_QUEUE_IDX);
+	queue->svq = init_vq(vdev, 2 * index + 1, VIRTIO_TX_QUEUE_IDX);
+	if(!queue->rvq || !queue->svq)
+		return -1;
+
+	// Make headers for transmit
+	queue->tx_hdrs = gmalloc(sizeof(VirtIONetHDR) * queue->svq->size / 2);
+	if(!queue->tx_hdrs)
+		return -2;
+	bzero(queue->tx_hdrs, sizeof(VirtIONetHDR) * queue->svq->size / 2);
+
+	// Prepare receive buffers in advance  
+	queue->rx_packets = gmalloc(sizeof(Packet*) * queue->rvq->size);
+	if(!queue->rx_packets)
+		return -2;
+	memset(queue->rx_packets, 0, sizeof(Packet*) * queue->rvq->size);
+
+	if(prepare_recv_buf(queue->rvq, queue->rvq->size))
+		return -2;
+	
+	// Prepare headers in send buffers in advance
+	if(prepare_send_buf(queue->svq, queue->tx_hdrs, queue->svq->size, priv->hdr_len))
+		return -3;
+
+	if(device_has_feature(vdev, VIRTIO_NET_F_MRG_RXBUF)) {
+		queue->rx_frame = rx_scratch(priv->gso ? MAX_GSO_FRAME_SIZE : MAX_FRAME_SIZE);
+		if(!queue->rx_frame)
+			return -2;
+	}
+
+	if(priv->gso) {
+		queue->rx_segment = rx_scratch(MAX_FRAME_SIZE);
+		if(!queue->rx_segment)
+			return -2;
+	}
+
+	return 0;
+}
+
 /* Probing function for VirtI/O network device */
 static int virtnet_probe(VirtNetPriv* priv) {
 	VirtIODevice* vdev = &priv->vdev;
-	// VirtI/O network device has three queues (receive, transmit, control)
-	VirtQueue* vqs[3];
 
 	// Confiuration may specify what MAC to use. Otherwise set designated MAC
-	get_config(vdev->ioaddr, 0, vdev->config.mac, ETH_ALEN);
-	if(!vdev->ioaddr) {
+	get_config(vdev, 0, vdev->config.mac, ETH_ALEN);
+	if(!vdev->ioaddr && !vdev->modern) {
 		memcpy(vdev->config.mac, "\0GURUM", ETH_ALEN);
 	}
 
 	// Get link status 
-	get_config(vdev->ioaddr, 6, &vdev->config.status, 2);
-	
-	// Check whether we supports control queue 
-	int nvqs = device_has_feature(&priv->vdev, VIRTIO_NET_F_CTRL_VQ) ? 3 : 2;
+	get_config(vdev, 6, &vdev->config.status, 2);
+
+	// Frames larger than a receive buffer are merged from several, whose number is in the header; modern devices always have it
+	priv->hdr_len = device_has_feature(vdev, VIRTIO_NET_F_MRG_RXBUF) || device_has_feature(vdev, VIRTIO_F_VERSION_1) ? VNET_HDR_LEN : VNET_HDR_LEN - 2;
+	priv->gso = device_has_feature(vdev, VIRTIO_NET_F_GUEST_TSO4) || device_has_feature(vdev, VIRTIO_NET_F_GUEST_TSO6);
+	priv->ecn = device_has_feature(vdev, VIRTIO_NET_F_HOST_ECN);
+
+	// Queue pairs are set through the control queue. One per core which can poll one on its own is enough
+	bool has_cvq = device_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ);
+	vdev->config.max_virtqueue_pairs = 1;
+	if(has_cvq && device_has_feature(vdev, VIRTIO_NET_F_MQ))
+		get_config(vdev, 8, &vdev->config.max_virtqueue_pairs, 2);
+
+	priv->queue_count = vdev->config.max_virtqueue_pairs;
+	if(priv->queue_count > NICDEV_MAX_QUEUE_COUNT)
+		priv->queue_count = NICDEV_MAX_QUEUE_COUNT;
+	if(priv->queue_count > 1 + (mp_processor_count() - 1) / 2)
+		priv->queue_count = 1 + (mp_processor_count() - 1) / 2;
+	if(priv->queue_count == 0)
+		priv->queue_count = 1;
 
 	// Set for queues
-	for(int i = 0; i < nvqs; i++) 
-		if(init_vq(vdev, i, vqs))
-			return -1;
-
-	priv->rvq = vqs[0];
-	priv->svq = vqs[1];
-	if(nvqs == 3)
-		priv->cvq = vqs[2];
-
-	// Make pseudo header for transmit
-	pseudo_vnet_hdr = gmalloc(sizeof(VirtIONetHDR));
-	bzero(pseudo_vnet_hdr, sizeof(VirtIONetHDR));
+	for(int i = 0; i < priv->queue_count; i++) {
+		int err = virtnet_probe_queue(priv, i);
+		if(err)
+			return err;
+	}
 
-	// Prepare receive buffers in advance  
-	if(prepare_recv_buf(priv->rvq, priv->rvq->size))
-		return -2;
-	
-	// Prepare pseudo header in send buffers in advance  
-	if(prepare_send_buf(priv->svq, priv->rvq->size))
-		return -3;
+	// Control queue follows all the queue pairs the device has
+	if(has_cvq) {
+		priv->cvq = init_vq(vdev, 2 * vdev->config.max_virtqueue_pairs, VIRTIO_CTRL_QUEUE_IDX);
+		if(!priv->cvq)
+			return -1;
+	}
 
 	// Device is alive at this point
 	add_status(vdev, VIRTIO_CONFIG_S_DRIVER_OK);
@@ -368,23 +690,36 @@ static int virtnet_probe(VirtNetPriv* priv) {
 
 /* Send control command to VirtI/O network device */
 static bool virtnet_send_command(VirtNetPriv* priv, uint8_t class, uint8_t cmd, void* data) {
-	VirtIONetCtrlPacket* ctrl = gmalloc(sizeof(VirtIONetCtrlPacket));
-	memset(ctrl, 0, sizeof(VirtIONetCtrlPacket));
-
-	// Controlling RX mode is only available now 
-	if(class != VIRTIO_NET_CTRL_RX) {
-		printf("[%02d] Class command not supported\n", class);
+	if(!priv->cvq)
 		return false;
+
+	// Controlling RX mode and queue pairs is only available now 
+	uint32_t len;
+	switch(class) {
+		case VIRTIO_NET_CTRL_RX:
+			len = 1;
+			break;
+		case VIRTIO_NET_CTRL_MQ:
+			len = 2;
+			break;
+		default:
+			printf("[%02d] Class command not supported\n", class);
+			return false;
 	}
+
+	VirtIONetCtrlPacket* ctrl = gmalloc(sizeof(VirtIONetCtrlPacket));
+	memset(ctrl, 0, sizeof(VirtIONetCtrlPacket));
 	ctrl->class = class;
 	ctrl->cmd = cmd;
 	ctrl->ack = ~0;
 
 	// TODO: Other classes need to be implemented. e.g VLAN, MAC Filtering...
-	ctrl->cmd_specific_data = *(uint8_t*)data;
+	memcpy(ctrl->cmd_specific_data, data, len);
 
-	if(add_buf(priv->cvq, ctrl, 4))
+	if(add_buf(priv->cvq, ctrl, len)) {
+		gfree(ctrl);
 		return false;
+	}
 
 	// Notify otherside of new buffer
 	kick(priv->cvq);
@@ -410,71 +745,305 @@ static bool virtnet_send_command(VirtNetPriv* priv, uint8_t class, uint8_t cmd,
 	return true;
 }
 
-/* Function for packet receive */
-static int virtnet_receive(VirtNetPriv* priv, void* buf, uint32_t len) {
-	// Instead of calling add_buf, we just notify that buffer index is updated 
-	VirtQueue* vq = priv->rvq;
-	vq->num_added++; 
-	VirtIONetPacket* vp = (VirtIONetPacket*)buf;
-	NICDevice* nicdev = priv->priv;
+/*
+ * Function for packet receive of a frame of len bytes at ether, in the packet if given.
+ * Returns true when the VNIC took the packet
+ */
+static bool virtnet_receive(VirtNetQueue* queue, VirtIONetHDR* vhdr, Ether* ether, uint32_t len, Packet* packet) {
+	NICDevice* nicdev = queue->priv->priv;
 
-	Ether* ether = (Ether*)vp->data;
+	uint16_t csum_start = vhdr->csum_start;
 	if(ether->type == endian16(ETHER_TYPE_8021Q)) {
 		VLAN* vlan = (VLAN*)ether->payload;
-		for(nicdev = nicdev->next; nicdev; nicdev = nicdev->next) {
-			if(nicdev->vlan_tci != vlan->tci & 0xff0f)
-				continue;
-
+		nicdev = nicdev_get_vlan(nicdev, endian16(vlan->tci));
+		if(nicdev) {
 			memmove((uint8_t*)ether + 4 , ether, ETHER_LEN - 2);
 			ether = (uint8_t*)ether + 4;
 			len -= 4;
-			break;
+			csum_start -= 4;
 		}
 	}
 
-	if(nicdev)
-		nicdev_rx(nicdev, ether, len - VNET_HDR_LEN);
+	if(!nicdev) {
+		nicdev_rx_drop(queue->priv->priv, NIC_DROP_FILTERED);
+		return false;
+	}
 
-	return 0;
+	// The host leaves checksums of frames it made itself partial; they are done here once
+	uint8_t flags = 0;
+	if(vhdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		if(nic_csum_complete((uint8_t*)ether, len, csum_start, vhdr->csum_offset))
+			flags = PACKET_F_RX_CSUM;
+	} else if(vhdr->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+		flags = PACKET_F_RX_CSUM;
+	}
+
+	if(packet) {
+		packet->start = (uint8_t*)ether - packet->buffer;
+		packet->end = packet->start + len;
+		packet->flags = flags;
+
+		return nicdev_rx_packet(nicdev, queue->index, packet);
+	}
+
+	nicdev_rx0(nicdev, ether, len, NULL, 0, flags);
+
+	return false;
+}
+
+/*
+ * Number of receive buffers the next frame is merged from, 0 until the device has used them all.
+ * Buffers are used in the order they are posted, so those of a frame follow each other.
+ */
+static uint16_t recv_buf_count(VirtNetQueue* queue) {
+	VirtQueue* vq = queue->rvq;
+	if(!hasUsedIdx(vq))
+		return 0;
+
+	if(!queue->rx_frame)
+		return 1;
+
+	asm volatile("lfence" ::: "memory"); //rmb();
+
+	VirtIONetHDR* vhdr = vq->data[used_index(vq, 0)];
+	uint16_t count = vhdr->num_buffers;
+	if(count <= 1 || count > vq->size)
+		return 1;
+
+	return has_used(vq, count) ? count : 0;
+}
+
+/*
+ * Cut a TCP frame of the host into segments of the MSS and receive them.
+ * The host leaves the TCP checksum to be filled in, as a stack asking the
+ * device for it does, so each segment is summed here.
+ */
+static void virtnet_receive_gso(VirtNetQueue* queue, VirtIONetHDR* vhdr, Packet* frame) {
+	NICDevice* nicdev = queue->priv->priv;
+
+	frame->flags = 0;
+	nic_packet_parse(frame);
+	frame->flags |= PACKET_F_TX_CSUM | PACKET_F_TX_GSO;
+	frame->gso_size = vhdr->gso_size;
+
+	uint16_t count = nic_packet_gso_count(frame);
+	size_t size = nic_packet_gso_size(frame);
+	if(!count || size > queue->rx_segment->size) {
+		nicdev_rx_drop(nicdev, NIC_DROP_FILTERED);
+		return;
+	}
+
+	VirtIONetHDR segment_hdr = { .flags = VIRTIO_NET_HDR_F_DATA_VALID };
+	for(uint16_t i = 0; i < count; i++) {
+		Packet* packet = nicdev_rx_alloc(nicdev, queue->index, size);
+		Packet* segment = packet ? packet : queue->rx_segment;
+		if(!packet)
+			segment->start = 0;
+
+		if(!nic_packet_gso_segment(frame, i, segment)) {
+			if(packet)
+				nic_free(packet);
+			nicdev_rx_drop(nicdev, NIC_DROP_FILTERED);
+			return;
+		}
+		nic_packet_tx_csum(segment);
+
+		Ether* ether = (Ether*)(segment->buffer + segment->start);
+		if(!virtnet_receive(queue, &segment_hdr, ether, segment->end - segment->start, packet) && packet)
+			nic_free(packet);
+	}
+}
+
+/*
+ * Merge a frame of several receive buffers into a buffer of the VNIC which
+ * took the last frame, or the queue's own if it has none with room, and
+ * receive it. The receive buffers stay posted as they are.
+ */
+static void virtnet_receive_merged(VirtNetQueue* queue, uint16_t count) {
+	VirtQueue* vq = queue->rvq;
+	NICDevice* nicdev = queue->priv->priv;
+	uint16_t hdr_len = queue->priv->hdr_len;
+
+	VirtIONetHDR vhdr;
+	memcpy(&vhdr, vq->data[used_index(vq, 0)], sizeof(VirtIONetHDR));
+
+	uint32_t size = 0;
+	for(uint16_t i = 0; i < count; i++)
+		size += used_len(vq, i);
+	size -= hdr_len;
+
+	// TCP frames to be segmented are put together in the queue's own buffer
+	Packet* packet = NULL;
+	if(vhdr.gso_type == VIRTIO_NET_HDR_GSO_NONE && size <= MAX_FRAME_SIZE)
+		packet = nicdev_rx_alloc(nicdev, queue->index, size);
+
+	Packet* frame = packet;
+	if(!packet && size <= queue->rx_frame->size) {
+		frame = queue->rx_frame;
+		frame->start = 0;
+	}
+
+	uint32_t offset = 0;
+	for(uint16_t i = 0; i < count; i++) {
+		uint32_t index = used_index(vq, 0);
+		uint32_t len;
+		uint8_t* buf = get_buf(vq, &len);
+
+		uint32_t skip = i == 0 ? hdr_len : 0;
+		if(frame)
+			memcpy(frame->buffer + frame->start + offset, buf + skip, len - skip);
+		offset += len - skip;
+
+		if(!queue->rx_packets[index])
+			refill_recv_buf(queue, index);
+		repost_recv_buf(vq, index);
+	}
+
+	if(!frame) {
+		nicdev_rx_drop(nicdev, NIC_DROP_FILTERED);
+		return;
+	}
+
+	if(vhdr.gso_type != VIRTIO_NET_HDR_GSO_NONE && queue->rx_segment) {
+		frame->end = frame->start + size;
+		virtnet_receive_gso(queue, &vhdr, frame);
+		return;
+	}
+
+	if(!virtnet_receive(queue, &vhdr, (Ether*)(frame->buffer + frame->start), size, packet) && packet)
+		nic_free(packet);
 }
 
 /* Function for packet send */
-static int virtnet_send(VirtNetPriv* priv, Packet* packet) {
+static int virtnet_send(VirtNetQueue* queue, Packet* packet) {
 	// Check whether free descriptor exists to prevent buffer overflow 
-	VirtQueue* vq = priv->svq;
+	VirtQueue* vq = queue->svq;
 	if(vq->num_free == 0) {
 		nic_free(packet);
 
 		return -1;
 	}
 
-	// Add new buffer and try to send 
+	// The device fills in the checksum it is asked for
 	int len = packet->end - packet->start;
-	add_buf(vq, packet, len);
+	uint32_t slot = vq->packed ? vq->packed_ring.next_avail / 2 : vq->free_head / 2;
+	VirtIONetHDR* hdr = &queue->tx_hdrs[slot];
+	hdr->flags = 0;
+	if(packet->flags & PACKET_F_TX_CSUM && packet->flags & PACKET_F_L4 &&
+			(packet->l4_proto == IP_PROTOCOL_TCP || packet->l4_proto == IP_PROTOCOL_UDP)) {
+		hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr->csum_start = packet->l4;
+		hdr->csum_offset = packet->l4_proto == IP_PROTOCOL_TCP ? 16 : 6;
+		if(hdr->csum_start + hdr->csum_offset + 2 > len)
+			hdr->flags = 0;
+	}
+
+	// and cuts a TCP frame into segments of the MSS, as the VNIC leaves it to devices which can
+	hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+	if(hdr->flags && packet->flags & PACKET_F_TX_GSO && nic_packet_gso_count(packet) > 1) {
+		uint8_t* frame = packet->buffer + packet->start;
+		hdr->gso_type = frame[packet->l3] >> 4 == 4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+		if(queue->priv->ecn && frame[packet->l4 + 13] & 0x80)
+			hdr->gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+		hdr->hdr_len = nic_packet_gso_size(packet) - packet->gso_size;
+		hdr->gso_size = packet->gso_size;
+	}
+
+	// Add new buffer and try to send 
+	if(vq->packed)
+		add_buf_packed(vq, packet, len, hdr, queue->priv->hdr_len);
+	else
+		add_buf(vq, packet, len);
 
 	return 0;
 }
 
-static bool poll(NICDevice* nicdev) {
+/* Give the driver's own buffers back to the descriptors holding packets of the VNIC's pool, and free the packets */
+static void remove_recv_buf(VirtNetQueue* queue, VNIC* vnic) {
+	for(uint32_t i = 0; i < queue->rvq->size; i++) {
+		Packet* packet = queue->rx_packets[i];
+		if(packet && nic_find_by_packet(packet) == vnic->pool_nic) {
+			post_recv_buf(queue, i, NULL);
+			nic_free(packet);
+		}
+	}
+}
+
+static bool virtnet_poll(VirtNetQueue* queue) {
 	uint32_t len;
 	int received = 0;
 	void* buf;
 
- 	VirtNetPriv* priv = nicdev->priv;
-	VirtQueue* vq = priv->rvq;
-	while((BUDGET_SIZE > received) && (buf = get_buf(vq, &len))) {
-		virtnet_receive(priv, buf, len);
+	NICDevice* nicdev = queue->priv->priv;
+	NICDeviceQueue* nicdev_queue = &nicdev->queues[queue->index];
+	VirtQueue* vq = queue->rvq;
+
+	uint16_t budget = nicdev_queue->rx_budget;
+
+	// Frames no VNIC has room for wait in the ring, and the host holds back the rest
+	if(nicdev_rx_pressure(nicdev) & VNIC_PRESSURE_QUEUE)
+		return true;
+
+	uint16_t count;
+	while((budget > received) && (count = recv_buf_count(queue))) {
 		received++;
+		if(count > 1) {
+			virtnet_receive_merged(queue, count);
+			continue;
+		}
+
+		// Instead of calling add_buf, we just notify that buffer index is updated 
+		uint32_t index = used_index(vq, 0);
+		buf = get_buf(vq, &len);
+
+		Packet* packet = queue->rx_packets[index];
+		uint16_t hdr_len = queue->priv->hdr_len;
+		bool taken = virtnet_receive(queue, buf, (Ether*)((uint8_t*)buf + hdr_len), len - hdr_len, packet);
+
+		// Frames copied out of the driver's own buffer or a VNIC packet leave it posted as is
+		if(taken || !packet)
+			refill_recv_buf(queue, index);
+		repost_recv_buf(vq, index);
+	}
+
+	// Frames the device has used and the budget left for the next poll; only whether there are any counts
+	uint16_t backlog = hasUsedIdx(vq);
+	nicdev_queue->rx_budget = poll_budget_update(&nicdev_queue->rx_poll, budget, received, backlog);
+
+	// VLAN devices share the rx queue of the parent
+	if(received) {
+		for(NICDevice* dev = nicdev; dev; dev = dev->next)
+			nicdev_rx_flush(dev);
 	}
  
 	if(vq->num_free > vq->size / 2) {
 		kick(vq);
 		vq->num_free = 0;
 	}
+
+	// Notifications of the pair so far, sent and left out
+	nicdev_queue->kicks = vq->kicks + queue->svq->kicks;
+	nicdev_queue->kicks_avoided = vq->kicks_avoided + queue->svq->kicks_avoided;
  
 	return true;
 }
 
+static bool poll(NICDevice* nicdev) {
+	VirtNetPriv* priv = nicdev->priv;
+
+	return virtnet_poll(&priv->queues[0]);
+}
+
+/*
+ * Give the driver's own buffers back to the descriptors holding packets of the VNIC's pool.
+ * Pairs polled by other cores are parked meanwhile (see nicdev_poll_stop()).
+ */
+static void virtio_remove_vnic(NICDevice* nicdev, VNIC* vnic) {
+	VirtNetPriv* priv = nicdev->priv;
+	for(int i = 0; i < priv->queue_count; i++)
+		remove_recv_buf(&priv->queues[i], vnic);
+}
+
 static bool process(Packet* packet, void* context) {
 	NICDevice* nicdev = context;
 	if(nicdev->vlan_proto == ETHER_TYPE_8021Q) { //Vlan Tagging
@@ -488,8 +1057,19 @@ static bool process(Packet* packet, void* context) {
 		ether->type = endian16(ETHER_TYPE_8021Q);
 		VLAN* vlan = (VLAN*)ether->payload;
 		vlan->tci = nicdev->vlan_tci;
+
+		// Headers after the tag are further from start
+		packet->l3 += 4;
+		packet->l4 += 4;
 	}
-	return virtnet_send(nicdev->priv, packet) == 0 ? true : false;
+	VirtNetPriv* priv = nicdev->priv;
+
+	return virtnet_send(&priv->queues[0], packet) == 0 ? true : false;
+}
+
+/* VLAN devices send through pair 0, so only the physical device's own VNICs are sent here */
+static bool process_queue(Packet* packet, void* context) {
+	return virtnet_send(context, packet) == 0 ? true : false;
 }
 
 static bool virtio_xmit(NICDevice* nicdev, Packet* packet) {
@@ -498,13 +1078,13 @@ static bool virtio_xmit(NICDevice* nicdev, Packet* packet) {
  
  	// Free used buffer
  	void* buf;
- 	while((buf = get_buf(priv->svq, NULL))) {
+ 	while((buf = get_buf(priv->queues[0].svq, NULL))) {
  		nic_free(buf);
  	}
  
  	// TX
 	if(process(packet, nicdev)) {
-		vq = priv->svq;
+		vq = priv->queues[0].svq;
 		kick(vq);
 	}
 
@@ -517,22 +1097,41 @@ static bool virtio_tx(NICDevice* nicdev) {
  
  	// Free used buffer
  	void* buf;
- 	while((buf = get_buf(priv->svq, NULL))) {
+ 	while((buf = get_buf(priv->queues[0].svq, NULL))) {
  		nic_free(buf);
  	}
  
- 	// TX
- 	int nicdev_tx(NICDevice* dev,
- 			bool (*process)(Packet* packet, void* context), void* context);
- 	int count = nicdev_tx(nicdev, process, nicdev);
+ 	// TX: VLAN devices send all their VNICs, the physical device the ones steered to pair 0
+	int count;
+	if(nicdev != priv->priv)
+		count = nicdev_tx(nicdev, process, nicdev);
+	else
+		count = nicdev_tx_queue(nicdev, 0, process_queue, &priv->queues[0]);
+
 	if(count) {
-		vq = priv->svq;
+		vq = priv->queues[0].svq;
 		kick(vq);
 	}
 
 	return true;
 }
 
+/* Busy event of a queue pair polled by a core of its own: receive and send what is steered to it */
+static bool virtio_queue_poll(void* context) {
+	VirtNetQueue* queue = context;
+	virtnet_poll(queue);
+
+ 	void* buf;
+ 	while((buf = get_buf(queue->svq, NULL))) {
+ 		nic_free(buf);
+ 	}
+
+	if(nicdev_tx_queue(queue->priv->priv, queue->index, process_queue, queue))
+		kick(queue->svq);
+
+	return true;
+}
+
 
 int init(void* device, void* data) {
 	int err;
@@ -585,11 +1184,34 @@ int init(void* device, void* data) {
 		nicdev->mac |= (uint64_t)priv->vdev.config.mac[i] << (ETH_ALEN - i - 1) * 8;
 	}
 
+	// Devices without the control queue are promiscuous from reset too
+	nicdev->promisc = true;
+
 	extern NICDriver device_driver;
 	nicdev->driver = (void*)&device_driver;
 	nicdev->priv = priv;
+	if(device_has_feature(&priv->vdev, VIRTIO_NET_F_CSUM))
+		nicdev->offloads |= NICDEV_OFFLOAD_TX_CSUM;
+	if(device_has_feature(&priv->vdev, VIRTIO_NET_F_HOST_TSO4))
+		nicdev->offloads |= NICDEV_OFFLOAD_TSO4;
+	if(device_has_feature(&priv->vdev, VIRTIO_NET_F_HOST_TSO6))
+		nicdev->offloads |= NICDEV_OFFLOAD_TSO6;
 	priv->priv = nicdev;
 
+	// Receive steering over the queue pairs; the device uses pair 0 only until it is set
+	uint16_t pairs = priv->queue_count;
+	if(pairs > 1 && !virtnet_send_command(priv, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs))
+		priv->queue_count = 1;
+	nicdev->queue_count = priv->queue_count;
+
+	// Receive buffers of MAX_BUF_SIZE each, a jumbo frame is merged from several
+	uint32_t rx_bufs = 0;
+	for(int i = 0; i < priv->queue_count; i++)
+		rx_bufs += priv->queues[i].rvq->size;
+	printf("%d receive buffers of %d bytes, frames up to %d bytes\n", rx_bufs, MAX_BUF_SIZE,
+			priv->queues[0].rx_frame ? MAX_FRAME_SIZE : MAX_BUF_SIZE - priv->hdr_len);
+	printf("%s interface, %s rings\n", priv->vdev.modern ? "Modern" : "Legacy", priv->queues[0].rvq->packed ? "packed" : "split");
+
 	extern int nicdev_register(NICDevice* dev);
 	//TODO check return value
 	nicdev_register(nicdev);
@@ -597,6 +1219,11 @@ int init(void* device, void* data) {
 	event_busy_add(poll, nicdev);
 	event_busy_add(virtio_tx, nicdev);
 
+	for(int i = 1; i < priv->queue_count; i++) {
+		uint8_t core = nicdev_poll_add(nicdev, i, virtio_queue_poll, &priv->queues[i]);
+		printf("Queue pair %d polled on core %d\n", i, mp_apic_id_to_processor_id(core));
+	}
+
 	return 0;
 error: 
 	if(priv)
@@ -606,8 +1233,8 @@ error:
 }
 
 void destroy(int id) {
-	// Destory pseudo header 
-// 	gfree(pseudo_vnet_hdr);
+	// Destory transmit headers
+// 	gfree(priv[id]->tx_hdrs);
 // 
 // 	// Destroy virtqueues
 // 	bfree(priv[id]->rvq->vring.desc);
@@ -646,6 +1273,7 @@ DeviceType device_type = DEVICE_TYPE_NIC;
 
 static PCI_ID pci_ids[] = {
 	PCI_DEVICE(0x1af4, 0x1000, "virtio", NULL), 
+	PCI_DEVICE(0x1af4, VIRTIO_PCI_MODERN_DEVICE_ID(1), "virtio", NULL),	// Without the legacy interface
 	{ 0 }
 };
 
@@ -684,5 +1312,7 @@ NICDriver device_driver = {
 	.get_info = get_info,
 
 	.add_vid = virtnet_vlan_rx_add_vid,
-	.remove_vid = virtnet_vlan_rx_kill_vid
+	.remove_vid = virtnet_vlan_rx_kill_vid,
+
+	.remove_vnic = virtio_remove_vnic,
 };
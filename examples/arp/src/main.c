@@ -24,7 +24,11 @@ void process(NIC* ni) {
 	Ether* ether = (Ether*)(packet->buffer + packet->start);
 	if(endian16(ether->type) == ETHER_TYPE_ARP) {
 		ARP* arp = (ARP*)ether->payload;
-		if(endian16(arp->operation) == 1 && endian32(arp->tpa) == address) {
+		// A packet shared with the queues of other VMs is copied before it is written
+		if(endian16(arp->operation) == 1 && endian32(arp->tpa) == address && nic_packet_unshare(ni, &packet)) {
+			ether = (Ether*)(packet->buffer + packet->start);
+			arp = (ARP*)ether->payload;
+
 			ether->dmac = ether->smac;
 			ether->smac = endian48(ni->mac);
 			arp->operation = endian16(2);
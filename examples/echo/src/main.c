@@ -8,23 +8,45 @@
 #include <net/checksum.h>
 #include <net/udp.h>
 
+#define BURST_SIZE	32
+
+static uint32_t address = 0xc0a8640a;	// 192.168.100.10
+
 void ginit(int argc, char** argv) {
+	// Another address may be given, so that several echo VMs share a network
+	for(int i = 0; i < argc; i++) {
+		uint32_t a, b, c, d;
+		if(sscanf(argv[i], "%u.%u.%u.%u", &a, &b, &c, &d) == 4) {
+			address = a << 24 | b << 16 | c << 8 | d;
+			break;
+		}
+	}
 }
 
 void init(int argc, char** argv) {
 }
 
-static uint32_t address = 0xc0a8640a;	// 192.168.100.10
-
-void process(NIC* ni) {
-	Packet* packet = nic_rx(ni);
-	if(!packet)
-		return;
+static Ether* frame(Packet* packet) {
+	return (Ether*)(packet->buffer + packet->start);
+}
 
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
+/**
+ * A packet shared with the queues of other VMs is copied before it is
+ * written, so *packet may be set to the copy.
+ *
+ * @return true if the packet is turned into a reply to be sent
+ */
+bool process(NIC* ni, Packet** packet) {
+	Ether* ether = frame(*packet);
 	if(endian16(ether->type) == ETHER_TYPE_ARP) {
 		ARP* arp = (ARP*)ether->payload;
 		if(endian16(arp->operation) == 1 && endian32(arp->tpa) == address) {
+			if(!nic_packet_unshare(ni, packet))
+				return false;
+
+			ether = frame(*packet);
+			arp = (ARP*)ether->payload;
+
 			ether->dmac = ether->smac;
 			ether->smac = endian48(ni->mac);
 			arp->operation = endian16(2);
@@ -33,17 +55,21 @@ void process(NIC* ni) {
 			arp->sha = ether->smac;
 			arp->spa = endian32(address);
 
-			nic_tx(ni, packet);
-			packet = NULL;
+			return true;
 		}
 	} else if(endian16(ether->type) == ETHER_TYPE_IPv4) {
 		IP* ip = (IP*)ether->payload;
 		if(ip->protocol == IP_PROTOCOL_ICMP && endian32(ip->destination) == address) {
+			if(!nic_packet_unshare(ni, packet))
+				return false;
+
+			ether = frame(*packet);
+			ip = (IP*)ether->payload;
 			ICMP* icmp = (ICMP*)ip->body;
 
 			icmp->type = 0;
 			icmp->checksum = 0;
-			icmp->checksum = endian16(checksum(icmp, packet->end - packet->start - ETHER_LEN - IP_LEN));
+			icmp->checksum = endian16(checksum(icmp, (*packet)->end - (*packet)->start - ETHER_LEN - IP_LEN));
 
 			ip->destination = ip->source;
 			ip->source = endian32(address);
@@ -54,11 +80,17 @@ void process(NIC* ni) {
 			ether->dmac = ether->smac;
 			ether->smac = endian48(ni->mac);
 
-			nic_tx(ni, packet);
-			packet = NULL;
+			return true;
 		} else if(ip->protocol == IP_PROTOCOL_UDP) {
 			UDP* udp = (UDP*)ip->body;
 			if(endian16(udp->destination) == 7) {
+				if(!nic_packet_unshare(ni, packet))
+					return false;
+
+				ether = frame(*packet);
+				ip = (IP*)ether->payload;
+				udp = (UDP*)ip->body;
+
 				uint16_t t = udp->destination;
 				udp->destination = udp->source;
 				udp->source = t;
@@ -75,14 +107,33 @@ void process(NIC* ni) {
 				ether->dmac = ether->smac;
 				ether->smac = t3;
 
-				nic_tx(ni, packet);
-				packet = NULL;
+				return true;
 			}
 		}
 	}
 
-	if(packet)
-		nic_free(packet);
+	return false;
+}
+
+void process_burst(NIC* ni) {
+	Packet* packets[BURST_SIZE];
+	Packet* replies[BURST_SIZE];
+	int reply_count = 0;
+
+	// With multiqueue every thread has a queue pair of its own
+	uint16_t queue = thread_id() % nic_queue_count(ni);
+
+	uint32_t count = nic_rxq_burst(ni, queue, packets, BURST_SIZE);
+	for(uint32_t i = 0; i < count; i++) {
+		if(process(ni, &packets[i]))
+			replies[reply_count++] = packets[i];
+		else
+			nic_free(packets[i]);
+	}
+
+	uint32_t sent = nic_txq_burst(ni, queue, replies, reply_count);
+	for(int i = sent; i < reply_count; i++)
+		nic_free(replies[i]);
 }
 
 void destroy() {
@@ -110,9 +161,7 @@ int main(int argc, char** argv) {
 			i = (i + 1) % count;
 
 			NIC* ni = nic_get(i);
-			if(nic_has_rx(ni)) {
-				process(ni);
-			}
+			process_burst(ni);
 		}
 	}
 
@@ -35,7 +35,11 @@ void process(NIC* ni) {
 
 	if(endian16(ether->type) == ETHER_TYPE_ARP) {
 		ARP* arp = (ARP*)ether->payload;
-		if(endian16(arp->operation) == 1 && endian32(arp->tpa) == address) {
+		// A packet shared with the queues of other VMs is copied before it is written
+		if(endian16(arp->operation) == 1 && endian32(arp->tpa) == address && nic_packet_unshare(ni, &packet)) {
+			ether = (Ether*)(packet->buffer + packet->start);
+			arp = (ARP*)ether->payload;
+
 			ether->dmac = ether->smac;
 			ether->smac = endian48(ni->mac);
 			arp->operation = endian16(2);
@@ -49,7 +53,9 @@ void process(NIC* ni) {
 		}
 	} else if(endian16(ether->type) == ETHER_TYPE_IPv4) {
 		IP* ip = (IP*)ether->payload;
-		if(ip->protocol == IP_PROTOCOL_ICMP && endian32(ip->destination) == address) {
+		if(ip->protocol == IP_PROTOCOL_ICMP && endian32(ip->destination) == address && nic_packet_unshare(ni, &packet)) {
+			ether = (Ether*)(packet->buffer + packet->start);
+			ip = (IP*)ether->payload;
 			ICMP* icmp = (ICMP*)ip->body;
 			icmp->type = 0;
 			icmp->checksum = 0;
@@ -68,7 +74,11 @@ void process(NIC* ni) {
 			packet = NULL;
 		} else if(ip->protocol == IP_PROTOCOL_UDP) {
 			UDP* udp = (UDP*)ip->body;
-			if(endian16(udp->destination) == 7) {
+			if(endian16(udp->destination) == 7 && nic_packet_unshare(ni, &packet)) {
+				ether = (Ether*)(packet->buffer + packet->start);
+				ip = (IP*)ether->payload;
+				udp = (UDP*)ip->body;
+
 				uint16_t t = udp->destination;
 				udp->destination = udp->source;
 				udp->source = t;
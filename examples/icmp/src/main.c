@@ -24,7 +24,11 @@ void process(NIC* ni) {
 	Ether* ether = (Ether*)(packet->buffer + packet->start);
 	if(endian16(ether->type) == ETHER_TYPE_ARP) {
 		ARP* arp = (ARP*)ether->payload;
-		if(endian16(arp->operation) == 1 && endian32(arp->tpa) == address) {
+		// A packet shared with the queues of other VMs is copied before it is written
+		if(endian16(arp->operation) == 1 && endian32(arp->tpa) == address && nic_packet_unshare(ni, &packet)) {
+			ether = (Ether*)(packet->buffer + packet->start);
+			arp = (ARP*)ether->payload;
+
 			ether->dmac = ether->smac;
 			ether->smac = endian48(ni->mac);
 			arp->operation = endian16(2);
@@ -38,7 +42,9 @@ void process(NIC* ni) {
 		}
 	} else if(endian16(ether->type) == ETHER_TYPE_IPv4) {
 		IP* ip = (IP*)ether->payload;
-		if(ip->protocol == IP_PROTOCOL_ICMP && endian32(ip->destination) == address) {
+		if(ip->protocol == IP_PROTOCOL_ICMP && endian32(ip->destination) == address && nic_packet_unshare(ni, &packet)) {
+			ether = (Ether*)(packet->buffer + packet->start);
+			ip = (IP*)ether->payload;
 			ICMP* icmp = (ICMP*)ip->body;
 			icmp->type = 0;
 			icmp->checksum = 0;
@@ -72,6 +72,9 @@ bool cpu_has_feature(int feature) {
 		case CPU_FEATURE_INVARIANT_TSC:
 			EXT(0x07);
 			return !!(d & 0x100);
+		case CPU_FEATURE_RDTSCP:
+			EXT(0x01);
+			return !!(d & 0x8000000);
 		default:
 			return false;
 	}
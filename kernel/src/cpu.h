@@ -10,6 +10,7 @@
 #define CPU_FEATURE_MWAIT_INTERRUPT	4
 #define CPU_FEATURE_TURBO_BOOST		5
 #define CPU_FEATURE_INVARIANT_TSC	6
+#define CPU_FEATURE_RDTSCP		7
 
 int cpu_init();
 bool cpu_has_feature(int feature);
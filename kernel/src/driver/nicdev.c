@@ -1,3 +1,8 @@
+#include <timer.h>
+#include <gmalloc.h>
+#include <lock.h>
+#include <util/event.h>
+#include "../mp.h"
 #include "nicdev.h"
 
 #define ETHER_TYPE_IPv4		0x0800		///< Ether type of IPv4
@@ -64,6 +69,13 @@ typedef struct _Ether {
 NICDevice* nicdevs[MAX_NIC_DEVICE_COUNT]; //key string
 int nicdevs_count;
 
+#define POLL_RUNNING		0		///< NICDeviceQueue.stop: the poller polls
+#define POLL_STOPPING		1		///< Core 0 asks the poller to stop
+#define POLL_STOPPED		2		///< The poller waits for core 0 to set it back to POLL_RUNNING
+
+static uint8_t poll_cores[MP_MAX_CORE_COUNT];	///< Queue pairs polled by each core but core 0, by APIC ID
+static bool poll_started;			///< Cores have started polling; pollers added from now on run on core 0
+
 //for linux driver
 //linux driver can't include glib header
 extern int strncmp (const char *__s1, const char *__s2, size_t __n);
@@ -90,6 +102,21 @@ int nicdev_register(NICDevice* nicdev) {
 
 	if(nicdev_get(nicdev->name)) return -2;
 
+	// Shared by the VLANs to be added
+	if(!nicdev->demux) {
+		nicdev->demux = gmalloc(sizeof(VNICDemux));
+		if(!nicdev->demux) return -1;
+
+		vnic_demux_init(nicdev->demux);
+	}
+
+	if(nicdev->queue_count > NICDEV_MAX_QUEUE_COUNT) return -1;
+
+	for(int i = 0; i < NICDEV_MAX_QUEUE_COUNT; i++) {
+		NICDeviceQueue* queue = &nicdev->queues[i];
+		queue->rx_budget = poll_budget_init(&queue->rx_poll, NICDEV_RX_BUDGET_MIN, NICDEV_RX_BUDGET_MAX, NICDEV_RX_BUDGET);
+	}
+
 	nicdevs[nicdevs_count++] = nicdev;
 
 	return 0;
@@ -114,21 +141,99 @@ NICDevice* nicdev_get_default() {
 	return nicdevs[0];
 }
 
-extern NIC* __nics[NIC_MAX_COUNT];
-extern int __nic_count;
+static inline uint16_t vlan_id(NICDevice* nicdev) {
+	return endian16(nicdev->vlan_tci) & 0xfff;
+}
+
+/* Device whose queue pairs frames of a device are received on; VLAN devices share those of the parent */
+static inline NICDevice* rx_device(NICDevice* nicdev) {
+	return nicdev->parent ? : nicdev;
+}
+
+/*
+ * Stop receiving into VNIC pools before the VNICs which may take frames of
+ * the device change. The driver takes the buffers posted back while the
+ * pollers are stopped (see NICDriver.remove_vnic), from every pool the queue
+ * pairs have followed.
+ */
+static void rx_vnic_clear(NICDevice* nicdev) {
+	NICDevice* parent = rx_device(nicdev);
+	bool posted = false;
+	for(int i = 0; i < NICDEV_MAX_QUEUE_COUNT; i++) {
+		posted |= parent->queues[i].rx_vnic != NULL;
+		parent->queues[i].rx_vnic = NULL;
+	}
+
+	NICDriver* driver = parent->driver;
+	if(!posted || !driver || !driver->remove_vnic) return;
+
+	for(NICDevice* dev = parent; dev; dev = dev->next) {
+		for(int i = 0; i < dev->vnics_count; i++) driver->remove_vnic(dev, dev->vnics[i]);
+	}
+}
+
+/* Receive into the pool of the VM taking every frame of the device, if there is one: of the VNIC steered to each queue pair, or any */
+static void rx_vnic_set(NICDevice* nicdev) {
+	NICDevice* parent = rx_device(nicdev);
+	VNIC* vnics[MAX_VNIC_COUNT];
+	int count = 0;
+	for(NICDevice* dev = parent; dev; dev = dev->next) {
+		for(int i = 0; i < dev->vnics_count; i++) {
+			// So many VNICs are not of a single VM
+			if(count >= MAX_VNIC_COUNT) return;
+
+			vnics[count++] = dev->vnics[i];
+		}
+	}
+
+	VNIC* owner = vnic_rx_owner(vnics, count);
+	if(!owner) return;
+
+	// Frames to no VNIC must not be seen by the VM: the device filters by MAC,
+	// and frames to its own MAC, which aren't passed on otherwise, are the VM's
+	if(parent->promisc) return;
+
+	bool has_mac = false;
+	for(int i = 0; i < count && !has_mac; i++) has_mac = vnics[i]->mac == parent->mac;
+	if(!has_mac) return;
+
+	for(int i = 0; i < NICDEV_MAX_QUEUE_COUNT; i++) {
+		VNIC* vnic = owner;
+		for(int j = 0; j < count && vnic == owner; j++) {
+			if(nicdev_vnic_queue(parent, vnics[j]) == i) vnic = vnics[j];
+		}
+
+		parent->queues[i].rx_vnic = vnic;
+	}
+}
 
 int nicdev_register_vnic(NICDevice* nicdev, VNIC* vnic) {
 	if(nicdev->vnics_count >= MAX_VNIC_COUNT) return -1;
 
-	for(int i = 0; i < nicdev->vnics_count; i++) {
-		if(nicdev->vnics[i]->mac == vnic->mac) return -1;
+	if(!nicdev->demux || vnic_demux_get(nicdev->demux, vlan_id(nicdev), vnic->mac)) return -1;
+
+	if(!nic_register(vnic->nic)) return -1;
+
+	// Frames to the VNIC must not land in the pool of another VM
+	nicdev_poll_stop(nicdev);
+	rx_vnic_clear(nicdev);
+
+	if(!vnic_demux_add(nicdev->demux, vlan_id(nicdev), vnic->mac, vnic)) {
+		nic_unregister(vnic->nic);
+		rx_vnic_set(nicdev);
+		nicdev_poll_start(nicdev);
+		return -1;
 	}
 
 	nicdev->vnics[nicdev->vnics_count++] = vnic;
+	vnic_subscribers_build(&nicdev->subscribers, nicdev->vnics, nicdev->vnics_count);
 	vnic->vlan_proto = nicdev->vlan_proto;
 	vnic->vlan_tci = nicdev->vlan_tci;
+	vnic->tx_gso = (nicdev->offloads & NICDEV_OFFLOAD_TSO4 ? VNIC_TX_GSO_TCPV4 : 0) |
+			(nicdev->offloads & NICDEV_OFFLOAD_TSO6 ? VNIC_TX_GSO_TCPV6 : 0);
 
-	__nics[__nic_count++] = vnic->nic;
+	rx_vnic_set(nicdev);
+	nicdev_poll_start(nicdev);
 
 	return vnic->id;
 }
@@ -137,17 +242,21 @@ VNIC* nicdev_unregister_vnic(NICDevice* nicdev, uint32_t id) {
 	for(int i = 0; i < nicdev->vnics_count; i++) {
 		if(nicdev->vnics[i]->id == id) {
 			VNIC* vnic = nicdev->vnics[i];
+
+			// The driver must not receive into the pool any more
+			nicdev_poll_stop(nicdev);
+			rx_vnic_clear(nicdev);
+
 			nicdev->vnics[i] = NULL;
 			nicdev->vnics[i] = nicdev->vnics[nicdev->vnics_count - 1];
 			nicdev->vnics_count--;
 
-			for(int j = 0; j < __nic_count; j++) {
-				if(__nics[j] == vnic->nic) {
-					__nics[j] = NULL;
-					__nics[j] = __nics[__nic_count - 1];
-					__nic_count--;
-				}
-			}
+			vnic_demux_remove(nicdev->demux, vlan_id(nicdev), vnic->config.mac);
+			vnic_subscribers_build(&nicdev->subscribers, nicdev->vnics, nicdev->vnics_count);
+			rx_vnic_set(nicdev);
+			nicdev_poll_start(nicdev);
+
+			nic_unregister(vnic->nic);
 
 			return vnic;
 		}
@@ -167,13 +276,9 @@ VNIC* nicdev_get_vnic(NICDevice* nicdev, uint32_t id) {
 }
 
 VNIC* nicdev_get_vnic_mac(NICDevice* nicdev, uint64_t mac) {
-	if(!nicdev) return NULL;
+	if(!nicdev || !nicdev->demux) return NULL;
 
-	for(int i = 0; i < nicdev->vnics_count; i++) {
-		if(nicdev->vnics[i]->mac == mac) return nicdev->vnics[i];
-	}
-
-	return NULL;
+	return vnic_demux_get(nicdev->demux, vlan_id(nicdev), mac);
 }
 
 extern int strcmp(const char *s1, const char *s2);
@@ -193,19 +298,51 @@ VNIC* nicdev_update_vnic(NICDevice* nicdev, VNIC* src_vnic) {
 	VNIC* dst_vnic = nicdev_get_vnic(nicdev, src_vnic->id);
 	if(!dst_vnic) return NULL;
 
-	if(dst_vnic->mac != src_vnic->mac) {
-		if(nicdev_get_vnic_mac(nicdev, src_vnic->mac)) return NULL;
+	uint64_t attrs[] = {
+		VNIC_MAC, src_vnic->mac,
+		VNIC_RX_BANDWIDTH, src_vnic->rx_bandwidth,
+		VNIC_TX_BANDWIDTH, src_vnic->tx_bandwidth,
+		VNIC_PADDING_HEAD, src_vnic->padding_head,
+		VNIC_PADDING_TAIL, src_vnic->padding_tail,
+		VNIC_NONE
+	};
+
+	if(nicdev_vnic_update(nicdev, dst_vnic, attrs) != VNIC_ERROR_NOERROR) return NULL;
+
+	return dst_vnic;
+}
+
+VNICError nicdev_vnic_update(NICDevice* nicdev, VNIC* vnic, uint64_t* attrs) {
+	uint64_t mac = vnic->config.mac;
+	for(int i = 0; attrs[i] != VNIC_NONE; i += 2) {
+		if(attrs[i] == VNIC_MAC && attrs[i + 1] != mac && nicdev_get_vnic_mac(nicdev, attrs[i + 1])) return VNIC_ERROR_ATTRIBUTE_INVALID;
+	}
 
-		dst_vnic->mac = src_vnic->mac;
+	// A promiscuous VNIC takes frames of other VMs
+	bool flags = false;
+	for(int i = 0; attrs[i] != VNIC_NONE; i += 2) flags |= attrs[i] == VNIC_FLAGS;
+	nicdev_poll_stop(nicdev);
+	if(flags) rx_vnic_clear(nicdev);
+
+	VNICError error = vnic_update(vnic, attrs);
+	if(error == VNIC_ERROR_NOERROR) {
+		// Frames to the new address go to the VNIC from now on; it picks the address up when it takes them
+		if(vnic->config.mac != mac) {
+			vnic_demux_remove(nicdev->demux, vlan_id(nicdev), mac);
+			vnic_demux_add(nicdev->demux, vlan_id(nicdev), vnic->config.mac, vnic);
+		}
+		vnic_subscribers_build(&nicdev->subscribers, nicdev->vnics, nicdev->vnics_count);
 	}
 
-	//TODO fix bandwidth
-	dst_vnic->rx_bandwidth = dst_vnic->nic->rx_bandwidth = src_vnic->rx_bandwidth;
-	dst_vnic->tx_bandwidth = dst_vnic->nic->tx_bandwidth = src_vnic->tx_bandwidth;
-	dst_vnic->padding_head = dst_vnic->nic->padding_head = src_vnic->padding_head;
-	dst_vnic->padding_tail = dst_vnic->nic->padding_tail = src_vnic->padding_tail;
+	if(flags) rx_vnic_set(nicdev);
+	nicdev_poll_start(nicdev);
 
-	return dst_vnic;
+	return error;
+}
+
+void nicdev_set_bandwidth(NICDevice* nicdev, uint64_t rx_bandwidth, uint64_t tx_bandwidth) {
+	token_bucket_init(&nicdev->rx_bucket, TIMER_FREQUENCY_PER_SEC, rx_bandwidth, 0, 0, 0, NULL);
+	token_bucket_init(&nicdev->tx_bucket, TIMER_FREQUENCY_PER_SEC, tx_bandwidth, 0, 0, 0, NULL);
 }
 
 
@@ -214,39 +351,155 @@ VNIC* nicdev_update_vnic(NICDevice* nicdev, VNIC* src_vnic) {
  */
 
 int nicdev_rx(NICDevice* dev, void* data, size_t size) {
-	return nicdev_rx0(dev, data, size, NULL, 0);
+	return nicdev_rx0(dev, data, size, NULL, 0, 0);
+}
+
+/* Find the VNICs which take a frame to dmac */
+static inline int rx_targets(NICDevice* nicdev, uint64_t dmac, VNIC** targets, bool* is_complete) {
+	if(unlikely(!nicdev->demux)) {
+		*is_complete = false;
+		return 0;
+	}
+
+	return vnic_demux_targets(nicdev->demux, &nicdev->subscribers, vlan_id(nicdev), dmac, targets, is_complete);
+}
+
+/*
+ * Queue pairs polled from several cores may stage to the same VNIC. The VNICs
+ * are locked in the order of their addresses, so that pollers locking several
+ * never wait for each other in a cycle.
+ */
+static void rx_lock(NICDevice* nicdev, VNIC** vnics, int count) {
+	if(nicdev->queue_count <= 1) return;
+
+	for(int i = 1; i < count; i++) {
+		VNIC* vnic = vnics[i];
+		int j = i;
+		for(; j > 0 && vnics[j - 1] > vnic; j--) vnics[j] = vnics[j - 1];
+		vnics[j] = vnic;
+	}
+
+	for(int i = 0; i < count; i++) lock_lock(&vnics[i]->rx_lock);
+}
+
+static void rx_unlock(NICDevice* nicdev, VNIC** vnics, int count) {
+	if(nicdev->queue_count <= 1) return;
+
+	for(int i = count - 1; i >= 0; i--) lock_unlock(&vnics[i]->rx_lock);
 }
 
 int nicdev_rx0(NICDevice* nicdev, void* data, size_t size,
-		void* data_optional, size_t size_optional) {
+		void* data_optional, size_t size_optional, uint8_t flags) {
 	Ether* eth = data;
 	if(size + size_optional < sizeof(Ether)) return NICDEV_PROCESS_PASS;
 
 	if(unlikely(!!rx_process)) rx_process(data, size, rx_process_context);
 
-	bool is_complete = false;
-	uint64_t dmac = endian48(eth->dmac);
-	for(int i = 0; i < nicdev->vnics_count; i++) {
-		VNIC* vnic = nicdev->vnics[i];
-		if(vnic->mac == dmac) {
-			is_complete = true;
-			goto recv;
-		}
+	// Frames over the device rate are dropped before they are demultiplexed
+	if(!token_bucket_consume(&nicdev->rx_bucket, timer_frequency(), size + size_optional, 1)) {
+		nicdev_rx_drop(nicdev, NIC_DROP_RATE_LIMITED);
+		return NICDEV_PROCESS_COMPLETE;
+	}
+
+	VNIC* targets[MAX_VNIC_COUNT];
+	bool is_complete;
+	int count = rx_targets(nicdev, endian48(eth->dmac), targets, &is_complete);
+	rx_lock(nicdev, targets, count);
+	if(count == 1)
+		vnic_rx_stage0(targets[0], (uint8_t*)eth, size, data_optional, size_optional, flags);
+	else if(count > 1)
+		vnic_rx_fanout0(targets, count, (uint8_t*)eth, size, data_optional, size_optional, flags);
+	rx_unlock(nicdev, targets, count);
+
+	if(is_complete) return NICDEV_PROCESS_COMPLETE;
+
+	return NICDEV_PROCESS_PASS;
+}
+
+Packet* nicdev_rx_alloc(NICDevice* nicdev, uint16_t queue, size_t size) {
+	VNIC* vnic = rx_device(nicdev)->queues[queue].rx_vnic;
+	if(!vnic) return NULL;
 
-		if(vnic->flags & NIC_F_PROMISC) goto recv;
+	Packet* packet = vnic_rx_alloc(vnic, size);
+	if(packet) packet->start = vnic->padding_head;
 
-		if(dmac & ETHER_MULTICAST) {
-			if(vnic->flags & NIC_F_MULTICAST) goto recv;
-			if(dmac == ETHER_BROADCAST && vnic->flags & NIC_F_BROADCAST) goto recv;
+	return packet;
+}
+
+uint32_t nicdev_rx_pressure(NICDevice* nicdev) {
+	uint32_t pressure = VNIC_PRESSURE_QUEUE | VNIC_PRESSURE_POOL;
+	int count = 0;
+
+	// VLAN devices share the rx queue of the parent
+	for(NICDevice* dev = nicdev; dev && pressure; dev = dev->next) {
+		for(int i = 0; i < dev->vnics_count && pressure; i++)
+			pressure &= vnic_rx_pressure(dev->vnics[i]);
+
+		count += dev->vnics_count;
+	}
+
+	return count ? pressure : 0;
+}
+
+void nicdev_rx_drop(NICDevice* nicdev, NICDropReason reason) {
+	__sync_fetch_and_add(&nicdev->rx_drops[reason], 1);
+}
+
+bool nicdev_rx_packet(NICDevice* nicdev, uint16_t queue, Packet* packet) {
+	Ether* eth = (Ether*)(packet->buffer + packet->start);
+	size_t size = packet->end - packet->start;
+	if(size < sizeof(Ether)) return false;
+
+	if(unlikely(!!rx_process)) rx_process(eth, size, rx_process_context);
+
+	if(!token_bucket_consume(&nicdev->rx_bucket, timer_frequency(), size, 1)) {
+		nicdev_rx_drop(nicdev, NIC_DROP_RATE_LIMITED);
+		return false;
+	}
+
+	VNIC* targets[MAX_VNIC_COUNT];
+	bool is_complete;
+	int count = rx_targets(nicdev, endian48(eth->dmac), targets, &is_complete);
+	rx_lock(nicdev, targets, count);
+	if(count == 1) {
+		// Following frames of the flow are likely to go to the same VNIC of the VM,
+		// unless rx_vnic_clear() has stopped posting buffers of the VM meanwhile
+		NICDeviceQueue* rx_queue = &rx_device(nicdev)->queues[queue];
+		VNIC* vnic = rx_queue->rx_vnic;
+		if(vnic && vnic != targets[0]) __sync_bool_compare_and_swap(&rx_queue->rx_vnic, vnic, targets[0]);
+
+		if(nic_find_by_packet(packet) == targets[0]->pool_nic) {
+			vnic_rx_stage2(targets[0], packet);
+			rx_unlock(nicdev, targets, count);
+			return true;
 		}
+	}
+
+	uint8_t flags = packet->flags & PACKET_F_RX_CSUM;
+	if(count == 1)
+		vnic_rx_stage0(targets[0], (uint8_t*)eth, size, NULL, 0, flags);
+	else if(count > 1)
+		vnic_rx_fanout0(targets, count, (uint8_t*)eth, size, NULL, 0, flags);
+	rx_unlock(nicdev, targets, count);
 
-		continue;
-recv:
-		vnic_rx(vnic, (uint8_t*)eth, size, data_optional, size_optional);
+	return false;
+}
+
+int nicdev_rx_flush(NICDevice* nicdev) {
+	int count = 0;
+	for(int i = 0; i < nicdev->vnics_count; i++) {
+		VNIC* vnic = nicdev->vnics[i];
+
+		// Packets another core stages after this look are flushed by it
+		if(nicdev->queue_count > 1 && !vnic->rx_burst_count)
+			continue;
+
+		rx_lock(nicdev, &vnic, 1);
+		count += vnic_rx_flush(vnic);
+		rx_unlock(nicdev, &vnic, 1);
 	}
-	if(is_complete) return NICDEV_PROCESS_COMPLETE;
 
-	return NICDEV_PROCESS_PASS;
+	return count;
 }
 
 int nicdev_srx(VNIC* vnic, void* data, size_t size) {
@@ -271,8 +524,11 @@ int nicdev_srx0(VNIC* vnic, void* data, size_t size,
 }
 
 typedef struct _TransmitContext{
+	NICDevice* nicdev;
 	bool (*process)(Packet* packet, void* context);
 	void* context;
+	TokenBucket* bucket;
+	uint64_t t;
 } TransmitContext;
 
 static bool transmitter(Packet* packet, void* context) {
@@ -282,8 +538,14 @@ static bool transmitter(Packet* packet, void* context) {
 
 	TransmitContext* transmitter_context = context;
 
+	// Checksums the device can't fill in are done here
+	if(packet->flags & PACKET_F_TX_CSUM && !(transmitter_context->nicdev->offloads & NICDEV_OFFLOAD_TX_CSUM))
+		nic_packet_tx_csum(packet);
+
 	if(!transmitter_context->process(packet, transmitter_context->context)) return false;
 
+	token_bucket_charge(transmitter_context->bucket, transmitter_context->t, packet->end - packet->start, 1);
+
 	return true;
 }
 
@@ -294,30 +556,132 @@ static bool transmitter(Packet* packet, void* context) {
  *
  * @return number of packets proccessed
  */
-//Task = budget
 int nicdev_tx(NICDevice* nicdev,
 		bool (*process)(Packet* packet, void* context), void* context) {
 	TransmitContext transmitter_context = {
+		.nicdev = nicdev,
 		.process = process,
-		.context = context};
+		.context = context,
+		.bucket = &nicdev->tx_bucket,
+		.t = timer_frequency()};
+
+	return vnic_tx_schedule(nicdev->vnics, nicdev->vnics_count, &nicdev->queues[0].round, &nicdev->tx_bucket,
+			transmitter, &transmitter_context);
+}
 
+int nicdev_tx_queue(NICDevice* nicdev, uint16_t queue,
+		bool (*process)(Packet* packet, void* context), void* context) {
+	VNIC* vnics[MAX_VNIC_COUNT];
 	int count = 0;
-	for(; nicdev->round < MAX_VNIC_COUNT; nicdev->round++) {
-		VNIC* vnic = nicdev->vnics[nicdev->round];
-		if(!vnic) {
-			nicdev->round = 0;
-			break;
-		}
+	for(int i = 0; i < nicdev->vnics_count; i++) {
+		if(nicdev_vnic_queue(nicdev, nicdev->vnics[i]) == queue) vnics[count++] = nicdev->vnics[i];
+	}
+
+	TransmitContext transmitter_context = {
+		.nicdev = nicdev,
+		.process = process,
+		.context = context,
+		.bucket = &nicdev->tx_bucket,
+		.t = timer_frequency()};
+
+	return vnic_tx_schedule(vnics, count, &nicdev->queues[queue].round, &nicdev->tx_bucket,
+			transmitter, &transmitter_context);
+}
+
+/* Core to poll the next queue pair on: the last cores first, leaving half of the others to VMs */
+static uint8_t poll_core() {
+	uint8_t* core_map = mp_processor_map();
+	int count = 0;
+	int reserved = 0;
+	for(int i = 1; i < MP_MAX_CORE_COUNT; i++) {
+		if(core_map[i] == MP_CORE_INVALID) continue;
+
+		count++;
+		if(poll_cores[i]) reserved++;
+	}
+
+	for(int i = MP_MAX_CORE_COUNT - 1; i > 0 && reserved < count / 2; i--) {
+		if(core_map[i] != MP_CORE_INVALID && !poll_cores[i]) return i;
+	}
+
+	// Once no more may be reserved, the core polling the fewest queue pairs takes another
+	uint8_t core = 0;
+	for(int i = 1; i < MP_MAX_CORE_COUNT; i++) {
+		if(poll_cores[i] && (!core || poll_cores[i] < poll_cores[core])) core = i;
+	}
+
+	return core;
+}
+
+uint8_t nicdev_poll_add(NICDevice* nicdev, uint16_t queue, bool (*poll)(void* context), void* context) {
+	NICDeviceQueue* q = &nicdev->queues[queue];
+	q->core = poll_started ? 0 : poll_core();
+	if(q->core == 0) {
+		event_busy_add(poll, context);
+		return 0;
+	}
+
+	q->poll = poll;
+	q->context = context;
+	poll_cores[q->core]++;
 
-		int budget = vnic->budget;
-		while(budget--) {
-			VNICError ret = vnic_tx(vnic, transmitter, &transmitter_context);
+	return q->core;
+}
 
-			if(ret == VNIC_ERROR_OPERATION_FAILED) // Transmiitter Error
-				return count;
-			else if(ret == VNIC_ERROR_RESOURCE_NOT_AVAILABLE) // There no Packet, Check next vnic
-				break;
+/* Busy event of a queue pair on a core of its own, which parks between two polls while core 0 changes the device */
+static bool poll_queue(void* context) {
+	NICDeviceQueue* queue = context;
+	if(unlikely(queue->stop == POLL_STOPPING) && __sync_bool_compare_and_swap(&queue->stop, POLL_STOPPING, POLL_STOPPED)) {
+		while(queue->stop == POLL_STOPPED)
+			asm volatile("pause" ::: "memory");
+
+		return true;
+	}
 
+	return queue->poll(queue->context);
+}
+
+void nicdev_poll_stop(NICDevice* nicdev) {
+	NICDevice* parent = rx_device(nicdev);
+	for(int i = 0; i < parent->queue_count; i++) {
+		if(parent->queues[i].core) parent->queues[i].stop = POLL_STOPPING;
+	}
+
+	// Either a poller starting now sees the request, or it is seen polling (see nicdev_poll_init())
+	__sync_synchronize();
+
+	// Queue pairs of core 0 are polled between its events
+	for(int i = 0; i < parent->queue_count; i++) {
+		NICDeviceQueue* queue = &parent->queues[i];
+		if(!queue->core) continue;
+
+		while(queue->polling && queue->stop != POLL_STOPPED)
+			asm volatile("pause" ::: "memory");
+	}
+}
+
+void nicdev_poll_start(NICDevice* nicdev) {
+	NICDevice* parent = rx_device(nicdev);
+	__sync_synchronize();
+
+	for(int i = 0; i < parent->queue_count; i++) {
+		if(parent->queues[i].core) parent->queues[i].stop = POLL_RUNNING;
+	}
+}
+
+int nicdev_poll_init(uint8_t apic_id) {
+	poll_started = true;
+
+	int count = 0;
+	for(int i = 0; i < nicdevs_count; i++) {
+		NICDevice* nicdev = nicdevs[i];
+		for(int j = 0; j < nicdev->queue_count; j++) {
+			NICDeviceQueue* queue = &nicdev->queues[j];
+			if(!queue->poll || queue->core != apic_id) continue;
+
+			queue->polling = true;
+			__sync_synchronize();
+			event_busy_add(poll_queue, queue);
 			count++;
 		}
 	}
@@ -325,6 +689,10 @@ int nicdev_tx(NICDevice* nicdev,
 	return count;
 }
 
+bool nicdev_is_poll_core(uint8_t apic_id) {
+	return apic_id < MP_MAX_CORE_COUNT && poll_cores[apic_id] > 0;
+}
+
 static bool stransmitter(Packet* packet, void* context) {
 	if(!packet) return false;
 
@@ -332,6 +700,9 @@ static bool stransmitter(Packet* packet, void* context) {
 
 	TransmitContext* transmitter_context = context;
 
+	// The slow path doesn't know the device; checksums are always done here
+	nic_packet_tx_csum(packet);
+
 	if(!transmitter_context->process(packet, transmitter_context->context)) return false;
 
 	return true;
@@ -2,13 +2,41 @@
 #define __NICDEV_H__
 
 #include <vnic.h>
+#include <demux.h>
 
 #define MAX_NIC_DEVICE_COUNT	128
 #define MAX_NIC_NAME_LEN	16
 
+#define NICDEV_OFFLOAD_TX_CSUM	(1 << 0)	///< The device fills in TCP/UDP checksums (PACKET_F_TX_CSUM)
+#define NICDEV_OFFLOAD_TSO4	(1 << 1)	///< The device segments TCP/IPv4 frames (PACKET_F_TX_GSO)
+#define NICDEV_OFFLOAD_TSO6	(1 << 2)	///< The device segments TCP/IPv6 frames (PACKET_F_TX_GSO)
+
+#define NICDEV_RX_BUDGET	64	///< Frames a driver takes from the device per poll to begin with
+#define NICDEV_RX_BUDGET_MIN	16	///< Least frames per poll the rx budget adapts down to
+#define NICDEV_RX_BUDGET_MAX	256	///< Most frames per poll the rx budget adapts up to
+
+#define NICDEV_MAX_QUEUE_COUNT	8	///< Most rx/tx queue pairs of a device
+
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
 
+/**
+ * Rx/tx queue pair of a device, polled by a single core
+ */
+typedef struct _NICDeviceQueue {
+	uint16_t	round;		///< VNIC to start the next tx round with (see vnic_tx_schedule())
+	uint16_t	rx_budget;	///< Frames the driver takes from the queue per poll, adapted by rx_poll
+	PollBudget	rx_poll;	///< Rx budget controller, fed by the driver after each poll
+	VNIC*		rx_vnic;	///< VNIC whose pool rx buffers are allocated from, NULL for the driver's own (see nicdev_rx_alloc())
+	uint8_t		core;		///< APIC ID of the core polling the queue pair
+	volatile bool	polling;	///< The core has started polling the queue pair (see nicdev_poll_init())
+	volatile uint8_t stop;		///< Core 0 asking the poller to stop, and it stopped (see nicdev_poll_stop())
+	bool		(*poll)(void* context);	///< Busy event polling the queue pair on a core of its own (NULL: polled on core 0)
+	void*		context;	///< Context of poll
+	uint64_t	kicks;		///< Notifications the driver sent the device for the queue pair
+	uint64_t	kicks_avoided;	///< Notifications left out as the device wasn't waiting for them
+} NICDeviceQueue;
+
 typedef struct _NICDevice{
 	char		name[MAX_NIC_NAME_LEN];
 	uint64_t	mac;
@@ -21,8 +49,18 @@ typedef struct _NICDevice{
 
 	VNIC*		vnics[MAX_VNIC_COUNT];
 	int		vnics_count;
+	VNICSubscribers	subscribers;	///< VNICs taking frames not addressed to them (see vnic_demux_targets())
+	uint32_t	offloads;	///< NICDEV_OFFLOAD_XXX the device does. Others are done in software
+	bool		promisc;	///< The device takes frames to any MAC, set by the driver before nicdev_register()
+	VNICDemux*	demux;		///< VNICs of the device and its VLANs by VLAN ID and MAC, shared with the VLANs
+	struct _NICDevice** vlans;	///< VLAN devices by VLAN ID, of the physical device only (NULL: no VLAN)
+	struct _NICDevice* parent;	///< Physical device of a VLAN device, whose queue pairs it receives on (NULL: physical)
 
-	uint16_t	round; //FIXME: current nicdev only support round robin schedule
+	uint16_t	queue_count;	///< Number of rx/tx queue pairs, set by the driver before nicdev_register() (0: 1)
+	NICDeviceQueue	queues[NICDEV_MAX_QUEUE_COUNT];	///< Rx/tx queue pairs. VLAN devices send through queue 0 of the parent
+	TokenBucket	rx_bucket;	///< Rx shaper of the device, root of the rx hierarchy (unlimited when zeroed)
+	TokenBucket	tx_bucket;	///< Tx shaper of the device, root of the tx hierarchy (unlimited when zeroed)
+	uint64_t	rx_drops[NIC_DROP_REASON_COUNT];	///< Frames dropped before they reached a VNIC, by NICDropReason
 
 	struct _NICDevice* next;
 	struct _NICDevice* prev;
@@ -50,6 +88,8 @@ typedef struct {
 
 	bool 		(*add_vid)(NICDevice* nicdev, uint16_t vid);
 	bool 		(*remove_vid)(NICDevice* nicdev, uint16_t vid);
+
+	void		(*remove_vnic)(NICDevice* nicdev, VNIC* vnic);	///< Stop using buffers of the VNIC's pool, while the pollers are stopped (optional)
 } NICDriver;
 
 typedef enum _NICDEV_PROCESS_TYPE {
@@ -98,6 +138,24 @@ VNIC* nicdev_get_vnic_mac(NICDevice* nicdev, uint64_t mac);
 VNIC* nicdev_get_vnic_name(NICDevice* nicdev, char* name);
 VNIC* nicdev_update_vnic(NICDevice* nicdev, VNIC* src_vnic);
 
+/**
+ * Update the attributes of a VNIC of the device (see vnic_update()) and
+ * demultiplex frames to it by its new MAC address and flags.
+ *
+ * @return VNIC_ERROR_ATTRIBUTE_INVALID if another VNIC of the device has the MAC address,
+ * otherwise the result of vnic_update()
+ */
+VNICError nicdev_vnic_update(NICDevice* nicdev, VNIC* vnic, uint64_t* attrs);
+
+/**
+ * Limit the bandwidth of the NIC device. It is shared by every VNIC on it.
+ *
+ * @param nicdev NIC Device
+ * @param rx_bandwidth input bandwidth in bps (0: unlimited)
+ * @param tx_bandwidth output bandwidth in bps (0: unlimited)
+ */
+void nicdev_set_bandwidth(NICDevice* nicdev, uint64_t rx_bandwidth, uint64_t tx_bandwidth);
+
 enum NICDEV_PROCESS_RESULT {
 	NICDEV_PROCESS_COMPLETE,
 	NICDEV_PROCESS_PASS,
@@ -134,10 +192,70 @@ int nicdev_rx(NICDevice* dev, void* data, size_t size);
  * @param size data size
  * @param data_optional optional data to be sent
  * @param size_optional opttional data size
+ * @param flags PACKET_F_RX_CSUM if the device verified the checksums
  *
  * @return  result of process
  */
-int nicdev_rx0(NICDevice* dev, void* data, size_t size, void* data_optional, size_t size_optional);
+int nicdev_rx0(NICDevice* dev, void* data, size_t size, void* data_optional, size_t size_optional, uint8_t flags);
+
+/**
+ * Allocate a buffer for the driver to receive into, from the pool of the VNIC
+ * which took the last unicast frame of the queue pair. Only a VM taking every
+ * frame of the device has its buffers posted (see vnic_rx_owner()), as frames
+ * land in them before their destination is known. So the device must not be
+ * promiscuous, and the VM must have a VNIC with the MAC of the device.
+ *
+ * @param dev NIC Device
+ * @param queue rx/tx queue pair
+ * @param size buffer size, after packet->start
+ *
+ * @return packet with start set to the head padding of the VNIC, or NULL if the driver has to use its own buffer
+ */
+Packet* nicdev_rx_alloc(NICDevice* dev, uint16_t queue, size_t size);
+
+/**
+ * Backpressure of the VNICs of the device and its VLANs (see vnic_rx_pressure())
+ * A driver seeing VNIC_PRESSURE_QUEUE leaves frames in the device until the VMs
+ * take packets, instead of taking them only to have them dropped.
+ *
+ * @param dev NIC Device
+ *
+ * @return VNIC_PRESSURE_XXX every VNIC is under, 0 if a VNIC takes frames or there is none
+ */
+uint32_t nicdev_rx_pressure(NICDevice* dev);
+
+/**
+ * Count a frame the driver dropped before it reached a VNIC
+ *
+ * @param dev NIC Device
+ * @param reason NICDropReason
+ */
+void nicdev_rx_drop(NICDevice* dev, NICDropReason reason);
+
+/**
+ * Receive a frame which the driver put in packet->buffer[start, end) of a buffer from nicdev_rx_alloc().
+ * The driver may set PACKET_F_RX_CSUM in packet->flags.
+ * A frame for a single VNIC owning the buffer is handed over without a copy.
+ * Otherwise the frame is copied to each VNIC and the buffer stays with the driver.
+ *
+ * @param dev NIC Device
+ * @param queue rx/tx queue pair the frame was received on
+ * @param packet packet from nicdev_rx_alloc()
+ *
+ * @return true if the packet was handed over and the driver needs a new buffer
+ */
+bool nicdev_rx_packet(NICDevice* dev, uint16_t queue, Packet* packet);
+
+/**
+ * Deliver the packets received by nicdev_rx() to the VNICs' rx queues.
+ * Drivers call it once per poll, after the received frames are passed to nicdev_rx() or nicdev_rx_packet(),
+ * or after each frame if they are handed frames one at a time. Until then the frames are not in the rx queues.
+ *
+ * @param dev NIC Device
+ *
+ * @return number of packets delivered
+ */
+int nicdev_rx_flush(NICDevice* dev);
 
 /**
  * @param dev NIC device
@@ -148,6 +266,79 @@ int nicdev_rx0(NICDevice* dev, void* data, size_t size, void* data_optional, siz
  */
 
 int nicdev_tx(NICDevice* dev, bool (*process)(Packet* packet, void* context), void* context);
+
+/**
+ * nicdev_tx() of the VNICs steered to a queue pair (see nicdev_vnic_queue())
+ *
+ * @param dev NIC device
+ * @param queue rx/tx queue pair
+ * @param process function to process packets in NIC device
+ * @param context context to be passed to process function
+ *
+ * @return number of packets proccessed
+ */
+int nicdev_tx_queue(NICDevice* dev, uint16_t queue, bool (*process)(Packet* packet, void* context), void* context);
+
+/**
+ * Queue pair a VNIC is steered to. VNICs of the same VM share one, so that
+ * the VM's frames are sent from a single queue and the device, which steers
+ * a flow's rx to the queue it was last sent from, receives them there too.
+ *
+ * @param dev NIC device
+ * @param vnic VNIC of the device
+ *
+ * @return rx/tx queue pair
+ */
+static inline uint16_t nicdev_vnic_queue(NICDevice* dev, VNIC* vnic) {
+	return dev->queue_count > 1 ? vnic->group % dev->queue_count : 0;
+}
+
+/**
+ * Poll a queue pair from a core of its own. Cores polling queue pairs don't
+ * run VMs; at most half of the cores but the first are taken, the last ones
+ * first. Without a core to spare the poller runs on core 0.
+ *
+ * @param dev NIC device
+ * @param queue rx/tx queue pair
+ * @param poll busy event polling the queue pair
+ * @param context context of poll
+ *
+ * @return APIC ID of the core polling the queue pair
+ */
+uint8_t nicdev_poll_add(NICDevice* dev, uint16_t queue, bool (*poll)(void* context), void* context);
+
+/**
+ * Start polling the queue pairs of the core. Every core calls it once devices are initialized.
+ *
+ * @param apic_id APIC ID of the core
+ *
+ * @return number of queue pairs polled
+ */
+int nicdev_poll_init(uint8_t apic_id);
+
+/**
+ * Stop the cores polling the queue pairs of a device, so that core 0 can
+ * change what they read without locks: the demux, subscribers and VNICs of
+ * the device and its VLANs. Returns once every poller which has started is
+ * parked between two polls. Pollers starting meanwhile park before they poll.
+ *
+ * @param dev NIC device, or a VLAN device of it
+ */
+void nicdev_poll_stop(NICDevice* dev);
+
+/**
+ * Let the pollers stopped by nicdev_poll_stop() go on.
+ *
+ * @param dev NIC device, or a VLAN device of it
+ */
+void nicdev_poll_start(NICDevice* dev);
+
+/**
+ * @param apic_id APIC ID of a core
+ *
+ * @return true if the core polls queue pairs and is not to run VMs
+ */
+bool nicdev_is_poll_core(uint8_t apic_id);
 /**
  * @param dev NIC device
  * @param data data to be sent
@@ -184,6 +375,18 @@ int nicdev_stx(VNIC* vnic, bool (*process)(Packet* packet, void* context), void*
  */
 NICDevice* nicdev_add_vlan(NICDevice* nicdev, uint16_t id);
 
+/**
+ * Find the VLAN device of a tagged frame received by a physical device.
+ *
+ * @param dev NIC Device
+ * @param id VLAN ID (the priority bits of the TCI are ignored)
+ *
+ * @return VLAN device, NULL if there is no such VLAN
+ */
+static inline NICDevice* nicdev_get_vlan(NICDevice* nicdev, uint16_t id) {
+	return nicdev->vlans ? nicdev->vlans[id & 0xfff] : NULL;
+}
+
 /**
  * @param dev NIC Device
  *
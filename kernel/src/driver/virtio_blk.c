@@ -39,6 +39,16 @@ typedef struct {
 	List*			status_list;
 } EventContext;
 
+/* Descriptors of count finished requests are free again; those of a packed ring once the device has used them */
+static void release(VirtQueue* vq, int count) {
+	if(vq->packed)
+		vq->num_free += vq->vq_ops->get_buf(vq, NULL);
+	else if(vq->indirect)
+		vq->num_free += count;
+	else
+		vq->num_free += count * 3;
+}
+
 static int blk_done(List* status_list) {
 	ListIterator iter;
 	list_iterator_init(&iter, status_list);
@@ -78,10 +88,7 @@ bool event(void* context) {
 	if(err) {
 		VirtQueue* vq = priv->vq_blk;
 
-		if(vq->indirect)
-			vq->num_free += list_size(event_context->status_list);
-		else
-			vq->num_free += list_size(event_context->status_list) * 3;
+		release(vq, list_size(event_context->status_list));
 
 		request_gfree(event_context->free_list);
 		list_destroy(event_context->status_list);
@@ -114,6 +121,9 @@ int add_event(List* blocks, List* free_list, List* status_list, int count, void(
 }
 
 static int add_request(VirtQueue* vq, VirtIOBlkReq* req, List* reqs) {
+	if(vq->num_free == 0 && vq->packed)
+		release(vq, 0);
+
 	if(vq->num_free == 0) {
 		return -FILE_ERR_NOSPC;
 	}
@@ -156,10 +166,7 @@ static int block_op(void* buffer, uint32_t type, uint32_t sector, int sector_cou
 	while(1) {
 		int err = blk_done(status_list);
 		if(err) {
-			if(vq->indirect)
-				vq->num_free += list_size(status_list);
-			else
-				vq->num_free += 3 * list_size(status_list);
+			release(vq, list_size(status_list));
 
 			request_gfree(free_list);
 
@@ -297,16 +304,22 @@ int virtio_blk_write_async(DiskDriver* driver, List* blocks, int sector_count, v
 /* Add status to virtio configuration status space */
 static void add_status(VirtIODevice* vdev, uint8_t status) {
 	vdev->status |= status;
-	port_out8(vdev->ioaddr + VIRTIO_PCI_STATUS, vdev->status);
+	if(vdev->modern)
+		virtio_modern_set_status(&vdev->mmio, vdev->status);
+	else
+		port_out8(vdev->ioaddr + VIRTIO_PCI_STATUS, vdev->status);
 }
 
 /* Probing function for PCI device */
 static int virtio_pci_probe(VirtIODevice* vdev) {
+	// Modern interface is used when the device has one, which the legacy only device doesn't
+	vdev->modern = virtio_modern_probe(vdev->dev, &vdev->mmio);
 
 	// Read I/O address
-	vdev->ioaddr = pci_read32(vdev->dev, PCI_BASE_ADDRESS_0) & ~3;
+	vdev->ioaddr = pci_read32(vdev->dev, PCI_BASE_ADDRESS_0);
+	vdev->ioaddr = vdev->ioaddr & PCI_BASE_ADDRESS_SPACE_IO ? vdev->ioaddr & ~3 : 0;
 
-	if(!vdev->ioaddr)
+	if(!vdev->ioaddr && !vdev->modern)
 		return -1;
 
 	// Enable device
@@ -333,10 +346,14 @@ static int synchronize_features(VirtIODevice* vdev) {
 		VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 		VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE,
 		VIRTIO_BLK_F_TOPOLOGY, VIRTIO_RING_F_INDIRECT_DESC,
+		VIRTIO_F_VERSION_1, VIRTIO_F_RING_PACKED, VIRTIO_RING_F_EVENT_IDX,
 	};
 
-	// Figure out what features device supports
-	device_features = port_in32(vdev->ioaddr + VIRTIO_PCI_HOST_FEATURES);
+	// Figure out what features device supports; legacy devices have 32 feature bits
+	if(vdev->modern)
+		device_features = virtio_modern_get_features(&vdev->mmio);
+	else
+		device_features = port_in32(vdev->ioaddr + VIRTIO_PCI_HOST_FEATURES);
 
 	// Features supported by both device and driver
 	uint32_t fbit;
@@ -344,22 +361,24 @@ static int synchronize_features(VirtIODevice* vdev) {
 
 	for(size_t i = 0; i < sizeof(features)/sizeof(int); i++) {
 		fbit = features[i];
-		if(fbit > 32) {
-			printf("We only support 32 feature bits\n");
+		if(fbit >= 64) {
+			printf("We only support 64 feature bits\n");
 			return -1;
 		}
 		driver_features |= (1ULL << fbit);
 	}
 	driver_features &= device_features;
 	
-	// Finally determine features that we are going to use
-	port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, driver_features);
+	// Finally determine features that we are going to use, which a modern device may refuse
+	if(vdev->modern)
+		virtio_modern_set_features(&vdev->mmio, driver_features);
+	else
+		port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, driver_features);
 	vdev->features |= driver_features;
 
 	add_status(vdev, VIRTIO_CONFIG_S_FEATURES_OK);
-
-	/* Device is alive at this point */
-	add_status(vdev, VIRTIO_CONFIG_S_DRIVER_OK);
+	if(vdev->modern && !(virtio_modern_get_status(&vdev->mmio) & VIRTIO_CONFIG_S_FEATURES_OK))
+		return -2;
 
 	return 0;
 }
@@ -373,18 +392,26 @@ int init_vq(VirtQueue* vq) {
 	if(device_has_feature(vq->vdev, VIRTIO_RING_F_INDIRECT_DESC)) {
 		vq->indirect = true;
 	}
+	vq->event = device_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX);
 	vq->vq_ops = gmalloc(sizeof(VirtQueueOps));
 	vq->vq_ops = &vops;
 
 	/* Select the queue we're interested in
 	 * Virtio block driver uses only one queue */
 	ioaddr = vq->vdev->ioaddr;
-	port_out16(ioaddr + VIRTIO_PCI_QUEUE_SEL, 0);
+	int num;
+	if(vq->vdev->modern) {
+		num = virtio_modern_queue_size(&vq->vdev->mmio, 0);
+		if(!num)
+			return -1;
+	} else {
+		port_out16(ioaddr + VIRTIO_PCI_QUEUE_SEL, 0);
 
-	// Check if queue is either not available or already active
-	int num = port_in32(ioaddr + VIRTIO_PCI_QUEUE_NUM);
-	if(!num || port_in32(ioaddr + VIRTIO_PCI_QUEUE_PFN))
-		return -1;	
+		// Check if queue is either not available or already active
+		num = port_in32(ioaddr + VIRTIO_PCI_QUEUE_NUM);
+		if(!num || port_in32(ioaddr + VIRTIO_PCI_QUEUE_PFN))
+			return -1;	
+	}
 
 	// Memory allocation for vring area
 	void* queue = gmalloc(0x2000 + 0xfff);
@@ -397,17 +424,36 @@ int init_vq(VirtQueue* vq) {
 	queue = (void*)((uintptr_t)(queue+0xfff) & ~0xfff);
 	memset(queue, 0, 0x2000);
 
-	// Activate the queue
-	port_out32(ioaddr + VIRTIO_PCI_QUEUE_PFN, (uintptr_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
-
-	// Create the vring
-	vring_init(vq->vring, num, queue, VIRTIO_PCI_VRING_ALIGN);
-	
 	// Initialize virtqueue
 	vq->num_free = num - (num % 3);
 	vq->num_added = 0;
 	vq->last_used_idx = 0;
 
+	if(device_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+		// Descriptors each buffer ID is made of
+		uint16_t* chain = gmalloc(sizeof(uint16_t) * num);
+		if(!chain)
+			return -3;
+
+		vq->packed = true;
+		vring_packed_init(&vq->packed_ring, num, queue, chain);
+
+		// We don't have interrupt handler. Tell otherside not to interrupt us
+		vq->packed_ring.driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+		vq->notify = virtio_modern_queue_enable(&vq->vdev->mmio, 0, num, VIRTUAL_TO_PHYSICAL(vq->packed_ring.desc),
+				VIRTUAL_TO_PHYSICAL(vq->packed_ring.driver), VIRTUAL_TO_PHYSICAL(vq->packed_ring.device));
+
+		return 0;
+	}
+
+	// Activate the queue
+	if(!vq->vdev->modern)
+		port_out32(ioaddr + VIRTIO_PCI_QUEUE_PFN, (uintptr_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+
+	// Create the vring
+	vring_init(vq->vring, num, queue, VIRTIO_PCI_VRING_ALIGN);
+
 	// We don't have interrupt handler. Tell otherside not to interrupt us
 	vq->vring->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 	vq->vring->used->flags |= VRING_USED_F_NO_NOTIFY;
@@ -420,6 +466,11 @@ int init_vq(VirtQueue* vq) {
 		vq->vring->desc[i].next = i + 1;
 	}
 	vq->vring->desc[num-1].next = 0;
+
+	if(vq->vdev->modern)
+		vq->notify = virtio_modern_queue_enable(&vq->vdev->mmio, 0, num, VIRTUAL_TO_PHYSICAL(vq->vring->desc),
+				VIRTUAL_TO_PHYSICAL(vq->vring->avail), VIRTUAL_TO_PHYSICAL(vq->vring->used));
+
 	return 0;
 }
 
@@ -439,6 +490,7 @@ Driver virtio_pci_driver = {
 
 static PCI_ID pci_ids[] = {
 	PCI_DEVICE(0x1af4, 0x1001, "virtio", NULL), 
+	PCI_DEVICE(0x1af4, VIRTIO_PCI_MODERN_DEVICE_ID(VIRTIO_ID_BLOCK), "virtio", NULL),	// Without the legacy interface
 	{ 0 }
 };
 
@@ -463,7 +515,9 @@ static int virtio_blk_init(DiskDriver* driver, const char* cmdline, DiskDriver**
 
 	// Memory allocations for a virtqueue & request buffers
 	priv->vq_blk = gmalloc(sizeof(VirtQueue));
+	memset(priv->vq_blk, 0, sizeof(VirtQueue));
 	priv->vq_blk->vdev = gmalloc(sizeof(VirtIODevice));
+	memset(priv->vq_blk->vdev, 0, sizeof(VirtIODevice));
 	priv->vq_blk->vring = gmalloc(sizeof(Vring));
 
 	count = pci_probe(virtio_device_type, virtio_device_probe, &virtio_pci_driver);
@@ -485,6 +539,9 @@ static int virtio_blk_init(DiskDriver* driver, const char* cmdline, DiskDriver**
 	if(err)
 		return -4;
 
+	/* Device is alive at this point */
+	add_status(priv->vq_blk->vdev, VIRTIO_CONFIG_S_DRIVER_OK);
+
 	// Disk attachment
 	for(int i = 0; i < count; i++) {
 		disks[i] = gmalloc(sizeof(DiskDriver));
@@ -4,6 +4,8 @@
 #include "disk.h"
 #include "virtio_config.h"
 #include "virtio_ring.h"
+#include "virtio_packed.h"
+#include "virtio_modern.h"
 #include "../pci.h"
 
 #define VIRTIO_BLK_F_BARRIER	0	/* Does host support barriers? */
@@ -25,6 +27,8 @@ typedef struct{
 	uint32_t ioaddr;
 	uint64_t features;
 	uint8_t status;
+	bool modern;		// VirtI/O 1.0 device through memory BARs (VIRTIO_F_VERSION_1), port I/O at ioaddr otherwise
+	VirtIOModern mmio;
 	
         /* Virtio over PCI */
         PCI_Device* dev;
@@ -34,8 +38,8 @@ typedef struct{
 
 /* Check whether virtio device has specific featurs */
 static inline bool device_has_feature(const VirtIODevice* vdev, uint32_t fbit) {
-	if(fbit > 32) {
-	//	printf("Feature bit needs to be under 32\n");
+	if(fbit >= 64) {
+	//	printf("Feature bit needs to be under 64\n");
 		return false;
 	}
 
@@ -79,6 +83,13 @@ struct _VirtQueue {
         VirtQueueOps* vq_ops;
 	Vring* vring;
 
+	/* Packed ring instead, when VIRTIO_F_RING_PACKED is negotiated */
+	bool packed;
+	VringPacked packed_ring;
+
+	/* Notify register for kick of a modern device, NULL for legacy */
+	volatile uint16_t* notify;
+
 	/* Head of free buffer list. */
 	uint32_t free_head;
 	/* Number we've added since last sync. */
@@ -93,6 +104,12 @@ struct _VirtQueue {
 	/* Host supports indirect buffers */
 	bool indirect;
 
+	/* Device tells when it is to be notified (VIRTIO_RING_F_EVENT_IDX) */
+	bool event;
+	/* Notifications sent, and left out as the device didn't wait for them */
+	uint64_t kicks;
+	uint64_t kicks_avoided;
+
 	/* Number of free buffers */
 	uint32_t num_free;
 };
@@ -103,6 +120,9 @@ extern DiskDriver virtio_blk_driver;
 
 /* Check whether device used avail buffer */
 static inline bool hasUsedIdx(VirtQueue* vq) {
+	if(vq->packed)
+		return vring_packed_is_used(&vq->packed_ring, 0);
+
         return vq->vring->used->idx != vq->last_used_idx;
 }
 #endif
@@ -0,0 +1,141 @@
+#include <string.h>
+// PacketNgin kernel header
+#include "../pci.h"
+// Virtio driver header
+#include "virtio_modern.h"
+#include "virtio_pci.h"
+
+#define COMMON8(modern, offset)		(*(volatile uint8_t*)((modern)->common + (offset)))
+#define COMMON16(modern, offset)	(*(volatile uint16_t*)((modern)->common + (offset)))
+#define COMMON32(modern, offset)	(*(volatile uint32_t*)((modern)->common + (offset)))
+
+/* Address of a memory BAR, which is mapped as it is */
+static volatile void* bar_address(PCI_Device* dev, uint8_t bar) {
+	if(bar > 5)
+		return NULL;
+
+	uint32_t reg = PCI_BASE_ADDRESS_0 + bar * 4;
+	uint32_t low = pci_read32(dev, reg);
+	if(low & PCI_BASE_ADDRESS_SPACE_IO)
+		return NULL;
+
+	uint64_t address = low & PCI_BASE_ADDRESS_MEM_MASK;
+	if((low & 0x6) == PCI_BASE_ADDRESS_MEM_TYPE_64 && bar < 5)
+		address |= (uint64_t)pci_read32(dev, reg + 4) << 32;
+
+	return (volatile void*)address;
+}
+
+bool virtio_modern_probe(PCI_Device* dev, VirtIOModern* modern) {
+	memset(modern, 0, sizeof(VirtIOModern));
+	if(!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+		return false;
+
+	// The first capability of each type is the one to use
+	uint8_t reg = PCI_CAPABILITY_LIST;
+	for(int i = 0; i < 48; i++) { // TTL is 48 (from Linux)
+		reg = pci_read8(dev, reg);
+		if(reg < 0x40)
+			break;
+
+		reg &= ~3;
+		if(pci_read8(dev, reg + VIRTIO_PCI_CAP_VNDR) == PCI_CAP_ID_VNDR) {
+			uint8_t type = pci_read8(dev, reg + VIRTIO_PCI_CAP_CFG_TYPE);
+			volatile void* base = bar_address(dev, pci_read8(dev, reg + VIRTIO_PCI_CAP_BAR));
+			volatile void* address = base ? base + pci_read32(dev, reg + VIRTIO_PCI_CAP_OFFSET) : NULL;
+
+			switch(type) {
+				case VIRTIO_PCI_CAP_COMMON_CFG:
+					if(!modern->common)
+						modern->common = address;
+					break;
+				case VIRTIO_PCI_CAP_NOTIFY_CFG:
+					if(!modern->notify) {
+						modern->notify = address;
+						modern->notify_multiplier = pci_read32(dev, reg + VIRTIO_PCI_NOTIFY_CAP_MULT);
+					}
+					break;
+				case VIRTIO_PCI_CAP_ISR_CFG:
+					if(!modern->isr)
+						modern->isr = address;
+					break;
+				case VIRTIO_PCI_CAP_DEVICE_CFG:
+					if(!modern->device)
+						modern->device = address;
+					break;
+			}
+		}
+
+		reg += VIRTIO_PCI_CAP_NEXT;
+	}
+
+	return modern->common && modern->notify && modern->isr;
+}
+
+uint64_t virtio_modern_get_features(VirtIOModern* modern) {
+	COMMON32(modern, VIRTIO_PCI_COMMON_DFSELECT) = 0;
+	uint64_t features = COMMON32(modern, VIRTIO_PCI_COMMON_DF);
+	COMMON32(modern, VIRTIO_PCI_COMMON_DFSELECT) = 1;
+	features |= (uint64_t)COMMON32(modern, VIRTIO_PCI_COMMON_DF) << 32;
+
+	return features;
+}
+
+void virtio_modern_set_features(VirtIOModern* modern, uint64_t features) {
+	COMMON32(modern, VIRTIO_PCI_COMMON_GFSELECT) = 0;
+	COMMON32(modern, VIRTIO_PCI_COMMON_GF) = (uint32_t)features;
+	COMMON32(modern, VIRTIO_PCI_COMMON_GFSELECT) = 1;
+	COMMON32(modern, VIRTIO_PCI_COMMON_GF) = features >> 32;
+}
+
+uint8_t virtio_modern_get_status(VirtIOModern* modern) {
+	return COMMON8(modern, VIRTIO_PCI_COMMON_STATUS);
+}
+
+void virtio_modern_set_status(VirtIOModern* modern, uint8_t status) {
+	COMMON8(modern, VIRTIO_PCI_COMMON_STATUS) = status;
+}
+
+void virtio_modern_get_config(VirtIOModern* modern, uint32_t offset, void* buf, uint32_t len) {
+	uint8_t* ptr = buf;
+	if(!modern->device) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	// Read again if the device changed it meanwhile
+	uint8_t generation;
+	do {
+		generation = COMMON8(modern, VIRTIO_PCI_COMMON_CFGGENERATION);
+		for(uint32_t i = 0; i < len; i++)
+			ptr[i] = modern->device[offset + i];
+	} while(generation != COMMON8(modern, VIRTIO_PCI_COMMON_CFGGENERATION));
+}
+
+uint16_t virtio_modern_queue_size(VirtIOModern* modern, uint16_t index) {
+	COMMON16(modern, VIRTIO_PCI_COMMON_Q_SELECT) = index;
+	if(COMMON16(modern, VIRTIO_PCI_COMMON_Q_ENABLE))
+		return 0;
+
+	return COMMON16(modern, VIRTIO_PCI_COMMON_Q_SIZE);
+}
+
+volatile uint16_t* virtio_modern_queue_enable(VirtIOModern* modern, uint16_t index, uint16_t size, uint64_t desc, uint64_t driver, uint64_t device) {
+	COMMON16(modern, VIRTIO_PCI_COMMON_Q_SELECT) = index;
+	COMMON16(modern, VIRTIO_PCI_COMMON_Q_SIZE) = size;
+
+	// We don't have interrupt handler
+	COMMON16(modern, VIRTIO_PCI_COMMON_Q_MSIX) = VIRTIO_MSI_NO_VECTOR;
+
+	COMMON32(modern, VIRTIO_PCI_COMMON_Q_DESCLO) = (uint32_t)desc;
+	COMMON32(modern, VIRTIO_PCI_COMMON_Q_DESCHI) = desc >> 32;
+	COMMON32(modern, VIRTIO_PCI_COMMON_Q_AVAILLO) = (uint32_t)driver;
+	COMMON32(modern, VIRTIO_PCI_COMMON_Q_AVAILHI) = driver >> 32;
+	COMMON32(modern, VIRTIO_PCI_COMMON_Q_USEDLO) = (uint32_t)device;
+	COMMON32(modern, VIRTIO_PCI_COMMON_Q_USEDHI) = device >> 32;
+
+	uint16_t notify_off = COMMON16(modern, VIRTIO_PCI_COMMON_Q_NOFF);
+	COMMON16(modern, VIRTIO_PCI_COMMON_Q_ENABLE) = 1;
+
+	return (volatile uint16_t*)(modern->notify + (uint32_t)notify_off * modern->notify_multiplier);
+}
@@ -0,0 +1,60 @@
+#ifndef __VIRTIO_MODERN_H__
+#define __VIRTIO_MODERN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../pci.h"
+
+/*
+ * Virtio 1.0 PCI transport (VIRTIO_F_VERSION_1), shared by virtio-net and
+ * virtio-blk. The device's structures are in memory BARs found through its
+ * vendor specific capabilities, so kicks and configuration are MMIO instead
+ * of port I/O.
+ */
+
+/* Feature bit of a device which is v1.0 compliant */
+#ifndef VIRTIO_F_VERSION_1
+#define VIRTIO_F_VERSION_1		32
+#endif
+
+/* Device IDs of devices without the legacy interface are 0x1040 + the virtio device ID */
+#define VIRTIO_PCI_MODERN_DEVICE_ID(id)	(0x1040 + (id))
+
+typedef struct {
+	volatile void*		common;			///< struct virtio_pci_common_cfg
+	volatile void*		notify;			///< Notification of queue N at N's queue_notify_off * notify_multiplier
+	uint32_t		notify_multiplier;
+	volatile uint8_t*	isr;
+	volatile uint8_t*	device;			///< Device specific configuration
+} VirtIOModern;
+
+/**
+ * Find the structures of a modern device through its capabilities.
+ *
+ * @return true if the device has them all
+ */
+bool virtio_modern_probe(PCI_Device* dev, VirtIOModern* modern);
+
+uint64_t virtio_modern_get_features(VirtIOModern* modern);
+void virtio_modern_set_features(VirtIOModern* modern, uint64_t features);
+uint8_t virtio_modern_get_status(VirtIOModern* modern);
+void virtio_modern_set_status(VirtIOModern* modern, uint8_t status);
+
+/** Read len bytes at offset of the device specific configuration */
+void virtio_modern_get_config(VirtIOModern* modern, uint32_t offset, void* buf, uint32_t len);
+
+/**
+ * Size of the queue, 0 if it isn't there or already enabled.
+ */
+uint16_t virtio_modern_queue_size(VirtIOModern* modern, uint16_t index);
+
+/**
+ * Enable a queue of size descriptors whose descriptor area, driver area and
+ * device area are at the guest physical addresses given; for a packed ring
+ * the areas are its descriptors and its driver and device event suppression.
+ *
+ * @return register the queue is notified through by its index
+ */
+volatile uint16_t* virtio_modern_queue_enable(VirtIOModern* modern, uint16_t index, uint16_t size, uint64_t desc, uint64_t driver, uint64_t device);
+
+#endif /* __VIRTIO_MODERN_H__ */
@@ -0,0 +1,183 @@
+#ifndef __VIRTIO_PACKED_H__
+#define __VIRTIO_PACKED_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Packed virtqueue (VIRTIO_F_RING_PACKED) shared by virtio-net and virtio-blk.
+ * Descriptors, available and used buffers are all in one ring, so a buffer
+ * costs the driver and the device one cache line instead of three. A
+ * descriptor is available while its AVAIL flag matches the driver's wrap
+ * counter and USED doesn't, and used when both match the device's.
+ */
+
+/* Feature bit of the packed ring */
+#define VIRTIO_F_RING_PACKED			34
+
+/* Descriptor flags in addition to VRING_DESC_F_NEXT, WRITE and INDIRECT */
+#define VRING_PACKED_DESC_F_AVAIL		(1 << 7)
+#define VRING_PACKED_DESC_F_USED		(1 << 15)
+
+/* Event suppression flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE		0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE		0x1
+#define VRING_PACKED_EVENT_FLAG_DESC		0x2
+
+/* Descriptors are chained with VRING_DESC_F_NEXT */
+#define VRING_PACKED_DESC_F_NEXT		1
+#define VRING_PACKED_DESC_F_WRITE		2
+
+typedef struct {
+	uint64_t		addr;	///< Guest physical address of the buffer
+	uint32_t		len;	///< Length of the buffer, or written by the device when used
+	uint16_t		id;	///< Buffer ID, returned by the device when used
+	volatile uint16_t	flags;	///< AVAIL and USED with NEXT, WRITE
+} VringPackedDesc;
+
+typedef struct {
+	volatile uint16_t	off_wrap;	///< Descriptor to be notified about and its wrap counter (VRING_PACKED_EVENT_FLAG_DESC)
+	volatile uint16_t	flags;		///< VRING_PACKED_EVENT_FLAG_XXX
+} VringPackedEvent;
+
+typedef struct {
+	uint16_t		num;		///< Descriptors of the ring
+	VringPackedDesc*	desc;
+	VringPackedEvent*	driver;		///< Driver event suppression, read by the device
+	VringPackedEvent*	device;		///< Device event suppression, read by the driver
+
+	uint16_t		next_avail;	///< Descriptor the next buffer is made available in
+	bool			avail_wrap;	///< Driver's wrap counter
+	uint16_t		next_used;	///< Descriptor the next used buffer is looked for in
+	bool			used_wrap;	///< Device's wrap counter as the driver follows it
+	uint16_t*		chain;		///< Descriptors of each buffer ID, skipped when it is used
+	uint16_t		added;		///< Descriptors made available since the device was last notified
+} VringPacked;
+
+/* Ring of num descriptors followed by the event suppression structures */
+static inline uint32_t vring_packed_size(uint16_t num) {
+	return sizeof(VringPackedDesc) * num + sizeof(VringPackedEvent) * 2;
+}
+
+/* Set up a ring of num descriptors in zeroed memory p, with a descriptor count of each ID in chain */
+static inline void vring_packed_init(VringPacked* vr, uint16_t num, void* p, uint16_t* chain) {
+	vr->num = num;
+	vr->desc = p;
+	vr->driver = p + sizeof(VringPackedDesc) * num;
+	vr->device = vr->driver + 1;
+	vr->next_avail = 0;
+	vr->avail_wrap = true;
+	vr->next_used = 0;
+	vr->used_wrap = true;
+	vr->chain = chain;
+	vr->added = 0;
+}
+
+/* AVAIL and USED flags which make a descriptor available in this lap of the ring */
+static inline uint16_t vring_packed_avail_flags(VringPacked* vr) {
+	return vr->avail_wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+}
+
+/* Whether the device used the descriptor offset after the next used one, which is always the case for the first of a chain */
+static inline bool vring_packed_is_used(VringPacked* vr, uint16_t offset) {
+	uint16_t index = vr->next_used + offset;
+	bool wrap = vr->used_wrap;
+	if(index >= vr->num) {
+		index -= vr->num;
+		wrap = !wrap;
+	}
+
+	uint16_t flags = vr->desc[index].flags;
+
+	return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap && !!(flags & VRING_PACKED_DESC_F_USED) == wrap;
+}
+
+/*
+ * Make a buffer of count descriptors available under ID. Flags of the first
+ * are written last, so the device sees the whole chain at once. Returns the
+ * descriptor the buffer starts at.
+ */
+static inline uint16_t vring_packed_add(VringPacked* vr, uint16_t id, const uint64_t* addr, const uint32_t* len, const uint16_t* flags, uint16_t count) {
+	uint16_t head = vr->next_avail;
+	uint16_t head_flags = 0;
+	uint16_t index = head;
+	for(uint16_t i = 0; i < count; i++) {
+		VringPackedDesc* desc = &vr->desc[index];
+		desc->addr = addr[i];
+		desc->len = len[i];
+		desc->id = id;
+
+		uint16_t desc_flags = flags[i] | vring_packed_avail_flags(vr);
+		if(i + 1 < count)
+			desc_flags |= VRING_PACKED_DESC_F_NEXT;
+
+		if(i == 0)
+			head_flags = desc_flags;
+		else
+			desc->flags = desc_flags;
+
+		if(++index == vr->num) {
+			index = 0;
+			vr->avail_wrap = !vr->avail_wrap;
+		}
+	}
+	vr->next_avail = index;
+	vr->chain[id] = count;
+	vr->added += count;
+
+	// x86 keeps stores in order, so the compiler is all to hold back
+	asm volatile("" ::: "memory"); // wmb()
+	vr->desc[head].flags = head_flags;
+
+	return head;
+}
+
+/*
+ * Whether the device asks to be notified of the descriptors made available
+ * since it last was, through its event suppression: always, never, or once
+ * the descriptor it is waiting for is (VRING_PACKED_EVENT_FLAG_DESC, only with
+ * VIRTIO_RING_F_EVENT_IDX). To be called with the descriptors visible to it.
+ */
+static inline bool vring_packed_need_kick(VringPacked* vr) {
+	uint16_t added = vr->added;
+	vr->added = 0;
+
+	uint16_t flags = vr->device->flags;
+	if(flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+
+	// The descriptor is of the lap its wrap counter tells
+	uint16_t off_wrap = vr->device->off_wrap;
+	uint16_t event = off_wrap & 0x7fff;
+	if(!!(off_wrap >> 15) != vr->avail_wrap)
+		event -= vr->num;
+
+	uint16_t new = vr->next_avail;
+	uint16_t old = new - added;
+
+	return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+/* Take the next used buffer, its ID and the bytes the device wrote. Returns false if there is none */
+static inline bool vring_packed_get(VringPacked* vr, uint16_t* id, uint32_t* len) {
+	if(!vring_packed_is_used(vr, 0))
+		return false;
+
+	// Data in host OS should be exposed before guest OS reads
+	asm volatile("lfence" ::: "memory"); // rmb()
+
+	VringPackedDesc* desc = &vr->desc[vr->next_used];
+	*id = desc->id;
+	if(len)
+		*len = desc->len;
+
+	vr->next_used += vr->chain[*id];
+	if(vr->next_used >= vr->num) {
+		vr->next_used -= vr->num;
+		vr->used_wrap = !vr->used_wrap;
+	}
+
+	return true;
+}
+
+#endif /* __VIRTIO_PACKED_H__ */
@@ -16,17 +16,106 @@
 
 /* Let other side know about buffer changed */
 void kick(VirtQueue* vq) {
-	// Data in guest OS need to be set before we update avail ring index
-	asm volatile("sfence" ::: "memory");
-
-	vq->vring->avail->idx += vq->num_added;
+	// Packed ring buffers are available as soon as they are added
+	uint16_t old = 0;
+	if(!vq->packed) {
+		// Data in guest OS need to be set before we update avail ring index
+		asm volatile("sfence" ::: "memory");
+
+		old = vq->vring->avail->idx;
+		vq->vring->avail->idx = old + vq->num_added;
+	}
 	vq->num_added = 0;
 
 	// Need to update avail index before notify otherside
 	asm volatile("mfence" ::: "memory");
 
+	// A device busy with the queue tells it doesn't wait for a notification, each of which is a VM exit
+	if(vq->event) {
+		bool need = vq->packed ? vring_packed_need_kick(&vq->packed_ring) :
+				vring_need_event(*vring_avail_event(vq->vring), vq->vring->avail->idx, old);
+		if(!need) {
+			vq->kicks_avoided++;
+			return;
+		}
+	}
+	vq->kicks++;
+
 	// Notify the other side
-	port_out16(vq->vdev->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+	if(vq->notify)
+		*vq->notify = 0;
+	else
+		port_out16(vq->vdev->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+}
+
+/*
+ * Put a request on a packed ring: its header, data and status, or a table of
+ * them for an indirect descriptor. The device writes the status when it is
+ * done, so the ID of the buffer is only the descriptor it starts at.
+ */
+static void add_packed(VirtQueue* vq, VirtIOBlkReq* req, void* table, uint16_t table_count) {
+	VringPacked* vr = &vq->packed_ring;
+	if(table) {
+		uint64_t addr = (uintptr_t)table;
+		uint32_t len = table_count * sizeof(VringPackedDesc);
+		uint16_t flags = VRING_DESC_F_INDIRECT;
+		vring_packed_add(vr, vr->next_avail, &addr, &len, &flags, 1);
+		vq->num_added++;
+		return;
+	}
+
+	uint64_t addr[3] = { (uintptr_t)req, (uintptr_t)req->data, (uintptr_t)&req->status };
+	uint32_t len[3] = { sizeof(uint64_t) * 2, 512 * req->sector_count, sizeof(uint8_t) };
+	uint16_t flags[3] = { 0, req->type == VIRTIO_BLK_T_IN ? VRING_PACKED_DESC_F_WRITE : 0, VRING_PACKED_DESC_F_WRITE };
+	vring_packed_add(vr, vr->next_avail, addr, len, flags, 3);
+	vq->num_added++;
+}
+
+/* Indirect table of a packed ring, whose descriptors follow each other without NEXT */
+static uint8_t* add_indirect_packed(VirtQueue* vq, List* req_list, List* free_list) {
+	size_t request_num = list_size(req_list) + 2; // Data parts + head, tail
+	VringPackedDesc* desc = gmalloc(request_num * sizeof(VringPackedDesc));
+	bzero(desc, request_num * sizeof(VringPackedDesc));
+	VirtIOBlkReq* first_req = NULL;
+	int count = 1;
+
+	ListIterator iter;
+	list_iterator_init(&iter, req_list);
+	while(list_iterator_has_next(&iter)) {
+		VirtIOBlkReq* req = list_iterator_next(&iter);
+		if(req) {
+			if(req->type == VIRTIO_BLK_T_IN)
+				desc[count].flags = VRING_PACKED_DESC_F_WRITE;
+
+			desc[count].addr = (uintptr_t)req->data;
+			desc[count].len = 512 * (req->sector_count);
+
+			list_iterator_remove(&iter);
+
+			if(count == 1)
+				first_req = req;
+
+			count++;
+
+			if(free_list)
+				list_add(free_list, req);
+		}
+	}
+
+	// Request header part
+	desc[0].addr = (uintptr_t)first_req;
+	desc[0].len = sizeof(uint64_t) * 2;
+
+	// Request status part
+	desc[count].flags = VRING_PACKED_DESC_F_WRITE;
+	desc[count].addr = (uintptr_t)&(first_req->status);
+	desc[count].len = sizeof(uint8_t);
+
+	add_packed(vq, NULL, desc, count + 1);
+
+	list_add(free_list, desc);
+
+	return &(first_req->status);
 }
 
 static uint8_t* add_indirect(VirtQueue* vq, List* req_list, List* free_list) {
@@ -97,11 +186,30 @@ int add_buf(VirtQueue* vq, List* req_list, List* free_list, List* status_list) {
 
 	// If device supports indirect descriptor
 	if(vq->indirect) {
-		list_add(status_list, add_indirect(vq, req_list, free_list));
+		list_add(status_list, vq->packed ? add_indirect_packed(vq, req_list, free_list) : add_indirect(vq, req_list, free_list));
 		vq->num_free--;
 		return 0;
 	}
 
+	if(vq->packed) {
+		ListIterator iter;
+		list_iterator_init(&iter, req_list);
+		while(list_iterator_has_next(&iter)) {
+			VirtIOBlkReq* req = list_iterator_next(&iter);
+			if(req) {
+				add_packed(vq, req, NULL, 0);
+
+				// Remove a request from the list
+				list_iterator_remove(&iter);
+
+				list_add(free_list, req);
+				list_add(status_list, &(req->status));
+			}
+		}
+
+		return 0;
+	}
+
 	// Add requests into the descriptor table
 	VirtIOBlkReq*  req = NULL;
 	ListIterator iter;
@@ -149,8 +257,21 @@ int add_buf(VirtQueue* vq, List* req_list, List* free_list, List* status_list) {
 	return 0;
 }	
 
-/* Get used buffer which host OS used */
+/*
+ * Get used buffer which host OS used. Descriptors of a packed ring are free
+ * once the device has used them rather than when it writes the status, as
+ * the used descriptor is written over the available one; the number freed
+ * is returned.
+ */
 int get_buf(VirtQueue* vq, uint32_t* len) {
+	if(vq->packed) {
+		int count = 0;
+		uint16_t id;
+		while(vring_packed_get(&vq->packed_ring, &id, len))
+			count += vq->packed_ring.chain[id];
+
+		return count;
+	}
 
 	// Data in host OS should be exposed before guest OS reads
 	asm volatile("lfence" ::: "memory");
@@ -15,6 +15,8 @@ typedef struct {
 #define VRING_DESC_F_INDIRECT		4
 /* We support indirect buffer descriptors */
 #define VIRTIO_RING_F_INDIRECT_DESC	28
+/* The other side tells at which index it is to be notified, in used_event and avail_event */
+#define VIRTIO_RING_F_EVENT_IDX		29
 
 	/*The flags as indicated above. */
 	uint16_t flags;
@@ -13,6 +13,8 @@ typedef enum {
 	ICC_TYPE_RESUMED,
 	ICC_TYPE_STOP,
 	ICC_TYPE_STOPPED,
+	ICC_TYPE_MAP,
+	ICC_TYPE_MAPPED,
 } ICCType;
 
 #define ICC_STATUS_DONE		0
@@ -48,6 +50,12 @@ typedef struct _ICC_Message {
 		struct {
 			int return_code;
 		} stopped;
+
+		struct {
+			uint32_t vmid;
+			void*	block;		// 2MB block to map to the VM
+			bool	map;		// false to unmap it
+		} map;
 	} data;
 } ICC_Message;
 
@@ -132,10 +132,28 @@ static void icc_stop(ICC_Message* msg) {
 	else sti();
 }
 
+extern uint64_t PHYSICAL_OFFSET;
+
+// A block a VNIC pool has grown by, or is shrinking by
+static void icc_map(ICC_Message* msg) {
+	uint64_t idx = (uint64_t)msg->data.map.block >> 21;
+	PAGE_L4U[idx].base = idx + (PHYSICAL_OFFSET >> 21);
+	PAGE_L4U[idx].us = msg->data.map.map;
+	PAGE_L4U[idx].rw = 1;
+	PAGE_L4U[idx].exb = 1;
+	task_refresh_mmap();
+
+	ICC_Message* msg2 = icc_alloc(ICC_TYPE_MAPPED);
+	msg2->data.map = msg->data.map;
+	icc_send(msg2, msg->apic_id);
+	icc_free(msg);
+}
+
 int icc_ap_init() {
 	icc_register(ICC_TYPE_START, icc_start);
 	icc_register(ICC_TYPE_RESUME, icc_resume);
 	icc_register(ICC_TYPE_STOP, icc_stop);
+	icc_register(ICC_TYPE_MAP, icc_map);
 	apic_register(49, icc_pause);
 
 	return 0;
@@ -18,6 +18,7 @@
 #include "amp.h"
 #include "mp.h"
 #include "cpu.h"
+#include "msr.h"
 #include "gdt.h"
 #include "idt.h"
 #include "acpi.h"
@@ -119,6 +120,10 @@ void main() {
 
 	uint64_t apic_id = mp_apic_id();
 
+	// VNIC pools pick the cache of the core by rdtscp or rdpid
+	if(cpu_has_feature(CPU_FEATURE_RDTSCP))
+		msr_write(apic_id, MSR_IA32_TSC_AUX);
+
 	extern uint64_t PHYSICAL_OFFSET;
 	console_init();
 
@@ -284,6 +289,9 @@ void main() {
 
 	mp_sync(); // Barrier #3
 
+	// Queue pairs of the devices are polled by the cores they are given to
+	nicdev_poll_init(apic_id);
+
 	// 	if(apic_id == 0) {
 	// 	        while(exec("/boot/init.psh") > 0)
 	// 	                event_loop();
@@ -35,8 +35,6 @@ typedef struct _Manager {
 	List* 	actives;
 } Manager;
 
-extern NIC* __nics[MAX_VNIC_COUNT];
-extern int __nic_count;
 
 ManagerCore* manager_core;
 Manager manager;
@@ -256,8 +254,6 @@ static VNIC* manager_create_vnic(char* nicdev_name) {
 
 		manager.vnics[i] = vnic;
 		manager.vnic_count++;
-		__nics[i] = vnic->nic;
-		__nic_count++;
 		break;
 	}
 
@@ -277,8 +273,6 @@ static bool manager_destroy_vnic(VNIC* vnic) {
 
 		manager.vnics[i] = NULL;
 		manager.vnic_count--;
-		__nics[i] = NULL;
-		__nic_count++;
 		break;
 	}
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <util/cmd.h>
+#include <util/types.h>
 
 #include "driver/nicdev.h"
 
@@ -12,6 +13,15 @@ static int cmd_nic(int argc, char** argv, void(*callback)(char* result, int exit
 		return 0;
 	}
 
+	if(argc == 4) {
+		NICDevice* nicdev = nicdev_get(argv[1]);
+		if(!nicdev) return CMD_ERROR;
+		if(!is_uint64(argv[2]) || !is_uint64(argv[3])) return CMD_WRONG_TYPE_OF_ARGS;
+
+		nicdev_set_bandwidth(nicdev, parse_uint64(argv[2]), parse_uint64(argv[3]));
+		return 0;
+	} else if(argc != 1) return CMD_WRONG_NUMBER_OF_ARGS;
+
 	for(int i = 0 ; i < nicdevs_count; i++) {
 		NICDevice* nicdev = nicdevs[i];
 
@@ -23,6 +33,18 @@ static int cmd_nic(int argc, char** argv, void(*callback)(char* result, int exit
 				(nicdev->mac >> 16) & 0xff,
 				(nicdev->mac >> 8) & 0xff,
 				(nicdev->mac >> 0) & 0xff);
+		if(nicdev->rx_bucket.rate)
+			printf("    RXBandwidth: %ldMbps\n", nicdev->rx_bucket.rate / 1000000);
+		if(nicdev->tx_bucket.rate)
+			printf("    TXBandwidth: %ldMbps\n", nicdev->tx_bucket.rate / 1000000);
+		if(nicdev->rx_drops[NIC_DROP_RATE_LIMITED] || nicdev->rx_drops[NIC_DROP_FILTERED])
+			printf("    RXDrops: RateLimited %ld Filtered %ld\n", nicdev->rx_drops[NIC_DROP_RATE_LIMITED],
+					nicdev->rx_drops[NIC_DROP_FILTERED]);
+		for(int j = 0; j < nicdev->queue_count; j++) {
+			NICDeviceQueue* queue = &nicdev->queues[j];
+			if(queue->kicks || queue->kicks_avoided)
+				printf("    Queue%d: Kicks %ld Avoided %ld\n", j, queue->kicks, queue->kicks_avoided);
+		}
 	}
 
 	return 0;
@@ -31,7 +53,8 @@ static int cmd_nic(int argc, char** argv, void(*callback)(char* result, int exit
 static Command commands[] = {
 	{
 		.name = "nic",
-		.desc = "Print a list of network interface",
+		.desc = "Print a list of network interface or limit the bandwidth of one",
+		.args = "[nic_name:str iband:u64 oband:u64]",
 		.func = cmd_nic
 	},
 };
@@ -239,6 +239,18 @@ void task_resource(uint32_t id, uint8_t type, void* data) {
 
 				vaddr += 0x200000;
 			}
+
+			// Blocks the pool has grown by
+			for(int i = 0; i < NIC_POOL_EXTENT_COUNT; i++) {
+				if(vnic->pool.extents[i].count == 0)
+					continue;
+
+				uint64_t idx = ((uint64_t)vnic->nic + vnic->pool.extents[i].base - NIC_CHUNK_SIZE) >> 21;
+				PAGE_L4U[idx].base = idx + (PHYSICAL_OFFSET >> 21);
+				PAGE_L4U[idx].us = 1;
+				PAGE_L4U[idx].rw = 1;
+				PAGE_L4U[idx].exb = 1;
+			}
 			task_refresh_mmap();
 			break;
 	}
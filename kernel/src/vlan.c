@@ -26,6 +26,25 @@ NICDevice* nicdev_add_vlan(NICDevice* nicdev, uint16_t id) {
 	vlan_nicdev->vlan_tci = endian16(id);
 	vlan_nicdev->driver = nicdev->driver;
 	vlan_nicdev->priv = nicdev->priv;
+	vlan_nicdev->offloads = nicdev->offloads;
+	vlan_nicdev->queue_count = nicdev->queue_count;
+	vlan_nicdev->demux = nicdev->demux;
+	vlan_nicdev->parent = nicdev;
+
+	// Drivers find the device of a tagged frame by its VLAN ID
+	if(!nicdev->vlans) {
+		nicdev->vlans = gmalloc(sizeof(NICDevice*) * VNIC_DEMUX_VLAN_COUNT);
+		if(!nicdev->vlans) {
+			gfree(vlan_nicdev);
+			return NULL;
+		}
+
+		memset(nicdev->vlans, 0, sizeof(NICDevice*) * VNIC_DEMUX_VLAN_COUNT);
+	}
+
+	// Pollers of the device walk the VLANs
+	nicdev_poll_stop(nicdev);
+	nicdev->vlans[id & 0xfff] = vlan_nicdev;
 
 	NICDevice* next = nicdev;
 	while(1) {
@@ -49,6 +68,7 @@ NICDevice* nicdev_add_vlan(NICDevice* nicdev, uint16_t id) {
 			break;
 		}
 	}
+	nicdev_poll_start(nicdev);
 
 	event_busy_add((void*)((NICDriver*)vlan_nicdev->driver)->tx_poll, vlan_nicdev);
 	return vlan_nicdev;
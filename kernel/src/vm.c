@@ -62,6 +62,7 @@ static VM_STDIO_CALLBACK stdio_callback;
 
 static int cmd_md5(int argc, char** argv, void(*callback)(char* result, int exit_status));
 static int cmd_create(int argc, char** argv, void(*callback)(char* result, int exit_status));
+static int cmd_nic_update(int argc, char** argv, void(*callback)(char* result, int exit_status));
 static int cmd_vm_destroy(int argc, char** argv, void(*callback)(char* result, int exit_status));
 static int cmd_vm_list(int argc, char** argv, void(*callback)(char* result, int exit_status));
 static int cmd_upload(int argc, char** argv, void(*callback)(char* result, int exit_status));
@@ -74,11 +75,20 @@ static Command commands[] = {
 	{
 		.name = "create",
 		.desc = "Create VM",
-		.args = "[-c core_count:u8] [-m memory_size:u32] [-s storage_size:u32] "
-			"[-n [mac:u64],[dev:str],[ibuf:u32],[obuf:u32],[iband:u64],[oband:u64],[hpad:u16],[tpad:u16],[pool:u32] ] "
+		.args = "[-c core_count:u8] [-m memory_size:u32] [-s storage_size:u32] [-i iband:u64] [-o oband:u64] "
+			"[-n [mac:u64],[dev:str],[ibuf:u32],[obuf:u32],[iband:u64],[oband:u64],[hpad:u16],[tpad:u16],[pool:u32],[quantum:u32],[priority:str{on|off}],[budget_min:u16],[budget_max:u16],"
+			"[codel:str{on|off}],[codel_target:u32],[codel_interval:u32],[shared_pool:str{on|off}],[pool_quota:u32],[pool_max:u32],[mtu:u16] ] "
 			"[-a args:str] -> vmid ",
 		.func = cmd_create
 	},
+	{
+		.name = "update",
+		.desc = "Change NIC attributes of a running VM",
+		.args = "vmid:u32 mac:u64 [mac:u64],[budget:u16],[iband:u64],[oband:u64],[hpad:u16],[tpad:u16],"
+			"[promisc:str{on|off}],[broadcast:str{on|off}],[multicast:str{on|off}],[quantum:u32],[priority:str{on|off}],"
+			"[budget_min:u16],[budget_max:u16],[codel:str{on|off}],[codel_target:u32],[codel_interval:u32] -> bool",
+		.func = cmd_nic_update
+	},
 	{
 		.name = "destroy",
 		.desc = "Destroy VM",
@@ -328,6 +338,88 @@ static void icc_stopped(ICC_Message* msg) {
 	event_trigger_fire((uint64_t)vm->id, (void*)vm->status, NULL, NULL);
 }
 
+static VM* vm_get(uint32_t vmid);
+
+// Map a block of a pool to the cores of the VM, or unmap it
+static void vm_pool_map(VM* vm, VNIC* vnic, void* block, int class) {
+	vm->pool_op.vnic = vnic;
+	vm->pool_op.block = block;
+	vm->pool_op.class = class;
+	vm->pool_op.acks = vm->core_size;
+
+	for(int i = 0; i < vm->core_size; i++) {
+		ICC_Message* msg = icc_alloc(ICC_TYPE_MAP);
+		msg->data.map.vmid = vm->id;
+		msg->data.map.block = block;
+		msg->data.map.map = class >= 0;
+		icc_send(msg, vm->cores[i]);
+	}
+}
+
+static void icc_mapped(ICC_Message* msg) {
+	VM* vm = vm_get(msg->data.map.vmid);
+	void* block = msg->data.map.block;
+	icc_free(msg);
+
+	if(!vm || vm->pool_op.block != block || --vm->pool_op.acks > 0)
+		return;
+
+	VNIC* vnic = vm->pool_op.vnic;
+	int class = vm->pool_op.class;
+	vm->pool_op.vnic = NULL;
+	vm->pool_op.block = NULL;
+
+	// Mapped everywhere: the VM may use the buffers from now on
+	if(class >= 0) {
+		if(vnic_pool_grow(vnic, block, class))
+			return;
+
+		vm_pool_map(vm, vnic, block, -1);
+		return;
+	}
+
+	// Unmapped everywhere: the block is no longer the VM's
+	bfree(block);
+}
+
+static bool vm_pool_event(void* context) {
+	MapIterator iter;
+	map_iterator_init(&iter, vms);
+	while(map_iterator_has_next(&iter)) {
+		VM* vm = map_iterator_next(&iter)->data;
+		if(vm->status != VM_STATUS_START || vm->pool_op.vnic)
+			continue;
+
+		for(int i = 0; i < vm->nic_count; i++) {
+			VNIC* vnic = vm->nics[i];
+			void* block = vnic_pool_shrink(vnic, VM_POOL_IDLE);
+			if(block) {
+				vm_pool_map(vm, vnic, block, -1);
+				break;
+			}
+
+			int class = vnic_pool_grow_class(vnic);
+			if(class < 0)
+				continue;
+
+			// Offsets of the buffers are from the NIC
+			block = bmalloc(1);
+			if(!block)
+				break;
+
+			if(block < (void*)vnic->nic || (uint64_t)(block - (void*)vnic->nic) + VNIC_POOL_SIZE_ALIGN > UINT32_MAX) {
+				bfree(block);
+				continue;
+			}
+
+			vm_pool_map(vm, vnic, block, class);
+			break;
+		}
+	}
+
+	return true;
+}
+
 static bool vm_delete(VM* vm) {
 	for(int i = 0; i < vm->core_size; i++) {
 		if(vm->cores[i]) {
@@ -357,11 +449,26 @@ static bool vm_delete(VM* vm) {
 		#else
 		extern int dispatcher_destroy_vnic(void* vnic);
 		#endif
+		// A shared pool is in the memory of one of them; none may use it any more before it is freed
 		for(int i = 0; i < vm->nic_count; i++) {
 			if(vm->nics[i]) {
 				NICDevice* nicdev = nicdev_get(vm->nics[i]->parent);
 				nicdev_unregister_vnic(nicdev, vm->nics[i]->id);
 				dispatcher_destroy_vnic(vm->nics[i]);
+			}
+		}
+
+		if(vm->pool_op.block)
+			bfree(vm->pool_op.block);
+
+		for(int i = 0; i < vm->nic_count; i++) {
+			if(vm->nics[i]) {
+				for(int j = 0; j < NIC_POOL_EXTENT_COUNT; j++) {
+					NICSlab* extent = &vm->nics[i]->pool.extents[j];
+					if(extent->count)
+						bfree((void*)vm->nics[i]->nic + extent->base - NIC_CHUNK_SIZE);
+				}
+
 				bfree(vm->nics[i]->nic);
 				vnic_free_id(vm->nics[i]->id);
 				gfree(vm->nics[i]);
@@ -447,19 +554,21 @@ int vm_init() {
 	icc_register(ICC_TYPE_PAUSED, icc_paused);
 	icc_register(ICC_TYPE_RESUMED, icc_resumed);
 	icc_register(ICC_TYPE_STOPPED, icc_stopped);
+	icc_register(ICC_TYPE_MAPPED, icc_mapped);
 
 	// Core 0 is occupied by RPC manager
 	cores[0].status = CORE_STATUS_START;
 
 	uint8_t* core_map = mp_processor_map();
 	for(int i = 1; i < MP_MAX_CORE_COUNT; i++) {
-		if(core_map[i] == MP_CORE_INVALID)
+		if(core_map[i] == MP_CORE_INVALID || nicdev_is_poll_core(i))
 			cores[i].status = CORE_STATUS_INVALID;	// Disable the core
 		else
 			cores[i].status = CORE_STATUS_AVAILABLE;	// Disable the core
 	}
 
 	event_idle_add(vm_loop, NULL);
+	event_timer_add(vm_pool_event, NULL, VM_POOL_PERIOD, VM_POOL_PERIOD);
 
 	cmd_register(commands, sizeof(commands) / sizeof(commands[0]));
 
@@ -519,6 +628,9 @@ uint32_t vm_create(VMSpec* vmspec) {
 		}
 	}
 
+	token_bucket_init(&vm->rx_bucket, TIMER_FREQUENCY_PER_SEC, vmspec->rx_bandwidth, 0, 0, 0, NULL);
+	token_bucket_init(&vm->tx_bucket, TIMER_FREQUENCY_PER_SEC, vmspec->tx_bandwidth, 0, 0, 0, NULL);
+
 	// Allocate core
 	vm->core_size = vmspec->core_size;
 	if(!vm->core_size) {
@@ -612,6 +724,29 @@ uint32_t vm_create(VMSpec* vmspec) {
 		}
 
 		memset(vm->nics, 0, sizeof(VNIC) * vm->nic_count);
+
+		// NICs with a shared pool allocate from the first of them, which holds
+		// the memory of all their pools but the 2MB each of the others keeps
+		// for its queues
+		uint64_t shared_size = 0;
+		int shared_count = 0;
+		for(int i = 0; i < vm->nic_count; i++) {
+			if(nics[i].flags & NICSPEC_F_SHARED_POOL) {
+				shared_size += nics[i].pool_size;
+				shared_count++;
+			}
+		}
+		if(shared_count > NIC_POOL_SHARE_COUNT) {
+			errno = EOVERMAX;
+			goto fail;
+		}
+		shared_size -= (uint64_t)(shared_count ? shared_count - 1 : 0) * VNIC_POOL_SIZE_ALIGN;
+		if(shared_size > VNIC_MAX_POOL_SIZE) {
+			errno = EOVERMAX;
+			goto fail;
+		}
+		VNIC* holder = NULL;
+
 		for(int i = 0; i < vm->nic_count; i++) {
 			NICDevice* nicdev;
 			if(!strlen(nics[i].parent)) {
@@ -655,12 +790,47 @@ uint32_t vm_create(VMSpec* vmspec) {
 				goto fail;
 			}
 
+			if(nics[i].pool_max & (VNIC_POOL_SIZE_ALIGN - 1)) {
+				errno = EALIGN;
+				goto fail;
+			}
+			if(nics[i].pool_max > VNIC_MAX_POOL_SIZE) {
+				errno = EOVERMAX;
+				goto fail;
+			}
+
+			uint64_t pool_size = nics[i].pool_size;
+			uint64_t pool_quota = nics[i].pool_quota;
+			VNIC* shared = NULL;
+			if(nics[i].flags & NICSPEC_F_SHARED_POOL) {
+				if(holder) {
+					shared = holder;
+					pool_size = VNIC_POOL_SIZE_ALIGN;
+				} else {
+					pool_size = shared_size;
+				}
+
+				// No NIC takes more than its own pool or half of the shared one unless told
+				if(!pool_quota && shared_count > 1)
+					pool_quota = nics[i].pool_size > shared_size / 2 ? nics[i].pool_size : shared_size / 2;
+			}
+
+			int queue_count = 1;
+			if(nics[i].flags & NICSPEC_F_MULTIQUEUE)
+				queue_count = vm->core_size < NIC_MAX_QUEUE_COUNT ? vm->core_size : NIC_MAX_QUEUE_COUNT;
+
 			uint64_t attrs[] = {
 				VNIC_MAC, nics[i].mac,
 				VNIC_DEV, (uint64_t)nicdev->name,
 				VNIC_BUDGET, nics[i].budget,
+				VNIC_BUDGET_MIN, nics[i].budget_min,
+				VNIC_BUDGET_MAX, nics[i].budget_max,
 				VNIC_FLAGS, nics[i].flags,
-				VNIC_POOL_SIZE, nics[i].pool_size,
+				VNIC_POOL_SIZE, pool_size,
+				VNIC_POOL_SHARED, (uint64_t)shared,
+				VNIC_POOL_QUOTA, pool_quota,
+				// A shared pool doesn't grow
+				VNIC_POOL_MAX_SIZE, shared || (nics[i].flags & NICSPEC_F_SHARED_POOL) ? 0 : nics[i].pool_max,
 				VNIC_RX_BANDWIDTH, nics[i].rx_bandwidth,
 				VNIC_TX_BANDWIDTH, nics[i].tx_bandwidth,
 				VNIC_PADDING_HEAD, nics[i].padding_head,
@@ -669,6 +839,18 @@ uint32_t vm_create(VMSpec* vmspec) {
 				VNIC_TX_QUEUE_SIZE, nics[i].tx_buffer_size,
 				VNIC_SLOW_RX_QUEUE_SIZE, nics[i].rx_buffer_size, //control plane use slowpath buffer size
 				VNIC_SLOW_TX_QUEUE_SIZE, nics[i].tx_buffer_size,
+				// Every thread of a multi-core VM may consume rx and produce tx
+				// unless each has a queue pair of its own
+				VNIC_RX_QUEUE_FLAGS, vm->core_size > queue_count ? NIC_QUEUE_F_MC : 0,
+				VNIC_TX_QUEUE_FLAGS, vm->core_size > queue_count ? NIC_QUEUE_F_MP : 0,
+				VNIC_QUEUE_COUNT, queue_count,
+				// VNICs of a VM are mapped together so they can share broadcasts
+				VNIC_GROUP, vm->id,
+				VNIC_TX_QUANTUM, nics[i].tx_quantum,
+				VNIC_TX_PRIORITY, nics[i].tx_priority,
+				VNIC_RX_CODEL_TARGET, nics[i].codel_target ? : CODEL_TARGET,
+				VNIC_RX_CODEL_INTERVAL, nics[i].codel_interval ? : CODEL_INTERVAL,
+				VNIC_MTU, nics[i].mtu ? : VNIC_MTU_DEFAULT,
 				VNIC_NONE
 			};
 
@@ -682,8 +864,8 @@ uint32_t vm_create(VMSpec* vmspec) {
 			char name_buf[32];
 			sprintf(name_buf, "v%deth%d", vm->id, i);
 			strncpy(vnic->name, name_buf, _IFNAMSIZ);
-			vnic->nic_size = nics[i].pool_size;
-			vnic->nic = bmalloc(nics[i].pool_size / 0x200000);
+			vnic->nic_size = pool_size;
+			vnic->nic = bmalloc(pool_size / 0x200000);
 			if(!vnic->nic) {
 				errno = EALLOCMEM;
 				goto fail;
@@ -694,6 +876,9 @@ uint32_t vm_create(VMSpec* vmspec) {
 				goto fail;
 			}
 
+			vnic->rx_bucket.parent = &vm->rx_bucket;
+			vnic->tx_bucket.parent = &vm->tx_bucket;
+
 			#ifdef PACKETNGIN_SINGLE
 			int dispatcher_create_vnic(void* vnic) { return 0; }
 			#else
@@ -707,6 +892,9 @@ uint32_t vm_create(VMSpec* vmspec) {
 			vm->nics[i] = vnic;
 
 			nicdev_register_vnic(nicdev, vnic);
+
+			if((nics[i].flags & NICSPEC_F_SHARED_POOL) && !holder)
+				holder = vnic;
 		}
 	}
 
@@ -734,7 +922,8 @@ bool vm_destroy(uint32_t vmid) {
 		errno = EVMID;
 		return false;
 	}
-	if(vm->status != VM_STATUS_STOP) {
+	// A block of a pool is yet to be mapped or unmapped by the cores
+	if(vm->status != VM_STATUS_STOP || vm->pool_op.vnic) {
 		errno = ESTATUS;
 		return false;
 	}
@@ -753,6 +942,41 @@ bool vm_destroy(uint32_t vmid) {
 	return true;
 }
 
+bool vm_nic_update(uint32_t vmid, uint64_t mac, uint64_t* attrs) {
+	VM* vm = vm_get(vmid);
+	if(!vm) {
+		errno = EVMID;
+		return false;
+	}
+
+	for(int i = 0; i < vm->nic_count; i++) {
+		VNIC* vnic = vm->nics[i];
+		if(vnic->config.mac != mac)
+			continue;
+
+		// Another NIC of the device may have the new MAC address
+		NICDevice* nicdev = nicdev_get(vnic->parent);
+		for(int j = 0; attrs[j] != VNIC_NONE; j += 2) {
+			if(attrs[j] == VNIC_MAC && attrs[j + 1] != mac && (!nicdev || nicdev_get_vnic_mac(nicdev, attrs[j + 1]))) {
+				errno = EVNICMAC;
+				return false;
+			}
+		}
+
+		// The device demultiplexes frames to the VNIC by its address and flags
+		VNICError error = nicdev ? nicdev_vnic_update(nicdev, vnic, attrs) : vnic_update(vnic, attrs);
+		if(error != VNIC_ERROR_NOERROR) {
+			errno = EVNICUPDATE;
+			return false;
+		}
+
+		return true;
+	}
+
+	errno = EVNICMAC;
+	return false;
+}
+
 bool vm_get_spec(VMSpec* vmspec) {
 	VM* vm = vm_get(vmspec->id);
 	if(!vm) {
@@ -764,6 +988,8 @@ bool vm_get_spec(VMSpec* vmspec) {
 	vmspec->core_size = vm->core_size;
 	vmspec->memory_size = vm->memory.count * VM_MEMORY_SIZE_ALIGN;
 	vmspec->storage_size = vm->storage.count * VM_STORAGE_SIZE_ALIGN;
+	vmspec->rx_bandwidth = vm->rx_bucket.rate;
+	vmspec->tx_bandwidth = vm->tx_bucket.rate;
 	
 	vmspec->nic_count = vm->nic_count;
 	for(int i = 0; i < vmspec->nic_count; i++) {
@@ -773,23 +999,38 @@ bool vm_get_spec(VMSpec* vmspec) {
 		nicspec->mac = vnic->mac;
 		strcpy(nicspec->parent, vnic->parent);
 		nicspec->budget = vnic->budget;
+		nicspec->budget_min = vnic->poll.min;
+		nicspec->budget_max = vnic->poll.max;
 		nicspec->flags = vnic->flags;
 
-		nicspec->rx_buffer_size = vnic->rx.size;
-		nicspec->tx_buffer_size = vnic->tx.size;
+		nicspec->rx_buffer_size = vnic->nic->rxq[0].size;
+		nicspec->tx_buffer_size = vnic->nic->txq[0].size;
 		nicspec->padding_head = vnic->padding_head;
 		nicspec->padding_tail = vnic->padding_tail;
 		nicspec->rx_bandwidth = vnic->rx_bandwidth;
 		nicspec->tx_bandwidth = vnic->tx_bandwidth;
 		nicspec->pool_size = vnic->nic_size;
-
-		nicspec->rx_packets = vnic->input_packets;
-		nicspec->tx_bytes = vnic->output_packets;
-		nicspec->tx_drop_bytes = vnic->output_drop_bytes;
-		nicspec->rx_bytes = vnic->input_bytes;
-		nicspec->tx_bytes = vnic->output_bytes;
-		nicspec->rx_drop_bytes = vnic->input_drop_bytes;
-		nicspec->tx_drop_bytes = vnic->output_drop_bytes;
+		nicspec->tx_quantum = vnic->tx_quantum;
+		nicspec->tx_priority = vnic->tx_priority;
+		nicspec->codel_target = vnic->config.rx_codel_target;
+		nicspec->codel_interval = vnic->config.rx_codel_interval;
+		nicspec->pool_quota = vnic->pool.quota;
+		nicspec->pool_charged = nic_pool_charged(vnic->nic);
+		nicspec->pool_max = vnic->pool_max;
+		nicspec->pool_grown = vnic_pool_size(vnic) - vnic->nic_size;
+
+		NICStats stats;
+		vnic_stats(vnic, &stats);
+		nicspec->rx_packets = stats.rx.packets;
+		nicspec->rx_bytes = stats.rx.bytes;
+		nicspec->rx_drop_packets = stats.rx.drop_packets;
+		nicspec->rx_drop_bytes = stats.rx.drop_bytes;
+		nicspec->tx_packets = stats.tx.packets;
+		nicspec->tx_bytes = stats.tx.bytes;
+		nicspec->tx_drop_packets = stats.tx.drop_packets;
+		nicspec->tx_drop_bytes = stats.tx.drop_bytes;
+		memcpy(nicspec->rx_drops, stats.rx.drops, sizeof(nicspec->rx_drops));
+		memcpy(nicspec->tx_drops, stats.tx.drops, sizeof(nicspec->tx_drops));
 	}
 	//TODO: Add arguments
 	return true;
@@ -1164,6 +1405,9 @@ static void print_vm_error(const char* msg) {
 		case ESTORAGE:
 			printf("VM Error: VM storage is empty");
 			break;
+		case EVNICUPDATE:
+			printf("VM Error: VNIC can't be updated so");
+			break;
 	}
 
 	if(msg) printf(": %s\n", msg);
@@ -1171,6 +1415,15 @@ static void print_vm_error(const char* msg) {
 }
 ////
 
+static void print_drops(char* indent, uint64_t* drops) {
+	static const char* reasons[NIC_DROP_REASON_COUNT] = { "NoMemory", "QueueFull", "RateLimited", "Filtered", "AQM" };
+
+	printf("%s        Drops:", indent ? : "");
+	for(int i = 0; i < NIC_DROP_REASON_COUNT; i++)
+		printf(" %s %ld", reasons[i], drops[i]);
+	printf("\n");
+}
+
 static void print_nicspec(NICSpec* nicspec, char* indent) {
 	printf("%s%s:\n", indent ? : "", nicspec->name);
 	printf("%s    Parent: %s\n", indent ? : "", nicspec->parent);
@@ -1215,6 +1468,21 @@ static void print_nicspec(NICSpec* nicspec, char* indent) {
 		else printf(", ");
 		printf("MULTIQUEUE");
 	}
+	if(nicspec->flags & NICSPEC_F_CHAIN) {
+		if(is_first) is_first = false;
+		else printf(", ");
+		printf("CHAIN");
+	}
+	if(nicspec->flags & NICSPEC_F_CODEL) {
+		if(is_first) is_first = false;
+		else printf(", ");
+		printf("CODEL %d/%dus", nicspec->codel_target, nicspec->codel_interval);
+	}
+	if(nicspec->flags & NICSPEC_F_SHARED_POOL) {
+		if(is_first) is_first = false;
+		else printf(", ");
+		printf("SHARED_POOL");
+	}
 	printf("]\n");
 
 	printf("%s    RXBandwidth: %ldMbps\n", indent ? : "", nicspec->rx_bandwidth / 1000000);
@@ -1223,14 +1491,27 @@ static void print_nicspec(NICSpec* nicspec, char* indent) {
 	printf("%s    TxSize: %ld\n", indent ? : "", nicspec->tx_buffer_size);
 	printf("%s    HeaderPadding: %ld\n", indent ? : "", nicspec->padding_head);
 	printf("%s    TailPadding: %ld\n", indent ? : "",  nicspec->padding_tail);
-	printf("%s    PoolSize: %ldMbs\n", indent ? : "",  nicspec->pool_size / (1024 * 1024));
+	if(nicspec->pool_max > nicspec->pool_size)
+		printf("%s    PoolSize: %ldMbs (+%ldMbs grown, %ldMbs at most)\n", indent ? : "",  nicspec->pool_size / (1024 * 1024),
+				nicspec->pool_grown / (1024 * 1024), nicspec->pool_max / (1024 * 1024));
+	else
+		printf("%s    PoolSize: %ldMbs\n", indent ? : "",  nicspec->pool_size / (1024 * 1024));
+	if(nicspec->pool_quota)
+		printf("%s    PoolQuota: %dKbs/%dKbs\n", indent ? : "",  nicspec->pool_charged / 1024, nicspec->pool_quota / 1024);
+	printf("%s    TxQuantum: %d%s\n", indent ? : "",  nicspec->tx_quantum, nicspec->tx_priority ? " (Priority)" : "");
+	if(nicspec->budget_min < nicspec->budget_max)
+		printf("%s    Budget: %d (%d-%d)\n", indent ? : "",  nicspec->budget, nicspec->budget_min, nicspec->budget_max);
+	else
+		printf("%s    Budget: %d\n", indent ? : "",  nicspec->budget);
 
 	printf("%s    RX:\n", indent ? : "");
 	printf("%s        Packets: %ld (%ld Bytes)\n", indent ? : "", nicspec->rx_packets, nicspec->rx_bytes);
 	printf("%s        DropPackets: %ld (%ld Bytes)\n", indent ? : "", nicspec->rx_drop_packets, nicspec->rx_drop_bytes);
+	print_drops(indent, nicspec->rx_drops);
 	printf("%s    TX:\n", indent ? : "");
-	printf("%s        Packets: %ld (%ld Bytes)\n", indent ? : "", nicspec->tx_bytes, nicspec->tx_bytes);
-	printf("%s        DropPackets: %ld (%ld Bytes)\n", indent ? : "", nicspec->tx_drop_bytes, nicspec->tx_drop_bytes);
+	printf("%s        Packets: %ld (%ld Bytes)\n", indent ? : "", nicspec->tx_packets, nicspec->tx_bytes);
+	printf("%s        DropPackets: %ld (%ld Bytes)\n", indent ? : "", nicspec->tx_drop_packets, nicspec->tx_drop_bytes);
+	print_drops(indent, nicspec->tx_drops);
 }
 
 static void print_vmspec(VMSpec* vmspec) {
@@ -1251,6 +1532,10 @@ static void print_vmspec(VMSpec* vmspec) {
 
 	printf("    Memory: %dMbs\n", vmspec->memory_size  / 0x100000);
 	printf("    Storage: %dMbs\n", vmspec->storage_size  / 0x100000);
+	if(vmspec->rx_bandwidth)
+		printf("    RXBandwidth: %ldMbps\n", vmspec->rx_bandwidth / 1000000);
+	if(vmspec->tx_bandwidth)
+		printf("    TXBandwidth: %ldMbps\n", vmspec->tx_bandwidth / 1000000);
 
 	if(vmspec->nic_count) {
 		printf("    NICS:\n");
@@ -1325,6 +1610,16 @@ static int cmd_create(int argc, char** argv, void(*callback)(char* result, int e
 
 			if(!is_uint32(argv[i])) return CMD_WRONG_TYPE_OF_ARGS;
 			vm.storage_size = parse_uint32(argv[i]);
+		} else if(strcmp(argv[i], "-i") == 0) {
+			NEXT_ARGUMENTS();
+
+			if(!is_uint64(argv[i])) return CMD_WRONG_TYPE_OF_ARGS;
+			vm.rx_bandwidth = parse_uint64(argv[i]);
+		} else if(strcmp(argv[i], "-o") == 0) {
+			NEXT_ARGUMENTS();
+
+			if(!is_uint64(argv[i])) return CMD_WRONG_TYPE_OF_ARGS;
+			vm.tx_bandwidth = parse_uint64(argv[i]);
 		} else if(strcmp(argv[i], "-n") == 0) {
 			NICSpec* nic = &(vm.nics[vm.nic_count++]);
 
@@ -1355,6 +1650,12 @@ static int cmd_create(int argc, char** argv, void(*callback)(char* result, int e
 				} else if(!strcmp(token, "budget")) {
 					if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
 					nic->budget = parse_uint16(value);
+				} else if(!strcmp(token, "budget_min")) {
+					if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->budget_min = parse_uint16(value);
+				} else if(!strcmp(token, "budget_max")) {
+					if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->budget_max = parse_uint16(value);
 				} else if(!strcmp(token, "ibuf")) {
 					if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
 					nic->rx_buffer_size = parse_uint32(value);
@@ -1409,9 +1710,49 @@ static int cmd_create(int argc, char** argv, void(*callback)(char* result, int e
 						nic->flags |= NICSPEC_F_MULTIQUEUE;
 						nic->flags ^= NICSPEC_F_MULTIQUEUE;
 					} else return CMD_WRONG_TYPE_OF_ARGS;
+				} else if(!strcmp(token, "codel")) {
+					if(!strcmp(value, "on")) nic->flags |= NICSPEC_F_CODEL;
+					else if(!strcmp(value, "off")) {
+						nic->flags |= NICSPEC_F_CODEL;
+						nic->flags ^= NICSPEC_F_CODEL;
+					} else return CMD_WRONG_TYPE_OF_ARGS;
+				} else if(!strcmp(token, "codel_target")) {
+					if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->codel_target = parse_uint32(value);
+				} else if(!strcmp(token, "codel_interval")) {
+					if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->codel_interval = parse_uint32(value);
+				} else if(!strcmp(token, "chain")) {
+					if(!strcmp(value, "on")) nic->flags |= NICSPEC_F_CHAIN;
+					else if(!strcmp(value, "off")) {
+						nic->flags |= NICSPEC_F_CHAIN;
+						nic->flags ^= NICSPEC_F_CHAIN;
+					} else return CMD_WRONG_TYPE_OF_ARGS;
 				} else if(!strcmp(token, "pool")) {
 					if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
 					nic->pool_size = parse_uint32(value);
+				} else if(!strcmp(token, "shared_pool")) {
+					if(!strcmp(value, "on")) nic->flags |= NICSPEC_F_SHARED_POOL;
+					else if(!strcmp(value, "off")) {
+						nic->flags |= NICSPEC_F_SHARED_POOL;
+						nic->flags ^= NICSPEC_F_SHARED_POOL;
+					} else return CMD_WRONG_TYPE_OF_ARGS;
+				} else if(!strcmp(token, "pool_quota")) {
+					if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->pool_quota = parse_uint32(value);
+				} else if(!strcmp(token, "pool_max")) {
+					if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->pool_max = parse_uint32(value);
+				} else if(!strcmp(token, "mtu")) {
+					if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->mtu = parse_uint16(value);
+				} else if(!strcmp(token, "quantum")) {
+					if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->tx_quantum = parse_uint32(value);
+				} else if(!strcmp(token, "priority")) {
+					if(!strcmp(value, "on")) nic->tx_priority = 1;
+					else if(!strcmp(value, "off")) nic->tx_priority = 0;
+					else return CMD_WRONG_TYPE_OF_ARGS;
 				} else {
 					i--;
 					break;
@@ -1437,6 +1778,124 @@ static int cmd_create(int argc, char** argv, void(*callback)(char* result, int e
 	return CMD_SUCCESS;
 }
 
+static int cmd_nic_update(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc != 4) return CMD_WRONG_NUMBER_OF_ARGS;
+	if(!is_uint32(argv[1]) || !is_uint64(argv[2])) return CMD_WRONG_TYPE_OF_ARGS;
+
+	uint32_t vmid = parse_uint32(argv[1]);
+	uint64_t mac = strtoull(argv[2], NULL, 16);
+
+	VMSpec vmspec = {};
+	vmspec.id = vmid;
+	if(!vm_get_spec(&vmspec)) {
+		print_vm_error("");
+		return CMD_ERROR;
+	}
+
+	uint64_t flags = 0;
+	for(int i = 0; i < vmspec.nic_count; i++) {
+		if(vmspec.nics[i].mac == mac)
+			flags = vmspec.nics[i].flags;
+	}
+
+	uint64_t attrs[32];
+	size_t count = 0;
+	bool flags_changed = false;
+
+	char* next;
+	char* token = strtok_r(argv[3], ",", &next);
+	while(token) {
+		char* value;
+		token = strtok_r(token, "=", &value);
+		if(!value) return CMD_WRONG_TYPE_OF_ARGS;
+
+		uint64_t flag = 0;
+		if(!strcmp(token, "mac")) {
+			if(!is_uint64(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_MAC;
+			attrs[count++] = strtoull(value, NULL, 16);
+		} else if(!strcmp(token, "budget")) {
+			if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_BUDGET;
+			attrs[count++] = parse_uint16(value);
+		} else if(!strcmp(token, "budget_min")) {
+			if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_BUDGET_MIN;
+			attrs[count++] = parse_uint16(value);
+		} else if(!strcmp(token, "budget_max")) {
+			if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_BUDGET_MAX;
+			attrs[count++] = parse_uint16(value);
+		} else if(!strcmp(token, "iband")) {
+			if(!is_uint64(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_RX_BANDWIDTH;
+			attrs[count++] = parse_uint64(value);
+		} else if(!strcmp(token, "oband")) {
+			if(!is_uint64(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_TX_BANDWIDTH;
+			attrs[count++] = parse_uint64(value);
+		} else if(!strcmp(token, "hpad")) {
+			if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_PADDING_HEAD;
+			attrs[count++] = parse_uint16(value);
+		} else if(!strcmp(token, "tpad")) {
+			if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_PADDING_TAIL;
+			attrs[count++] = parse_uint16(value);
+		} else if(!strcmp(token, "quantum")) {
+			if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_TX_QUANTUM;
+			attrs[count++] = parse_uint32(value);
+		} else if(!strcmp(token, "priority")) {
+			if(strcmp(value, "on") && strcmp(value, "off")) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_TX_PRIORITY;
+			attrs[count++] = !strcmp(value, "on");
+		} else if(!strcmp(token, "promisc")) {
+			flag = NICSPEC_F_PROMISC;
+		} else if(!strcmp(token, "broadcast")) {
+			flag = NICSPEC_F_BROADCAST;
+		} else if(!strcmp(token, "multicast")) {
+			flag = NICSPEC_F_MULTICAST;
+		} else if(!strcmp(token, "codel")) {
+			flag = NICSPEC_F_CODEL;
+		} else if(!strcmp(token, "codel_target")) {
+			if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_RX_CODEL_TARGET;
+			attrs[count++] = parse_uint32(value);
+		} else if(!strcmp(token, "codel_interval")) {
+			if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
+			attrs[count++] = VNIC_RX_CODEL_INTERVAL;
+			attrs[count++] = parse_uint32(value);
+		} else return CMD_WRONG_TYPE_OF_ARGS;
+
+		if(flag) {
+			if(!strcmp(value, "on")) flags |= flag;
+			else if(!strcmp(value, "off")) flags &= ~flag;
+			else return CMD_WRONG_TYPE_OF_ARGS;
+
+			flags_changed = true;
+		}
+
+		if(count + 4 > sizeof(attrs) / sizeof(attrs[0])) return CMD_WRONG_NUMBER_OF_ARGS;
+
+		token = strtok_r(next, ",", &next);
+	}
+
+	if(flags_changed) {
+		attrs[count++] = VNIC_FLAGS;
+		attrs[count++] = flags;
+	}
+	attrs[count] = VNIC_NONE;
+
+	if(!vm_nic_update(vmid, mac, attrs)) {
+		print_vm_error("");
+		return CMD_ERROR;
+	}
+
+	callback("true", 0);
+	return CMD_SUCCESS;
+}
+
 static int cmd_vm_destroy(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
 	if(argc != 2) return CMD_WRONG_NUMBER_OF_ARGS;
 	if(!is_uint32(argv[1])) return CMD_WRONG_TYPE_OF_ARGS;
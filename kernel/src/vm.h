@@ -31,6 +31,8 @@ typedef struct {
 #define VM_MAX_STORAGE_SIZE	0x8000000		//128Mb
 #define VM_MAX_NIC_COUNT	NIC_MAX_COUNT
 #define VNIC_MAX_POOL_SIZE	0x8000000		//128Mb
+#define VM_POOL_PERIOD		100000			//100ms between checks of the pools to grow or shrink
+#define VM_POOL_IDLE		10000000		//10s a block of a pool is idle before it is given back
 
 typedef enum {
 	CORE_STATUS_INVALID,
@@ -56,6 +58,7 @@ typedef enum _VMError {
 	ETHREADID,
 	EALIGN,
 	ESTORAGE,
+	EVNICUPDATE,
 } VMError;
 
 /**
@@ -70,6 +73,14 @@ typedef struct _VM {
 	uint64_t	used_size;			///< Application image size
 	int		nic_count;			///< Number of NICs
 	VNIC**		nics;				///< NICs (gmalloc)
+	TokenBucket	rx_bucket;			///< Rx shaper shared by the NICs, parent of theirs
+	TokenBucket	tx_bucket;			///< Tx shaper shared by the NICs, parent of theirs
+	struct {
+		VNIC*	vnic;				///< NIC the block is of, NULL if no block is being mapped
+		void*	block;				///< Block a pool grows or shrinks by
+		int	class;				///< Size class to grow by, -1 to shrink
+		int	acks;				///< Cores which are yet to map or unmap the block
+	} pool_op;					///< Block of a pool being mapped to the cores, one at a time
 	//	VFIO*		fio;
 	int		argc;				///< Number of arguments
 	char**		argv;				///< Arguments (gmalloc)
@@ -100,6 +111,18 @@ uint32_t vm_create(VMSpec* vm_spec);
  */
 bool vm_get_spec(VMSpec* vm_spec);
 
+/**
+ * Change the attributes of a NIC of a running VM. Traffic keeps flowing
+ * while the NIC picks the change up.
+ *
+ * @param vmid id
+ * @param mac MAC address of the NIC
+ * @param attrs VNIC attributes to change, ending with VNIC_NONE (see vnic_update())
+ *
+ * @return true for success, false for failure
+ */
+bool vm_nic_update(uint32_t vmid, uint64_t mac, uint64_t* attrs);
+
 /**
  * Destroy VM
  *
@@ -47,6 +47,9 @@ typedef enum {
 #define NICSPEC_F_BROADCAST			NIC_F_BROADCAST
 #define NICSPEC_F_MULTICAST			NIC_F_MULTICAST
 #define NICSPEC_F_MULTIQUEUE		NIC_F_MULTIQUEUE
+#define NICSPEC_F_CHAIN				NIC_F_CHAIN
+#define NICSPEC_F_CODEL				NIC_F_CODEL
+#define NICSPEC_F_SHARED_POOL			NIC_F_SHARED_POOL
 
 #define NICSPEC_DEFAULT_MAC				0
 #define NICSPEC_DEFAULT_BUDGET_SIZE		32
@@ -61,6 +64,8 @@ typedef struct {
 	uint64_t	mac;
 	char		parent[MAX_NIC_NAME_LEN];
 	uint16_t	budget;
+	uint16_t	budget_min;	// Least budget it adapts down to, 0 for a fixed budget
+	uint16_t	budget_max;	// Most budget it adapts up to, 0 for a fixed budget
 	uint64_t	flags;
 	uint32_t	rx_buffer_size;
 	uint32_t	tx_buffer_size;
@@ -69,6 +74,15 @@ typedef struct {
 	uint64_t	rx_bandwidth;
 	uint64_t	tx_bandwidth;
 	uint32_t	pool_size;
+	uint32_t	tx_quantum;	// Weight of the NIC in bytes, 0 for the default
+	uint8_t		tx_priority;	// Nonzero for the strict priority class
+	uint32_t	codel_target;	// Target sojourn time of rx queues in us with NICSPEC_F_CODEL, 0 for the default
+	uint32_t	codel_interval;	// CoDel interval of rx queues in us, 0 for the default
+	uint32_t	pool_quota;	// Most bytes of buffers the NIC holds at once, 0 for the default (unlimited unless the pool is shared)
+	uint32_t	pool_charged;	// Bytes of buffers the NIC holds (with a quota only)
+	uint32_t	pool_max;	// Most bytes the pool grows to by 2Mb blocks, 0 for a fixed pool
+	uint32_t	pool_grown;	// Bytes of the blocks the pool has grown by
+	uint16_t	mtu;		// Largest frame payload, 0 for the default. Above 2Kb the pool keeps jumbo buffers
 
 	uint64_t	rx_bytes;
 	uint64_t	rx_packets;
@@ -78,6 +92,8 @@ typedef struct {
 	uint64_t	tx_packets;
 	uint64_t	tx_drop_bytes;
 	uint64_t	tx_drop_packets;
+	uint64_t	rx_drops[NIC_DROP_REASON_COUNT];	// Dropped packets by NICDropReason
+	uint64_t	tx_drops[NIC_DROP_REASON_COUNT];
 } NICSpec;
 
 #define VMSPEC_MAX_NIC_COUNT	16
@@ -90,6 +106,8 @@ typedef struct {
 	uint32_t	core_size;
 	uint32_t	memory_size;
 	uint32_t	storage_size;
+	uint64_t	rx_bandwidth;	// Shared by the NICs, 0 for unlimited
+	uint64_t	tx_bandwidth;	// Shared by the NICs, 0 for unlimited
 
 	uint16_t	nic_count;
 	NICSpec		nics[VMSPEC_MAX_NIC_COUNT];
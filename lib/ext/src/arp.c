@@ -163,6 +163,15 @@ bool arp_process(NIC* nic, Packet* packet) {
 			if(table)
 				arp_table_update(table, ether->smac, arp->spa, true);
 
+			// A packet shared with the queues of other VMs is copied before it is written
+			if(!nic_packet_unshare(nic, &packet)) {
+				nic_free(packet);
+				return true;
+			}
+
+			ether = (Ether*)(packet->buffer + packet->start);
+			arp = (ARP*)ether->payload;
+
 			ether->dmac = ether->smac;
 			ether->smac = endian48(nic->mac);
 			arp->operation = endian16(2);
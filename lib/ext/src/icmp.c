@@ -22,6 +22,16 @@ bool icmp_process(NIC* nic, Packet* packet) {
 
 		switch(icmp->type) {
 			case ICMP_TYPE_ECHO_REQUEST:
+				// A packet shared with the queues of other VMs is copied before it is written
+				if(!nic_packet_unshare(nic, &packet)) {
+					nic_free(packet);
+					return true;
+				}
+
+				ether = (Ether*)(packet->buffer + packet->start);
+				ip = (IP*)ether->payload;
+				icmp = (ICMP*)((uint8_t*)ip + ip->ihl * 4);
+
 				icmp->type = 0;
 				icmp->checksum = 0;
 				icmp->checksum = endian16(checksum(icmp, packet->end - packet->start - ETHER_LEN - (ip->ihl * 4)));
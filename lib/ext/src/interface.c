@@ -13,8 +13,6 @@ IPv4InterfaceTable* interface_table_get(NIC* nic) {
 		if(interface_key < 0)
 			return NULL;
 
-		interface_key = nic_config_key(nic, NIC_ADDR_IPv4);
-
 		table = nic_config_get(nic, interface_key);
 		memset(table, 0, sizeof(IPv4InterfaceTable));
 	} else
@@ -215,12 +215,16 @@ static int write_vm(RPC* rpc, VMSpec* vm) {
 	WRITE(write_uint32(rpc, vm->core_size));
 	WRITE(write_uint32(rpc, vm->memory_size));
 	WRITE(write_uint32(rpc, vm->storage_size));
+	WRITE(write_uint64(rpc, vm->rx_bandwidth));
+	WRITE(write_uint64(rpc, vm->tx_bandwidth));
 
 	WRITE(write_uint16(rpc, vm->nic_count));
 	for(int i = 0; i < vm->nic_count; i++) {
 		WRITE(write_uint64(rpc, vm->nics[i].mac));
 		WRITE(write_string(rpc, vm->nics[i].parent));
 		WRITE(write_uint16(rpc, vm->nics[i].budget));
+		WRITE(write_uint16(rpc, vm->nics[i].budget_min));
+		WRITE(write_uint16(rpc, vm->nics[i].budget_max));
 		WRITE(write_uint64(rpc, vm->nics[i].flags));
 		WRITE(write_uint32(rpc, vm->nics[i].rx_buffer_size));
 		WRITE(write_uint32(rpc, vm->nics[i].tx_buffer_size));
@@ -229,6 +233,15 @@ static int write_vm(RPC* rpc, VMSpec* vm) {
 		WRITE(write_uint8(rpc, vm->nics[i].padding_head));
 		WRITE(write_uint8(rpc, vm->nics[i].padding_tail));
 		WRITE(write_uint32(rpc, vm->nics[i].pool_size));
+		WRITE(write_uint32(rpc, vm->nics[i].pool_quota));
+		WRITE(write_uint32(rpc, vm->nics[i].pool_charged));
+		WRITE(write_uint32(rpc, vm->nics[i].tx_quantum));
+		WRITE(write_uint8(rpc, vm->nics[i].tx_priority));
+		WRITE(write_uint32(rpc, vm->nics[i].codel_target));
+		WRITE(write_uint32(rpc, vm->nics[i].codel_interval));
+		WRITE(write_uint16(rpc, vm->nics[i].mtu));
+		WRITE(write_uint32(rpc, vm->nics[i].pool_max));
+		WRITE(write_uint32(rpc, vm->nics[i].pool_grown));
 
 		WRITE(write_uint64(rpc, vm->nics[i].rx_bytes));
 		WRITE(write_uint64(rpc, vm->nics[i].rx_packets));
@@ -239,6 +252,11 @@ static int write_vm(RPC* rpc, VMSpec* vm) {
 		WRITE(write_uint64(rpc, vm->nics[i].tx_packets));
 		WRITE(write_uint64(rpc, vm->nics[i].tx_drop_bytes));
 		WRITE(write_uint64(rpc, vm->nics[i].tx_drop_packets));
+
+		for(int j = 0; j < NIC_DROP_REASON_COUNT; j++) {
+			WRITE(write_uint64(rpc, vm->nics[i].rx_drops[j]));
+			WRITE(write_uint64(rpc, vm->nics[i].tx_drops[j]));
+		}
 	}
 
 	WRITE(write_uint16(rpc, vm->argc));
@@ -265,6 +283,8 @@ static int read_vm(RPC* rpc, VMSpec* vm) {
 	READ2(read_uint32(rpc, &vm->core_size), failed);
 	READ2(read_uint32(rpc, &vm->memory_size), failed);
 	READ2(read_uint32(rpc, &vm->storage_size), failed);
+	READ2(read_uint64(rpc, &vm->rx_bandwidth), failed);
+	READ2(read_uint64(rpc, &vm->tx_bandwidth), failed);
 	READ2(read_uint16(rpc, &vm->nic_count), failed);
 
 	if(vm->nic_count) {
@@ -276,6 +296,8 @@ static int read_vm(RPC* rpc, VMSpec* vm) {
 			memcpy(vm->nics[i].parent, ch, len2);
 
 			READ2(read_uint16(rpc, &vm->nics[i].budget), failed);
+			READ2(read_uint16(rpc, &vm->nics[i].budget_min), failed);
+			READ2(read_uint16(rpc, &vm->nics[i].budget_max), failed);
 			READ2(read_uint64(rpc, &vm->nics[i].flags), failed);
 			READ2(read_uint32(rpc, &vm->nics[i].rx_buffer_size), failed);
 			READ2(read_uint32(rpc, &vm->nics[i].tx_buffer_size), failed);
@@ -284,6 +306,15 @@ static int read_vm(RPC* rpc, VMSpec* vm) {
 			READ2(read_uint8(rpc, &vm->nics[i].padding_head), failed);
 			READ2(read_uint8(rpc, &vm->nics[i].padding_tail), failed);
 			READ2(read_uint32(rpc, &vm->nics[i].pool_size), failed);
+			READ2(read_uint32(rpc, &vm->nics[i].pool_quota), failed);
+			READ2(read_uint32(rpc, &vm->nics[i].pool_charged), failed);
+			READ2(read_uint32(rpc, &vm->nics[i].tx_quantum), failed);
+			READ2(read_uint8(rpc, &vm->nics[i].tx_priority), failed);
+			READ2(read_uint32(rpc, &vm->nics[i].codel_target), failed);
+			READ2(read_uint32(rpc, &vm->nics[i].codel_interval), failed);
+			READ2(read_uint16(rpc, &vm->nics[i].mtu), failed);
+			READ2(read_uint32(rpc, &vm->nics[i].pool_max), failed);
+			READ2(read_uint32(rpc, &vm->nics[i].pool_grown), failed);
 
 			READ2(read_uint64(rpc, &vm->nics[i].rx_bytes), failed);
 			READ2(read_uint64(rpc, &vm->nics[i].rx_packets), failed);
@@ -294,6 +325,11 @@ static int read_vm(RPC* rpc, VMSpec* vm) {
 			READ2(read_uint64(rpc, &vm->nics[i].tx_packets), failed);
 			READ2(read_uint64(rpc, &vm->nics[i].tx_drop_bytes), failed);
 			READ2(read_uint64(rpc, &vm->nics[i].tx_drop_packets), failed);
+
+			for(int j = 0; j < NIC_DROP_REASON_COUNT; j++) {
+				READ2(read_uint64(rpc, &vm->nics[i].rx_drops[j]), failed);
+				READ2(read_uint64(rpc, &vm->nics[i].tx_drops[j]), failed);
+			}
 		}
 	}
 
@@ -5,11 +5,13 @@ project 'test'
     location    '.'
 
     buildcommands {
-        'make -C cache'
+        'make -C cache',
+        'make -C vnic'
     }
 
     cleancommands {
-        'make clean -C cache'
+        'make clean -C cache',
+        'make clean -C vnic'
     }
 
 
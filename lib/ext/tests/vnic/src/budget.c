@@ -0,0 +1,223 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+#include <budget.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	1024
+#define MIN		8
+#define MAX		256
+#define PHASE		200	///< Rounds of each load
+
+static void budget_init_func(void** state) {
+	PollBudget poll;
+
+	// Without bounds the budget is fixed
+	assert_int_equal(poll_budget_init(&poll, 0, 0, 32), 32);
+	assert_false(poll_budget_adaptive(&poll));
+	assert_int_equal(poll_budget_update(&poll, 32, 32, 1000), 32);
+	assert_int_equal(poll_budget_update(&poll, 32, 0, 0), 32);
+
+	// One bound only: the budget is the other
+	assert_int_equal(poll_budget_init(&poll, 0, 128, 32), 32);
+	assert_int_equal(poll.min, 32);
+	assert_int_equal(poll.max, 128);
+	assert_int_equal(poll_budget_init(&poll, 8, 0, 32), 32);
+	assert_int_equal(poll.max, 32);
+	assert_true(poll_budget_adaptive(&poll));
+
+	// The budget starts within the bounds
+	assert_int_equal(poll_budget_init(&poll, 64, 128, 32), 64);
+	assert_int_equal(poll_budget_init(&poll, 8, 16, 32), 16);
+	assert_int_equal(poll_budget_init(&poll, 64, 16, 32), 64);
+	assert_false(poll_budget_adaptive(&poll));
+
+	// Grows while it is used up and there is more, not when the queue held less
+	poll_budget_init(&poll, MIN, MAX, 32);
+	assert_int_equal(poll_budget_update(&poll, 32, 32, 1), 64);
+	assert_int_equal(poll_budget_update(&poll, 64, 64, 0), 64);
+	assert_int_equal(poll_budget_update(&poll, 200, 200, 1), MAX);
+
+	// Shrinks when rounds do less, down to the least budget
+	uint16_t budget = MAX;
+	for(int i = 0; i < 1000; i++)
+		budget = poll_budget_update(&poll, budget, 0, 0);
+	assert_int_equal(budget, MIN);
+}
+
+typedef struct {
+	uint32_t	rate;		///< Packets arriving per round
+	uint32_t	settle;		///< Rounds the budget is given to settle
+} Phase;
+
+/*
+ * A queue served once a round with packets arriving at a rate which steps up
+ * and down. The budget has to keep the backlog bounded while the rate is within
+ * its bounds and come down again after the load drops.
+ */
+static void budget_step_func(void** state) {
+	Phase phases[] = {
+		{ 4, 40 },
+		{ 200, 20 },	// Step up
+		{ 10, 60 },	// Step down
+		{ 120, 10 },
+		{ 1000, 0 },	// More than the most budget
+		{ 0, 40 },
+	};
+
+	PollBudget poll;
+	uint16_t budget = poll_budget_init(&poll, MIN, MAX, 32);
+	uint32_t backlog = 0;
+
+	for(int p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+		uint32_t rate = phases[p].rate;
+		uint32_t settled = 0;
+		uint32_t high = 0;
+
+		for(int r = 0; r < PHASE; r++) {
+			backlog += rate;
+			uint32_t work = backlog < budget ? backlog : budget;
+			backlog -= work;
+			budget = poll_budget_update(&poll, budget, work, backlog);
+
+			// Enough for the load with a backlog of no more than a round, and not much more than twice of it
+			uint32_t most = rate * 2 + 1 > MIN ? rate * 2 + 1 : MIN;
+			if(budget < rate || backlog > rate || budget > most)
+				settled = r + 1;
+
+			if(backlog > high)
+				high = backlog;
+		}
+
+		printf("\t%4u packets per round: budget %3u after %3u rounds to settle, backlog %u at most\n",
+				rate, budget, settled, high);
+
+		if(rate <= MAX) {
+			assert_true(settled <= phases[p].settle);
+		} else {
+			assert_int_equal(budget, MAX);
+			backlog = 0;
+		}
+	}
+}
+
+/*
+ * A fixed budget is either too low for the load or too high for an idle queue
+ */
+static void budget_fixed_func(void** state) {
+	uint32_t budgets[] = { 32, MAX };
+	uint32_t rates[] = { 200, 0 };
+	for(int i = 0; i < 2; i++) {
+		PollBudget poll;
+		uint16_t budget = poll_budget_init(&poll, 0, 0, budgets[i]);
+		uint32_t backlog = 0;
+
+		for(int r = 0; r < PHASE; r++) {
+			backlog += rates[i];
+			uint32_t work = backlog < budget ? backlog : budget;
+			backlog -= work;
+			budget = poll_budget_update(&poll, budget, work, backlog);
+		}
+
+		assert_int_equal(budget, budgets[i]);
+		assert_int_equal(backlog, rates[i] > budgets[i] ? (rates[i] - budgets[i]) * PHASE : 0);
+	}
+}
+
+static VNIC vnic;
+
+static void nic_create(uint64_t min, uint64_t max) {
+	uint64_t attrs[] = {
+		VNIC_BUDGET_MIN, min,
+		VNIC_BUDGET_MAX, max,
+		VNIC_RX_BANDWIDTH, 0,
+		VNIC_TX_BANDWIDTH, 0,
+		FIXTURE_QUEUE_SIZES(QUEUE_SIZE),
+		VNIC_TX_PRIORITY, 1,
+		VNIC_NONE
+	};
+
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+}
+
+static bool transmitter(Packet* packet, void* context) {
+	nic_free(packet);
+
+	return true;
+}
+
+static void enqueue(int count) {
+	for(int i = 0; i < count; i++) {
+		Packet* packet = nic_alloc(vnic.nic, 64);
+		assert_non_null(packet);
+		packet->end = packet->start + 64;
+		assert_true(nic_tx(vnic.nic, packet));
+	}
+}
+
+static void budget_vnic_func(void** state) {
+	nic_create(MIN, MAX);
+	assert_int_equal(vnic.budget, 32);
+
+	VNIC* vnics[] = { &vnic };
+	uint16_t round = 0;
+
+	// A backlog doubles the budget each round it is used up
+	enqueue(600);
+	assert_int_equal(vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL), 32);
+	assert_int_equal(vnic.budget, 64);
+	assert_int_equal(vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL), 64);
+	assert_int_equal(vnic.budget, 128);
+	assert_int_equal(vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL), 128);
+	assert_int_equal(vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL), 256);
+	assert_int_equal(vnic.budget, MAX);
+	assert_int_equal(vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL), 600 - 480);
+
+	// and an idle VNIC gives it back
+	for(int i = 0; i < 100; i++)
+		vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL);
+	assert_int_equal(vnic.budget, MIN);
+
+	// The bounds are changed with the rest of the configuration
+	uint64_t attrs[] = {
+		VNIC_BUDGET_MIN, 0,
+		VNIC_BUDGET_MAX, 0,
+		VNIC_BUDGET, 48,
+		VNIC_NONE
+	};
+	assert_int_equal(vnic_update(&vnic, attrs), VNIC_ERROR_NOERROR);
+	enqueue(100);
+	assert_int_equal(vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL), 48);
+	assert_int_equal(vnic.budget, 48);
+	assert_int_equal(vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL), 48);
+	assert_int_equal(vnic_tx_schedule(vnics, 1, &round, NULL, transmitter, NULL), 4);
+
+	uint64_t attrs2[] = {
+		VNIC_BUDGET_MAX, 1 << 16,
+		VNIC_NONE
+	};
+	assert_int_equal(vnic_update(&vnic, attrs2), VNIC_ERROR_ATTRIBUTE_INVALID);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(budget_init_func),
+		cmocka_unit_test(budget_step_func),
+		cmocka_unit_test(budget_fixed_func),
+		cmocka_unit_test(budget_vnic_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
@@ -0,0 +1,254 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define JUMBO_SIZE	9000
+
+static VNIC vnic;
+static NIC* nic;
+
+static void nic_create(uint64_t flags) {
+	uint64_t attrs[] = {
+		VNIC_FLAGS, flags,
+		VNIC_MTU, JUMBO_SIZE,
+		VNIC_NONE
+	};
+
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+	nic = vnic.nic;
+}
+
+static void pattern(uint8_t* buf, size_t size, int seed) {
+	for(size_t i = 0; i < size; i++)
+		buf[i] = (i * 7 + seed) & 0xff;
+}
+
+static int segments(Packet* packet) {
+	int count = 0;
+	for(; packet; packet = nic_packet_next(nic, packet))
+		count++;
+
+	return count;
+}
+
+// Buffers of the larger classes are all taken, so a jumbo frame only fits in a chain
+static int exhaust(Packet** taken) {
+	int count = 0;
+	for(int class = NIC_POOL_CLASS_COUNT - 1; class > 0; class--) {
+		Packet* packet;
+		while((packet = nic_pool_get(nic, &nic->pool, nic->pool.slabs[class].size, true)))
+			taken[count++] = packet;
+	}
+
+	return count;
+}
+
+static void chain_alloc_func(void** state) {
+	nic_create(0);
+
+	Packet* packet = nic_pool_get_chain(nic, &nic->pool, JUMBO_SIZE, 0, 0, true);
+	assert_non_null(packet);
+	assert_int_equal(segments(packet), (JUMBO_SIZE + packet->size - 1) / packet->size);
+	assert_int_equal(nic_packet_length(nic, packet), JUMBO_SIZE);
+
+	static uint8_t data[JUMBO_SIZE], data2[JUMBO_SIZE];
+	pattern(data, JUMBO_SIZE, 1);
+	assert_int_equal(nic_packet_write(nic, packet, 0, data, JUMBO_SIZE), JUMBO_SIZE);
+	assert_int_equal(nic_packet_read(nic, packet, 0, data2, JUMBO_SIZE), JUMBO_SIZE);
+	assert_memory_equal(data, data2, JUMBO_SIZE);
+
+	// Reads across segment boundaries
+	assert_int_equal(nic_packet_read(nic, packet, 2000, data2, 100), 100);
+	assert_memory_equal(data + 2000, data2, 100);
+	assert_int_equal(nic_packet_read(nic, packet, JUMBO_SIZE - 10, data2, 100), 10);
+
+	// Too many segments
+	assert_null(nic_pool_get_chain(nic, &nic->pool, NIC_PACKET_MAX_SEGMENTS * packet->size + 1, 0, 0, true));
+
+	// Freeing the head frees the chain
+	assert_true(nic_pool_used(nic) > 0);
+	assert_true(nic_free(packet));
+	assert_int_equal(nic_pool_used(nic), 0);
+
+	// A single buffer when one fits
+	packet = nic_alloc_chain(nic, JUMBO_SIZE);
+	assert_non_null(packet);
+	assert_int_equal(packet->next, 0);
+	assert_int_equal(nic_packet_length(nic, packet), JUMBO_SIZE);
+	nic_free(packet);
+
+	fixture_destroy(&vnic);
+}
+
+static void chain_prepend_append_func(void** state) {
+	nic_create(0);
+
+	Packet* packet = nic_alloc_chain(nic, 100);
+	assert_non_null(packet);
+	assert_int_equal(packet->start, 0);
+	uint8_t* payload = packet->buffer + packet->start;
+	pattern(payload, 100, 2);
+
+	// No headroom: a new segment goes in front and the payload stays where it is
+	Packet* head = packet;
+	uint8_t* ip = nic_packet_prepend(nic, &head, 20);
+	assert_non_null(ip);
+	assert_ptr_not_equal(head, packet);
+	memset(ip, 0x45, 20);
+
+	// The room left in front of the new segment takes the next header
+	uint8_t* ether = nic_packet_prepend(nic, &head, 14);
+	assert_int_equal(ether + 14, ip);
+	memset(ether, 0xee, 14);
+
+	// Trailers go after the payload, and to a new segment when it is full
+	uint8_t* crc = nic_packet_append(nic, head, 4);
+	assert_int_equal(crc, payload + 100);
+	memset(crc, 0xcc, 4);
+	uint8_t* tail = nic_packet_append(nic, head, packet->size);
+	assert_non_null(tail);
+	memset(tail, 0xaa, packet->size);
+	assert_int_equal(segments(head), 3);
+
+	uint32_t len = nic_packet_length(nic, head);
+	assert_int_equal(len, 14 + 20 + 100 + 4 + packet->size);
+
+	static uint8_t frame[8192];
+	assert_int_equal(nic_packet_read(nic, head, 0, frame, len), len);
+	assert_int_equal(frame[0], 0xee);
+	assert_int_equal(frame[14], 0x45);
+	assert_memory_equal(frame + 34, payload, 100);
+	assert_int_equal(frame[134], 0xcc);
+	assert_int_equal(frame[len - 1], 0xaa);
+
+	// A shared packet is copied before anything is put in front of it
+	Packet* shared = nic_alloc_chain(nic, 64);
+	shared->ref = 2;
+	Packet* shared_head = shared;
+	assert_non_null(nic_packet_prepend(nic, &shared_head, 14));
+	assert_true(shared_head != shared);
+	assert_int_equal(shared->ref, 1);
+	assert_int_equal(shared->end - shared->start, 64);
+	assert_int_equal(nic_packet_length(nic, shared_head), 14 + 64);
+	nic_free(shared);
+	nic_free(shared_head);
+
+	nic_free(head);
+
+	fixture_destroy(&vnic);
+}
+
+static void chain_rx_func(void** state) {
+	static uint8_t frame[JUMBO_SIZE], frame2[JUMBO_SIZE];
+	static Packet* taken[POOL_SIZE / 2048];
+	pattern(frame, JUMBO_SIZE, 3);
+
+	// Without NIC_F_CHAIN a jumbo frame needs a buffer of its own
+	nic_create(0);
+	int count = exhaust(taken);
+	assert_int_equal(vnic_rx(&vnic, frame, 1000, frame + 1000, JUMBO_SIZE - 1000), VNIC_ERROR_RESOURCE_NOT_AVAILABLE);
+	for(int i = 0; i < count; i++)
+		nic_free(taken[i]);
+	fixture_destroy(&vnic);
+
+	nic_create(NIC_F_CHAIN);
+	count = exhaust(taken);
+	assert_int_equal(vnic_rx(&vnic, frame, 1000, frame + 1000, JUMBO_SIZE - 1000), VNIC_ERROR_NOERROR);
+
+	Packet* packet = nic_rx(nic);
+	assert_non_null(packet);
+	assert_true(segments(packet) > 1);
+	assert_int_equal(nic_packet_length(nic, packet), JUMBO_SIZE);
+	assert_int_equal(nic_packet_read(nic, packet, 0, frame2, JUMBO_SIZE), JUMBO_SIZE);
+	assert_memory_equal(frame, frame2, JUMBO_SIZE);
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.rx.bytes, JUMBO_SIZE);
+
+	nic_free(packet);
+	for(int i = 0; i < count; i++)
+		nic_free(taken[i]);
+
+	fixture_destroy(&vnic);
+}
+
+static uint8_t sent_frame[JUMBO_SIZE];
+static uint32_t sent_size;
+
+static bool transmitter(Packet* packet, void* context) {
+	(*(uint64_t*)context)++;
+
+	// Drivers get contiguous frames
+	assert_int_equal(packet->next, 0);
+	sent_size = packet->end - packet->start;
+	memcpy(sent_frame, packet->buffer + packet->start, sent_size);
+	nic_free(packet);
+
+	return true;
+}
+
+static void chain_tx_func(void** state) {
+	nic_create(0);
+
+	static uint8_t frame[JUMBO_SIZE];
+	pattern(frame, JUMBO_SIZE, 4);
+
+	Packet* packet = nic_pool_get_chain(nic, &nic->pool, JUMBO_SIZE, 0, 0, true);
+	nic_packet_write(nic, packet, 0, frame, JUMBO_SIZE);
+	assert_true(nic_tx(nic, packet));
+
+	uint64_t sent = 0;
+	uint32_t count = 32;
+	assert_int_equal(vnic_tx_burst(&vnic, &count, transmitter, &sent), VNIC_ERROR_NOERROR);
+	assert_int_equal(sent, 1);
+	assert_int_equal(sent_size, JUMBO_SIZE);
+	assert_memory_equal(sent_frame, frame, JUMBO_SIZE);
+
+	// Copies of a chain are chained too when no buffer fits
+	static Packet* taken[POOL_SIZE / 2048];
+	int taken_count = exhaust(taken);
+	packet = nic_pool_get_chain(nic, &nic->pool, JUMBO_SIZE, 0, 0, true);
+	nic_packet_write(nic, packet, 0, frame, JUMBO_SIZE);
+	assert_true(nic_tx_dup(nic, packet));
+	nic_free(packet);
+
+	// No buffer for the frame: it is dropped, not sent in pieces
+	count = 32;
+	vnic_tx_burst(&vnic, &count, transmitter, &sent);
+	assert_int_equal(sent, 1);
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.tx.bytes, JUMBO_SIZE);
+	assert_int_equal(stats.tx.drop_packets, 1);
+	assert_int_equal(stats.tx.drop_bytes, JUMBO_SIZE);
+	assert_int_equal(stats.tx.drops[NIC_DROP_NO_MEMORY], 1);
+
+	for(int i = 0; i < taken_count; i++)
+		nic_free(taken[i]);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(chain_alloc_func),
+		cmocka_unit_test(chain_prepend_append_func),
+		cmocka_unit_test(chain_rx_func),
+		cmocka_unit_test(chain_tx_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
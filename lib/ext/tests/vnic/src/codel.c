@@ -0,0 +1,189 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+#include <codel.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fixture.h"
+
+#define TARGET		5000
+#define INTERVAL	100000
+#define ARRIVAL		100	///< Ticks between packets
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	256
+
+// Gap before the n-th drop of a dropping state, as the control law computes it
+static uint64_t gap(uint32_t n) {
+	return ((uint64_t)INTERVAL << 16) / (uint64_t)sqrt((double)((uint64_t)n << 32));
+}
+
+static void codel_schedule_func(void** state) {
+	CoDel codel;
+	codel_init(&codel, TARGET, INTERVAL);
+
+	// A standing queue from time 1: nothing is dropped for an interval, then
+	// the drops come interval / sqrt(n) apart
+	uint64_t drops[64];
+	int count = 0;
+	uint64_t t;
+	for(t = 1; count < 64; t += ARRIVAL) {
+		if(codel_drop(&codel, t, TARGET * 2, 10))
+			drops[count++] = t;
+	}
+
+	assert_int_equal(drops[0], 1 + INTERVAL);
+	uint64_t next = drops[0];
+	for(int i = 1; i < count; i++) {
+		next += gap(i);
+
+		// Packets come every ARRIVAL ticks; the first one at or after the time is dropped
+		assert_true(drops[i] >= next && drops[i] < next + ARRIVAL);
+	}
+	assert_int_equal(codel.count, count);
+	assert_true(codel.dropping);
+
+	// Below target it stops at once
+	assert_false(codel_drop(&codel, t, TARGET - 1, 10));
+	assert_false(codel.dropping);
+	assert_int_equal(codel.first_above, 0);
+
+	// Above target again soon: it takes an interval again, then goes on at
+	// about the rate it stopped with
+	t += ARRIVAL;
+	assert_false(codel_drop(&codel, t, TARGET, 10));
+	uint64_t above = t + INTERVAL;
+	for(t += ARRIVAL; t < above; t += ARRIVAL)
+		assert_false(codel_drop(&codel, t, TARGET, 10));
+	assert_true(codel_drop(&codel, t, TARGET, 10));
+	assert_int_equal(codel.count, count - 1);
+	assert_int_equal(codel.drop_next, t + gap(count - 1));
+
+	// Long after it stopped it starts over with a single drop
+	codel_drop(&codel, t + ARRIVAL, 0, 10);
+	t += 32 * INTERVAL;
+	codel_drop(&codel, t, TARGET, 10);
+	assert_true(codel_drop(&codel, t + INTERVAL, TARGET, 10));
+	assert_int_equal(codel.count, 1);
+	assert_int_equal(codel.drop_next, t + INTERVAL + INTERVAL);
+}
+
+static void codel_idle_func(void** state) {
+	CoDel codel;
+
+	// Bursts which drain within an interval are never dropped
+	codel_init(&codel, TARGET, INTERVAL);
+	uint64_t t = 1;
+	for(int burst = 0; burst < 100; burst++) {
+		for(uint64_t sojourn = 0; sojourn < INTERVAL / 2; sojourn += ARRIVAL)
+			assert_false(codel_drop(&codel, t + sojourn, sojourn, 100));
+		t += INTERVAL / 2;
+		assert_false(codel_drop(&codel, t, 0, 0));
+	}
+
+	// Nor is a single packet
+	for(t = 1; t < 10 * INTERVAL; t += ARRIVAL)
+		assert_false(codel_drop(&codel, t, TARGET * 10, 1));
+
+	// Without an interval nothing is
+	codel_init(&codel, TARGET, 0);
+	for(t = 1; t < 10 * INTERVAL; t += ARRIVAL)
+		assert_false(codel_drop(&codel, t, TARGET * 10, 10));
+}
+
+static VNIC vnic;
+
+static void nic_create(uint64_t flags) {
+	uint64_t attrs[] = {
+		VNIC_FLAGS, flags,
+		VNIC_RX_BANDWIDTH, 0,
+		VNIC_TX_BANDWIDTH, 0,
+		FIXTURE_QUEUE_SIZES(QUEUE_SIZE),
+		VNIC_RX_CODEL_TARGET, 1,
+		VNIC_RX_CODEL_INTERVAL, 1000,
+		VNIC_NONE
+	};
+
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+}
+
+static uint64_t rdtsc() {
+	uint64_t t;
+	uint32_t* p = (uint32_t*)&t;
+	asm volatile("rdtsc" : "=a"(p[0]), "=d"(p[1]));
+	return t;
+}
+
+// A VM which doesn't take its packets while they keep coming, at most one every ARRIVAL ticks
+static uint32_t stall(uint32_t count) {
+	uint8_t frame[64] = { 0, };
+	uint32_t received = 0;
+	for(uint32_t i = 0; i < count && queue_available(&vnic.nic->rxq[0]); i++) {
+		uint64_t t = rdtsc();
+		if(vnic_rx(&vnic, frame, sizeof(frame), NULL, 0) == VNIC_ERROR_NOERROR)
+			received++;
+
+		// The oldest packet has been waiting long
+		Packet* head;
+		if(queue_peek(vnic.nic, &vnic.nic->rxq[0], &head, 1))
+			head->time = 1;
+
+		while(rdtsc() < t + ARRIVAL);
+	}
+
+	return received;
+}
+
+static void codel_vnic_func(void** state) {
+	// Microseconds are timer ticks
+	vnic__init_timer(1000000);
+
+	// Tail drop only
+	nic_create(0);
+	uint32_t received = stall(QUEUE_SIZE * 2);
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.rx.drop_packets, 0);
+	assert_int_equal(received, QUEUE_SIZE - 1);
+	fixture_destroy(&vnic);
+
+	// The standing queue is kept short
+	nic_create(NIC_F_CODEL);
+	received = stall(QUEUE_SIZE * 2);
+	vnic_stats(&vnic, &stats);
+	assert_true(stats.rx.drop_packets > 0);
+	assert_int_equal(stats.rx.drops[NIC_DROP_AQM], stats.rx.drop_packets);
+	assert_true(received < QUEUE_SIZE - 1);
+	assert_int_equal(stats.rx.packets, received);
+
+	// Turned off, the rest is queued
+	uint64_t attrs[] = {
+		VNIC_FLAGS, 0,
+		VNIC_NONE
+	};
+	assert_int_equal(vnic_update(&vnic, attrs), VNIC_ERROR_NOERROR);
+	uint64_t drops = stats.rx.drop_packets;
+	stall(10);
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.rx.drop_packets, drops);
+	fixture_destroy(&vnic);
+
+	vnic__init_timer(0);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(codel_schedule_func),
+		cmocka_unit_test(codel_idle_func),
+		cmocka_unit_test(codel_vnic_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
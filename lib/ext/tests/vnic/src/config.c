@@ -0,0 +1,249 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define KEY_COUNT	600
+#define LOOKUPS		1000000
+
+static VNIC vnic;
+static NIC* nic;
+
+static void nic_create() {
+	fixture_create(&vnic, 0, POOL_SIZE, NULL);
+	nic = vnic.nic;
+}
+
+static void name(char* buf, int i) {
+	sprintf(buf, "net.config.%d", i);
+}
+
+static void config_basic_func(void** state) {
+	nic_create();
+
+	uint32_t total = nic_config_total(nic);
+	assert_int_equal(nic_config_available(nic), total);
+	assert_int_equal(nic_config_key(nic, "net.ipv4"), -2);
+
+	int32_t key = nic_config_alloc(nic, "net.ipv4", 12);
+	assert_true(key > 0);
+	assert_int_equal(nic_config_key(nic, "net.ipv4"), key);
+	assert_int_equal(nic_config_size(nic, key), 12);
+	assert_int_equal(nic_config_available(nic), total - (1 + 3 + 3) * sizeof(uint32_t));
+
+	int32_t key2 = nic_config_alloc(nic, "net.ipv6", 48);
+	assert_true(key2 > key);
+	assert_int_equal(nic_config_key(nic, "net.ipv6"), key2);
+	assert_int_equal(nic_config_size(nic, key2), 48);
+
+	// The data of the entries don't overlap
+	uint32_t* ipv4 = nic_config_get(nic, key);
+	uint64_t* ipv6 = nic_config_get(nic, key2);
+	memset(ipv4, 0xff, 12);
+	memset(ipv6, 0xee, 48);
+	assert_int_equal(ipv4[2], 0xffffffff);
+	assert_int_equal(nic_config_key(nic, "net.ipv6"), key2);
+
+	// Names are unique and limited
+	char long_name[300];
+	memset(long_name, 'a', sizeof(long_name) - 1);
+	long_name[sizeof(long_name) - 1] = '\0';
+	assert_int_equal(nic_config_alloc(nic, "net.ipv4", 4), -1);
+	assert_int_equal(nic_config_alloc(nic, long_name, 4), -1);
+	assert_int_equal(nic_config_key(nic, long_name), -1);
+
+	nic_config_free(nic, key);
+	assert_int_equal(nic_config_key(nic, "net.ipv4"), -2);
+	assert_int_equal(nic_config_key(nic, "net.ipv6"), key2);
+	nic_config_free(nic, key2);
+	assert_int_equal(nic_config_available(nic), total);
+
+	fixture_destroy(&vnic);
+}
+
+static void config_many_func(void** state) {
+	nic_create();
+
+	uint32_t total = nic_config_total(nic);
+	static int32_t keys[KEY_COUNT];
+	char buf[32];
+	for(int i = 0; i < KEY_COUNT; i++) {
+		name(buf, i);
+		keys[i] = nic_config_alloc(nic, buf, sizeof(int));
+		assert_true(keys[i] > 0);
+		*(int*)nic_config_get(nic, keys[i]) = i;
+	}
+
+	for(int i = 0; i < KEY_COUNT; i++) {
+		name(buf, i);
+		assert_int_equal(nic_config_key(nic, buf), keys[i]);
+		assert_int_equal(*(int*)nic_config_get(nic, keys[i]), i);
+	}
+
+	// Freed entries leave holes and freed slots behind, over and over
+	for(int round = 0; round < 8; round++) {
+		for(int i = round % 2; i < KEY_COUNT; i += 2) {
+			nic_config_free(nic, keys[i]);
+			name(buf, i);
+			assert_int_equal(nic_config_key(nic, buf), -2);
+		}
+
+		for(int i = round % 2; i < KEY_COUNT; i += 2) {
+			name(buf, i);
+			keys[i] = nic_config_alloc(nic, buf, sizeof(int));
+			assert_true(keys[i] > 0);
+			*(int*)nic_config_get(nic, keys[i]) = i;
+		}
+
+		for(int i = 0; i < KEY_COUNT; i++) {
+			name(buf, i);
+			assert_int_equal(nic_config_key(nic, buf), keys[i]);
+			assert_int_equal(*(int*)nic_config_get(nic, keys[i]), i);
+		}
+	}
+
+	// The index is full before the area
+	int count = KEY_COUNT;
+	for(; ; count++) {
+		name(buf, count);
+		if(nic_config_alloc(nic, buf, sizeof(int)) < 0)
+			break;
+	}
+	assert_int_equal(count, NIC_CONFIG_INDEX_LOAD);
+
+	for(int i = 0; i < count; i++) {
+		name(buf, i);
+		nic_config_free(nic, nic_config_key(nic, buf));
+	}
+	assert_int_equal(nic_config_available(nic), total);
+
+	fixture_destroy(&vnic);
+}
+
+static void config_space_func(void** state) {
+	nic_create();
+
+	// Large entries fill the area
+	uint32_t total = nic_config_total(nic);
+	int32_t keys[64];
+	int count = 0;
+	char buf[32];
+	for(; count < 64; count++) {
+		name(buf, count);
+		keys[count] = nic_config_alloc(nic, buf, 4096);
+		if(keys[count] < 0)
+			break;
+	}
+	assert_int_equal(keys[count], -2);
+	assert_true(count > 0);
+
+	// Small ones take what is left at the end
+	static int32_t smalls[NIC_CONFIG_INDEX_LOAD];
+	int small_count = 0;
+	for(; ; small_count++) {
+		name(buf, 2000 + small_count);
+		smalls[small_count] = nic_config_alloc(nic, buf, sizeof(int));
+		if(smalls[small_count] < 0)
+			break;
+	}
+	// Less than an entry of them is left, however large the NIC header is
+	assert_true(nic_config_available(nic) < 6 * sizeof(uint32_t));
+
+	// A freed entry in the middle makes room for smaller ones
+	nic_config_free(nic, keys[count / 2]);
+	name(buf, 1000);
+	int32_t key = nic_config_alloc(nic, buf, 2048);
+	assert_int_equal(key, keys[count / 2]);
+	name(buf, 1001);
+	int32_t key2 = nic_config_alloc(nic, buf, 1024);
+	assert_true(key2 > key && key2 < keys[count / 2 + 1]);
+	name(buf, 1002);
+	assert_int_equal(nic_config_alloc(nic, buf, 4096), -2);
+
+	nic_config_free(nic, key);
+	nic_config_free(nic, key2);
+	for(int i = 0; i < count; i++) {
+		if(i != count / 2)
+			nic_config_free(nic, keys[i]);
+	}
+	for(int i = 0; i < small_count; i++)
+		nic_config_free(nic, smalls[i]);
+	assert_int_equal(nic_config_available(nic), total);
+
+	fixture_destroy(&vnic);
+}
+
+// Lookup as it was before the index: a walk over the entries
+static int32_t linear_key(NIC* nic, char* name) {
+	int len = strlen(name) + 1;
+	uint32_t* head = (uint32_t*)nic->config_head;
+	uint32_t words = ((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head) / sizeof(uint32_t);
+	for(uint32_t* p = head + sizeof(NICConfigIndex) / sizeof(uint32_t); p < head + words; ) {
+		if(*p == 0) {
+			p++;
+		} else {
+			if((*p >> 16) == len && strncmp(name, (const char*)(p + 1), len - 1) == 0)
+				return p - head;
+
+			p += *p & 0xffff;
+		}
+	}
+
+	return -2;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void config_bench_func(void** state) {
+	nic_create();
+
+	static char names[KEY_COUNT][32];
+	for(int i = 0; i < KEY_COUNT; i++) {
+		name(names[i], i);
+		assert_true(nic_config_alloc(nic, names[i], 64) > 0);
+	}
+
+	int64_t sum = 0;
+	double t0 = now();
+	for(int i = 0; i < LOOKUPS; i++)
+		sum += nic_config_key(nic, names[i % KEY_COUNT]);
+	double hashed = (now() - t0) * 1e9 / LOOKUPS;
+
+	int64_t sum2 = 0;
+	t0 = now();
+	for(int i = 0; i < LOOKUPS / 100; i++)
+		sum2 += linear_key(nic, names[i % KEY_COUNT]);
+	double linear = (now() - t0) * 1e9 / (LOOKUPS / 100);
+
+	printf("\t%d keys: %.1f ns per lookup with the index, %.1f ns by walking the area\n", KEY_COUNT, hashed, linear);
+	assert_true(sum > 0 && sum2 > 0);
+	assert_true(hashed < linear);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(config_basic_func),
+		cmocka_unit_test(config_many_func),
+		cmocka_unit_test(config_space_func),
+		cmocka_unit_test(config_bench_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
@@ -0,0 +1,253 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+#include <demux.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define VLAN_COUNT	VNIC_DEMUX_VLAN_COUNT
+#define VNIC_NUM	NIC_MAX_ID
+#define FRAMES		(1 << 20)
+#define MAC		0x001122000000L
+#define BROADCAST	0xffffffffffffL
+#define MULTICAST	0x01005e000001L
+
+static VNICDemux demux;
+static VNIC vnics[VNIC_NUM];
+
+static VNIC* vnic_create(int i, uint64_t mac, uint64_t flags) {
+	VNIC* vnic = &vnics[i];
+	memset(vnic, 0, sizeof(VNIC));
+	vnic->id = i;
+	vnic->mac = vnic->config.mac = mac;
+	vnic->flags = vnic->config.flags = flags;
+
+	return vnic;
+}
+
+static bool contains(VNIC** targets, int count, VNIC* vnic) {
+	for(int i = 0; i < count; i++) {
+		if(targets[i] == vnic)
+			return true;
+	}
+
+	return false;
+}
+
+static void demux_table_func(void** state) {
+	vnic_demux_init(&demux);
+
+	// The same address on different VLANs are different VNICs
+	for(int i = 0; i < VNIC_NUM; i++)
+		assert_true(vnic_demux_add(&demux, i % 4, MAC + i / 4, vnic_create(i, MAC + i / 4, 0)));
+	assert_int_equal(demux.count, VNIC_NUM);
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		assert_ptr_equal(vnic_demux_get(&demux, i % 4, MAC + i / 4), &vnics[i]);
+	assert_null(vnic_demux_get(&demux, 4, MAC));
+	assert_null(vnic_demux_get(&demux, 0, MAC + VNIC_NUM));
+
+	// The table is never more than half full
+	assert_false(vnic_demux_add(&demux, 5, MAC, &vnics[0]));
+
+	// Entries moved back over removed ones are found still
+	for(int i = 0; i < VNIC_NUM; i += 3)
+		assert_ptr_equal(vnic_demux_remove(&demux, i % 4, MAC + i / 4), &vnics[i]);
+	assert_null(vnic_demux_remove(&demux, 0, MAC));
+	assert_false(vnic_demux_add(&demux, 1, MAC, &vnics[0]));
+
+	for(int i = 0; i < VNIC_NUM; i++) {
+		VNIC* vnic = vnic_demux_get(&demux, i % 4, MAC + i / 4);
+		if(i % 3 == 0)
+			assert_null(vnic);
+		else
+			assert_ptr_equal(vnic, &vnics[i]);
+	}
+
+	for(int i = 0; i < VNIC_NUM; i++) {
+		if(i % 3 != 0)
+			assert_ptr_equal(vnic_demux_remove(&demux, i % 4, MAC + i / 4), &vnics[i]);
+	}
+	assert_int_equal(demux.count, 0);
+	for(int i = 0; i < VNIC_DEMUX_SIZE; i++)
+		assert_null(demux.entries[i].vnic);
+}
+
+static void demux_subscribers_func(void** state) {
+	vnic_demux_init(&demux);
+
+	VNIC* vlan[] = {
+		vnic_create(0, MAC + 0, 0),
+		vnic_create(1, MAC + 1, NIC_F_BROADCAST),
+		vnic_create(2, MAC + 2, NIC_F_MULTICAST),
+		vnic_create(3, MAC + 3, NIC_F_PROMISC),
+		vnic_create(4, MAC + 4, NIC_F_BROADCAST | NIC_F_MULTICAST),
+	};
+	int count = sizeof(vlan) / sizeof(vlan[0]);
+	for(int i = 0; i < count; i++)
+		assert_true(vnic_demux_add(&demux, 7, vlan[i]->config.mac, vlan[i]));
+
+	VNICSubscribers subscribers;
+	vnic_subscribers_build(&subscribers, vlan, count);
+	assert_int_equal(subscribers.promisc, 1);
+	assert_int_equal(subscribers.multicast, 3);
+	assert_int_equal(subscribers.broadcast, 4);
+
+	VNIC* targets[MAX_VNIC_COUNT];
+	bool is_complete;
+
+	// Unicast goes to its VNIC and the promiscuous one
+	assert_int_equal(vnic_demux_targets(&demux, &subscribers, 7, MAC + 0, targets, &is_complete), 2);
+	assert_true(is_complete);
+	assert_ptr_equal(targets[0], vlan[0]);
+	assert_ptr_equal(targets[1], vlan[3]);
+
+	// only once to a promiscuous VNIC of its own
+	assert_int_equal(vnic_demux_targets(&demux, &subscribers, 7, MAC + 3, targets, &is_complete), 1);
+	assert_true(is_complete);
+
+	// and to nobody else on another VLAN
+	assert_int_equal(vnic_demux_targets(&demux, &subscribers, 8, MAC + 0, targets, &is_complete), 1);
+	assert_false(is_complete);
+	assert_ptr_equal(targets[0], vlan[3]);
+
+	assert_int_equal(vnic_demux_targets(&demux, &subscribers, 7, MULTICAST, targets, &is_complete), 3);
+	assert_false(is_complete);
+	assert_true(contains(targets, 3, vlan[2]) && contains(targets, 3, vlan[3]) && contains(targets, 3, vlan[4]));
+
+	assert_int_equal(vnic_demux_targets(&demux, &subscribers, 7, BROADCAST, targets, &is_complete), 4);
+	assert_false(is_complete);
+	assert_false(contains(targets, 4, vlan[0]));
+
+	// Flags are taken from the configuration published to the VNIC
+	vlan[0]->config.flags = NIC_F_PROMISC;
+	vnic_subscribers_build(&subscribers, vlan, count);
+	assert_int_equal(vnic_demux_targets(&demux, &subscribers, 7, MAC + 1, targets, &is_complete), 3);
+}
+
+/*
+ * Demultiplexing as it was before the table: a walk over the VLAN devices for
+ * the tag and over the VNICs of the device for the address.
+ */
+typedef struct _Device {
+	uint16_t	vid;
+	VNIC*		vnics[MAX_VNIC_COUNT];
+	int		vnics_count;
+	struct _Device*	next;
+} Device;
+
+static Device devices[VLAN_COUNT];
+
+static int linear_targets(uint16_t vid, uint64_t dmac, VNIC** targets, bool* is_complete) {
+	Device* device;
+	for(device = &devices[0]; device; device = device->next) {
+		if(device->vid == vid)
+			break;
+	}
+
+	int count = 0;
+	*is_complete = false;
+	if(!device)
+		return 0;
+
+	for(int i = 0; i < device->vnics_count; i++) {
+		VNIC* vnic = device->vnics[i];
+		if(vnic->mac == dmac) {
+			*is_complete = true;
+			targets[count++] = vnic;
+		} else if(vnic->flags & NIC_F_PROMISC) {
+			targets[count++] = vnic;
+		} else if(dmac & ((uint64_t)1 << 40)) {
+			if(vnic->flags & NIC_F_MULTICAST || (dmac == BROADCAST && vnic->flags & NIC_F_BROADCAST))
+				targets[count++] = vnic;
+		}
+	}
+
+	return count;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void demux_bench_func(void** state) {
+	// 4096 VLANs sharing as many VNICs as there may be, half of them listening to broadcast
+	vnic_demux_init(&demux);
+	static VNICSubscribers subscribers[VLAN_COUNT];
+	memset(devices, 0, sizeof(devices));
+	for(int vid = 0; vid < VLAN_COUNT; vid++) {
+		devices[vid].vid = vid;
+		devices[vid].next = vid + 1 < VLAN_COUNT ? &devices[vid + 1] : NULL;
+	}
+
+	for(int i = 0; i < VNIC_NUM; i++) {
+		uint16_t vid = i * VLAN_COUNT / VNIC_NUM;
+		VNIC* vnic = vnic_create(i, MAC + i, i % 2 ? NIC_F_BROADCAST : 0);
+		assert_true(vnic_demux_add(&demux, vid, vnic->config.mac, vnic));
+		devices[vid].vnics[devices[vid].vnics_count++] = vnic;
+	}
+	for(int vid = 0; vid < VLAN_COUNT; vid++)
+		vnic_subscribers_build(&subscribers[vid], devices[vid].vnics, devices[vid].vnics_count);
+
+	// Frames to every VNIC and to nobody, some broadcast, on every VLAN
+	static uint16_t vids[FRAMES];
+	static uint64_t dmacs[FRAMES];
+	srand(1);
+	for(int i = 0; i < FRAMES; i++) {
+		int n = rand() % (VNIC_NUM * 2);
+		vids[i] = n < VNIC_NUM ? n * VLAN_COUNT / VNIC_NUM : rand() % VLAN_COUNT;
+		dmacs[i] = i % 16 == 0 ? BROADCAST : MAC + n;
+	}
+
+	VNIC* targets[MAX_VNIC_COUNT];
+	bool is_complete;
+	uint64_t delivered = 0, complete = 0;
+	double t0 = now();
+	for(int i = 0; i < FRAMES; i++) {
+		delivered += vnic_demux_targets(&demux, &subscribers[vids[i]], vids[i], dmacs[i], targets, &is_complete);
+		complete += is_complete;
+	}
+	double hashed = (now() - t0) * 1e9 / FRAMES;
+
+	uint64_t delivered2 = 0, complete2 = 0;
+	t0 = now();
+	for(int i = 0; i < FRAMES / 64; i++) {
+		delivered2 += linear_targets(vids[i], dmacs[i], targets, &is_complete);
+		complete2 += is_complete;
+	}
+	double linear = (now() - t0) * 1e9 / (FRAMES / 64);
+
+	// Both deliver the same
+	uint64_t delivered3 = 0, complete3 = 0;
+	for(int i = 0; i < FRAMES / 64; i++) {
+		delivered3 += vnic_demux_targets(&demux, &subscribers[vids[i]], vids[i], dmacs[i], targets, &is_complete);
+		complete3 += is_complete;
+	}
+	assert_int_equal(delivered2, delivered3);
+	assert_int_equal(complete2, complete3);
+
+	printf("\t%d VLANs, %d VNICs: %.1f ns per frame with the table, %.1f ns by walking the devices\n",
+			VLAN_COUNT, VNIC_NUM, hashed, linear);
+	printf("\t%lu frames delivered %lu times, %lu to a single VNIC\n", (uint64_t)FRAMES, delivered, complete);
+	assert_true(complete > 0);
+	assert_true(hashed < linear);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(demux_table_func),
+		cmocka_unit_test(demux_subscribers_func),
+		cmocka_unit_test(demux_bench_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
@@ -0,0 +1,207 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	FIXTURE_QUEUE_SIZE
+#define FRAME_SIZE	64
+
+static VNIC vnic;
+static NIC* nic;
+
+static void nic_create(VNIC* vnic, uint32_t id, uint64_t rx_bandwidth) {
+	uint64_t attrs[] = {
+		VNIC_RX_BANDWIDTH, rx_bandwidth,
+		VNIC_RX_BURST, FRAME_SIZE,
+		VNIC_TX_BANDWIDTH, 0,
+		VNIC_NONE
+	};
+
+	fixture_create(vnic, id, POOL_SIZE, attrs);
+}
+
+// Every drop has a reason
+static void assert_reasons(NICCounters* counters) {
+	uint64_t drops = 0;
+	for(int i = 0; i < NIC_DROP_REASON_COUNT; i++)
+		drops += counters->drops[i];
+
+	assert_int_equal(drops, counters->drop_packets);
+}
+
+// Every buffer of the pool is taken
+static int exhaust(Packet** taken) {
+	int count = 0;
+	for(int class = NIC_POOL_CLASS_COUNT - 1; class >= 0; class--) {
+		Packet* packet;
+		while((packet = nic_pool_get(nic, &nic->pool, nic->pool.slabs[class].size, true)))
+			taken[count++] = packet;
+	}
+
+	return count;
+}
+
+static void drops_queue_func(void** state) {
+	nic_create(&vnic, 0, 0);
+	nic = vnic.nic;
+	uint8_t frame[FRAME_SIZE] = { 0, };
+
+	// The VM doesn't take its packets: the queue fills and tells the device
+	assert_int_equal(vnic_rx_pressure(&vnic), 0);
+	int i;
+	for(i = 0; vnic_rx(&vnic, frame, FRAME_SIZE, NULL, 0) == VNIC_ERROR_NOERROR; i++);
+	assert_int_equal(i, QUEUE_SIZE - 1);
+	assert_int_equal(vnic_rx_pressure(&vnic), VNIC_PRESSURE_QUEUE);
+
+	// Staged frames which don't fit are dropped for the same reason
+	for(i = 0; i < 4; i++)
+		vnic_rx_stage(&vnic, frame, FRAME_SIZE, NULL, 0);
+	vnic_rx_flush(&vnic);
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.rx.drops[NIC_DROP_QUEUE_FULL], 5);
+	assert_int_equal(stats.rx.drop_bytes, 5 * FRAME_SIZE);
+	assert_reasons(&stats.rx);
+
+	// A packet taken lifts the pressure
+	nic_free(nic_rx(nic));
+	assert_int_equal(vnic_rx_pressure(&vnic), 0);
+
+	fixture_destroy(&vnic);
+}
+
+static void drops_pool_func(void** state) {
+	static Packet* taken[POOL_SIZE / 128];
+	nic_create(&vnic, 0, 0);
+	nic = vnic.nic;
+	uint8_t frame[FRAME_SIZE] = { 0, };
+
+	// No buffer for a frame: the driver is told to keep its own buffers
+	int count = exhaust(taken);
+	assert_int_equal(vnic_rx(&vnic, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_RESOURCE_NOT_AVAILABLE);
+	assert_int_equal(vnic_rx_stage(&vnic, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_RESOURCE_NOT_AVAILABLE);
+	assert_int_equal(vnic_rx_pressure(&vnic), VNIC_PRESSURE_POOL);
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.rx.drops[NIC_DROP_NO_MEMORY], 2);
+	assert_reasons(&stats.rx);
+
+	// Buffers freed by the VM aren't given to the driver until a copied frame got one
+	for(int i = 0; i < count; i++)
+		nic_free(taken[i]);
+	assert_null(vnic_rx_alloc(&vnic, FRAME_SIZE));
+	assert_int_equal(vnic_rx(&vnic, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_NOERROR);
+	assert_int_equal(vnic_rx_pressure(&vnic), 0);
+
+	Packet* packet = vnic_rx_alloc(&vnic, FRAME_SIZE);
+	assert_non_null(packet);
+	vnic_free(&vnic, packet);
+
+	// Running out of buffers for the driver is pressure too
+	count = exhaust(taken);
+	assert_null(vnic_rx_alloc(&vnic, FRAME_SIZE));
+	assert_int_equal(vnic_rx_pressure(&vnic), VNIC_PRESSURE_POOL);
+	for(int i = 0; i < count; i++)
+		nic_free(taken[i]);
+
+	fixture_destroy(&vnic);
+}
+
+static void drops_rate_func(void** state) {
+	// Microseconds are timer ticks
+	vnic__init_timer(1000000);
+
+	// 1000 bytes per second with a burst of a frame: frames after the first are over the rate
+	nic_create(&vnic, 0, 8000);
+	nic = vnic.nic;
+	uint8_t frame[FRAME_SIZE] = { 0, };
+	for(int i = 0; i < QUEUE_SIZE - 1; i++)
+		vnic_rx(&vnic, frame, FRAME_SIZE, NULL, 0);
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_true(stats.rx.drops[NIC_DROP_RATE_LIMITED] > 0);
+	assert_int_equal(stats.rx.packets + stats.rx.drop_packets, QUEUE_SIZE - 1);
+	assert_reasons(&stats.rx);
+
+	// Over the rate isn't pressure; the device can't help it
+	assert_int_equal(vnic_rx_pressure(&vnic), 0);
+
+	fixture_destroy(&vnic);
+	vnic__init_timer(0);
+}
+
+static bool transmitter(Packet* packet, void* context) {
+	nic_free(packet);
+
+	return *(bool*)context;
+}
+
+static void drops_tx_func(void** state) {
+	nic_create(&vnic, 0, 0);
+	nic = vnic.nic;
+
+	// The VM sends more than the queue holds
+	int i;
+	for(i = 0; i < QUEUE_SIZE; i++) {
+		Packet* packet = nic_alloc(nic, FRAME_SIZE);
+		packet->end = packet->start + FRAME_SIZE;
+		nic_tx(nic, packet);
+	}
+
+	// The transmitter fails once
+	bool ok = false;
+	uint32_t count = 32;
+	assert_int_equal(vnic_tx_burst(&vnic, &count, transmitter, &ok), VNIC_ERROR_OPERATION_FAILED);
+	assert_int_equal(count, 0);
+
+	// A chain of another NIC is never followed
+	VNIC vnic2;
+	nic_create(&vnic2, 1, 0);
+	assert_true(nic_register(vnic.nic));
+	assert_true(nic_register(vnic2.nic));
+	nic = vnic2.nic;
+	Packet* chain = nic_pool_get_chain(nic, &nic->pool, 9000, 0, 0, true);
+	assert_int_not_equal(chain->next, 0);
+	nic = vnic.nic;
+	assert_true(nic_tx(nic, chain));
+
+	ok = true;
+	while(vnic_has_tx(&vnic)) {
+		count = 32;
+		vnic_tx_burst(&vnic, &count, transmitter, &ok);
+	}
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.tx.packets, QUEUE_SIZE - 2);
+	assert_int_equal(stats.tx.drops[NIC_DROP_QUEUE_FULL], 2);
+	assert_int_equal(stats.tx.drops[NIC_DROP_FILTERED], 1);
+	assert_reasons(&stats.tx);
+
+	fixture_destroy(&vnic2);
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(drops_queue_func),
+		cmocka_unit_test(drops_pool_func),
+		cmocka_unit_test(drops_rate_func),
+		cmocka_unit_test(drops_tx_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
@@ -0,0 +1,320 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+#include <demux.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x200000
+#define QUEUE_SIZE	FIXTURE_QUEUE_SIZE
+#define VNIC_NUM	4		// The last one is in a group of its own
+#define COUNT		100000
+
+static VNIC vnics[VNIC_NUM];
+static VNIC* targets[VNIC_NUM];
+static uint8_t frame[64];
+
+// Statistics summed over the cores
+static NICStats snapshot(VNIC* vnic) {
+	NICStats stats;
+	vnic_stats(vnic, &stats);
+
+	return stats;
+}
+
+static void nic_create(VNIC* vnic, uint32_t id, uint32_t group) {
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334400 + id,
+		VNIC_FLAGS, NIC_F_BROADCAST,
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_FLAGS, NIC_QUEUE_F_MC,
+		VNIC_GROUP, group,
+		VNIC_NONE
+	};
+
+	fixture_create(vnic, id, POOL_SIZE, attrs);
+	assert_true(nic_register(vnic->nic));
+}
+
+static int setup(void** state) {
+	for(int i = 0; i < VNIC_NUM; i++) {
+		nic_create(&vnics[i], 10 + i, i == VNIC_NUM - 1 ? 2 : 1);
+		targets[i] = &vnics[i];
+	}
+
+	memset(frame, 0xff, 6);
+	for(int i = 6; i < sizeof(frame); i++)
+		frame[i] = i;
+
+	return 0;
+}
+
+static int teardown(void** state) {
+	for(int i = 0; i < VNIC_NUM; i++)
+		fixture_destroy(&vnics[i]);
+
+	return 0;
+}
+
+static size_t pool_used() {
+	size_t used = 0;
+	for(int i = 0; i < VNIC_NUM; i++)
+		used += nic_pool_used(vnics[i].nic);
+
+	return used;
+}
+
+static void fanout_share_func(void** state) {
+	assert_int_equal(vnic_rx_fanout(targets, VNIC_NUM, frame, 16, frame + 16, sizeof(frame) - 16), VNIC_NUM);
+	for(int i = 0; i < VNIC_NUM; i++)
+		vnic_rx_flush(&vnics[i]);
+
+	// One copy for the group and one for the VNIC outside of it
+	assert_int_equal(pool_used(), 2 * 2048);
+
+	Packet* packets[VNIC_NUM];
+	for(int i = 0; i < VNIC_NUM; i++) {
+		packets[i] = nic_rx(vnics[i].nic);
+		assert_non_null(packets[i]);
+		assert_null(nic_rx(vnics[i].nic));
+		assert_int_equal(packets[i]->end - packets[i]->start, sizeof(frame));
+		assert_memory_equal(packets[i]->buffer + packets[i]->start, frame, sizeof(frame));
+		assert_int_equal(snapshot(&vnics[i]).rx.packets, 1);
+	}
+
+	assert_ptr_equal(packets[1], packets[0]);
+	assert_ptr_equal(packets[2], packets[0]);
+	assert_ptr_equal(nic_find_by_packet(packets[0]), vnics[0].nic);
+	assert_int_equal(packets[0]->ref, VNIC_NUM - 1);
+	assert_true(packets[VNIC_NUM - 1] != packets[0]);
+	assert_int_equal(packets[VNIC_NUM - 1]->ref, 1);
+
+	// The shared buffer stays until every consumer has freed it
+	assert_true(nic_free(packets[2]));
+	assert_true(nic_free(packets[0]));
+	assert_int_equal(packets[1]->ref, 1);
+	assert_int_equal(pool_used(), 2 * 2048);
+
+	assert_true(nic_free(packets[1]));
+	assert_int_equal(pool_used(), 2048);
+
+	assert_true(nic_free(packets[VNIC_NUM - 1]));
+	assert_int_equal(pool_used(), 0);
+}
+
+static void fanout_unshare_func(void** state) {
+	assert_int_equal(vnic_rx_fanout(targets, VNIC_NUM, frame, sizeof(frame), NULL, 0), VNIC_NUM);
+	for(int i = 0; i < VNIC_NUM; i++)
+		vnic_rx_flush(&vnics[i]);
+
+	Packet* packets[VNIC_NUM - 1];
+	for(int i = 0; i < VNIC_NUM - 1; i++) {
+		packets[i] = nic_rx(vnics[i].nic);
+		assert_non_null(packets[i]);
+	}
+	assert_true(nic_free(nic_rx(vnics[VNIC_NUM - 1].nic)));
+
+	// Nothing is written into the shared buffer
+	Packet* shared = packets[0];
+	uint8_t zero[sizeof(frame)] = { 0, };
+	assert_int_equal(nic_packet_write(vnics[0].nic, shared, 0, zero, sizeof(zero)), 0);
+	assert_null(nic_packet_append(vnics[0].nic, shared, 4));
+
+	// Writers get a copy of their own
+	uint8_t* tag = nic_packet_prepend(vnics[1].nic, &packets[1], 4);
+	assert_non_null(tag);
+	assert_true(packets[1] != shared);
+	assert_ptr_equal(nic_find_by_packet(packets[1]), vnics[1].nic);
+	assert_int_equal(packets[1]->ref, 1);
+	assert_int_equal(shared->ref, VNIC_NUM - 2);
+	memset(tag, 0, 4);
+	assert_memory_equal(packets[1]->buffer + packets[1]->start + 4, frame, sizeof(frame));
+
+	// So does a transmitter
+	assert_true(nic_tx(vnics[2].nic, packets[2]));
+	Packet* sent = queue_pop(vnics[2].nic, &vnics[2].nic->txq[0]);
+	assert_true(sent != shared);
+	assert_ptr_equal(nic_find_by_packet(sent), vnics[2].nic);
+	assert_int_equal(sent->ref, 1);
+	assert_int_equal(shared->ref, 1);
+	assert_memory_equal(sent->buffer + sent->start, frame, sizeof(frame));
+
+	// The copies left the data of the last consumer alone
+	assert_true(nic_packet_unshare(vnics[0].nic, &packets[0]));
+	assert_ptr_equal(packets[0], shared);
+	assert_memory_equal(shared->buffer + shared->start, frame, sizeof(frame));
+
+	assert_true(nic_free(shared));
+	assert_true(nic_free(packets[1]));
+	assert_true(nic_free(sent));
+	assert_int_equal(pool_used(), 0);
+}
+
+static void fanout_try_tx_func(void** state) {
+	assert_int_equal(vnic_rx_fanout(targets, VNIC_NUM, frame, sizeof(frame), NULL, 0), VNIC_NUM);
+	for(int i = 0; i < VNIC_NUM; i++)
+		vnic_rx_flush(&vnics[i]);
+
+	Packet* packets[VNIC_NUM];
+	for(int i = 0; i < VNIC_NUM; i++)
+		packets[i] = nic_rx(vnics[i].nic);
+
+	NIC* nic = vnics[1].nic;
+	while(queue_available(&nic->txq[0])) {
+		Packet* packet = nic_alloc(nic, 64);
+		assert_non_null(packet);
+		assert_true(nic_try_tx(nic, packet));
+	}
+
+	// A shared packet the queue has no room for stays with the caller, reference and all
+	size_t used = pool_used();
+	assert_false(nic_try_tx(nic, packets[1]));
+	assert_int_equal(pool_used(), used);
+	assert_int_equal(packets[0]->ref, VNIC_NUM - 1);
+
+	Packet* packet;
+	while((packet = queue_pop(nic, &nic->txq[0])))
+		assert_true(nic_free(packet));
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		assert_true(nic_free(packets[i]));
+	assert_int_equal(pool_used(), 0);
+}
+
+static void fanout_ungrouped_func(void** state) {
+	// VNICs made without VNIC_GROUP are in no group, so they share nothing
+	VNIC ungrouped[2];
+	VNIC* ungrouped_targets[2];
+	uint64_t attrs[] = {
+		VNIC_FLAGS, NIC_F_BROADCAST,
+		VNIC_RX_QUEUE_FLAGS, NIC_QUEUE_F_MC,
+		VNIC_NONE
+	};
+
+	for(int i = 0; i < 2; i++) {
+		fixture_create(&ungrouped[i], 20 + i, POOL_SIZE, attrs);
+		assert_true(nic_register(ungrouped[i].nic));
+		assert_int_equal(ungrouped[i].group, 0);
+		ungrouped_targets[i] = &ungrouped[i];
+	}
+
+	assert_int_equal(vnic_rx_fanout(ungrouped_targets, 2, frame, sizeof(frame), NULL, 0), 2);
+
+	Packet* packets[2];
+	for(int i = 0; i < 2; i++) {
+		vnic_rx_flush(&ungrouped[i]);
+		packets[i] = nic_rx(ungrouped[i].nic);
+		assert_non_null(packets[i]);
+		assert_int_equal(packets[i]->ref, 1);
+		assert_ptr_equal(nic_find_by_packet(packets[i]), ungrouped[i].nic);
+	}
+	assert_null(vnic_rx_owner(ungrouped_targets, 2));
+
+	for(int i = 0; i < 2; i++) {
+		assert_true(nic_free(packets[i]));
+		fixture_destroy(&ungrouped[i]);
+	}
+}
+
+static void fanout_drop_func(void** state) {
+	// VNIC 1 takes one less packet than the others
+	Packet* packet = nic_alloc(vnics[1].nic, 64);
+	assert_non_null(packet);
+	assert_true(queue_push(vnics[1].nic, &vnics[1].nic->rxq[0], packet));
+
+	for(int i = 0; i < QUEUE_SIZE - 1; i++)
+		vnic_rx_fanout(targets, VNIC_NUM, frame, sizeof(frame), NULL, 0);
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		vnic_rx_flush(&vnics[i]);
+
+	assert_int_equal(snapshot(&vnics[0]).rx.drop_packets, 0);
+	assert_int_equal(snapshot(&vnics[1]).rx.drop_packets, 1);
+
+	// The packet dropped by the full queue lost a reference only
+	for(int i = 0; i < VNIC_NUM; i++) {
+		while((packet = nic_rx(vnics[i].nic)))
+			assert_true(nic_free(packet));
+	}
+
+	assert_int_equal(pool_used(), 0);
+}
+
+static void* consumer(void* arg) {
+	VNIC* vnic = arg;
+	int count = 0;
+	while(count < COUNT) {
+		Packet* packet = nic_rx(vnic->nic);
+		if(!packet) {
+			sched_yield();
+			continue;
+		}
+
+		assert_memory_equal(packet->buffer + packet->start, frame, sizeof(frame));
+		assert_true(nic_free(packet));
+		count++;
+	}
+
+	return NULL;
+}
+
+static void fanout_mt_func(void** state) {
+	// Every consumer frees its references on a core of its own
+	pthread_t threads[VNIC_NUM];
+	for(int i = 0; i < VNIC_NUM; i++)
+		pthread_create(&threads[i], NULL, consumer, &vnics[i]);
+
+	int count[VNIC_NUM] = { 0, };
+	while(count[0] < COUNT) {
+		int rx = VNIC_NUM;
+		for(int i = 0; i < VNIC_NUM; i++) {
+			if(queue_size(&vnics[i].nic->rxq[0]) + VNIC_BURST_SIZE >= QUEUE_SIZE - 1)
+				rx = 0;
+		}
+
+		if(rx == 0) {
+			for(int i = 0; i < VNIC_NUM; i++)
+				vnic_rx_flush(&vnics[i]);
+			sched_yield();
+			continue;
+		}
+
+		assert_int_equal(vnic_rx_fanout(targets, VNIC_NUM, frame, sizeof(frame), NULL, 0), VNIC_NUM);
+		for(int i = 0; i < VNIC_NUM; i++)
+			count[i]++;
+	}
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		vnic_rx_flush(&vnics[i]);
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		pthread_join(threads[i], NULL);
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		assert_int_equal(snapshot(&vnics[i]).rx.drop_packets, i == 1 ? 1 : 0);
+
+	assert_int_equal(pool_used(), 0);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(fanout_share_func),
+		cmocka_unit_test(fanout_unshare_func),
+		cmocka_unit_test(fanout_try_tx_func),
+		cmocka_unit_test(fanout_ungrouped_func),
+		cmocka_unit_test(fanout_drop_func),
+		cmocka_unit_test(fanout_mt_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, setup, teardown);
+}
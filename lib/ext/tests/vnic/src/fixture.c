@@ -0,0 +1,88 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define ATTR_COUNT	64
+
+bool fixture_init(VNIC* vnic, uint32_t id, void* region, uint64_t pool_size, uint64_t* attrs) {
+	memset(vnic, 0, sizeof(VNIC));
+	vnic->nic = region;
+	vnic->nic_size = pool_size;
+	vnic->id = id;
+
+	uint64_t defaults[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"eth0",
+		VNIC_BUDGET, 32,
+		VNIC_FLAGS, 0,
+		VNIC_POOL_SIZE, pool_size,
+		VNIC_RX_BANDWIDTH, 1000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000L,
+		VNIC_PADDING_HEAD, 0,
+		VNIC_PADDING_TAIL, 0,
+		FIXTURE_QUEUE_SIZES(FIXTURE_QUEUE_SIZE),
+		VNIC_NONE
+	};
+
+	// The test's attributes take the place of the defaults of the same keys
+	uint64_t merged[ATTR_COUNT * 2 + sizeof(defaults) / sizeof(uint64_t)];
+	int count = 0;
+	for(int i = 0; attrs && attrs[i * 2] != VNIC_NONE; i++) {
+		assert_true(count < ATTR_COUNT * 2);
+		merged[count++] = attrs[i * 2];
+		merged[count++] = attrs[i * 2 + 1];
+	}
+
+	int overrides = count;
+	for(int i = 0; defaults[i * 2] != VNIC_NONE; i++) {
+		bool found = false;
+		for(int j = 0; j < overrides; j += 2)
+			found |= merged[j] == defaults[i * 2];
+
+		if(!found) {
+			merged[count++] = defaults[i * 2];
+			merged[count++] = defaults[i * 2 + 1];
+		}
+	}
+	merged[count] = VNIC_NONE;
+
+	return vnic_init(vnic, merged);
+}
+
+void fixture_create(VNIC* vnic, uint32_t id, uint64_t pool_size, uint64_t* attrs) {
+	void* region;
+	assert_int_equal(posix_memalign(&region, 0x200000, pool_size), 0);
+	assert_true(fixture_init(vnic, id, region, pool_size, attrs));
+}
+
+static void drain(NIC* nic, NICQueue* queue) {
+	Packet* packet;
+	while((packet = queue_pop(nic, queue)))
+		nic_free(packet);
+}
+
+void fixture_destroy(VNIC* vnic) {
+	NIC* nic = vnic->nic;
+	for(int i = 0; i < nic->queue_count; i++) {
+		drain(nic, &nic->rxq[i]);
+		drain(nic, &nic->txq[i]);
+	}
+	drain(nic, &nic->srx);
+	drain(nic, &nic->stx);
+
+	assert_int_equal(nic_pool_used(nic), 0);
+	assert_int_equal(nic_pool_charged(nic), 0);
+
+	nic_unregister(nic);
+	free(nic);
+	vnic->nic = NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef __FIXTURE_H__
+#define __FIXTURE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <vnic.h>
+
+#define FIXTURE_POOL_SIZE	0x200000
+#define FIXTURE_QUEUE_SIZE	64
+
+/* Attributes giving all four queues of a VNIC the same size */
+#define FIXTURE_QUEUE_SIZES(size)		\
+	VNIC_RX_QUEUE_SIZE, (size),		\
+	VNIC_TX_QUEUE_SIZE, (size),		\
+	VNIC_SLOW_RX_QUEUE_SIZE, (size),	\
+	VNIC_SLOW_TX_QUEUE_SIZE, (size)
+
+/**
+ * Initialize a VNIC in region, pool_size bytes aligned to 2MB. attrs, ended by
+ * VNIC_NONE, take the place of the defaults of the same keys: MAC
+ * 00:11:22:33:44:55 of eth0, budget 32, no flags, 1Gbps both ways, no padding
+ * and queues of FIXTURE_QUEUE_SIZE. attrs may be NULL.
+ *
+ * @return vnic_init() result
+ */
+bool fixture_init(VNIC* vnic, uint32_t id, void* region, uint64_t pool_size, uint64_t* attrs);
+
+/**
+ * Allocate a pool of pool_size bytes and initialize a VNIC in it, failing the
+ * test if it can't (see fixture_init()).
+ */
+void fixture_create(VNIC* vnic, uint32_t id, uint64_t pool_size, uint64_t* attrs);
+
+/**
+ * Free the packets left in the queues of a VNIC, check that its pool has none
+ * out, unregister and free it.
+ */
+void fixture_destroy(VNIC* vnic);
+
+#endif /* __FIXTURE_H__ */
@@ -0,0 +1,305 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define REGION_SIZE	(POOL_SIZE + NIC_POOL_EXTENT_COUNT * NIC_POOL_EXTENT_SIZE)
+#define MAX_SIZE	(POOL_SIZE + 4 * NIC_POOL_EXTENT_SIZE)
+#define QUEUE_SIZE	256
+#define FRAME_SIZE	64
+#define ROUNDS		1000
+#define HELD_MAX	4096	///< Most packets the VM holds on to
+
+static VNIC vnic;
+static NIC* nic;
+
+// Blocks come from above the NIC as bmalloc gives them to the manager
+static void* blocks[NIC_POOL_EXTENT_COUNT];
+static int block_count;
+
+static void nic_create(uint64_t max) {
+	void* region;
+	assert_int_equal(posix_memalign(&region, NIC_POOL_EXTENT_SIZE, REGION_SIZE), 0);
+
+	block_count = 0;
+	for(int i = NIC_POOL_EXTENT_COUNT - 1; i >= 0; i--)
+		blocks[block_count++] = region + POOL_SIZE + i * NIC_POOL_EXTENT_SIZE;
+
+	uint64_t attrs[] = {
+		VNIC_POOL_MAX_SIZE, max,
+		VNIC_MTU, 9000,
+		VNIC_RX_BANDWIDTH, 0,
+		VNIC_TX_BANDWIDTH, 0,
+		FIXTURE_QUEUE_SIZES(QUEUE_SIZE),
+		VNIC_NONE
+	};
+
+	assert_true(fixture_init(&vnic, 0, region, POOL_SIZE, attrs));
+	nic = vnic.nic;
+}
+
+// What the manager does on its timer
+static bool grow() {
+	int class = vnic_pool_grow_class(&vnic);
+	if(class < 0 || block_count == 0)
+		return false;
+
+	void* block = blocks[--block_count];
+	if(!vnic_pool_grow(&vnic, block, class)) {
+		block_count++;
+		return false;
+	}
+
+	return true;
+}
+
+static bool shrink() {
+	void* block = vnic_pool_shrink(&vnic, 0);
+	if(!block)
+		return false;
+
+	blocks[block_count++] = block;
+
+	return true;
+}
+
+// Every buffer of the pool is taken
+static int exhaust(Packet** taken) {
+	int count = 0;
+	for(int class = NIC_POOL_CLASS_COUNT - 1; class >= 0; class--) {
+		Packet* packet;
+		while((packet = nic_pool_get(nic, &nic->pool, nic->pool.slabs[class].size, true)))
+			taken[count++] = packet;
+	}
+
+	return count;
+}
+
+static void growpool_grow_func(void** state) {
+	static Packet* taken[REGION_SIZE / 128];
+	nic_create(MAX_SIZE);
+	assert_int_equal(vnic_pool_size(&vnic), POOL_SIZE);
+	size_t total = nic_pool_total(nic);
+
+	// Enough buffers: no growth
+	assert_int_equal(vnic_pool_grow_class(&vnic), -1);
+
+	// The pool runs out and grows by a block of the class it is short of
+	int count = exhaust(taken);
+	assert_null(nic_alloc(nic, FRAME_SIZE));
+	int class = vnic_pool_grow_class(&vnic);
+	assert_int_equal(class, 0);
+	assert_true(grow());
+	assert_int_equal(vnic_pool_size(&vnic), POOL_SIZE + NIC_POOL_EXTENT_SIZE);
+	assert_true(nic_pool_total(nic) > total);
+
+	// Buffers of the block are found and freed as any other, with or without the registry
+	Packet* packet = nic_alloc(nic, FRAME_SIZE);
+	assert_non_null(packet);
+	assert_true((void*)packet >= (void*)nic + POOL_SIZE);
+	assert_ptr_equal(nic_find_by_packet(packet), nic);
+	assert_true(nic_register(nic));
+	assert_ptr_equal(nic_find_by_packet(packet), nic);
+
+	// The header of the block decides, as the registry of a VM isn't told when the block goes to another NIC
+	static NIC other;
+	NICExtentHeader* header = (void*)((uintptr_t)packet & ~(uintptr_t)(NIC_POOL_EXTENT_SIZE - 1));
+	header->nic = &other;
+	assert_ptr_equal(nic_find_by_packet(packet), &other);
+	header->nic = nic;
+	nic_unregister(nic);
+
+	// A frame is received into the block
+	uint8_t frame[FRAME_SIZE] = { 0, };
+	assert_int_equal(vnic_rx(&vnic, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_NOERROR);
+	Packet* received = nic_rx(nic);
+	assert_true((void*)received >= (void*)nic + POOL_SIZE);
+
+	// In use, it stays
+	assert_false(shrink());
+	assert_false(shrink());
+	nic_free(received);
+	assert_true(vnic_free(&vnic, packet));
+
+	// Each class short of buffers gets a block, no more
+	while(grow());
+	assert_int_equal(vnic_pool_size(&vnic), POOL_SIZE + NIC_POOL_CLASS_COUNT * NIC_POOL_EXTENT_SIZE);
+
+	// nor beyond the most size
+	assert_true(vnic_pool_grow(&vnic, blocks[--block_count], 0));
+	assert_int_equal(vnic_pool_size(&vnic), MAX_SIZE);
+	assert_false(vnic_pool_grow(&vnic, blocks[block_count - 1], 0));
+
+	for(int i = 0; i < count; i++)
+		nic_free(taken[i]);
+
+	// Idle, the blocks are given back, one at a time
+	shrink();
+	int shrunk = 0;
+	while(shrink())
+		shrunk++;
+	assert_int_equal(shrunk, MAX_SIZE / NIC_POOL_EXTENT_SIZE - POOL_SIZE / NIC_POOL_EXTENT_SIZE);
+	assert_int_equal(vnic_pool_size(&vnic), POOL_SIZE);
+	assert_int_equal(nic_pool_total(nic), total);
+	assert_int_equal(block_count, NIC_POOL_EXTENT_COUNT);
+
+	fixture_destroy(&vnic);
+}
+
+static void growpool_fixed_func(void** state) {
+	static Packet* taken[POOL_SIZE / 128];
+
+	// Without the most size the pool is fixed
+	nic_create(0);
+	int count = exhaust(taken);
+	assert_int_equal(vnic_pool_grow_class(&vnic), -1);
+	assert_false(vnic_pool_grow(&vnic, blocks[0], 0));
+
+	// which may be raised, but not below the size
+	uint64_t attrs[] = {
+		VNIC_POOL_MAX_SIZE, POOL_SIZE / 2,
+		VNIC_NONE
+	};
+	assert_int_equal(vnic_update(&vnic, attrs), VNIC_ERROR_ATTRIBUTE_INVALID);
+	attrs[1] = MAX_SIZE;
+	assert_int_equal(vnic_update(&vnic, attrs), VNIC_ERROR_NOERROR);
+	assert_int_equal(vnic_pool_grow_class(&vnic), 0);
+
+	for(int i = 0; i < count; i++)
+		nic_free(taken[i]);
+
+	// A block which isn't of the NIC is refused
+	void* below;
+	assert_int_equal(posix_memalign(&below, NIC_POOL_EXTENT_SIZE, NIC_POOL_EXTENT_SIZE), 0);
+	if(below < (void*)nic)
+		assert_false(vnic_pool_grow(&vnic, below, 0));
+	free(below);
+	assert_false(vnic_pool_grow(&vnic, blocks[0] + 4096, 0));
+	assert_false(vnic_pool_grow(&vnic, blocks[0], NIC_POOL_CLASS_COUNT));
+
+	fixture_destroy(&vnic);
+}
+
+typedef struct {
+	volatile bool	stop;
+	uint64_t	packets;
+	uint64_t	failures;
+} Traffic;
+
+// The VM holds on to the packets it receives for a while and sends some of its own
+static void* vm(void* context) {
+	Traffic* traffic = context;
+	static Packet* held[HELD_MAX];
+	uint32_t count = 0;
+	uint32_t limit = HELD_MAX;
+	uint32_t seed = 1;
+
+	while(!traffic->stop) {
+		Packet* packet;
+		while((packet = nic_rx(nic))) {
+			held[count++] = packet;
+			traffic->packets++;
+
+			// Bursts are let go of at once, after a long or a short while
+			if(count == limit) {
+				while(count > 0)
+					nic_free(held[--count]);
+
+				seed = seed * 1103515245 + 12345;
+				limit = (seed >> 16) % 4 == 0 ? HELD_MAX : QUEUE_SIZE;
+			}
+		}
+
+		seed = seed * 1103515245 + 12345;
+		uint32_t size = 64 << ((seed >> 16) % 8);
+		packet = nic_alloc(nic, size);
+		if(packet) {
+			assert_ptr_equal(nic_find_by_packet(packet), nic);
+			memset(packet->buffer, 0xa5, size);
+			nic_free(packet);
+		} else {
+			traffic->failures++;
+		}
+	}
+
+	while(count > 0)
+		nic_free(held[--count]);
+
+	return NULL;
+}
+
+/*
+ * Frames arrive in bursts while the VM holds on to them: the pool grows while
+ * it runs short and shrinks when the VM lets go, over and over.
+ */
+static void growpool_stress_func(void** state) {
+	nic_create(REGION_SIZE);
+	assert_true(nic_register(nic));
+
+	Traffic traffic = { 0, };
+	pthread_t thread;
+	pthread_create(&thread, NULL, vm, &traffic);
+
+	uint8_t frame[1500] = { 0, };
+	uint32_t grown = 0;
+	uint32_t shrunk = 0;
+	uint32_t most = 0;
+	for(int round = 0; round < ROUNDS; round++) {
+		uint32_t size = round % 3 == 0 ? 1500 : FRAME_SIZE;
+		for(int i = 0; i < QUEUE_SIZE / 2; i++)
+			vnic_rx(&vnic, frame, size, NULL, 0);
+
+		while(!queue_empty(&nic->rxq[0]));
+
+		if(grow())
+			grown++;
+		if(shrink())
+			shrunk++;
+
+		uint32_t extents = (vnic_pool_size(&vnic) - POOL_SIZE) / NIC_POOL_EXTENT_SIZE;
+		if(extents > most)
+			most = extents;
+	}
+
+	traffic.stop = true;
+	pthread_join(thread, NULL);
+
+	// Everything the VM took is back, so are the blocks
+	Packet* packet;
+	while((packet = nic_rx(nic)))
+		nic_free(packet);
+	for(int i = 0; i < 2; i++) {
+		while(shrink())
+			shrunk++;
+	}
+
+	printf("\t%lu packets, %lu failed allocations, %u grown, %u shrunk, %u blocks at most\n", traffic.packets, traffic.failures, grown, shrunk, most);
+	assert_true(grown > 0);
+	assert_int_equal(shrunk, grown);
+	assert_int_equal(vnic_pool_size(&vnic), POOL_SIZE);
+	assert_int_equal(block_count, NIC_POOL_EXTENT_COUNT);
+
+	nic_unregister(nic);
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(growpool_grow_func),
+		cmocka_unit_test(growpool_fixed_func),
+		cmocka_unit_test(growpool_stress_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
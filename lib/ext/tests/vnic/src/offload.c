@@ -0,0 +1,472 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define FRAME_SIZE	128
+
+static VNIC vnic;
+static NIC* nic;
+
+static void nic_create() {
+	// GSO frames take jumbo buffers
+	uint64_t attrs[] = {
+		VNIC_MTU, 9000,
+		VNIC_NONE
+	};
+
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+	nic = vnic.nic;
+}
+
+static void put16(uint8_t* p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+// Ethernet (802.1Q tagged if vlan) + IPv4 with options of ihl words + TCP/UDP, the rest is payload
+static uint8_t* frame_ipv4(uint8_t* frame, bool vlan, uint8_t ihl, uint8_t protocol) {
+	memset(frame, 0, FRAME_SIZE);
+	for(int i = 0; i < FRAME_SIZE; i++)
+		frame[i] = i * 13;
+
+	uint8_t* p = frame + 12;
+	if(vlan) {
+		put16(p, 0x8100);
+		put16(p + 2, 100);
+		p += 4;
+	}
+	put16(p, 0x0800);
+
+	uint8_t* ip = p + 2;
+	ip[0] = 0x40 | ihl;
+	put16(ip + 2, frame + FRAME_SIZE - ip);
+	put16(ip + 6, 0);
+	ip[9] = protocol;
+	put32(ip + 12, 0x0a000001);
+	put32(ip + 16, 0x0a000002);
+
+	return ip;
+}
+
+// Internet checksum of the pseudo header and the segment, as lib/ext tcp_pack() does it
+static uint16_t reference_csum(uint8_t* ip, uint8_t* l4, size_t size, uint8_t protocol) {
+	uint32_t sum = 0;
+	for(int i = 12; i < 20; i += 2)
+		sum += (uint16_t)ip[i] << 8 | ip[i + 1];
+	sum += protocol + size;
+	for(size_t i = 0; i < size; i += 2)
+		sum += (uint16_t)l4[i] << 8 | (i + 1 < size ? l4[i + 1] : 0);
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+// The partial checksum a stack puts in the field when it offloads the rest
+static uint16_t pseudo_csum(uint8_t* ip, size_t size, uint8_t protocol) {
+	uint32_t sum = 0;
+	for(int i = 12; i < 20; i += 2)
+		sum += (uint16_t)ip[i] << 8 | ip[i + 1];
+	sum += protocol + size;
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+static Packet* packet_of(uint8_t* frame, size_t size) {
+	Packet* packet = nic_alloc(nic, size);
+	assert_non_null(packet);
+	memcpy(packet->buffer + packet->start, frame, size);
+	packet->end = packet->start + size;
+
+	return packet;
+}
+
+static void offload_parse_func(void** state) {
+	nic_create();
+	uint8_t frame[FRAME_SIZE];
+
+	// IPv4 with options, tagged
+	frame_ipv4(frame, true, 7, 6);
+	Packet* packet = packet_of(frame, FRAME_SIZE);
+	assert_true(nic_packet_parse(packet));
+	assert_int_equal(packet->flags, PACKET_F_L3 | PACKET_F_L4);
+	assert_int_equal(packet->l3, 18);
+	assert_int_equal(packet->l4, 18 + 28);
+	assert_int_equal(packet->l4_proto, 6);
+
+	// The hash is the RSS hash, computed once
+	uint32_t hash = nic_rss_hash(frame, FRAME_SIZE);
+	assert_int_equal(nic_packet_hash(packet), hash);
+	assert_true(packet->flags & PACKET_F_HASH);
+	packet->buffer[packet->start + 18 + 12] ^= 0xff;
+	assert_int_equal(nic_packet_hash(packet), hash);
+	nic_free(packet);
+
+	// Fragments but the first have no transport header
+	uint8_t* ip = frame_ipv4(frame, false, 5, 17);
+	put16(ip + 6, 100);
+	packet = packet_of(frame, FRAME_SIZE);
+	assert_true(nic_packet_parse(packet));
+	assert_int_equal(packet->flags, PACKET_F_L3);
+	assert_int_equal(packet->l3, 14);
+	nic_free(packet);
+
+	// IPv6
+	memset(frame, 0, FRAME_SIZE);
+	put16(frame + 12, 0x86dd);
+	frame[14] = 0x60;
+	frame[14 + 6] = 17;
+	packet = packet_of(frame, FRAME_SIZE);
+	assert_true(nic_packet_parse(packet));
+	assert_int_equal(packet->l4, 14 + 40);
+	assert_int_equal(packet->l4_proto, 17);
+	nic_free(packet);
+
+	// Neither IPv4 nor IPv6
+	put16(frame + 12, 0x0806);
+	packet = packet_of(frame, FRAME_SIZE);
+	packet->flags = PACKET_F_L3 | PACKET_F_RX_CSUM;
+	assert_false(nic_packet_parse(packet));
+	assert_int_equal(packet->flags, PACKET_F_RX_CSUM);
+
+	// Headers put in front move the offsets
+	frame_ipv4(frame, false, 5, 6);
+	Packet* packet2 = nic_alloc(nic, FRAME_SIZE + 8);
+	packet2->start = 8;
+	packet2->end = packet2->start + FRAME_SIZE;
+	memcpy(packet2->buffer + packet2->start, frame, FRAME_SIZE);
+	nic_packet_parse(packet2);
+	assert_non_null(nic_packet_prepend(nic, &packet2, 8));
+	assert_int_equal(packet2->l3, 14 + 8);
+	assert_int_equal(packet2->l4, 34 + 8);
+
+	nic_free(packet);
+	nic_free(packet2);
+
+	fixture_destroy(&vnic);
+}
+
+static void offload_csum_func(void** state) {
+	nic_create();
+	uint8_t frame[FRAME_SIZE];
+
+	uint8_t protocols[] = { 6, 17 };
+	for(int i = 0; i < 2; i++) {
+		for(int ihl = 5; ihl <= 6; ihl++) {
+			uint8_t protocol = protocols[i];
+			uint8_t* ip = frame_ipv4(frame, ihl == 6, ihl, protocol);
+			uint8_t* l4 = ip + ihl * 4;
+			size_t size = frame + FRAME_SIZE - l4 - (ihl == 6);	// odd length too
+			uint8_t* field = l4 + (protocol == 6 ? 16 : 6);
+			if(protocol == 17)
+				put16(l4 + 4, size);
+
+			memset(field, 0, 2);
+			uint16_t expected = reference_csum(ip, l4, size, protocol);
+
+			put16(field, pseudo_csum(ip, size, protocol));
+			Packet* packet = packet_of(frame, l4 + size - frame);
+			nic_packet_parse(packet);
+			packet->flags |= PACKET_F_TX_CSUM;
+			assert_true(nic_packet_tx_csum(packet));
+			assert_false(packet->flags & PACKET_F_TX_CSUM);
+
+			uint8_t* csum = packet->buffer + packet->start + packet->l4 + (protocol == 6 ? 16 : 6);
+			assert_int_equal((uint16_t)csum[0] << 8 | csum[1], expected);
+			nic_free(packet);
+		}
+	}
+
+	// Nothing to do without a request, and nothing done for other protocols
+	frame_ipv4(frame, false, 5, 1);
+	Packet* packet = packet_of(frame, FRAME_SIZE);
+	assert_true(nic_packet_tx_csum(packet));
+	nic_packet_parse(packet);
+	packet->flags |= PACKET_F_TX_CSUM;
+	assert_false(nic_packet_tx_csum(packet));
+	assert_memory_equal(packet->buffer + packet->start, frame, FRAME_SIZE);
+	nic_free(packet);
+
+	// The field must be in the frame
+	uint8_t data[64] = { 0, };
+	assert_false(nic_csum_complete(data, sizeof(data), 60, 6));
+	assert_true(nic_csum_complete(data, sizeof(data), 40, 6));
+	assert_int_equal(data[46], 0xff);
+	assert_int_equal(data[47], 0xff);
+
+	fixture_destroy(&vnic);
+}
+
+static void offload_rx_func(void** state) {
+	nic_create();
+	uint8_t frame[FRAME_SIZE];
+	frame_ipv4(frame, false, 5, 17);
+
+	// The VM gets the headers parsed and the checksum status from the device
+	assert_int_equal(vnic_rx_stage0(&vnic, frame, 40, frame + 40, FRAME_SIZE - 40, PACKET_F_RX_CSUM | PACKET_F_TX_CSUM), VNIC_ERROR_NOERROR);
+	assert_int_equal(vnic_rx_stage(&vnic, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_NOERROR);
+
+	// Zero-copy frames keep what the driver set
+	Packet* packet = vnic_alloc(&vnic, FRAME_SIZE);
+	memcpy(packet->buffer + packet->start, frame, FRAME_SIZE);
+	packet->end = packet->start + FRAME_SIZE;
+	packet->flags = PACKET_F_RX_CSUM | PACKET_F_HASH;
+	assert_int_equal(vnic_rx_stage2(&vnic, packet), VNIC_ERROR_NOERROR);
+	vnic_rx_flush(&vnic);
+
+	uint8_t expected[] = {
+		PACKET_F_L3 | PACKET_F_L4 | PACKET_F_RX_CSUM,
+		PACKET_F_L3 | PACKET_F_L4,
+		PACKET_F_L3 | PACKET_F_L4 | PACKET_F_RX_CSUM,
+	};
+	for(int i = 0; i < 3; i++) {
+		packet = nic_rx(nic);
+		assert_non_null(packet);
+		assert_int_equal(packet->flags, expected[i]);
+		assert_int_equal(packet->l3, 14);
+		assert_int_equal(packet->l4, 34);
+		assert_int_equal(packet->l4_proto, 17);
+		nic_free(packet);
+	}
+
+	// Packets fresh from the pool have no metadata
+	packet = nic_alloc(nic, FRAME_SIZE);
+	assert_int_equal(packet->flags, 0);
+	nic_free(packet);
+
+	fixture_destroy(&vnic);
+}
+
+#define GSO_FRAME_SIZE	(14 + 20 + 32 + 4000)
+#define GSO_MSS		1448
+
+static uint32_t get32(uint8_t* p) {
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// TCP/IPv4 frame of size bytes with timestamps, PSH and FIN, asking for segmentation
+static Packet* frame_gso(uint8_t* frame, size_t size, uint16_t mss) {
+	memset(frame, 0, size);
+	for(size_t i = 0; i < size; i++)
+		frame[i] = i * 7;
+
+	put16(frame + 12, 0x0800);
+	uint8_t* ip = frame + 14;
+	memset(ip, 0, 20);
+	ip[0] = 0x45;
+	put16(ip + 2, size - 14);
+	put16(ip + 4, 1000);
+	ip[9] = 6;
+	put32(ip + 12, 0x0a000001);
+	put32(ip + 16, 0x0a000002);
+
+	uint8_t* tcp = ip + 20;
+	put32(tcp + 4, 0xfffff000);	// wraps around
+	tcp[12] = 8 << 4;
+	tcp[13] = 0x80 | 0x10 | 0x08 | 0x01;	// CWR ACK PSH FIN
+
+	Packet* packet = packet_of(frame, size);
+	assert_true(nic_packet_parse(packet));
+	assert_true(nic_packet_csum_offload(packet));
+	packet->flags |= PACKET_F_TX_GSO;
+	packet->gso_size = mss;
+
+	return packet;
+}
+
+// Each segment is a frame of its own, with headers and checksums a receiver accepts
+static void check_segment(Packet* segment, uint8_t* frame, uint16_t index, uint16_t count) {
+	uint8_t* data = segment->buffer + segment->start;
+	size_t size = segment->end - segment->start;
+	size_t payload = GSO_FRAME_SIZE - 66;
+	size_t len = index < count - 1 ? GSO_MSS : payload - index * GSO_MSS;
+	assert_int_equal(size, 66 + len);
+	assert_int_equal(segment->flags & ~PACKET_F_HASH, PACKET_F_L3 | PACKET_F_L4 | PACKET_F_TX_CSUM);
+	assert_memory_equal(data + 66, frame + 66 + index * GSO_MSS, len);
+
+	uint8_t* ip = data + 14;
+	assert_int_equal((uint16_t)ip[2] << 8 | ip[3], size - 14);
+	assert_int_equal((uint16_t)ip[4] << 8 | ip[5], 1000 + index);
+	uint32_t sum = 0;
+	for(int i = 0; i < 20; i += 2)
+		sum += (uint16_t)ip[i] << 8 | ip[i + 1];
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	assert_int_equal(sum, 0xffff);
+
+	uint8_t* tcp = ip + 20;
+	assert_int_equal(get32(tcp + 4), (uint32_t)(0xfffff000 + index * GSO_MSS));
+	uint8_t flags = 0x10;
+	if(index == 0)
+		flags |= 0x80;
+	if(index == count - 1)
+		flags |= 0x08 | 0x01;
+	assert_int_equal(tcp[13], flags);
+
+	// The device, or the kernel for it, fills in the checksum of the segment
+	uint8_t field[2];
+	memcpy(field, tcp + 16, 2);
+	memset(tcp + 16, 0, 2);
+	uint16_t expected = reference_csum(ip, tcp, size - 34, 6);
+	memcpy(tcp + 16, field, 2);
+	assert_true(nic_packet_tx_csum(segment));
+	assert_int_equal((uint16_t)tcp[16] << 8 | tcp[17], expected);
+}
+
+static void offload_gso_func(void** state) {
+	nic_create();
+	static uint8_t frame[GSO_FRAME_SIZE];
+
+	Packet* packet = frame_gso(frame, GSO_FRAME_SIZE, GSO_MSS);
+	memcpy(frame, packet->buffer + packet->start, GSO_FRAME_SIZE);
+	uint16_t count = nic_packet_gso_count(packet);
+	assert_int_equal(count, 3);
+	assert_int_equal(nic_packet_gso_size(packet), 66 + GSO_MSS);
+
+	for(uint16_t i = 0; i < count; i++) {
+		Packet* segment = nic_alloc(nic, nic_packet_gso_size(packet));
+		assert_true(nic_packet_gso_segment(packet, i, segment));
+		check_segment(segment, frame, i, count);
+		nic_free(segment);
+	}
+
+	// No more segments, nor room in a small buffer
+	Packet* segment = nic_alloc(nic, 64);
+	assert_false(nic_packet_gso_segment(packet, count, segment));
+	segment->start = segment->size - 64;
+	assert_false(nic_packet_gso_segment(packet, 0, segment));
+	nic_free(segment);
+
+	// A frame within the MSS is one segment
+	packet->gso_size = GSO_FRAME_SIZE;
+	assert_int_equal(nic_packet_gso_count(packet), 1);
+
+	// Only TCP frames asking for it are segmented
+	packet->gso_size = 0;
+	assert_int_equal(nic_packet_gso_count(packet), 0);
+	packet->gso_size = GSO_MSS;
+	packet->flags &= ~PACKET_F_TX_GSO;
+	assert_int_equal(nic_packet_gso_count(packet), 0);
+	packet->flags |= PACKET_F_TX_GSO;
+	packet->l4_proto = 17;
+	assert_int_equal(nic_packet_gso_count(packet), 0);
+	packet->l4_proto = 6;
+	packet->buffer[packet->start + 46] = 4 << 4;
+	assert_int_equal(nic_packet_gso_count(packet), 0);
+	nic_free(packet);
+
+	// Fragments are summed over the datagram, which the device doesn't see
+	uint8_t* ip = frame_ipv4(frame, false, 5, 17);
+	put16(ip + 6, 0x2000);
+	packet = packet_of(frame, FRAME_SIZE);
+	nic_packet_parse(packet);
+	assert_false(nic_packet_csum_offload(packet));
+	assert_false(packet->flags & PACKET_F_TX_CSUM);
+	nic_free(packet);
+
+	fixture_destroy(&vnic);
+}
+
+typedef struct {
+	uint8_t*	frame;
+	uint16_t	count;
+	uint16_t	sent;
+	uint16_t	fail;	///< Segment the transmitter fails on (0: none)
+} GSOTransmitter;
+
+static bool gso_transmitter(Packet* packet, void* context) {
+	GSOTransmitter* transmitter = context;
+	if(transmitter->fail && transmitter->sent == transmitter->fail) {
+		nic_free(packet);
+		return false;
+	}
+
+	if(transmitter->count == 1)
+		assert_int_equal(packet->end - packet->start, GSO_FRAME_SIZE);
+	else
+		check_segment(packet, transmitter->frame, transmitter->sent, transmitter->count);
+
+	transmitter->sent++;
+	nic_free(packet);
+
+	return true;
+}
+
+static void offload_gso_tx_func(void** state) {
+	nic_create();
+	static uint8_t frame[GSO_FRAME_SIZE];
+	NICStats stats;
+
+	// Devices which can't segment get the segments of the frame
+	Packet* packet = frame_gso(frame, GSO_FRAME_SIZE, GSO_MSS);
+	memcpy(frame, packet->buffer + packet->start, GSO_FRAME_SIZE);
+	assert_true(nic_tx(nic, packet));
+	GSOTransmitter transmitter = { frame, 3, 0, 0 };
+	uint32_t count = 32;
+	assert_int_equal(vnic_tx_burst(&vnic, &count, gso_transmitter, &transmitter), VNIC_ERROR_NOERROR);
+	assert_int_equal(count, 1);
+	assert_int_equal(transmitter.sent, 3);
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.tx.packets, 1);
+	assert_int_equal(stats.tx.bytes, GSO_FRAME_SIZE);
+
+	// Those which can get the frame
+	vnic.tx_gso = VNIC_TX_GSO_TCPV4;
+	assert_true(nic_tx(nic, frame_gso(frame, GSO_FRAME_SIZE, GSO_MSS)));
+	transmitter = (GSOTransmitter){ frame, 1, 0, 0 };
+	count = 32;
+	vnic_tx_burst(&vnic, &count, gso_transmitter, &transmitter);
+	assert_int_equal(transmitter.sent, 1);
+	vnic.tx_gso = 0;
+
+	// The segments after one the transmitter fails on are not sent
+	assert_true(nic_tx(nic, frame_gso(frame, GSO_FRAME_SIZE, GSO_MSS)));
+	transmitter = (GSOTransmitter){ frame, 3, 0, 1 };
+	count = 32;
+	vnic_tx_burst(&vnic, &count, gso_transmitter, &transmitter);
+	assert_int_equal(transmitter.sent, 1);
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.tx.drops[NIC_DROP_QUEUE_FULL], 1);
+
+	// Frames which can't be segmented are dropped
+	packet = frame_gso(frame, GSO_FRAME_SIZE, 16);
+	assert_true(nic_tx(nic, packet));
+	count = 32;
+	vnic_tx_burst(&vnic, &count, gso_transmitter, &transmitter);
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.tx.drops[NIC_DROP_FILTERED], 1);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(offload_parse_func),
+		cmocka_unit_test(offload_csum_func),
+		cmocka_unit_test(offload_rx_func),
+		cmocka_unit_test(offload_gso_func),
+		cmocka_unit_test(offload_gso_tx_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
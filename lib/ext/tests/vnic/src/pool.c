@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <lock.h>
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x200000
+#define MAX_PACKETS	2048
+#define COUNT		1000000
+#define THREAD_NUM	4
+
+static VNIC vnic;
+static Packet* packets[MAX_PACKETS];
+static uint16_t sizes[MAX_PACKETS];
+
+static void nic_create(uint64_t mtu) {
+	uint64_t attrs[] = {
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_MTU, mtu,
+		VNIC_NONE
+	};
+
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+}
+
+static void pool_class_func(void** state) {
+	nic_create(9000);
+
+	size_t total = nic_pool_total(vnic.nic);
+	assert_int_equal(nic_pool_free(vnic.nic), total);
+	assert_int_equal(nic_pool_used(vnic.nic), 0);
+
+	Packet* p1 = nic_alloc(vnic.nic, 64);
+	Packet* p2 = nic_alloc(vnic.nic, 1500);
+	Packet* p3 = nic_alloc(vnic.nic, 3000);
+	Packet* p4 = nic_alloc(vnic.nic, 9000);
+	assert_non_null(p1);
+	assert_non_null(p2);
+	assert_non_null(p3);
+	assert_non_null(p4);
+	assert_null(nic_alloc(vnic.nic, 10000));
+
+	assert_int_equal(p1->size + sizeof(Packet), 2048);
+	assert_int_equal(p2->size + sizeof(Packet), 2048);
+	assert_int_equal(p3->size + sizeof(Packet), 4096);
+	assert_int_equal(p4->size + sizeof(Packet), 9216);
+	assert_int_equal(nic_pool_used(vnic.nic), 2048 * 2 + 4096 + 9216);
+
+	// Buffers don't overlap the header and stay in the NIC
+	assert_true((void*)p1 >= (void*)vnic.nic + NIC_HEADER_SIZE);
+	assert_ptr_equal(nic_find_by_packet(p4), vnic.nic);
+	assert_true((void*)p4->buffer + p4->size <= (void*)vnic.nic + POOL_SIZE);
+
+	assert_true(nic_free(p1));
+	assert_true(nic_free(p2));
+	assert_true(nic_free(p3));
+	assert_true(nic_free(p4));
+	assert_int_equal(nic_pool_used(vnic.nic), 0);
+
+	// Pointers which are not a buffer of the pool
+	assert_false(nic_free((Packet*)((void*)p1 + 64)));
+	assert_false(nic_free((Packet*)((void*)vnic.nic + 64)));
+
+	fixture_destroy(&vnic);
+}
+
+static void pool_jumbo_func(void** state) {
+	nic_create(9000);
+	uint32_t small = vnic.nic->pool.slabs[0].count;
+	assert_int_not_equal(vnic.nic->pool.slabs[NIC_POOL_CLASS_COUNT - 1].count, 0);
+	fixture_destroy(&vnic);
+
+	// Without jumbo frames the space of the jumbo class goes to the smallest one
+	nic_create(VNIC_MTU_DEFAULT);
+	assert_int_equal(vnic.nic->pool.slabs[NIC_POOL_CLASS_COUNT - 1].count, 0);
+	assert_true(vnic.nic->pool.slabs[0].count > small);
+	assert_null(nic_alloc(vnic.nic, 9000));
+
+	Packet* packet = nic_alloc(vnic.nic, 3000);
+	assert_non_null(packet);
+	nic_free(packet);
+	fixture_destroy(&vnic);
+
+	// Chained frames take jumbo buffers when they fit
+	uint64_t attrs[] = {
+		VNIC_FLAGS, NIC_F_CHAIN,
+		VNIC_NONE
+	};
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+	assert_int_equal(vnic.nic->pool.slabs[0].count, small);
+	fixture_destroy(&vnic);
+}
+
+static void pool_exhaust_func(void** state) {
+	nic_create(VNIC_MTU_DEFAULT);
+
+	size_t total = nic_pool_total(vnic.nic);
+
+	// Small packets take larger classes when the smallest one runs out
+	int count = 0;
+	while(count < MAX_PACKETS && (packets[count] = nic_alloc(vnic.nic, 64)))
+		count++;
+
+	assert_in_range(count, 1, MAX_PACKETS - 1);
+	assert_int_equal(nic_pool_used(vnic.nic), total);
+	assert_int_equal(nic_pool_free(vnic.nic), 0);
+	assert_null(vnic_alloc(&vnic, 64));
+
+	// Every buffer is handed out once
+	for(int i = 0; i < count; i++) {
+		memset(packets[i]->buffer, i & 0xff, packets[i]->size);
+	}
+	for(int i = 0; i < count; i++) {
+		assert_int_equal(packets[i]->buffer[0], i & 0xff);
+		assert_int_equal(packets[i]->buffer[packets[i]->size - 1], i & 0xff);
+	}
+
+	for(int i = 0; i < count; i++)
+		assert_true(vnic_free(&vnic, packets[i]));
+
+	assert_int_equal(nic_pool_used(vnic.nic), 0);
+
+	// And all of them come back
+	int count2 = 0;
+	while(count2 < MAX_PACKETS && (packets[count2] = vnic_alloc(&vnic, 64)))
+		count2++;
+	assert_int_equal(count2, count);
+
+	for(int i = 0; i < count2; i++)
+		assert_true(vnic_free(&vnic, packets[i]));
+
+	fixture_destroy(&vnic);
+}
+
+static void* mt_worker(void* arg) {
+	int id = (int)(uintptr_t)arg;
+	Packet* held[64];
+
+	for(int i = 0; i < COUNT / THREAD_NUM / 64; i++) {
+		for(int j = 0; j < 64; j++) {
+			while(!(held[j] = nic_alloc(vnic.nic, j % 4 ? 64 : 3000)))
+				sched_yield();
+			held[j]->start = id;
+			held[j]->end = j;
+		}
+
+		for(int j = 0; j < 64; j++) {
+			assert_int_equal(held[j]->start, id);
+			assert_int_equal(held[j]->end, j);
+			assert_true(nic_free(held[j]));
+		}
+	}
+
+	return NULL;
+}
+
+static void pool_mt_func(void** state) {
+	nic_create(VNIC_MTU_DEFAULT);
+
+	pthread_t threads[THREAD_NUM];
+	for(int i = 0; i < THREAD_NUM; i++)
+		pthread_create(&threads[i], NULL, mt_worker, (void*)(uintptr_t)i);
+
+	for(int i = 0; i < THREAD_NUM; i++)
+		pthread_join(threads[i], NULL);
+
+	assert_int_equal(nic_pool_used(vnic.nic), 0);
+
+	fixture_destroy(&vnic);
+}
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int thread_cpus[THREAD_NUM];
+static int thread_caches[THREAD_NUM];
+
+static void* cache_worker(void* arg) {
+	int id = (int)(uintptr_t)arg;
+
+	// The thread stays on its core, so the pool sees the core it is on
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(thread_cpus[id], &set);
+	assert_int_equal(pthread_setaffinity_np(pthread_self(), sizeof(set), &set), 0);
+
+	pthread_mutex_lock(&cache_mutex);
+
+	NICPoolCache* caches = (void*)vnic.nic + vnic.nic->pool.cache;
+	uint32_t before[NIC_POOL_CACHE_COUNT];
+	for(int i = 0; i < NIC_POOL_CACHE_COUNT; i++)
+		before[i] = caches[i].count[0];
+
+	// The cache the buffer came from is the only one whose count changed
+	Packet* packet = nic_alloc(vnic.nic, 64);
+	assert_non_null(packet);
+
+	thread_caches[id] = -1;
+	for(int i = 0; i < NIC_POOL_CACHE_COUNT; i++) {
+		if(caches[i].count[0] != before[i]) {
+			assert_int_equal(thread_caches[id], -1);
+			thread_caches[id] = i;
+		}
+	}
+	assert_true(nic_free(packet));
+
+	pthread_mutex_unlock(&cache_mutex);
+
+	return NULL;
+}
+
+static void pool_cache_func(void** state) {
+	nic_create(VNIC_MTU_DEFAULT);
+
+	// Threads go to different cores as far as there are cores
+	cpu_set_t set;
+	assert_int_equal(sched_getaffinity(0, sizeof(set), &set), 0);
+	int cpu = -1;
+	for(int i = 0; i < THREAD_NUM; i++) {
+		do {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		} while(!CPU_ISSET(cpu, &set));
+		thread_cpus[i] = cpu;
+	}
+
+	pthread_t threads[THREAD_NUM];
+	for(int i = 0; i < THREAD_NUM; i++)
+		pthread_create(&threads[i], NULL, cache_worker, (void*)(uintptr_t)i);
+
+	for(int i = 0; i < THREAD_NUM; i++)
+		pthread_join(threads[i], NULL);
+
+	// Each thread uses the cache of the core it runs on, not the first one's
+	for(int i = 0; i < THREAD_NUM; i++) {
+		assert_int_equal(thread_caches[i], thread_cpus[i] % NIC_POOL_CACHE_COUNT);
+		for(int j = 0; j < i; j++) {
+			if(thread_cpus[i] % NIC_POOL_CACHE_COUNT != thread_cpus[j] % NIC_POOL_CACHE_COUNT)
+				assert_int_not_equal(thread_caches[i], thread_caches[j]);
+		}
+	}
+	printf("\t%d cores for %d threads\n", CPU_COUNT(&set) < THREAD_NUM ? CPU_COUNT(&set) : THREAD_NUM, THREAD_NUM);
+
+	fixture_destroy(&vnic);
+}
+
+/*
+ * The pool as it was before size classes: one byte per 64 bytes chunk and a
+ * linear scan from the last allocated position under a single lock
+ */
+typedef struct {
+	uint8_t*	bitmap;
+	uint32_t	count;
+	void*		pool;
+	uint32_t	index;
+	uint32_t	used;
+	volatile uint8_t lock;
+} BitmapPool;
+
+static BitmapPool bitmap_pool;
+
+static void bitmap_init(BitmapPool* pool, void* base, size_t size) {
+	// Same header as the NIC so both pools have the same space for packets
+	uint32_t index = vnic.nic->pool.cache;
+	pool->bitmap = base + index;
+	pool->count = (size - index) / NIC_CHUNK_SIZE;
+	index = ROUNDUP(index + pool->count, NIC_CHUNK_SIZE);
+	pool->count = (size - index) / NIC_CHUNK_SIZE;
+	pool->pool = base + index;
+	pool->index = 0;
+	pool->used = 0;
+	pool->lock = 0;
+	memset(pool->bitmap, 0, pool->count);
+}
+
+static Packet* bitmap_alloc(BitmapPool* pool, uint16_t size) {
+	uint8_t* bitmap = pool->bitmap;
+	uint32_t count = pool->count;
+
+	uint32_t size2 = sizeof(Packet) + 32 + size + 32;
+	uint8_t req = (ROUNDUP(size2, NIC_CHUNK_SIZE)) / NIC_CHUNK_SIZE;
+
+	lock_lock(&pool->lock);
+	uint32_t index = pool->index;
+
+	uint32_t idx = 0;
+	for(idx = index; idx <= count - req; idx++) {
+		for(uint32_t j = 0; j < req; j++) {
+			if(bitmap[idx + j] != 0) {
+				idx += j + bitmap[idx + j] - 1;
+				goto next;
+			}
+		}
+
+		goto found;
+next:
+		;
+	}
+
+	for(idx = 0; idx + req <= index; idx++) {
+		for(uint32_t j = 0; j < req; j++) {
+			if(bitmap[idx + j] != 0) {
+				idx += j + bitmap[idx + j] - 1;
+				goto next2;
+			}
+		}
+
+		goto found;
+next2:
+		;
+	}
+
+	lock_unlock(&pool->lock);
+	return NULL;
+
+found:
+	pool->index = idx + req;
+	for(uint32_t k = 0; k < req; k++)
+		bitmap[idx + k] = req - k;
+
+	pool->used += req;
+	lock_unlock(&pool->lock);
+
+	Packet* packet = pool->pool + (idx * NIC_CHUNK_SIZE);
+	packet->time = 0;
+	packet->start = 0;
+	packet->end = 0;
+	packet->size = (req * NIC_CHUNK_SIZE) - sizeof(Packet);
+
+	return packet;
+}
+
+static void bitmap_free(BitmapPool* pool, Packet* packet) {
+	uint32_t idx = ((uintptr_t)packet - (uintptr_t)pool->pool) / NIC_CHUNK_SIZE;
+	uint8_t req = pool->bitmap[idx];
+	for(uint32_t i = 0; i < req; i++)
+		pool->bitmap[idx + i] = 0;
+
+	lock_lock(&pool->lock);
+	pool->used -= req;
+	lock_unlock(&pool->lock);
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Mostly small packets with some full sized ones, like ordinary traffic
+static uint16_t packet_size(unsigned int* seed) {
+	int r = rand_r(seed) % 10;
+	return r < 6 ? 64 + rand_r(seed) % 64 : r < 8 ? 512 : 1500;
+}
+
+#define WORKING_SET	256
+
+// Share of the pool holding payload the packets asked for
+static double payload_usage(int count, size_t total) {
+	size_t payload = 0;
+	for(int i = 0; i < count; i++)
+		payload += sizes[i];
+
+	return (double)payload / total;
+}
+
+static void pool_deferred_func(void** state) {
+	nic_create(1500);
+
+	Packet* ps[NIC_POOL_DEFERRED_SIZE + 2];
+	for(int i = 0; i < NIC_POOL_DEFERRED_SIZE + 2; i++) {
+		ps[i] = vnic_alloc(&vnic, 64);
+		assert_non_null(ps[i]);
+	}
+
+	// The VM holds the free list and every cache
+	NICPoolCache* caches = (void*)vnic.nic + vnic.nic->pool.cache;
+	for(int i = 0; i < NIC_POOL_CACHE_COUNT; i++)
+		caches[i].lock = 1;
+	vnic.nic->pool.slabs[0].lock = 1;
+
+	for(int i = 0; i < NIC_POOL_DEFERRED_SIZE; i++)
+		assert_true(vnic_free(&vnic, ps[i]));
+	assert_int_equal(vnic.pool.deferred_count, NIC_POOL_DEFERRED_SIZE);
+	assert_int_equal(nic_pool_used(vnic.nic), 2048 * (NIC_POOL_DEFERRED_SIZE + 2));
+
+	// One more is lost rather than waited for
+	assert_false(vnic_free(&vnic, ps[NIC_POOL_DEFERRED_SIZE]));
+
+	// The deferred ones go back with the next free once the VM lets go
+	for(int i = 0; i < NIC_POOL_CACHE_COUNT; i++)
+		caches[i].lock = 0;
+	vnic.nic->pool.slabs[0].lock = 0;
+
+	assert_true(vnic_free(&vnic, ps[NIC_POOL_DEFERRED_SIZE + 1]));
+	assert_int_equal(vnic.pool.deferred_count, 0);
+	assert_int_equal(nic_pool_used(vnic.nic), 2048);
+
+	assert_true(nic_free(ps[NIC_POOL_DEFERRED_SIZE]));
+
+	fixture_destroy(&vnic);
+}
+
+static void pool_benchmark_func(void** state) {
+	nic_create(VNIC_MTU_DEFAULT);
+
+	void* base;
+	assert_int_equal(posix_memalign(&base, POOL_SIZE, POOL_SIZE), 0);
+	bitmap_init(&bitmap_pool, base, POOL_SIZE);
+
+	// Alloc/free rate: keep a working set and replace a random packet each time
+	unsigned int seed = 1;
+	for(int i = 0; i < WORKING_SET; i++)
+		assert_non_null(packets[i] = bitmap_alloc(&bitmap_pool, (sizes[i] = packet_size(&seed))));
+
+	double start = now();
+	for(int i = 0; i < COUNT; i++) {
+		int j = rand_r(&seed) % WORKING_SET;
+		bitmap_free(&bitmap_pool, packets[j]);
+		assert_non_null(packets[j] = bitmap_alloc(&bitmap_pool, (sizes[j] = packet_size(&seed))));
+	}
+	double bitmap_time = now() - start;
+
+	// Fragmentation: fill the rest of the pool with full sized packets
+	int bitmap_count = WORKING_SET;
+	while(bitmap_count < MAX_PACKETS && (packets[bitmap_count] = bitmap_alloc(&bitmap_pool, sizes[bitmap_count] = 1500)))
+		bitmap_count++;
+	double bitmap_usage = payload_usage(bitmap_count, (size_t)bitmap_pool.count * NIC_CHUNK_SIZE);
+
+	seed = 1;
+	for(int i = 0; i < WORKING_SET; i++)
+		assert_non_null(packets[i] = nic_alloc(vnic.nic, (sizes[i] = packet_size(&seed))));
+
+	start = now();
+	for(int i = 0; i < COUNT; i++) {
+		int j = rand_r(&seed) % WORKING_SET;
+		nic_free(packets[j]);
+		assert_non_null(packets[j] = nic_alloc(vnic.nic, (sizes[j] = packet_size(&seed))));
+	}
+	double slab_time = now() - start;
+
+	int slab_count = WORKING_SET;
+	while(slab_count < MAX_PACKETS && (packets[slab_count] = nic_alloc(vnic.nic, sizes[slab_count] = 1500)))
+		slab_count++;
+	double slab_usage = payload_usage(slab_count, nic_pool_total(vnic.nic));
+
+	printf("\tbitmap: %.2f M alloc+free/s, %d packets fit, payload %.0f%% of pool\n",
+			COUNT / bitmap_time / 1e6, bitmap_count, bitmap_usage * 100);
+	printf("\tslab:   %.2f M alloc+free/s, %d packets fit, payload %.0f%% of pool\n",
+			COUNT / slab_time / 1e6, slab_count, slab_usage * 100);
+
+	for(int i = 0; i < slab_count; i++)
+		nic_free(packets[i]);
+
+	free(base);
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(pool_class_func),
+		cmocka_unit_test(pool_jumbo_func),
+		cmocka_unit_test(pool_exhaust_func),
+		cmocka_unit_test(pool_mt_func),
+		cmocka_unit_test(pool_cache_func),
+		cmocka_unit_test(pool_deferred_func),
+		cmocka_unit_test(pool_benchmark_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
@@ -0,0 +1,332 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <lock.h>
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x200000
+#define QUEUE_SIZE	FIXTURE_QUEUE_SIZE
+#define PACKET_NUM	256		// More than QUEUE_SIZE so that a packet is never queued twice
+#define COUNT		200000
+#define PRODUCER_NUM	4
+
+static VNIC vnic;
+static Packet* packets[PACKET_NUM];
+
+static void nic_create(uint32_t rx_flags) {
+	uint64_t attrs[] = {
+		VNIC_RX_QUEUE_FLAGS, rx_flags,
+		VNIC_NONE
+	};
+
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+
+	for(int i = 0; i < PACKET_NUM; i++) {
+		packets[i] = nic_alloc(vnic.nic, 64);
+		assert_non_null(packets[i]);
+	}
+}
+
+// Every test leaves the queues empty
+static void nic_destroy() {
+	for(int i = 0; i < PACKET_NUM; i++)
+		assert_true(nic_free(packets[i]));
+
+	fixture_destroy(&vnic);
+}
+
+static int packet_index(Packet* packet) {
+	for(int i = 0; i < PACKET_NUM; i++) {
+		if(packets[i] == packet)
+			return i;
+	}
+
+	return -1;
+}
+
+static void* spsc_producer(void* arg) {
+	for(int i = 0; i < COUNT; i++) {
+		while(!queue_push(vnic.nic, &vnic.nic->rxq[0], packets[i % PACKET_NUM]))
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void queue_full_func(void** state) {
+	nic_create(0);
+
+	assert_true(queue_empty(&vnic.nic->rxq[0]));
+	assert_null(nic_rx(vnic.nic));
+
+	int count = 0;
+	while(queue_push(vnic.nic, &vnic.nic->rxq[0], packets[count]))
+		count++;
+
+	// One slot is always left empty to tell full from empty
+	assert_int_equal(count, QUEUE_SIZE - 1);
+	assert_int_equal(queue_size(&vnic.nic->rxq[0]), QUEUE_SIZE - 1);
+	assert_false(queue_available(&vnic.nic->rxq[0]));
+
+	for(int i = 0; i < count; i++)
+		assert_ptr_equal(nic_rx(vnic.nic), packets[i]);
+
+	assert_true(queue_empty(&vnic.nic->rxq[0]));
+	assert_null(nic_rx(vnic.nic));
+
+	nic_destroy();
+}
+
+static void queue_spsc_order_func(void** state) {
+	nic_create(0);
+
+	pthread_t producer;
+	pthread_create(&producer, NULL, spsc_producer, NULL);
+
+	for(int i = 0; i < COUNT; i++) {
+		Packet* packet;
+		while(!(packet = nic_rx(vnic.nic)))
+			sched_yield();
+
+		assert_ptr_equal(packet, packets[i % PACKET_NUM]);
+	}
+
+	pthread_join(producer, NULL);
+	assert_true(queue_empty(&vnic.nic->rxq[0]));
+
+	nic_destroy();
+}
+
+static void* mpsc_producer(void* arg) {
+	int id = (int)(uintptr_t)arg;
+	int per = PACKET_NUM / PRODUCER_NUM;
+
+	for(int i = 0; i < COUNT / PRODUCER_NUM; i++) {
+		while(!queue_push(vnic.nic, &vnic.nic->rxq[0], packets[id * per + i % per]))
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void queue_mpsc_order_func(void** state) {
+	nic_create(NIC_QUEUE_F_MP);
+
+	pthread_t producers[PRODUCER_NUM];
+	for(int i = 0; i < PRODUCER_NUM; i++)
+		pthread_create(&producers[i], NULL, mpsc_producer, (void*)(uintptr_t)i);
+
+	// Packets of each producer must arrive in the order they were pushed
+	int per = PACKET_NUM / PRODUCER_NUM;
+	int next[PRODUCER_NUM] = { 0, };
+	for(int i = 0; i < COUNT / PRODUCER_NUM * PRODUCER_NUM; i++) {
+		Packet* packet;
+		while(!(packet = nic_rx(vnic.nic)))
+			sched_yield();
+
+		int index = packet_index(packet);
+		assert_in_range(index, 0, PACKET_NUM - 1);
+
+		int id = index / per;
+		assert_int_equal(index % per, next[id] % per);
+		next[id]++;
+	}
+
+	for(int i = 0; i < PRODUCER_NUM; i++) {
+		pthread_join(producers[i], NULL);
+		assert_int_equal(next[i], COUNT / PRODUCER_NUM);
+	}
+
+	assert_true(queue_empty(&vnic.nic->rxq[0]));
+
+	nic_destroy();
+}
+
+static volatile int consumed;
+
+static void* mc_consumer(void* arg) {
+	while(__atomic_load_n(&consumed, __ATOMIC_RELAXED) < COUNT) {
+		if(nic_rx(vnic.nic))
+			__atomic_add_fetch(&consumed, 1, __ATOMIC_RELAXED);
+		else
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void queue_mc_func(void** state) {
+	nic_create(NIC_QUEUE_F_MC);
+	consumed = 0;
+
+	pthread_t consumers[2];
+	for(int i = 0; i < 2; i++)
+		pthread_create(&consumers[i], NULL, mc_consumer, NULL);
+
+	spsc_producer(NULL);
+
+	for(int i = 0; i < 2; i++)
+		pthread_join(consumers[i], NULL);
+
+	assert_int_equal(consumed, COUNT);
+	assert_true(queue_empty(&vnic.nic->rxq[0]));
+
+	nic_destroy();
+}
+
+static void queue_burst_func(void** state) {
+	nic_create(NIC_QUEUE_F_MP);
+
+	// A burst is cut at the free space of the queue
+	assert_int_equal(queue_push_burst(vnic.nic, &vnic.nic->rxq[0], packets, QUEUE_SIZE), QUEUE_SIZE - 1);
+	assert_int_equal(queue_push_burst(vnic.nic, &vnic.nic->rxq[0], packets, 1), 0);
+
+	Packet* burst[QUEUE_SIZE];
+	assert_int_equal(nic_rx_burst(vnic.nic, burst, 16), 16);
+	for(int i = 0; i < 16; i++)
+		assert_ptr_equal(burst[i], packets[i]);
+
+	// Peek does not pop until the packets are advanced over
+	assert_int_equal(queue_peek(vnic.nic, &vnic.nic->rxq[0], burst, 8), 8);
+	assert_ptr_equal(burst[0], packets[16]);
+	assert_int_equal(queue_size(&vnic.nic->rxq[0]), QUEUE_SIZE - 1 - 16);
+	queue_advance(vnic.nic, &vnic.nic->rxq[0], 8);
+	assert_int_equal(queue_size(&vnic.nic->rxq[0]), QUEUE_SIZE - 1 - 24);
+
+	assert_int_equal(nic_rx_burst(vnic.nic, burst, QUEUE_SIZE), QUEUE_SIZE - 1 - 24);
+	for(int i = 0; i < QUEUE_SIZE - 1 - 24; i++)
+		assert_ptr_equal(burst[i], packets[24 + i]);
+
+	assert_true(queue_empty(&vnic.nic->rxq[0]));
+	assert_int_equal(nic_rx_burst(vnic.nic, burst, QUEUE_SIZE), 0);
+
+	// Wrapping around the end of the ring
+	assert_int_equal(nic_tx_burst(vnic.nic, packets, 40), 40);
+	while(queue_pop(vnic.nic, &vnic.nic->txq[0]))
+		;
+	assert_int_equal(nic_tx_burst(vnic.nic, packets + 40, 40), 40);
+	assert_int_equal(queue_pop_burst(vnic.nic, &vnic.nic->txq[0], burst, QUEUE_SIZE), 40);
+	for(int i = 0; i < 40; i++)
+		assert_ptr_equal(burst[i], packets[40 + i]);
+
+	nic_destroy();
+}
+
+/*
+ * The queue as it was before it became lock-free: head and tail share one
+ * cache line and every push and pop takes a spinlock
+ */
+typedef struct {
+	uint32_t	base;
+	uint32_t	head;
+	uint32_t	tail;
+	uint32_t	size;
+	volatile uint8_t rlock;
+	volatile uint8_t wlock;
+} LockedQueue;
+
+static LockedQueue locked_queue;
+
+static bool locked_push(NIC* nic, LockedQueue* queue, Packet* packet) {
+	lock_lock(&queue->wlock);
+	uint64_t* array = (void*)nic + queue->base;
+	uint32_t next = (queue->tail + 1) % queue->size;
+	bool result = false;
+	if(queue->head != next) {
+		array[queue->tail] = ((uint64_t)nic->id << 32) | (uint64_t)(uint32_t)((uintptr_t)packet - (uintptr_t)nic);
+		queue->tail = next;
+		result = true;
+	}
+	lock_unlock(&queue->wlock);
+
+	return result;
+}
+
+static void* locked_pop(NIC* nic, LockedQueue* queue) {
+	lock_lock(&queue->rlock);
+	uint64_t* array = (void*)nic + queue->base;
+	void* packet = NULL;
+	if(queue->head != queue->tail) {
+		packet = (void*)nic + (uint32_t)array[queue->head];
+		array[queue->head] = 0;
+		queue->head = (queue->head + 1) % queue->size;
+	}
+	lock_unlock(&queue->rlock);
+
+	return packet;
+}
+
+static void* locked_producer(void* arg) {
+	for(int i = 0; i < COUNT; i++) {
+		while(!locked_push(vnic.nic, &locked_queue, packets[i % PACKET_NUM]))
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void queue_throughput_func(void** state) {
+	nic_create(0);
+
+	locked_queue.base = vnic.nic->txq[0].base;
+	locked_queue.size = vnic.nic->txq[0].size;
+
+	pthread_t producer;
+	double start = now();
+	pthread_create(&producer, NULL, locked_producer, NULL);
+	for(int i = 0; i < COUNT; i++) {
+		Packet* packet;
+		while(!(packet = locked_pop(vnic.nic, &locked_queue)))
+			sched_yield();
+		assert_ptr_equal(packet, packets[i % PACKET_NUM]);
+	}
+	pthread_join(producer, NULL);
+	double locked = now() - start;
+
+	start = now();
+	pthread_create(&producer, NULL, spsc_producer, NULL);
+	for(int i = 0; i < COUNT; i++) {
+		Packet* packet;
+		while(!(packet = nic_rx(vnic.nic)))
+			sched_yield();
+		assert_ptr_equal(packet, packets[i % PACKET_NUM]);
+	}
+	pthread_join(producer, NULL);
+	double lockfree = now() - start;
+
+	printf("\tlocked:    %.2f Mpps\n", COUNT / locked / 1e6);
+	printf("\tlock-free: %.2f Mpps\n", COUNT / lockfree / 1e6);
+
+	nic_destroy();
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(queue_full_func),
+		cmocka_unit_test(queue_spsc_order_func),
+		cmocka_unit_test(queue_mpsc_order_func),
+		cmocka_unit_test(queue_mc_func),
+		cmocka_unit_test(queue_burst_func),
+		cmocka_unit_test(queue_throughput_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
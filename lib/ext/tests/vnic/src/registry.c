@@ -0,0 +1,180 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define VNIC_NUM	4
+
+static VNIC vnics[VNIC_NUM];
+
+// The last VNIC spans two 2MB blocks
+static void nic_create(VNIC* vnic, uint32_t id, uint64_t pool_size) {
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334400 + id,
+		VNIC_MTU, 9000,
+		VNIC_NONE
+	};
+
+	fixture_create(vnic, id, pool_size, attrs);
+	assert_true(nic_register(vnic->nic));
+}
+
+static int setup(void** state) {
+	for(int i = 0; i < VNIC_NUM; i++)
+		nic_create(&vnics[i], 100 + i * 7, i == VNIC_NUM - 1 ? 0x400000 : 0x200000);
+
+	return 0;
+}
+
+static int teardown(void** state) {
+	for(int i = 0; i < VNIC_NUM; i++)
+		fixture_destroy(&vnics[i]);
+
+	return 0;
+}
+
+static void registry_lookup_func(void** state) {
+	assert_int_equal(nic_count(), VNIC_NUM);
+
+	for(int i = 0; i < VNIC_NUM; i++) {
+		NIC* nic = vnics[i].nic;
+		assert_ptr_equal(nic_get_by_id(vnics[i].id), nic);
+
+		Packet* packet = nic_alloc(nic, 64);
+		assert_non_null(packet);
+		assert_ptr_equal(nic_find_by_packet(packet), nic);
+		assert_true(nic_free(packet));
+	}
+
+	assert_null(nic_get_by_id(1));
+	assert_null(nic_get_by_id(NIC_MAX_ID));
+
+	// Jumbo buffers of the last VNIC are in its second block
+	NIC* nic = vnics[VNIC_NUM - 1].nic;
+	Packet* packet = nic_alloc(nic, 9000);
+	assert_non_null(packet);
+	assert_true((uintptr_t)packet - (uintptr_t)nic >= 0x200000);
+	assert_ptr_equal(nic_find_by_packet(packet), nic);
+	assert_true(nic_free(packet));
+}
+
+static void registry_cross_func(void** state) {
+	// Every VNIC sends one packet of its own to every other VNIC
+	for(int i = 0; i < VNIC_NUM; i++) {
+		for(int j = 0; j < VNIC_NUM; j++) {
+			if(i == j)
+				continue;
+
+			Packet* packet = nic_alloc(vnics[i].nic, 64);
+			assert_non_null(packet);
+			packet->end = i;
+			assert_true(queue_push(vnics[j].nic, &vnics[j].nic->rxq[0], packet));
+		}
+	}
+
+	// Receivers see the packets in the pools of the senders
+	for(int j = 0; j < VNIC_NUM; j++) {
+		for(int i = 0; i < VNIC_NUM; i++) {
+			if(i == j)
+				continue;
+
+			Packet* packet = nic_rx(vnics[j].nic);
+			assert_non_null(packet);
+			assert_int_equal(packet->end, i);
+			assert_ptr_equal(nic_find_by_packet(packet), vnics[i].nic);
+			assert_true(nic_free(packet));
+		}
+
+		assert_null(nic_rx(vnics[j].nic));
+	}
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		assert_int_equal(nic_pool_used(vnics[i].nic), 0);
+}
+
+static void registry_unregister_func(void** state) {
+	// A packet queued to another VNIC outlives the VNIC it came from
+	Packet* packet = nic_alloc(vnics[0].nic, 64);
+	assert_non_null(packet);
+	assert_true(queue_push(vnics[1].nic, &vnics[1].nic->rxq[0], packet));
+
+	Packet* packet2 = nic_alloc(vnics[2].nic, 64);
+	assert_non_null(packet2);
+	assert_true(queue_push(vnics[1].nic, &vnics[1].nic->rxq[0], packet2));
+
+	nic_unregister(vnics[0].nic);
+	assert_int_equal(nic_count(), VNIC_NUM - 1);
+	assert_null(nic_get_by_id(vnics[0].id));
+
+	// The rest are still found after the registry is rebuilt
+	for(int i = 1; i < VNIC_NUM; i++)
+		assert_ptr_equal(nic_get_by_id(vnics[i].id), vnics[i].nic);
+
+	assert_ptr_equal(nic_rx(vnics[1].nic), packet2);
+	assert_null(nic_rx(vnics[1].nic));
+	assert_true(nic_free(packet2));
+
+	assert_true(nic_register(vnics[0].nic));
+	assert_ptr_equal(nic_get_by_id(vnics[0].id), vnics[0].nic);
+	assert_true(nic_free(packet));
+}
+
+static void registry_rebuild_func(void** state) {
+	// Applications get __nics written by the kernel, which bumps the generation
+	extern NIC* __nics[NIC_MAX_COUNT];
+	extern int __nic_count;
+	extern uint32_t __nic_generation;
+
+	int count = __nic_count;
+	__nic_count = 0;
+	__nic_generation++;
+	assert_null(nic_get_by_id(vnics[1].id));
+
+	__nic_count = count;
+	__nic_generation++;
+	for(int i = 0; i < VNIC_NUM; i++) {
+		assert_ptr_equal(nic_get_by_id(vnics[i].id), vnics[i].nic);
+		assert_ptr_equal(__nics[i], nic_get_by_id(__nics[i]->id));
+	}
+
+	// A NIC replaced in place leaves the count as it is
+	VNIC vnic;
+	fixture_create(&vnic, 200, 0x200000, NULL);
+
+	NIC* nic = __nics[0];
+	__nics[0] = vnic.nic;
+	__nic_generation++;
+	assert_ptr_equal(nic_get_by_id(200), vnic.nic);
+	assert_null(nic_get_by_id(nic->id));
+
+	Packet* packet = nic_alloc(vnic.nic, 64);
+	assert_non_null(packet);
+	assert_ptr_equal(nic_find_by_packet(packet), vnic.nic);
+	assert_true(nic_free(packet));
+
+	__nics[0] = nic;
+	__nic_generation++;
+	assert_null(nic_get_by_id(200));
+	assert_ptr_equal(nic_get_by_id(nic->id), nic);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(registry_lookup_func),
+		cmocka_unit_test(registry_cross_func),
+		cmocka_unit_test(registry_unregister_func),
+		cmocka_unit_test(registry_rebuild_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, setup, teardown);
+}
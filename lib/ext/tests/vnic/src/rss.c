@@ -0,0 +1,261 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	1024
+#define QUEUE_COUNT	4
+#define FLOW_NUM	64
+#define FRAME_SIZE	64
+
+static VNIC vnic;
+
+// Statistics summed over the cores
+static NICStats snapshot(VNIC* vnic) {
+	NICStats stats;
+	vnic_stats(vnic, &stats);
+
+	return stats;
+}
+
+static bool nic_open(uint64_t flags, uint32_t queue_count) {
+	void* region;
+	assert_int_equal(posix_memalign(&region, 0x200000, POOL_SIZE), 0);
+
+	uint64_t attrs[] = {
+		VNIC_FLAGS, flags,
+		FIXTURE_QUEUE_SIZES(QUEUE_SIZE),
+		VNIC_QUEUE_COUNT, queue_count,
+		VNIC_NONE
+	};
+
+	if(fixture_init(&vnic, 0, region, POOL_SIZE, attrs))
+		return true;
+
+	free(region);
+	return false;
+}
+
+static void nic_create(uint32_t queue_count) {
+	assert_true(nic_open(NIC_F_MULTIQUEUE, queue_count));
+}
+
+static void put16(uint8_t* p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+// Ethernet + IPv4 + TCP/UDP ports; tests put the flow and the sequence number in the last bytes
+static void frame_ipv4(uint8_t* frame, uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport, uint8_t protocol) {
+	memset(frame, 0, FRAME_SIZE);
+	put16(frame + 12, 0x0800);
+	uint8_t* ip = frame + 14;
+	ip[0] = 0x45;
+	ip[9] = protocol;
+	put32(ip + 12, src);
+	put32(ip + 16, dst);
+	put16(ip + 20, sport);
+	put16(ip + 22, dport);
+}
+
+static void rss_hash_func(void** state) {
+	// Verification suite of Microsoft RSS
+	uint8_t frame[FRAME_SIZE + 4];
+	frame_ipv4(frame, 0x420995bb, 0xa18e6450, 2794, 1766, 6);
+	assert_int_equal(nic_rss_hash(frame, FRAME_SIZE), 0x51ccc178);
+	frame_ipv4(frame, 0x420995bb, 0xa18e6450, 2794, 1766, 1);
+	assert_int_equal(nic_rss_hash(frame, FRAME_SIZE), 0x323e8fc2);
+	frame_ipv4(frame, 0xc75c6f02, 0x41458c53, 14230, 4739, 17);
+	assert_int_equal(nic_rss_hash(frame, FRAME_SIZE), 0xc626b0ea);
+
+	// Fragments hash by addresses only
+	put16(frame + 14 + 6, 0x2000);
+	assert_int_equal(nic_rss_hash(frame, FRAME_SIZE), 0xd718262a);
+
+	// 802.1Q tag is skipped
+	frame_ipv4(frame, 0x420995bb, 0xa18e6450, 2794, 1766, 6);
+	memmove(frame + 16, frame + 12, FRAME_SIZE - 12);
+	put16(frame + 12, 0x8100);
+	assert_int_equal(nic_rss_hash(frame, FRAME_SIZE + 4), 0x51ccc178);
+
+	// IPv6: 3ffe:2501:200:1fff::7 -> 3ffe:2501:200:3::1
+	uint8_t frame6[14 + 40 + 8] = { 0, };
+	put16(frame6 + 12, 0x86dd);
+	uint8_t* ip6 = frame6 + 14;
+	ip6[6] = 6;
+	uint8_t src6[16] = { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff, [15] = 0x07 };
+	uint8_t dst6[16] = { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03, [15] = 0x01 };
+	memcpy(ip6 + 8, src6, 16);
+	memcpy(ip6 + 24, dst6, 16);
+	put16(ip6 + 40, 2794);
+	put16(ip6 + 42, 1766);
+	assert_int_equal(nic_rss_hash(frame6, sizeof(frame6)), 0x40207d3d);
+
+	// Frames which are not IP go to the first queue
+	put16(frame + 12, 0x0806);
+	assert_int_equal(nic_rss_hash(frame, FRAME_SIZE), 0);
+	assert_int_equal(nic_rss_hash(frame, 10), 0);
+}
+
+static void rss_affinity_func(void** state) {
+	nic_create(QUEUE_COUNT);
+	assert_int_equal(nic_queue_count(vnic.nic), QUEUE_COUNT);
+
+	uint32_t srcs[FLOW_NUM];
+	uint16_t ports[FLOW_NUM];
+	srand(1);
+	for(int i = 0; i < FLOW_NUM; i++) {
+		srcs[i] = rand();
+		ports[i] = rand();
+	}
+
+	// Frames of the flows are interleaved
+	uint8_t frame[FRAME_SIZE];
+	for(int seq = 0; seq < 8; seq++) {
+		for(int i = 0; i < FLOW_NUM; i++) {
+			frame_ipv4(frame, srcs[i], 0x0a000001, ports[i], 80, 6);
+			frame[FRAME_SIZE - 2] = i;
+			frame[FRAME_SIZE - 1] = seq;
+			assert_int_equal(vnic_rx_stage(&vnic, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_NOERROR);
+		}
+	}
+	vnic_rx_flush(&vnic);
+	assert_int_equal(snapshot(&vnic).rx.packets, FLOW_NUM * 8);
+
+	// Each flow is in one queue, the one its hash maps to, in order
+	int queues[FLOW_NUM];
+	int next[FLOW_NUM] = { 0, };
+	for(int i = 0; i < FLOW_NUM; i++)
+		queues[i] = -1;
+
+	for(int q = 0; q < QUEUE_COUNT; q++) {
+		Packet* packet;
+		while((packet = nic_rxq(vnic.nic, q))) {
+			uint8_t* data = packet->buffer + packet->start;
+			int flow = data[FRAME_SIZE - 2];
+			if(queues[flow] == -1)
+				queues[flow] = q;
+
+			assert_int_equal(queues[flow], q);
+			assert_int_equal(nic_rss_queue(vnic.nic, nic_rss_hash(data, FRAME_SIZE)), q);
+			assert_int_equal(data[FRAME_SIZE - 1], next[flow]++);
+			assert_true(nic_free(packet));
+		}
+	}
+
+	for(int i = 0; i < FLOW_NUM; i++)
+		assert_int_equal(next[i], 8);
+
+	assert_int_equal(nic_pool_used(vnic.nic), 0);
+
+	fixture_destroy(&vnic);
+}
+
+static void rss_uniformity_func(void** state) {
+	nic_create(QUEUE_COUNT);
+
+	// Distinct client flows to one server
+	const int count = 20000;
+	int hits[QUEUE_COUNT] = { 0, };
+	uint8_t frame[FRAME_SIZE];
+	srand(2);
+	for(int i = 0; i < count; i++) {
+		frame_ipv4(frame, 0xc0a80000 | (rand() & 0xffff), 0x0a000001, 1024 + rand() % 60000, 80, 6);
+		hits[nic_rss_queue(vnic.nic, nic_rss_hash(frame, FRAME_SIZE))]++;
+	}
+
+	// Chi-square with 3 degrees of freedom: 16.27 is p = 0.001
+	double expected = (double)count / QUEUE_COUNT;
+	double chi2 = 0;
+	for(int q = 0; q < QUEUE_COUNT; q++) {
+		printf("\tqueue %d: %d flows\n", q, hits[q]);
+		chi2 += (hits[q] - expected) * (hits[q] - expected) / expected;
+	}
+	printf("\tchi-square: %.2f\n", chi2);
+	assert_true(chi2 < 16.27);
+
+	fixture_destroy(&vnic);
+}
+
+static bool transmitter(Packet* packet, void* context) {
+	int* counts = context;
+	counts[packet->end]++;
+	nic_free(packet);
+
+	return true;
+}
+
+static void rss_tx_func(void** state) {
+	nic_create(QUEUE_COUNT);
+
+	// A backlogged queue doesn't starve the others
+	for(int q = 0; q < QUEUE_COUNT; q++) {
+		int n = q == 0 ? 200 : 10;
+		for(int i = 0; i < n; i++) {
+			Packet* packet = nic_alloc(vnic.nic, 64);
+			assert_non_null(packet);
+			packet->end = q;
+			assert_true(nic_txq(vnic.nic, q, packet));
+		}
+	}
+
+	assert_true(vnic_has_tx(&vnic));
+
+	int counts[QUEUE_COUNT] = { 0, };
+	uint32_t sent = 32;
+	assert_int_equal(vnic_tx_burst(&vnic, &sent, transmitter, counts), VNIC_ERROR_NOERROR);
+	assert_int_equal(sent, 32);
+	for(int q = 1; q < QUEUE_COUNT; q++)
+		assert_int_equal(counts[q], 8);
+
+	while(vnic_has_tx(&vnic)) {
+		sent = 32;
+		vnic_tx_burst(&vnic, &sent, transmitter, counts);
+	}
+
+	assert_int_equal(counts[0], 200);
+	for(int q = 1; q < QUEUE_COUNT; q++)
+		assert_int_equal(counts[q], 10);
+
+	assert_int_equal(nic_pool_used(vnic.nic), 0);
+
+	fixture_destroy(&vnic);
+}
+
+static void rss_single_func(void** state) {
+	// Without NIC_F_MULTIQUEUE there is one queue pair
+	assert_true(nic_open(0, QUEUE_COUNT));
+	assert_int_equal(nic_queue_count(vnic.nic), 1);
+	assert_int_equal(nic_rss_queue(vnic.nic, 0xffffffff), 0);
+	fixture_destroy(&vnic);
+
+	assert_false(nic_open(NIC_F_MULTIQUEUE, NIC_MAX_QUEUE_COUNT + 1));
+	assert_false(nic_open(NIC_F_MULTIQUEUE, 0));
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(rss_hash_func),
+		cmocka_unit_test(rss_affinity_func),
+		cmocka_unit_test(rss_uniformity_func),
+		cmocka_unit_test(rss_tx_func),
+		cmocka_unit_test(rss_single_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
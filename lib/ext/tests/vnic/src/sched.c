@@ -0,0 +1,216 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	256
+#define VNIC_NUM	4
+#define ROUNDS		2000
+
+static VNIC vnics[VNIC_NUM];
+static VNIC* targets[VNIC_NUM];
+static size_t sizes[VNIC_NUM] = { 64, 512, 1514, 9000 };	// Mixed frame sizes of the tenants
+static uint64_t bytes[VNIC_NUM];
+static int order[4096];
+static int order_count;
+
+static void nic_create(VNIC* vnic, uint32_t quantum, uint8_t priority) {
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334400 + (vnic - vnics),
+		FIXTURE_QUEUE_SIZES(QUEUE_SIZE),
+		VNIC_TX_QUANTUM, quantum,
+		VNIC_TX_PRIORITY, priority,
+		VNIC_MTU, 9000,
+		VNIC_NONE
+	};
+
+	fixture_create(vnic, 0, POOL_SIZE, attrs);
+}
+
+static void nic_destroy() {
+	for(int i = 0; i < VNIC_NUM; i++)
+		fixture_destroy(&vnics[i]);
+}
+
+// The VM of each VNIC keeps its tx queue full
+static void backlog(int i, int limit) {
+	int count = 0;
+	Packet* packet;
+	while(count++ < limit && queue_available(&vnics[i].nic->txq[0]) && (packet = nic_alloc(vnics[i].nic, sizes[i]))) {
+		packet->end = packet->start + sizes[i];
+		packet->buffer[packet->start] = i;
+		assert_true(nic_tx(vnics[i].nic, packet));
+	}
+}
+
+static bool transmitter(Packet* packet, void* context) {
+	int i = packet->buffer[packet->start];
+	bytes[i] += packet->end - packet->start;
+	if(order_count < sizeof(order) / sizeof(order[0]))
+		order[order_count++] = i;
+
+	nic_free(packet);
+
+	return true;
+}
+
+// Jain's fairness index of the bytes sent in proportion to the weights
+static double fairness(double* weights) {
+	double sum = 0, square = 0;
+	for(int i = 0; i < VNIC_NUM; i++) {
+		double x = bytes[i] / weights[i];
+		sum += x;
+		square += x * x;
+	}
+
+	return sum * sum / (VNIC_NUM * square);
+}
+
+static double simulate(bool drr) {
+	memset(bytes, 0, sizeof(bytes));
+	uint16_t round = 0;
+	for(int r = 0; r < ROUNDS; r++) {
+		for(int i = 0; i < VNIC_NUM; i++)
+			backlog(i, QUEUE_SIZE);
+
+		if(drr) {
+			vnic_tx_schedule(targets, VNIC_NUM, &round, NULL, transmitter, NULL);
+		} else {
+			// Round robin of a packet budget per VNIC
+			for(int i = 0; i < VNIC_NUM; i++) {
+				uint32_t count = vnics[i].budget;
+				vnic_tx_burst(&vnics[i], &count, transmitter, NULL);
+			}
+		}
+	}
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		assert_true(vnic_has_tx(&vnics[i]));
+
+	double weights[VNIC_NUM];
+	for(int i = 0; i < VNIC_NUM; i++)
+		weights[i] = vnics[i].tx_quantum;
+
+	return fairness(weights);
+}
+
+static void sched_fairness_func(void** state) {
+	for(int i = 0; i < VNIC_NUM; i++) {
+		nic_create(&vnics[i], 0, 0);
+		targets[i] = &vnics[i];
+	}
+	assert_int_equal(vnics[0].tx_quantum, VNIC_TX_QUANTUM_SIZE);
+
+	double rr = simulate(false);
+	printf("\tround robin: fairness %.4f\n", rr);
+
+	double drr = simulate(true);
+	printf("\tDRR: fairness %.4f\n", drr);
+	for(int i = 0; i < VNIC_NUM; i++)
+		printf("\t%4zu bytes frames: %lu bytes\n", sizes[i], bytes[i]);
+
+	assert_true(drr > 0.99);
+	assert_true(drr > rr);
+
+	nic_destroy();
+}
+
+static void sched_weight_func(void** state) {
+	// Quanta of 1:1:2:4 with the frame sizes mixed as before
+	uint32_t quanta[VNIC_NUM] = { 9216, 9216, 2 * 9216, 4 * 9216 };
+	for(int i = 0; i < VNIC_NUM; i++)
+		nic_create(&vnics[i], quanta[i], 0);
+
+	double drr = simulate(true);
+	printf("\tweighted DRR: fairness %.4f\n", drr);
+	assert_true(drr > 0.99);
+
+	nic_destroy();
+}
+
+static void sched_priority_func(void** state) {
+	// The VNIC of 64 bytes frames is latency sensitive
+	nic_create(&vnics[0], 0, 1);
+	for(int i = 1; i < VNIC_NUM; i++)
+		nic_create(&vnics[i], 0, 0);
+
+	uint16_t round = 0;
+	for(int r = 0; r < 100; r++) {
+		for(int i = 1; i < VNIC_NUM; i++)
+			backlog(i, QUEUE_SIZE);
+		backlog(0, 8);
+
+		// It goes first, whatever the round is
+		order_count = 0;
+		vnic_tx_schedule(targets, VNIC_NUM, &round, NULL, transmitter, NULL);
+		for(int j = 0; j < 8; j++)
+			assert_int_equal(order[j], 0);
+		assert_true(order[8] != 0);
+		assert_false(vnic_has_tx(&vnics[0]));
+	}
+
+	// Over its budget it has to wait for the next call
+	backlog(0, QUEUE_SIZE);
+	order_count = 0;
+	vnic_tx_schedule(targets, VNIC_NUM, &round, NULL, transmitter, NULL);
+	assert_int_equal(order[vnics[0].budget - 1], 0);
+	assert_true(order[vnics[0].budget] != 0);
+
+	nic_destroy();
+}
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static void sched_device_func(void** state) {
+	for(int i = 0; i < VNIC_NUM; i++)
+		nic_create(&vnics[i], 0, 0);
+
+	// A device in debt sends nothing and starts with the same VNIC next time
+	TokenBucket bucket;
+	token_bucket_init(&bucket, 1000000, 1000, 1500, 0, 0, NULL);
+	token_bucket_charge(&bucket, rdtsc(), 1000000, 1);
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		backlog(i, 4);
+
+	uint16_t round = 2;
+	assert_int_equal(vnic_tx_schedule(targets, VNIC_NUM, &round, &bucket, transmitter, NULL), 0);
+	assert_int_equal(round, 2);
+
+	// A quantum is one jumbo frame. VNICs left idle don't save their quantum up
+	assert_int_equal(vnic_tx_schedule(targets, VNIC_NUM, &round, NULL, transmitter, NULL), 3 * 4 + 1);
+	assert_int_equal(round, 3);
+	for(int i = 0; i < VNIC_NUM - 1; i++)
+		assert_int_equal(vnics[i].tx_deficit, 0);
+	assert_int_equal(vnics[VNIC_NUM - 1].tx_deficit, VNIC_TX_QUANTUM_SIZE - 9000);
+
+	nic_destroy();
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(sched_fairness_func),
+		cmocka_unit_test(sched_weight_func),
+		cmocka_unit_test(sched_priority_func),
+		cmocka_unit_test(sched_device_func),
+	};
+
+	for(int i = 0; i < VNIC_NUM; i++)
+		targets[i] = &vnics[i];
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
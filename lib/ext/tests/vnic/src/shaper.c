@@ -0,0 +1,272 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+#include <shaper.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fixture.h"
+
+#define FREQUENCY	1000000		// Simulated timer ticks in microseconds
+#define FRAME_SIZE	1500
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	1024
+#define TOLERANCE	0.01
+
+/*
+ * Offer frames of a bucket at the given rate for a simulated second
+ *
+ * @return number of bytes which conformed
+ */
+// Statistics summed over the cores
+static NICStats snapshot(VNIC* vnic) {
+	NICStats stats;
+	vnic_stats(vnic, &stats);
+
+	return stats;
+}
+
+static uint64_t offer(TokenBucket** buckets, int count, uint64_t* rates, uint64_t* bytes) {
+	uint64_t next[count];
+	memset(next, 0, sizeof(next));
+	memset(bytes, 0, sizeof(uint64_t) * count);
+
+	uint64_t total = 0;
+	for(uint64_t t = 0; t < FREQUENCY; t++) {
+		for(int i = 0; i < count; i++) {
+			if(next[i] > t)
+				continue;
+
+			next[i] += (uint64_t)FREQUENCY * FRAME_SIZE * 8 / rates[i];
+			if(token_bucket_consume(buckets[i], t, FRAME_SIZE, 1)) {
+				bytes[i] += FRAME_SIZE;
+				total += FRAME_SIZE;
+			}
+		}
+	}
+
+	return total;
+}
+
+static void assert_rate(uint64_t bytes, uint64_t rate, uint64_t burst) {
+	double achieved = (double)(bytes - burst) * 8;
+	printf("\t%.2f Mbps of %.2f Mbps\n", achieved / 1000000, (double)rate / 1000000);
+	assert_true(achieved > rate * (1 - TOLERANCE));
+	assert_true(achieved < rate * (1 + TOLERANCE));
+}
+
+static void shaper_rate_func(void** state) {
+	// Twice the rate is offered
+	TokenBucket bucket;
+	token_bucket_init(&bucket, FREQUENCY, 100000000, 65536, 0, 0, NULL);
+
+	TokenBucket* buckets[] = { &bucket };
+	uint64_t rates[] = { 200000000 };
+	uint64_t bytes[1];
+	assert_rate(offer(buckets, 1, rates, bytes), 100000000, 65536);
+
+	// Less than the rate passes as it is
+	token_bucket_init(&bucket, FREQUENCY, 100000000, 65536, 0, 0, NULL);
+	rates[0] = 50000000;
+	assert_int_equal(offer(buckets, 1, rates, bytes), 50000000 / 8 / FRAME_SIZE * FRAME_SIZE + FRAME_SIZE);
+}
+
+static void shaper_packet_rate_func(void** state) {
+	// 100 Kpps of 1500 bytes are 1.2 Gbps
+	TokenBucket bucket;
+	token_bucket_init(&bucket, FREQUENCY, 10000000000L, 0, 100000, 64, NULL);
+
+	TokenBucket* buckets[] = { &bucket };
+	uint64_t rates[] = { 5000000000L };
+	uint64_t bytes[1];
+	uint64_t packets = offer(buckets, 1, rates, bytes) / FRAME_SIZE;
+	printf("\t%lu packets of 100000 pps\n", packets - 64);
+	assert_true(packets - 64 > 100000 * (1 - TOLERANCE));
+	assert_true(packets - 64 < 100000 * (1 + TOLERANCE));
+}
+
+static void shaper_burst_func(void** state) {
+	TokenBucket bucket;
+	token_bucket_init(&bucket, FREQUENCY, 8000000, 15000, 0, 0, NULL);
+
+	// A full bucket passes its burst at once and one frame in debt
+	int count = 0;
+	while(token_bucket_consume(&bucket, 0, FRAME_SIZE, 1))
+		count++;
+	assert_int_equal(count, 15000 / FRAME_SIZE + 1);
+
+	// The debt is paid back first: 1500 bytes at 1 MB/s take 1.5 ms
+	assert_false(token_bucket_conform(&bucket, 1499));
+	assert_true(token_bucket_conform(&bucket, 1500));
+
+	// Idle time doesn't add more than the burst
+	count = 0;
+	while(token_bucket_consume(&bucket, 100 * FREQUENCY, FRAME_SIZE, 1))
+		count++;
+	assert_int_equal(count, 15000 / FRAME_SIZE + 1);
+}
+
+static void shaper_hierarchy_func(void** state) {
+	// Two VNICs of 60 Mbps in a VM of 100 Mbps on a device of 1 Gbps
+	TokenBucket device, vm, vnic1, vnic2, vnic3;
+	token_bucket_init(&device, FREQUENCY, 1000000000, 65536, 0, 0, NULL);
+	token_bucket_init(&vm, FREQUENCY, 100000000, 65536, 0, 0, &device);
+	token_bucket_init(&vnic1, FREQUENCY, 60000000, 65536, 0, 0, &vm);
+	token_bucket_init(&vnic2, FREQUENCY, 60000000, 65536, 0, 0, &vm);
+
+	TokenBucket* buckets[] = { &vnic1, &vnic2 };
+	uint64_t rates[] = { 200000000, 200000000 };
+	uint64_t bytes[2];
+	assert_rate(offer(buckets, 2, rates, bytes), 100000000, 65536);
+
+	// Neither VNIC goes over its own limit in the share of the VM
+	for(int i = 0; i < 2; i++)
+		assert_true((bytes[i] - 65536) * 8 < 60000000 * (1 + TOLERANCE));
+
+	// A VNIC alone is held to its own limit
+	token_bucket_init(&device, FREQUENCY, 1000000000, 65536, 0, 0, NULL);
+	token_bucket_init(&vm, FREQUENCY, 100000000, 65536, 0, 0, &device);
+	token_bucket_init(&vnic3, FREQUENCY, 60000000, 65536, 0, 0, &vm);
+	TokenBucket* buckets2[] = { &vnic3 };
+	assert_rate(offer(buckets2, 1, rates, bytes), 60000000, 65536);
+}
+
+#define CHARGE_COUNT	1000000
+
+static pthread_barrier_t charge_start;
+
+static void* charger(void* arg) {
+	pthread_barrier_wait(&charge_start);
+
+	// The time stands still, so no tokens are added
+	for(int i = 0; i < CHARGE_COUNT; i++)
+		token_bucket_charge(arg, 1, 1, 1);
+
+	return NULL;
+}
+
+static void shaper_mt_func(void** state) {
+	// Two VNICs charge the bucket of their VM from cores of their own
+	TokenBucket vm, vnics[2];
+	token_bucket_init(&vm, FREQUENCY, 1000000000, 65536, 1000000, 32, NULL);
+	for(int i = 0; i < 2; i++)
+		token_bucket_init(&vnics[i], FREQUENCY, 1000000000, 65536, 1000000, 32, &vm);
+	token_bucket_charge(&vm, 1, 0, 0);
+
+	pthread_t threads[2];
+	pthread_barrier_init(&charge_start, NULL, 2);
+	for(int i = 0; i < 2; i++)
+		pthread_create(&threads[i], NULL, charger, &vnics[i]);
+	for(int i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&charge_start);
+
+	// No charge is lost
+	assert_int_equal(vm.packet_tokens, (32 - 2 * (int64_t)CHARGE_COUNT) * FREQUENCY);
+	assert_int_equal(vm.tokens, (65536 - 2 * (int64_t)CHARGE_COUNT) * 8 * FREQUENCY);
+}
+
+static void shaper_unlimited_func(void** state) {
+	TokenBucket bucket;
+	token_bucket_init(&bucket, FREQUENCY, 0, 0, 0, 0, NULL);
+	for(int i = 0; i < 100000; i++)
+		assert_true(token_bucket_consume(&bucket, 0, FRAME_SIZE, 1));
+
+	// Without a timer limits are off
+	token_bucket_init(&bucket, 0, 1000, 0, 10, 0, NULL);
+	for(int i = 0; i < 100000; i++)
+		assert_true(token_bucket_consume(&bucket, i, FRAME_SIZE, 1));
+}
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t tsc_frequency() {
+	double t0 = now();
+	uint64_t c0 = rdtsc();
+	while(now() - t0 < 0.1);
+
+	return (rdtsc() - c0) / (now() - t0);
+}
+
+static bool transmitter(Packet* packet, void* context) {
+	*(uint64_t*)context += packet->end - packet->start;
+	nic_free(packet);
+
+	return true;
+}
+
+static void shaper_vnic_tx_func(void** state) {
+	vnic__init_timer(tsc_frequency());
+
+	VNIC vnic;
+	uint64_t attrs[] = {
+		VNIC_TX_BANDWIDTH, 200000000L,
+		VNIC_TX_BURST, 15000,
+		FIXTURE_QUEUE_SIZES(QUEUE_SIZE),
+		VNIC_NONE
+	};
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+
+	// The VM limits the VNIC to less than its own rate
+	TokenBucket vm;
+	token_bucket_init(&vm, vnic.tx_bucket.frequency, 100000000L, 15000, 0, 0, NULL);
+	vnic.tx_bucket.parent = &vm;
+
+	// The VM keeps the tx queue full for half a second
+	uint64_t bytes = 0;
+	double t0 = now();
+	while(now() - t0 < 0.5) {
+		Packet* packet;
+		while(queue_available(&vnic.nic->txq[0]) && (packet = nic_alloc(vnic.nic, FRAME_SIZE))) {
+			packet->end = packet->start + FRAME_SIZE;
+			assert_true(nic_tx(vnic.nic, packet));
+		}
+
+		uint32_t count = vnic.budget;
+		vnic_tx_burst(&vnic, &count, transmitter, &bytes);
+	}
+	double elapsed = now() - t0;
+
+	assert_int_equal(snapshot(&vnic).tx.bytes, bytes);
+	assert_int_equal(snapshot(&vnic).tx.drop_packets, 0);
+
+	// Bursts of the VNIC and the VM
+	double achieved = (bytes - 30000) * 8 / elapsed;
+	printf("\t%.2f Mbps of 100 Mbps\n", achieved / 1000000);
+	assert_true(achieved > 100000000 * 0.95);
+	assert_true(achieved < 100000000 * 1.05);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(shaper_rate_func),
+		cmocka_unit_test(shaper_packet_rate_func),
+		cmocka_unit_test(shaper_burst_func),
+		cmocka_unit_test(shaper_hierarchy_func),
+		cmocka_unit_test(shaper_mt_func),
+		cmocka_unit_test(shaper_unlimited_func),
+		cmocka_unit_test(shaper_vnic_tx_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
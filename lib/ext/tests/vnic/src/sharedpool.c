@@ -0,0 +1,213 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define SHARER_SIZE	0x200000
+#define FRAME_SIZE	128
+#define QUOTA		(32 * 2048)
+
+static VNIC holder;
+static VNIC sharer;
+
+static void nic_create(VNIC* vnic, uint32_t id, uint32_t size, VNIC* shared, uint64_t quota) {
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334455 + id,
+		VNIC_FLAGS, shared ? NIC_F_SHARED_POOL : 0,
+		VNIC_POOL_SHARED, (uint64_t)shared,
+		VNIC_POOL_QUOTA, quota,
+		VNIC_MTU, 9000,		// Chains are linearized into jumbo buffers
+		VNIC_RX_BANDWIDTH, 0,
+		VNIC_TX_BANDWIDTH, 0,
+		VNIC_NONE
+	};
+
+	fixture_create(vnic, id, size, attrs);
+	assert_true(nic_register(vnic->nic));
+}
+
+// The sharer goes first; the holder outlives it
+static void nic_destroy() {
+	fixture_destroy(&sharer);
+	fixture_destroy(&holder);
+}
+
+static void setup(uint64_t quota) {
+	nic_create(&holder, 1, POOL_SIZE, NULL, 0);
+	nic_create(&sharer, 2, SHARER_SIZE, &holder, quota);
+}
+
+static uint8_t frame[FRAME_SIZE];
+static Packet* sent;
+
+static bool transmitter(Packet* packet, void* context) {
+	sent = packet;
+	assert_int_equal(packet->end - packet->start, *(uint32_t*)context);
+	assert_memory_equal(packet->buffer + packet->start, frame, packet->end - packet->start);
+	nic_free(packet);
+
+	return true;
+}
+
+// A packet received on one VNIC is sent on the other by the VM
+static void forward(VNIC* from, VNIC* to) {
+	assert_int_equal(vnic_rx(from, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_NOERROR);
+
+	Packet* packet = nic_rx(from->nic);
+	assert_non_null(packet);
+	assert_ptr_equal(nic_find_by_packet(packet), holder.nic);
+	assert_true(nic_tx(to->nic, packet));
+
+	uint32_t size = FRAME_SIZE;
+	uint32_t count = 32;
+	sent = NULL;
+	assert_int_equal(vnic_tx_burst(to, &count, transmitter, &size), VNIC_ERROR_NOERROR);
+	assert_int_equal(count, 1);
+
+	// The transmitter got the very buffer the frame was received into
+	assert_ptr_equal(sent, packet);
+}
+
+static void sharedpool_init_func(void** state) {
+	setup(0);
+
+	// Both allocate from the memory of the holder
+	assert_ptr_equal(nic_pool_nic(sharer.nic), holder.nic);
+	assert_ptr_equal(sharer.pool_nic, holder.nic);
+	assert_int_equal(nic_pool_total(sharer.nic), nic_pool_total(holder.nic));
+
+	Packet* packet = nic_alloc(sharer.nic, FRAME_SIZE);
+	assert_ptr_equal(nic_find_by_packet(packet), holder.nic);
+	assert_int_equal(nic_pool_used(holder.nic), nic_pool_used(sharer.nic));
+	assert_true(nic_pool_used(holder.nic) > 0);
+	assert_true(vnic_free(&holder, packet));
+
+	// Only the holder's pool is shared, and not with a NIC of the same ID
+	VNIC vnic;
+	void* region;
+	assert_int_equal(posix_memalign(&region, 0x200000, SHARER_SIZE), 0);
+	uint64_t attrs[] = {
+		VNIC_POOL_SHARED, (uint64_t)&sharer,
+		VNIC_NONE
+	};
+	assert_false(fixture_init(&vnic, 3, region, SHARER_SIZE, attrs));
+	attrs[1] = (uint64_t)&holder;
+	assert_false(fixture_init(&vnic, holder.id, region, SHARER_SIZE, attrs));
+	free(region);
+
+	nic_destroy();
+}
+
+static void sharedpool_forward_func(void** state) {
+	setup(QUOTA);
+	for(int i = 0; i < FRAME_SIZE; i++)
+		frame[i] = i * 7;
+
+	// Either way without a copy
+	forward(&holder, &sharer);
+	forward(&sharer, &holder);
+
+	NICStats stats;
+	vnic_stats(&sharer, &stats);
+	assert_int_equal(stats.tx.packets, 1);
+	assert_int_equal(stats.tx.drop_packets, 0);
+	vnic_stats(&holder, &stats);
+	assert_int_equal(stats.tx.packets, 1);
+	assert_int_equal(stats.tx.drop_packets, 0);
+
+	nic_destroy();
+}
+
+static bool chain_transmitter(Packet* packet, void* context) {
+	*(uint32_t*)context = packet->end - packet->start;
+	nic_free(packet);
+
+	return true;
+}
+
+static void sharedpool_chain_func(void** state) {
+	setup(QUOTA);
+
+	// A chain the sharer built is of the same pool, so the holder follows it
+	Packet* chain = nic_pool_get_chain(nic_pool_nic(sharer.nic), &sharer.nic->pool, 6000, 0, 0, true);
+	assert_non_null(chain);
+	assert_int_not_equal(chain->next, 0);
+	assert_int_equal(nic_packet_length(sharer.nic, chain), 6000);
+	assert_int_equal(nic_packet_length(holder.nic, chain), 6000);
+	assert_true(nic_tx(holder.nic, chain));
+
+	uint32_t size = 0;
+	uint32_t count = 32;
+	assert_int_equal(vnic_tx_burst(&holder, &count, chain_transmitter, &size), VNIC_ERROR_NOERROR);
+	assert_int_equal(size, 6000);
+
+	NICStats stats;
+	vnic_stats(&holder, &stats);
+	assert_int_equal(stats.tx.drops[NIC_DROP_FILTERED], 0);
+	assert_int_equal(stats.tx.packets, 1);
+
+	nic_destroy();
+}
+
+static void sharedpool_quota_func(void** state) {
+	static Packet* taken[POOL_SIZE / 2048];
+	setup(QUOTA);
+
+	// The sharer takes its quota and no more
+	int count = 0;
+	Packet* packet;
+	while((packet = nic_alloc(sharer.nic, FRAME_SIZE)))
+		taken[count++] = packet;
+	assert_int_equal(count, QUOTA / 2048);
+	assert_int_equal(nic_pool_charged(sharer.nic), QUOTA);
+	assert_null(vnic_alloc(&sharer, FRAME_SIZE));
+	assert_int_equal(vnic_rx(&sharer, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_RESOURCE_NOT_AVAILABLE);
+
+	// and the holder still has buffers
+	Packet* packet2 = nic_alloc(holder.nic, FRAME_SIZE);
+	assert_non_null(packet2);
+	assert_true(vnic_rx(&holder, frame, FRAME_SIZE, NULL, 0) == VNIC_ERROR_NOERROR);
+	nic_free(nic_rx(holder.nic));
+
+	// A buffer is uncharged from the share which allocated it, whoever frees it
+	assert_true(vnic_free(&holder, taken[--count]));
+	assert_int_equal(nic_pool_charged(sharer.nic), QUOTA - 2048);
+	assert_non_null(taken[count] = nic_alloc(sharer.nic, FRAME_SIZE));
+	count++;
+
+	// Larger classes cost more of the quota
+	nic_free(taken[--count]);
+	assert_null(nic_alloc(sharer.nic, 3000));
+
+	while(count > 0)
+		nic_free(taken[--count]);
+	nic_free(packet2);
+
+	Packet* large = nic_alloc(sharer.nic, 3000);
+	assert_non_null(large);
+	assert_int_equal(nic_pool_charged(sharer.nic), large->size + sizeof(Packet));
+	nic_free(large);
+
+	nic_destroy();
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(sharedpool_init_func),
+		cmocka_unit_test(sharedpool_forward_func),
+		cmocka_unit_test(sharedpool_chain_func),
+		cmocka_unit_test(sharedpool_quota_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
@@ -0,0 +1,198 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	FIXTURE_QUEUE_SIZE
+#define FRAME_SIZE	64
+#define THREAD_NUM	4
+#define COUNT		(1 << 20)
+
+static VNIC vnic;
+
+static void nic_create() {
+	fixture_create(&vnic, 0, POOL_SIZE, NULL);
+}
+
+static uint64_t histogram_sum(NICCounters* counters) {
+	uint64_t sum = 0;
+	for(int i = 0; i < NIC_STATS_HISTOGRAM_SIZE; i++)
+		sum += counters->residency[i];
+
+	return sum;
+}
+
+static void stats_layout_func(void** state) {
+	nic_create();
+
+	// Each direction of each core is on cache lines of its own
+	assert_int_equal(vnic.nic->stats % NIC_CACHE_LINE_SIZE, 0);
+	assert_int_equal(sizeof(NICCounters) % NIC_CACHE_LINE_SIZE, 0);
+	assert_int_equal(offsetof(NICStats, tx) % NIC_CACHE_LINE_SIZE, 0);
+	assert_true(vnic.nic->stats >= vnic.nic->pool.cache + NIC_POOL_CACHE_COUNT * sizeof(NICPoolCache));
+	assert_true(vnic.nic->stats + NIC_STATS_CORE_COUNT * sizeof(NICStats) <= vnic.nic->pool.pool);
+
+	NICStats* stats = (NICStats*)((void*)vnic.nic + vnic.nic->stats);
+	NICStats* mine = nic_stats(vnic.nic, vnic.nic->stats);
+	assert_true(mine >= stats && mine < stats + NIC_STATS_CORE_COUNT);
+
+	fixture_destroy(&vnic);
+}
+
+static void stats_histogram_func(void** state) {
+	NICCounters counters;
+	memset(&counters, 0, sizeof(counters));
+
+	uint64_t time = 1000000;
+	nic_stats_residency(&counters, time, time);
+	nic_stats_residency(&counters, time, time + 1);
+	nic_stats_residency(&counters, time, time + 2);
+	nic_stats_residency(&counters, time, time + 3);
+	nic_stats_residency(&counters, time, time + 1023);
+	nic_stats_residency(&counters, time, time + 1024);
+	nic_stats_residency(&counters, time, time - 1);			// Clock of another core a bit behind
+	nic_stats_residency(&counters, time, time + (1L << 40));
+	nic_stats_residency(&counters, 0, time);			// Not stamped
+
+	assert_int_equal(counters.residency[0], 3);
+	assert_int_equal(counters.residency[1], 2);
+	assert_int_equal(counters.residency[9], 1);
+	assert_int_equal(counters.residency[10], 1);
+	assert_int_equal(counters.residency[NIC_STATS_HISTOGRAM_SIZE - 1], 1);
+	assert_int_equal(histogram_sum(&counters), 8);
+}
+
+static bool transmitter(Packet* packet, void* context) {
+	nic_free(packet);
+
+	return *(bool*)context;
+}
+
+static void stats_traffic_func(void** state) {
+	nic_create();
+
+	// Received frames are counted when queued and their residency when taken out
+	uint8_t frame[FRAME_SIZE] = { 0, };
+	for(int i = 0; i < QUEUE_SIZE + 8; i++)
+		vnic_rx_stage(&vnic, frame, FRAME_SIZE, NULL, 0);
+	vnic_rx_flush(&vnic);
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.rx.packets, QUEUE_SIZE - 1);
+	assert_int_equal(stats.rx.bytes, (QUEUE_SIZE - 1) * FRAME_SIZE);
+	assert_int_equal(stats.rx.drop_packets, 9);
+	assert_int_equal(stats.rx.drop_bytes, 9 * FRAME_SIZE);
+	assert_int_equal(histogram_sum(&stats.rx), 0);
+
+	Packet* packets[QUEUE_SIZE];
+	assert_non_null(packets[0] = nic_rx(vnic.nic));
+	uint32_t count = nic_rx_burst(vnic.nic, packets + 1, QUEUE_SIZE) + 1;
+	assert_int_equal(count, QUEUE_SIZE - 1);
+
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(histogram_sum(&stats.rx), count);
+	for(uint32_t i = 0; i < count; i++)
+		nic_free(packets[i]);
+
+	// Sent packets are counted on both sides of the tx queue
+	for(int i = 0; i < QUEUE_SIZE + 4; i++) {
+		Packet* packet = nic_alloc(vnic.nic, FRAME_SIZE);
+		packet->end = packet->start + FRAME_SIZE;
+		nic_tx(vnic.nic, packet);
+	}
+
+	bool success = true;
+	uint32_t sent = 8;
+	vnic_tx_burst(&vnic, &sent, transmitter, &success);
+	assert_int_equal(sent, 8);
+
+	success = false;
+	sent = 8;
+	vnic_tx_burst(&vnic, &sent, transmitter, &success);
+
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.tx.packets, 8);
+	assert_int_equal(stats.tx.bytes, 8 * FRAME_SIZE);
+	assert_int_equal(stats.tx.drop_packets, 5 + 1);		// Queue full and transmitter failure
+	assert_int_equal(stats.tx.drop_bytes, (5 + 1) * FRAME_SIZE);
+	assert_int_equal(histogram_sum(&stats.tx), 9);
+
+	Packet* packet;
+	while((packet = queue_pop(vnic.nic, &vnic.nic->txq[0])))
+		nic_free(packet);
+
+	fixture_destroy(&vnic);
+}
+
+static volatile bool running;
+
+static void* writer(void* arg) {
+	NICCounters* counters = &nic_stats(vnic.nic, vnic.nic->stats)->rx;
+	for(int i = 0; i < COUNT; i++)
+		nic_stats_residency(counters, 1, 1 + (i & 0xff));
+
+	return NULL;
+}
+
+static void* reader(void* arg) {
+	uint64_t last = 0;
+	while(running) {
+		NICStats stats;
+		vnic_stats(&vnic, &stats);
+
+		uint64_t sum = histogram_sum(&stats.rx);
+		assert_true(sum >= last);
+		last = sum;
+		(*(uint64_t*)arg)++;
+	}
+
+	return NULL;
+}
+
+static void stats_concurrent_func(void** state) {
+	nic_create();
+
+	// Snapshots are taken while the counters are updated and nothing is lost
+	uint64_t snapshots = 0;
+	pthread_t threads[THREAD_NUM + 1];
+	running = true;
+	pthread_create(&threads[THREAD_NUM], NULL, reader, &snapshots);
+	for(int i = 0; i < THREAD_NUM; i++)
+		pthread_create(&threads[i], NULL, writer, NULL);
+
+	for(int i = 0; i < THREAD_NUM; i++)
+		pthread_join(threads[i], NULL);
+	running = false;
+	pthread_join(threads[THREAD_NUM], NULL);
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	printf("\t%lu snapshots during %d updates\n", snapshots, THREAD_NUM * COUNT);
+	assert_int_equal(histogram_sum(&stats.rx), THREAD_NUM * COUNT);
+	assert_int_equal(stats.rx.residency[0], THREAD_NUM * COUNT / 256 * 2);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(stats_layout_func),
+		cmocka_unit_test(stats_histogram_func),
+		cmocka_unit_test(stats_traffic_func),
+		cmocka_unit_test(stats_concurrent_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
@@ -0,0 +1,248 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	256
+#define FRAME_SIZE	64
+#define ROUNDS		200000
+
+static VNIC vnic;
+
+static void nic_create() {
+	uint64_t attrs[] = {
+		VNIC_FLAGS, NIC_F_BROADCAST,
+		FIXTURE_QUEUE_SIZES(QUEUE_SIZE),
+		VNIC_NONE
+	};
+
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+}
+
+static bool transmitter(Packet* packet, void* context) {
+	(*(uint64_t*)context)++;
+	nic_free(packet);
+
+	return true;
+}
+
+static void update_apply_func(void** state) {
+	nic_create();
+
+	uint64_t attrs[] = {
+		VNIC_BUDGET, 64,
+		VNIC_MAC, 0x001122334466,
+		VNIC_FLAGS, NIC_F_PROMISC,
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 16,
+		VNIC_RX_BANDWIDTH, 100000000L,
+		VNIC_TX_BANDWIDTH, 200000000L,
+		VNIC_TX_QUANTUM, 1514,
+		VNIC_TX_PRIORITY, 1,
+		VNIC_DEV, (uint64_t)"eth0",
+		VNIC_POOL_SIZE, POOL_SIZE,
+		VNIC_NONE
+	};
+	assert_int_equal(vnic_update(&vnic, attrs), VNIC_ERROR_NOERROR);
+
+	// Published but not picked up until the fast path runs
+	assert_int_equal(vnic.budget, 32);
+	assert_int_equal(vnic.config.budget, 64);
+	assert_int_equal(vnic.config_version % 2, 0);
+
+	uint64_t sent = 0;
+	uint32_t count = 1;
+	vnic_tx_burst(&vnic, &count, transmitter, &sent);
+
+	assert_int_equal(vnic.config_applied, vnic.config_version);
+	assert_int_equal(vnic.budget, 64);
+	assert_int_equal(vnic.mac, 0x001122334466);
+	assert_int_equal(vnic.flags, NIC_F_PROMISC);
+	assert_int_equal(vnic.tx_quantum, 1514);
+	assert_int_equal(vnic.tx_priority, 1);
+	assert_int_equal(vnic.rx_bandwidth, 100000000L);
+	assert_int_equal(vnic.tx_bandwidth, 200000000L);
+
+	// The VM sees the change in the NIC
+	assert_int_equal(vnic.nic->mac, 0x001122334466);
+	assert_int_equal(vnic.nic->padding_head, 32);
+	assert_int_equal(vnic.nic->padding_tail, 16);
+	assert_int_equal(vnic.nic->rx_bandwidth, 100000000L);
+
+	// Buffers have room for the new padding
+	Packet* packet = nic_alloc(vnic.nic, 2048 - sizeof(Packet) - 32);
+	assert_non_null(packet);
+	assert_true(packet->size > 2048);
+	nic_free(packet);
+
+	fixture_destroy(&vnic);
+}
+
+static void update_reject_func(void** state) {
+	nic_create();
+	uint32_t version = vnic.config_version;
+
+	// The queues and the memory of the NIC stay as they are
+	uint64_t unsupported[][3] = {
+		{ VNIC_RX_QUEUE_SIZE, 512, VNIC_NONE },
+		{ VNIC_POOL_SIZE, 2 * POOL_SIZE, VNIC_NONE },
+		{ VNIC_FLAGS, NIC_F_MULTIQUEUE, VNIC_NONE },
+		{ VNIC_DEV, (uint64_t)"eth1", VNIC_NONE },
+		{ VNIC_QUEUE_COUNT, 2, VNIC_NONE },
+	};
+	for(int i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++)
+		assert_int_equal(vnic_update(&vnic, unsupported[i]), VNIC_ERROR_UNSUPPORTED);
+
+	uint64_t invalid[][3] = {
+		{ VNIC_BUDGET, 0, VNIC_NONE },
+		{ VNIC_MAC, 0x1000000000000L, VNIC_NONE },
+		{ VNIC_PADDING_HEAD, 0x10000, VNIC_NONE },
+	};
+	for(int i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+		assert_int_equal(vnic_update(&vnic, invalid[i]), VNIC_ERROR_ATTRIBUTE_INVALID);
+
+	// Nothing is published by a rejected update, even partly
+	uint64_t partial[] = { VNIC_BUDGET, 64, VNIC_TX_QUEUE_SIZE, 512, VNIC_NONE };
+	assert_int_equal(vnic_update(&vnic, partial), VNIC_ERROR_UNSUPPORTED);
+	assert_int_equal(vnic.config_version, version);
+	assert_int_equal(vnic.config.budget, 32);
+
+	uint64_t pool_max = vnic.pool_max;
+	uint64_t partial2[] = { VNIC_POOL_MAX_SIZE, 2 * POOL_SIZE, VNIC_BUDGET, 0, VNIC_NONE };
+	assert_int_equal(vnic_update(&vnic, partial2), VNIC_ERROR_ATTRIBUTE_INVALID);
+	assert_int_equal(vnic.pool_max, pool_max);
+
+	fixture_destroy(&vnic);
+}
+
+static void update_shaper_func(void** state) {
+	// The shaper keeps its debt over a change of rate
+	vnic__init_timer(1000000);
+	nic_create();
+
+	token_bucket_charge(&vnic.tx_bucket, 0, 10000000, 1);
+	int64_t tokens = vnic.tx_bucket.tokens;
+	assert_true(tokens < 0);
+
+	uint64_t attrs[] = { VNIC_TX_BANDWIDTH, 10000000, VNIC_TX_BURST, 1500, VNIC_NONE };
+	assert_int_equal(vnic_update(&vnic, attrs), VNIC_ERROR_NOERROR);
+
+	uint32_t count = 0;
+	vnic_tx_burst(&vnic, &count, transmitter, NULL);
+	assert_int_equal(vnic.tx_bucket.rate, 10000000);
+	assert_int_equal(vnic.tx_bucket.depth, 1500 * 8 * 1000000L);
+	assert_int_equal(vnic.tx_bucket.tokens, tokens);
+
+	// Tokens over the new depth are dropped
+	uint64_t attrs2[] = { VNIC_TX_BANDWIDTH, 0, VNIC_NONE };
+	assert_int_equal(vnic_update(&vnic, attrs2), VNIC_ERROR_NOERROR);
+	vnic_tx_burst(&vnic, &count, transmitter, NULL);
+	uint64_t attrs3[] = { VNIC_TX_BANDWIDTH, 10000000, VNIC_TX_BURST, 1500, VNIC_NONE };
+	assert_int_equal(vnic_update(&vnic, attrs3), VNIC_ERROR_NOERROR);
+	vnic_tx_burst(&vnic, &count, transmitter, NULL);
+	assert_int_equal(vnic.tx_bucket.tokens, vnic.tx_bucket.depth);
+
+	vnic__init_timer(0);
+	fixture_destroy(&vnic);
+}
+
+static volatile bool running;
+
+// Budgets and quanta are updated together; the fast path never sees them apart
+static void* updater(void* arg) {
+	uint64_t* updates = arg;
+	for(uint16_t budget = 1; running; budget = budget % 64 + 1) {
+		uint64_t attrs[] = {
+			VNIC_BUDGET, budget,
+			VNIC_TX_QUANTUM, budget * 1000,
+			VNIC_PADDING_HEAD, budget,
+			VNIC_RX_BANDWIDTH, budget * 1000000L,
+			VNIC_NONE
+		};
+		assert_int_equal(vnic_update(&vnic, attrs), VNIC_ERROR_NOERROR);
+		(*updates)++;
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+static void update_traffic_func(void** state) {
+	nic_create();
+
+	uint64_t updates = 0;
+	pthread_t thread;
+	running = true;
+	pthread_create(&thread, NULL, updater, &updates);
+
+	uint8_t frame[FRAME_SIZE] = { 0, };
+	uint64_t received = 0, sent = 0, applied = 0;
+	uint32_t version = vnic.config_applied;
+	for(int r = 0; r < ROUNDS; r++) {
+		// Frames are received and sent back by the VM
+		assert_int_equal(vnic_rx_stage(&vnic, frame, FRAME_SIZE, NULL, 0), VNIC_ERROR_NOERROR);
+		vnic_rx_flush(&vnic);
+
+		Packet* packet;
+		while((packet = nic_rx(vnic.nic))) {
+			received++;
+			assert_true(nic_tx(vnic.nic, packet));
+		}
+
+		uint32_t count = 32;
+		vnic_tx_burst(&vnic, &count, transmitter, &sent);
+
+		// Let the updater in on machines with few cores
+		if(r % 64 == 0)
+			sched_yield();
+
+		if(vnic.config_applied != version) {
+			version = vnic.config_applied;
+			applied++;
+		}
+
+		if(vnic.budget != 32 || version) {
+			assert_int_equal(vnic.tx_quantum, vnic.budget * 1000);
+			assert_int_equal(vnic.padding_head, vnic.budget);
+			assert_int_equal(vnic.rx_bandwidth, vnic.budget * 1000000L);
+		}
+	}
+
+	running = false;
+	pthread_join(thread, NULL);
+
+	printf("\t%lu updates published, %lu picked up by %d rounds of traffic\n", updates, applied, ROUNDS);
+	assert_int_equal(received, ROUNDS);
+	assert_int_equal(sent, ROUNDS);
+
+	NICStats stats;
+	vnic_stats(&vnic, &stats);
+	assert_int_equal(stats.rx.drop_packets, 0);
+	assert_int_equal(stats.tx.drop_packets, 0);
+	assert_true(applied > 0);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(update_apply_func),
+		cmocka_unit_test(update_reject_func),
+		cmocka_unit_test(update_shaper_func),
+		cmocka_unit_test(update_traffic_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
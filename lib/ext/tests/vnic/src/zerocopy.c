@@ -0,0 +1,275 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <nic.h>
+#include <vnic.h>
+#include <demux.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixture.h"
+
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	1024
+#define HDR_LEN		12		// virtio-net header
+#define BUF_SIZE	1526
+#define COUNT		200000
+
+static VNIC vnic;
+static uint8_t frame[BUF_SIZE];
+
+// Statistics summed over the cores
+static NICStats snapshot(VNIC* vnic) {
+	NICStats stats;
+	vnic_stats(vnic, &stats);
+
+	return stats;
+}
+
+static void nic_create() {
+	uint64_t attrs[] = {
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 32,
+		FIXTURE_QUEUE_SIZES(QUEUE_SIZE),
+		VNIC_NONE
+	};
+
+	fixture_create(&vnic, 0, POOL_SIZE, attrs);
+
+	for(int i = 0; i < BUF_SIZE; i++)
+		frame[i] = i;
+}
+
+static void zerocopy_stage_func(void** state) {
+	nic_create();
+
+	// The packet the frame was received into is the one the VM gets
+	Packet* packet = vnic_alloc(&vnic, BUF_SIZE);
+	assert_non_null(packet);
+	packet->start = 32;
+	memcpy(packet->buffer + packet->start, frame, 64);
+	packet->end = packet->start + 64;
+
+	assert_int_equal(vnic_rx_stage2(&vnic, packet), VNIC_ERROR_NOERROR);
+	assert_null(nic_rx(vnic.nic));
+	assert_int_equal(vnic_rx_flush(&vnic), 1);
+
+	Packet* packet2 = nic_rx(vnic.nic);
+	assert_ptr_equal(packet2, packet);
+	assert_int_equal(packet2->end - packet2->start, 64);
+	assert_memory_equal(packet2->buffer + packet2->start, frame, 64);
+	assert_int_equal(snapshot(&vnic).rx.packets, 1);
+	assert_int_equal(snapshot(&vnic).rx.bytes, 64);
+	assert_true(nic_free(packet2));
+
+	// Packets which don't fit in the rx queue go back to the pool
+	for(int i = 0; i < QUEUE_SIZE + VNIC_BURST_SIZE; i++) {
+		packet = vnic_alloc(&vnic, BUF_SIZE);
+		assert_non_null(packet);
+		packet->end = packet->start + 64;
+		assert_int_equal(vnic_rx_stage2(&vnic, packet), VNIC_ERROR_NOERROR);
+	}
+	vnic_rx_flush(&vnic);
+
+	assert_int_equal(snapshot(&vnic).rx.drop_packets, VNIC_BURST_SIZE + 1);
+	assert_int_equal(queue_size(&vnic.nic->rxq[0]), QUEUE_SIZE - 1);
+
+	while((packet = nic_rx(vnic.nic)))
+		assert_true(nic_free(packet));
+
+	assert_int_equal(nic_pool_used(vnic.nic), 0);
+
+	fixture_destroy(&vnic);
+}
+
+static void vnic_create(VNIC* vnic, uint64_t mac, uint32_t group) {
+	uint64_t attrs[] = {
+		VNIC_MAC, mac,
+		VNIC_GROUP, group,
+		VNIC_NONE
+	};
+
+	fixture_create(vnic, 0, POOL_SIZE, attrs);
+}
+
+/*
+ * A device receiving a frame as nicdev_rx_packet() does: into a buffer of the
+ * VM owning the device if there is one, handed over if the frame is to it.
+ */
+static void device_rx(VNIC** vnics, int count, VNICDemux* demux, VNICSubscribers* subscribers, uint64_t dmac) {
+	static uint8_t driver_buffer[BUF_SIZE];
+
+	VNIC* owner = vnic_rx_owner(vnics, count);
+	Packet* packet = owner ? vnic_rx_alloc(owner, BUF_SIZE) : NULL;
+	uint8_t* buffer = packet ? packet->buffer + packet->start : driver_buffer;
+
+	// DMA
+	memcpy(buffer, frame, 64);
+	for(int i = 0; i < 6; i++)
+		buffer[i] = dmac >> (40 - i * 8);
+
+	VNIC* targets[MAX_VNIC_COUNT];
+	bool is_complete;
+	int targets_count = vnic_demux_targets(demux, subscribers, 0, dmac, targets, &is_complete);
+	if(packet && targets_count == 1 && nic_find_by_packet(packet) == targets[0]->pool_nic) {
+		packet->end = packet->start + 64;
+		vnic_rx_stage2(targets[0], packet);
+		return;
+	}
+
+	for(int i = 0; i < targets_count; i++)
+		vnic_rx_stage(targets[i], buffer, 64, NULL, 0);
+	if(packet)
+		nic_free(packet);
+}
+
+static void zerocopy_owner_func(void** state) {
+	VNIC a, b;
+	vnic_create(&a, 0x00112233440a, 1);
+	vnic_create(&b, 0x00112233440b, 2);
+	VNIC* vnics[] = { &a, &b };
+
+	VNICDemux demux;
+	vnic_demux_init(&demux);
+	assert_true(vnic_demux_add(&demux, 0, a.mac, &a));
+	VNICSubscribers subscribers;
+	vnic_subscribers_build(&subscribers, vnics, 1);
+
+	// Alone, a VM has frames of the device received into its own buffers
+	assert_ptr_equal(vnic_rx_owner(vnics, 1), &a);
+	device_rx(vnics, 1, &demux, &subscribers, a.mac);
+	vnic_rx_flush(&a);
+	Packet* packet = nic_rx(a.nic);
+	assert_non_null(packet);
+	assert_ptr_equal(nic_find_by_packet(packet), a.nic);
+	nic_free(packet);
+
+	// and with another VNIC of it
+	b.group = a.group;
+	assert_ptr_equal(vnic_rx_owner(vnics, 2), &a);
+	b.group = 2;
+
+	// Not once a VNIC of another VM takes frames of the device, or it is promiscuous
+	assert_null(vnic_rx_owner(vnics, 2));
+	a.config.flags |= NIC_F_PROMISC;
+	assert_null(vnic_rx_owner(vnics, 1));
+	a.config.flags &= ~NIC_F_PROMISC;
+
+	// A frame for B never lands in A's pool
+	assert_true(vnic_demux_add(&demux, 0, b.mac, &b));
+	vnic_subscribers_build(&subscribers, vnics, 2);
+	for(int i = 0; i < VNIC_BURST_SIZE; i++) {
+		device_rx(vnics, 2, &demux, &subscribers, b.mac);
+		assert_int_equal(nic_pool_used(a.nic), 0);
+	}
+	vnic_rx_flush(&b);
+
+	assert_int_equal(snapshot(&a).rx.packets, 1);
+	assert_int_equal(snapshot(&b).rx.packets, VNIC_BURST_SIZE);
+	while((packet = nic_rx(b.nic))) {
+		assert_ptr_equal(nic_find_by_packet(packet), b.nic);
+		nic_free(packet);
+	}
+
+	fixture_destroy(&a);
+	fixture_destroy(&b);
+}
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+/*
+ * A driver poll: frames are written to rx buffers by the device (not timed),
+ * passed to the VNIC and flushed, and the VM takes them.
+ */
+static double copy_rx(size_t size) {
+	static uint8_t buffer[BUF_SIZE];
+	uint64_t cycles = 0;
+
+	for(int i = 0; i < COUNT; i += VNIC_BURST_SIZE) {
+		uint64_t t = rdtsc();
+		for(int j = 0; j < VNIC_BURST_SIZE; j++) {
+			memcpy(buffer + HDR_LEN, frame, size);	// DMA
+			t -= rdtsc();
+			vnic_rx_stage(&vnic, buffer + HDR_LEN, size, NULL, 0);
+			t += rdtsc();
+		}
+		vnic_rx_flush(&vnic);
+		cycles += rdtsc() - t;
+
+		Packet* packet;
+		while((packet = nic_rx(vnic.nic)))
+			nic_free(packet);
+	}
+
+	return (double)COUNT * size / cycles;
+}
+
+static double zerocopy_rx(size_t size) {
+	Packet* posted[VNIC_BURST_SIZE];
+	for(int j = 0; j < VNIC_BURST_SIZE; j++) {
+		posted[j] = vnic_alloc(&vnic, BUF_SIZE);
+		assert_non_null(posted[j]);
+	}
+
+	uint64_t cycles = 0;
+	for(int i = 0; i < COUNT; i += VNIC_BURST_SIZE) {
+		uint64_t t = rdtsc();
+		for(int j = 0; j < VNIC_BURST_SIZE; j++) {
+			Packet* packet = posted[j];
+			memcpy(packet->buffer + packet->start + HDR_LEN, frame, size);	// DMA
+			t -= rdtsc();
+			packet->start += HDR_LEN;
+			packet->end = packet->start + size;
+			vnic_rx_stage2(&vnic, packet);
+
+			// The driver posts a new buffer in place of the one handed over
+			posted[j] = vnic_alloc(&vnic, BUF_SIZE);
+			t += rdtsc();
+		}
+		vnic_rx_flush(&vnic);
+		cycles += rdtsc() - t;
+
+		Packet* packet;
+		while((packet = nic_rx(vnic.nic)))
+			nic_free(packet);
+	}
+
+	for(int j = 0; j < VNIC_BURST_SIZE; j++)
+		nic_free(posted[j]);
+
+	return (double)COUNT * size / cycles;
+}
+
+static void zerocopy_benchmark_func(void** state) {
+	nic_create();
+
+	size_t sizes[] = { 64, 512, 1514 };
+	for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		double copy = copy_rx(sizes[i]);
+		double zerocopy = zerocopy_rx(sizes[i]);
+		printf("\t%4zu bytes: copy %.2f bytes/cycle, zero-copy %.2f bytes/cycle\n", sizes[i], copy, zerocopy);
+	}
+
+	assert_int_equal(snapshot(&vnic).rx.drop_packets, 0);
+	assert_int_equal(nic_pool_used(vnic.nic), 0);
+
+	fixture_destroy(&vnic);
+}
+
+int main(void) {
+	const struct CMUnitTest UnitTest[] = {
+		cmocka_unit_test(zerocopy_stage_func),
+		cmocka_unit_test(zerocopy_owner_func),
+		cmocka_unit_test(zerocopy_benchmark_func),
+	};
+
+	return cmocka_run_group_tests(UnitTest, NULL, NULL);
+}
@@ -41,6 +41,8 @@
 #define ETHARP_TRUST_IP_MAC         0
 #define ETH_PAD_SIZE                2
 #define LWIP_CHKSUM_ALGORITHM       2
+#define CHECKSUM_GEN_TCP            0   // Left to the device (see low_level_output())
+#define CHECKSUM_GEN_UDP            0
 
 #define LWIP_TCP_KEEPALIVE          1
 
@@ -127,18 +127,22 @@ low_level_output(struct netif *netif, struct pbuf *p)
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
 
+  /* frames larger than a buffer are sent chained */
   u16_t tot_len = p->tot_len;
-  Packet* packet = nic_alloc(nic, tot_len);
+  Packet* packet = nic_alloc_chain(nic, tot_len);
   if(!packet)
 	  return ERR_MEM;
 
-  packet->end = packet->start + tot_len;
   int idx = 0;
   for(q = p; q != NULL; q = q->next) {
-    memcpy(packet->buffer + packet->start + idx, q->payload, q->len);
+    nic_packet_write(nic, packet, idx, q->payload, q->len);
     idx += q->len;
   }
 
+  /* TCP/UDP checksums are filled in by the device, or by the kernel for it */
+  if(nic_packet_parse(packet))
+    nic_packet_csum_offload(packet);
+
   NIC_DPI tx_process = ((struct netif_private*)netif->state)->tx_process;
   if(tx_process)
     packet = tx_process(packet);
@@ -166,10 +170,12 @@ low_level_output(struct netif *netif, struct pbuf *p)
 static struct pbuf *
 low_level_input(struct netif *netif, Packet* packet)
 {
+  NIC* nic = ((struct netif_private*)netif->state)->nic;
   struct pbuf *p, *q;
   u16_t len;
 
-  len = packet->end - packet->start;
+  /* the packet may be a chain of segments */
+  len = nic_packet_length(nic, packet);
 
 #if ETH_PAD_SIZE
   len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
@@ -188,7 +194,7 @@ low_level_input(struct netif *netif, Packet* packet)
     /* We iterate over the pbuf chain until we have read the entire
      * packet into the pbuf. */
     for(q = p; q != NULL; q = q->next) {
-      memcpy(q->payload, packet->buffer + packet->start + idx, q->len);
+      nic_packet_read(nic, packet, idx, q->payload, q->len);
       idx += q->len;
     }
     nic_free(packet);
@@ -0,0 +1,67 @@
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file
+ * Adaptive poll budget.
+ *
+ * A poll budget bounds the packets a queue is served per round before the
+ * poller moves on. The controller grows the budget fast while rounds use all of
+ * it and leave a backlog, and shrinks it slowly toward twice the average work
+ * of a round when they don't, so busy queues get throughput and idle ones don't
+ * hold a large share of the next round when a burst comes.
+ *
+ * It isn't locked. It is updated by the core polling the queue.
+ */
+
+#define POLL_BUDGET_SHIFT	3	///< Weight of a round in the average work is 1 / 2^POLL_BUDGET_SHIFT
+#define POLL_BUDGET_SCALE	16	///< Average work is kept multiplied by this
+
+/**
+ * State of the budget controller
+ */
+typedef struct _PollBudget {
+	uint16_t	min;			///< Least budget
+	uint16_t	max;			///< Most budget, equal to min for a fixed budget
+	uint32_t	average;		///< Moving average of the packets processed per round times POLL_BUDGET_SCALE
+} PollBudget;
+
+/**
+ * Initialize a budget controller
+ *
+ * @param poll budget controller
+ * @param min least budget (0: the budget the poller starts with)
+ * @param max most budget (0: the budget the poller starts with)
+ * @param budget budget the poller starts with
+ *
+ * @return budget the poller starts with, clamped to [min, max]
+ */
+uint16_t poll_budget_init(PollBudget* poll, uint16_t min, uint16_t max, uint16_t budget);
+
+/**
+ * Check whether the controller changes the budget at all
+ *
+ * @param poll budget controller
+ *
+ * @return false if the budget is fixed
+ */
+static inline bool poll_budget_adaptive(PollBudget* poll) {
+	return poll->min < poll->max;
+}
+
+/**
+ * Feed the outcome of a round to the controller
+ *
+ * @param poll budget controller
+ * @param budget budget of the round
+ * @param work packets processed in the round
+ * @param backlog packets left in the queue after the round
+ *
+ * @return budget of the next round
+ */
+uint16_t poll_budget_update(PollBudget* poll, uint16_t budget, uint32_t work, uint32_t backlog);
+
+#endif /* __BUDGET_H__ */
@@ -0,0 +1,60 @@
+#ifndef __CODEL_H__
+#define __CODEL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file
+ * CoDel (Controlled Delay) active queue management, RFC 8289.
+ *
+ * CoDel drops packets when the sojourn time of a queue stays above a target
+ * for an interval, then more and more often, interval / sqrt(drops) apart,
+ * until it falls below the target again. Queues are kept short without
+ * hurting bursts which drain within an interval.
+ *
+ * It is run where packets are queued: the sojourn time is that of the oldest
+ * packet of the queue and the packet to be queued is the one dropped. Times
+ * are in timer ticks.
+ *
+ * It isn't locked. It is updated by the producer of the queue.
+ */
+
+#define CODEL_TARGET		5000	///< Default target sojourn time in microseconds
+#define CODEL_INTERVAL		100000	///< Default interval in microseconds, about a round trip time
+
+/**
+ * CoDel state of a queue
+ */
+typedef struct _CoDel {
+	uint64_t	target;			///< Acceptable sojourn time
+	uint64_t	interval;		///< Time the sojourn time may stay above target (0: never drop)
+	uint64_t	first_above;		///< Time the sojourn time will have been above target for an interval (0: below target)
+	uint64_t	drop_next;		///< Time of the next drop while dropping, of the last one otherwise
+	uint32_t	count;			///< Packets dropped in this dropping state
+	uint32_t	last_count;		///< Packets dropped in the last dropping state
+	bool		dropping;		///< In the dropping state
+} CoDel;
+
+/**
+ * Initialize CoDel state
+ *
+ * @param codel CoDel state
+ * @param target acceptable sojourn time
+ * @param interval time the sojourn time may stay above target (0: never drop)
+ */
+void codel_init(CoDel* codel, uint64_t target, uint64_t interval);
+
+/**
+ * Decide whether a packet to be queued is dropped
+ *
+ * @param codel CoDel state
+ * @param t current time
+ * @param sojourn time the oldest packet of the queue has been queued (0: empty queue)
+ * @param backlog number of packets in the queue
+ *
+ * @return true if the packet is to be dropped
+ */
+bool codel_drop(CoDel* codel, uint64_t t, uint64_t sojourn, uint32_t backlog);
+
+#endif /* __CODEL_H__ */
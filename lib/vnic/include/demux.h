@@ -0,0 +1,98 @@
+#ifndef __DEMUX_H__
+#define __DEMUX_H__
+
+#include "vnic.h"
+
+/**
+ * @file
+ * Demultiplexing of received frames to VNICs.
+ *
+ * The VNICs of a device and of all its VLANs are in a single table by VLAN ID
+ * and MAC address, so a unicast frame takes one lookup however many VLANs and
+ * VNICs there are. VNICs which take frames not addressed to them are listed
+ * per VLAN in VNICSubscribers.
+ *
+ * Neither the table nor the subscribers are locked. They are changed while
+ * the cores looking frames up in them are stopped (see nicdev_poll_stop()).
+ */
+
+#define VNIC_DEMUX_VLAN_COUNT	4096			///< VLAN IDs (12 bits)
+#define VNIC_DEMUX_BITS		11
+#define VNIC_DEMUX_SIZE		(1 << VNIC_DEMUX_BITS)	///< Slots of the table, twice the most VNICs (NIC_MAX_ID)
+
+/**
+ * VNICs taking frames which are not addressed to them on a VLAN, ordered so
+ * that each kind of frame goes to a prefix of the list: vnics[0, promisc) are
+ * promiscuous, vnics[0, multicast) take multicast frames and
+ * vnics[0, broadcast) broadcast frames.
+ */
+typedef struct _VNICSubscribers {
+	uint16_t	promisc;		///< VNICs with NIC_F_PROMISC
+	uint16_t	multicast;		///< and with NIC_F_MULTICAST
+	uint16_t	broadcast;		///< and with NIC_F_BROADCAST
+	VNIC*		vnics[MAX_VNIC_COUNT];
+} VNICSubscribers;
+
+typedef struct _VNICDemuxEntry {
+	uint64_t	key;			///< VLAN ID << 48 | MAC address
+	VNIC*		vnic;			///< NULL if the slot is empty
+} VNICDemuxEntry;
+
+/**
+ * Open-addressed table of VNICs by VLAN ID and MAC address, probed linearly.
+ * Removal shifts the following entries back, so there are no deleted slots.
+ */
+typedef struct _VNICDemux {
+	uint32_t	count;			///< Number of VNICs in the table
+	VNICDemuxEntry	entries[VNIC_DEMUX_SIZE];
+} VNICDemux;
+
+void vnic_demux_init(VNICDemux* demux);
+
+/**
+ * @param vid VLAN ID (0: untagged)
+ *
+ * @return false if the address is taken on the VLAN or the table is full
+ */
+bool vnic_demux_add(VNICDemux* demux, uint16_t vid, uint64_t mac, VNIC* vnic);
+
+/**
+ * @return the VNIC removed, NULL if there was none
+ */
+VNIC* vnic_demux_remove(VNICDemux* demux, uint16_t vid, uint64_t mac);
+VNIC* vnic_demux_get(VNICDemux* demux, uint16_t vid, uint64_t mac);
+
+/**
+ * List the VNICs of a VLAN which take frames not addressed to them, by the
+ * flags they are configured with (VNICConfig).
+ *
+ * @param vnics VNICs of the VLAN
+ */
+void vnic_subscribers_build(VNICSubscribers* subscribers, VNIC** vnics, int count);
+
+/**
+ * Find the VNICs which take a frame.
+ *
+ * @param subscribers subscribers of the VLAN
+ * @param targets at least MAX_VNIC_COUNT
+ * @param is_complete set if the frame was addressed to a VNIC and nobody else needs it
+ *
+ * @return number of targets
+ */
+int vnic_demux_targets(VNICDemux* demux, VNICSubscribers* subscribers, uint16_t vid, uint64_t dmac,
+		VNIC** targets, bool* is_complete);
+
+/**
+ * Find the VNIC whose pool a device may receive frames into before they are
+ * demultiplexed. The VM can read and write the buffer meanwhile, so every
+ * frame of the device must be one it may take: the VNICs are all of its
+ * group, or it is alone, and none is promiscuous. The caller also makes sure
+ * the device itself takes no frames addressed to other hosts.
+ *
+ * @param vnics VNICs of the device and of all its VLANs
+ *
+ * @return the first VNIC, NULL if frames are to be received into buffers of the driver
+ */
+VNIC* vnic_rx_owner(VNIC** vnics, int count);
+
+#endif /* __DEMUX_H__ */
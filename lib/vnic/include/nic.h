@@ -21,14 +21,44 @@
 #define NIC_F_BROADCAST			((uint64_t)1 << 4)
 #define NIC_F_MULTICAST			((uint64_t)1 << 5)
 #define NIC_F_MULTIQUEUE		((uint64_t)1 << 6)
+#define NIC_F_CHAIN			((uint64_t)1 << 7)	///< Frames larger than a buffer are received chained
+#define NIC_F_CODEL			((uint64_t)1 << 8)	///< Rx queues are managed by CoDel (see VNIC_RX_CODEL_TARGET)
+#define NIC_F_SHARED_POOL		((uint64_t)1 << 9)	///< Buffers come from a pool shared with other NICs of the VM (see VNIC_POOL_SHARED)
 
 #define NIC_MAX_COUNT		64
+#define NIC_MAX_ID		1024			///< NIC IDs are less than this
 #define NIC_MAX_LINKS		8
 #define NIC_CHUNK_SIZE		64
 #define NIC_MAX_SIZE		(16 * 1024 * 1024)	// 16MB
 #define NIC_HEADER_SIZE		(64 * 1024)		// 64KB
 
-#define NIC_MAGIC_HEADER	0x0A38E56586468C01LL	// PacketNgin vNIC 01(version)
+#define NIC_CONFIG_INDEX_SIZE	1024			// Slots of the config index (power of 2)
+#define NIC_CONFIG_INDEX_LOAD	(NIC_CONFIG_INDEX_SIZE * 3 / 4)	// Most entries of the config index
+#define NIC_CONFIG_DELETED	0xffff			// Slot of a freed config entry
+
+#define NIC_MAGIC_HEADER	0x0A38E56586468C0BLL	// PacketNgin vNIC 11(version)
+#define NIC_MAGIC_EXTENT	0x0A38E5658646EC0BLL	// PacketNgin vNIC extent 11(version)
+
+#define NIC_CACHE_LINE_SIZE	64
+
+#define NIC_QUEUE_F_MP		((uint32_t)1 << 0)	///< Multiple producers may push concurrently
+#define NIC_QUEUE_F_MC		((uint32_t)1 << 1)	///< Multiple consumers may pop concurrently
+#define NIC_QUEUE_BURST_MAX	64			///< Maximum number of packets queue_push_burst() pushes at once
+
+#define NIC_MAX_QUEUE_COUNT	8			///< Maximum number of rx/tx queue pairs (NIC_F_MULTIQUEUE)
+
+#define NIC_POOL_CLASS_COUNT	3			///< Number of buffer size classes (2KB, 4KB, 9KB)
+#define NIC_POOL_CACHE_COUNT	16			///< Number of per-core caches (indexed by APIC ID)
+#define NIC_POOL_CACHE_SIZE	32			///< Maximum number of buffers a core caches per size class
+#define NIC_PACKET_MAX_SEGMENTS	8			///< Maximum number of segments of a chained packet
+#define NIC_POOL_SHARE_COUNT	16			///< Maximum number of NICs sharing a pool
+#define NIC_POOL_SHARE_NONE	0xff			///< Packet::share of a buffer which isn't charged to any NIC
+#define NIC_POOL_EXTENT_COUNT	16			///< Maximum number of blocks a pool grows by
+#define NIC_POOL_EXTENT_SIZE	0x200000		///< Size of a block a pool grows by
+#define NIC_POOL_DEFERRED_SIZE	32			///< Most buffers put without waiting which are held until their free list is unlocked
+
+#define NIC_STATS_CORE_COUNT	16			///< Number of per-core statistics blocks (indexed by APIC ID)
+#define NIC_STATS_HISTOGRAM_SIZE	32		///< Number of log2 buckets of queue residency time
 
 /**
  * @file
@@ -37,39 +67,178 @@
 
 // Host API
 
+/**
+ * Lock-free packet queue
+ *
+ * The producer owns tail and the consumer owns head. Each side lives on its
+ * own cache line and keeps a cached copy of the other side's index, so the
+ * shared index is only read when the cached one says the queue is full or
+ * empty. By default the queue is single producer, single consumer.
+ * NIC_QUEUE_F_MP makes producers reserve slots with compare-and-swap and
+ * NIC_QUEUE_F_MC serializes consumers with rlock.
+ */
 typedef struct _NICQueue {
 	uint32_t	base;			///< Base offset
-	uint32_t	head;			///< Queue head
-	uint32_t	tail;			///< Queue tail
 	uint32_t	size;			///< Maximum number of packets this queue can have
-	volatile uint8_t rlock;		///< Read lock
-	volatile uint8_t wlock;		///< Write lock
-} NICQueue;
+	uint32_t	flags;			///< NIC_QUEUE_F_XXX
+
+	// Producer side
+	volatile uint32_t tail __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));	///< Queue tail
+	uint32_t	head_cache;		///< Last head seen by the producer
+
+	// Consumer side
+	volatile uint32_t head __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));	///< Queue head
+	uint32_t	tail_cache;		///< Last tail seen by the consumer
+	volatile uint8_t rlock;			///< Read lock (NIC_QUEUE_F_MC only)
+} __attribute__((__aligned__(NIC_CACHE_LINE_SIZE))) NICQueue;
+
+/**
+ * Buffers of one size class
+ *
+ * Free buffers are linked through their first 4 bytes by NIC offset.
+ */
+typedef struct _NICSlab {
+	uint32_t	base;			///< Offset of the first buffer
+	uint32_t	size;			///< Buffer size including the Packet header
+	uint32_t	count;			///< Number of buffers
+	uint32_t	cache_size;		///< Maximum number of buffers a core caches
+	volatile uint32_t free;			///< Offset of the first free buffer (0 if none)
+	volatile uint32_t free_count;		///< Number of free buffers not cached by any core
+	volatile uint8_t lock;			///< Free list lock
+} NICSlab;
+
+/**
+ * Per-core magazine of free buffers
+ */
+typedef struct _NICPoolCache {
+	uint32_t	buffers[NIC_POOL_CLASS_COUNT][NIC_POOL_CACHE_SIZE];	///< Offsets of cached buffers
+	uint32_t	count[NIC_POOL_CLASS_COUNT];	///< Number of cached buffers
+	volatile uint8_t lock;			///< Owned by the core while it allocates or frees
+} __attribute__((__aligned__(NIC_CACHE_LINE_SIZE))) NICPoolCache;
 
 /**
- * Bitmap Pool
+ * Size-class Pool
+ *
+ * The pool is split into slabs of fixed-size buffers. A core allocates from
+ * and frees to its own cache, and only goes to the slab free lists when the
+ * cache runs empty or full, moving half a cache at once.
+ *
+ * The NICs of a VM may share the pool of one of them, the holder
+ * (NIC_F_SHARED_POOL). Their pool is a copy of the holder's layout, offsets
+ * are from the holder, and the free lists and caches of the holder are used.
+ * Each NIC has a share of the pool which the bytes of the buffers it
+ * allocates are charged to, up to its quota, so one NIC can't starve the
+ * others. Buffers are uncharged from the share which allocated them, whoever
+ * frees them.
+ *
+ * A pool may grow by blocks of NIC_POOL_EXTENT_SIZE anywhere above the NIC
+ * within 4GB of it, and shrink back when they are idle (see nic_pool_grow()).
+ * The buffers of an extent are of a single class, used once the slab and the
+ * cache of the class run out, and go back to the extent's free list without
+ * being cached.
+ *
+ * A buffer put without waiting while its free list is locked is kept in the
+ * caller's copy of the layout, and put again by its next get or put which
+ * doesn't wait either. The kernel never waits for a lock the VM could hold.
  */
 typedef struct _NICPool {
-	uint32_t	bitmap;		///< Bitmap
-	uint32_t	count;		///< Chunk count
-	uint32_t	pool;		///< Bitmap pool
-	uint32_t	index;
-	uint32_t	used;		///< Number of active chunks
-	volatile uint8_t lock;	///< Write lock
+	uint32_t	cache;			///< Offset of NICPoolCache[NIC_POOL_CACHE_COUNT]
+	uint32_t	pool;			///< Offset of the first slab
+	NICSlab		slabs[NIC_POOL_CLASS_COUNT];	///< Slabs from the smallest class
+	NICSlab		extents[NIC_POOL_EXTENT_COUNT];	///< Buffers of the blocks the pool has grown by (count 0: unused)
+	uint8_t		extent_classes[NIC_POOL_EXTENT_COUNT];	///< Size class of the buffers of each extent
+	uint32_t	owner;			///< ID of the NIC holding the pool (the NIC itself unless the pool is shared)
+	uint8_t		share;			///< Share charged for the buffers allocated by the NIC
+	uint32_t	quota;			///< Most bytes charged to the share (0: not charged)
+	volatile uint32_t charged[NIC_POOL_SHARE_COUNT];	///< Bytes charged to each share (used in the holder's pool only)
+	uint32_t	deferred[NIC_POOL_DEFERRED_SIZE];	///< Offsets of buffers whose free list was locked when they were put
+	uint32_t	deferred_count;		///< Number of deferred buffers
+	volatile uint8_t deferred_lock;		///< Held while the deferred buffers change
 } NICPool;
 
+/**
+ * Head of a block a pool has grown by. Buffers of the block follow it at
+ * NIC_CHUNK_SIZE. nic_find_by_packet() finds the NIC by it, as the registry
+ * doesn't index such blocks.
+ */
+typedef struct _NICExtentHeader {
+	uint64_t	magic;			///< NIC_MAGIC_EXTENT while the block is in a pool
+	struct _NIC*	nic;			///< NIC whose pool has the block
+} NICExtentHeader;
+
+/**
+ * Why a packet was dropped
+ */
+typedef enum _NICDropReason {
+	NIC_DROP_NO_MEMORY,		///< No buffer in the pool
+	NIC_DROP_QUEUE_FULL,		///< The queue, or the transmitter, had no room
+	NIC_DROP_RATE_LIMITED,		///< Over the bandwidth of the VNIC
+	NIC_DROP_FILTERED,		///< Not to be passed on, like chains in another NIC's pool
+	NIC_DROP_AQM,			///< Dropped by queue management (NIC_F_CODEL)
+	NIC_DROP_REASON_COUNT,
+} NICDropReason;
+
+/**
+ * Statistics of one direction
+ *
+ * Bucket i of the residency histogram counts packets which spent [2^i, 2^(i+1))
+ * timer ticks in the queue (bucket 0 also counts 0 ticks, the last one everything longer).
+ * Dropped packets are counted in total and by reason.
+ */
+typedef struct _NICCounters {
+	uint64_t	packets;		///< Total packets
+	uint64_t	bytes;			///< Total bytes
+	uint64_t	drop_packets;		///< Total dropped packets
+	uint64_t	drop_bytes;		///< Total dropped bytes
+	uint64_t	drops[NIC_DROP_REASON_COUNT];	///< Dropped packets by NICDropReason
+	uint64_t	residency[NIC_STATS_HISTOGRAM_SIZE];	///< Packets by log2 of timer ticks spent in the queue
+} __attribute__((__aligned__(NIC_CACHE_LINE_SIZE))) NICCounters;
+
+/**
+ * Per-core statistics
+ *
+ * A core only adds to its own block, so the producer and the consumer of a
+ * queue never write the same cache line. The rx side is counted by the core
+ * receiving frames into the NIC, and its residency, from reception to
+ * nic_rx(), by the core taking them out. The tx side counts packets dropped by
+ * nic_tx() on the core sending them, and packets transmitted with their
+ * residency, from nic_tx() to transmission, on the core draining the queue.
+ */
+typedef struct _NICStats {
+	NICCounters	rx;			///< Input
+	NICCounters	tx;			///< Output
+} NICStats;
+
+/**
+ * Config index
+ *
+ * It takes the first words of the config area. Entries follow it, and the key
+ * of an entry is the offset of its header in words from config_head. The
+ * slots are an open-addressed table probed linearly; a slot holds the upper
+ * 16 bits of the name hash over the key of the entry (0: empty,
+ * NIC_CONFIG_DELETED: freed). Zeroed memory is an empty index.
+ */
+typedef struct _NICConfigIndex {
+	uint16_t	tail;			///< Word after the last entry (0: nothing allocated yet)
+	uint16_t	used;			///< Words taken by entries
+	uint16_t	count;			///< Entries in the index
+	uint16_t	deleted;		///< Slots of freed entries
+	uint32_t	slots[NIC_CONFIG_INDEX_SIZE];	///< Hash and key of each entry
+} NICConfigIndex;
+
 /**
  * NIC Memory Map
  *
  * NIC_MAGIC_HEADER (8 bytes)
  * Metadata (bandwidth, pdding, queue, pool)
  * Config
- * Fast path rx queue
- * Fast path tx queue
+ * Fast path rx queues (one per queue pair)
+ * Fast path tx queues (one per queue pair)
  * Slow path rx queue
  * Slow path tx queue
- * Packet pool bitmap
- * Packet payload pool
+ * Per-core pool caches
+ * Per-core statistics
+ * Packet payload pool (2KB slab, 4KB slab, 9KB slab)
  */
 typedef struct _NIC {
 	// 2MBs aligned
@@ -83,23 +252,18 @@ typedef struct _NIC {
 	uint64_t	rx_bandwidth;		///< Rx bandwith limit (bps)
 	uint64_t	tx_bandwidth;		///< Tx bandwith limit (bps)
 
-	uint64_t	input_bytes;		///< Total input bytes (read only)
-	uint64_t	input_packets;		///< Total input packets (read only)
-	uint64_t	input_drop_bytes;	///< Total dropped input bytes (read only)
-	uint64_t	input_drop_packets;	///< Total dropped input packets (read only)
-	uint64_t	output_bytes;		///< Total output bytes (read only)
-	uint64_t	output_packets;		///< Total output packets (read only)
-	uint64_t	output_drop_bytes;	///< Total dropped output bytes (read only)
-	uint64_t	output_drop_packets;	///< Total dropped output packets (read only)
+	uint32_t	stats;			///< Offset of NICStats[NIC_STATS_CORE_COUNT] (see nic_stats_snapshot())
 
 	uint16_t	padding_head;
 	uint16_t	padding_tail;
 
-	NICQueue	rx;
-	NICQueue	tx;
+	uint16_t	queue_count;		///< Number of rx/tx queue pairs, more than 1 with NIC_F_MULTIQUEUE only
+
+	NICQueue	rxq[NIC_MAX_QUEUE_COUNT] __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));	///< Rx queue of each queue pair
+	NICQueue	txq[NIC_MAX_QUEUE_COUNT] __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));	///< Tx queue of each queue pair
 
-	NICQueue	srx;
-	NICQueue	stx;
+	NICQueue	srx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
+	NICQueue	stx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
 
 	NICPool		pool;
 
@@ -107,38 +271,287 @@ typedef struct _NIC {
 	uint8_t		config_head[0];
 	uint8_t		config_tail[0] __attribute__((__aligned__(NIC_HEADER_SIZE)));
 
-	// rx queue (8 bytes aligned)
-	// tx queue (8 bytes aligned)
+	// rx queues (NIC_CACHE_LINE_SIZE(64) bytes aligned)
+	// tx queues (NIC_CACHE_LINE_SIZE(64) bytes aligned)
 	// slow rx queue (8 bytes aligned)
 	// slow tx queue (8 bytes aligned)
-	// pool bitmap (8 bytes aligned)
-	// pool (NIC_CHUNK_SIZE(64) bytges aligned)
+	// pool caches (NIC_CACHE_LINE_SIZE(64) bytes aligned)
+	// statistics (NIC_CACHE_LINE_SIZE(64) bytes aligned)
+	// pool (NIC_CHUNK_SIZE(64) bytes aligned)
 } __attribute__((packed)) NIC;
 
+/**
+ * Add a NIC to __nics and index it by its ID and by the 2MB blocks it spans,
+ * so that nic_get_by_id() and nic_find_by_packet() take constant time.
+ *
+ * @return false if __nics is full or the ID is not less than NIC_MAX_ID
+ */
+bool nic_register(NIC* nic);
+void nic_unregister(NIC* nic);
+
 NIC* nic_find_by_packet(Packet* packet);
 int nic_count();
 NIC* nic_get(int index);
 NIC* nic_get_by_id(uint32_t id);
 
+/**
+ * NIC whose memory holds the buffers of a NIC, the NIC itself unless the pool
+ * is shared. The holder must outlive the NICs sharing its pool.
+ *
+ * @return NULL if the holder isn't registered
+ */
+NIC* nic_pool_nic(NIC* nic);
+
 Packet* nic_alloc(NIC* nic, uint16_t size);
 bool nic_free(Packet* packet);
 
+/**
+ * Allocate a buffer from the smallest size class which fits size bytes.
+ * Larger classes are used when it runs out. The buffer is charged to the
+ * share of pool if it has a quota.
+ *
+ * @param nic holder of the pool (see nic_pool_nic())
+ * @param pool slab layout to trust (the NIC's own or a private copy of it)
+ * @param wait false to give up instead of spinning on a busy lock
+ * @return NULL if there is no buffer available or the share is over its quota
+ */
+Packet* nic_pool_get(NIC* nic, NICPool* pool, uint32_t size, bool wait);
+
+/**
+ * Return a buffer to the pool in O(1). A packet shared by several queues
+ * (ref > 1) only loses one reference until the last one is put.
+ *
+ * @param wait false to defer buffers whose free list is locked to a later put, in a pool private to the caller
+ * @return false if the packet is not a buffer of the pool, or a buffer is lost as too many are deferred
+ */
+bool nic_pool_put(NIC* nic, NICPool* pool, Packet* packet, bool wait);
+
+/**
+ * Chained packets
+ *
+ * A packet may be a chain of up to NIC_PACKET_MAX_SEGMENTS buffers (see
+ * Packet). Putting the first segment puts the whole chain.
+ */
+
+/**
+ * @return the next segment, NULL if this is the last or the link is not a buffer of the pool
+ */
+Packet* nic_pool_next(NIC* nic, NICPool* pool, Packet* packet);
+
+/**
+ * @return data bytes of all the segments
+ */
+uint32_t nic_pool_length(NIC* nic, NICPool* pool, Packet* packet);
+
+/**
+ * Allocate a chain of buffers of the smallest class with room for size bytes.
+ * The first segment starts at padding_head and every segment leaves
+ * padding_tail free.
+ *
+ * @return NULL if there are not enough buffers or it takes more than NIC_PACKET_MAX_SEGMENTS
+ */
+Packet* nic_pool_get_chain(NIC* nic, NICPool* pool, uint32_t size, uint16_t padding_head, uint16_t padding_tail, bool wait);
+
+/**
+ * Allocate a packet with size bytes of data after the head padding, in a
+ * single buffer if one fits or else in a chain.
+ */
+Packet* nic_alloc_chain(NIC* nic, uint32_t size);
+Packet* nic_packet_next(NIC* nic, Packet* packet);
+uint32_t nic_packet_length(NIC* nic, Packet* packet);
+
+/**
+ * Make a packet writable. A packet shared by several rx queues (ref > 1) is
+ * copied with its metadata into a buffer of the NIC's pool, *packet is set
+ * to the copy and the shared one loses the caller's reference. Transmitting
+ * unshares packets on its own; others must before writing to them.
+ *
+ * @return false if there is no buffer for the copy, *packet is left as it is
+ */
+bool nic_packet_unshare(NIC* nic, Packet** packet);
+
+/**
+ * Make room for size bytes in front of the data without moving it. The
+ * headroom of the first segment is taken if it is enough, otherwise a new
+ * segment is put in front and *packet is set to it.
+ *
+ * A shared packet is unshared first (see nic_packet_unshare()).
+ *
+ * @return the room, NULL if there is no buffer for it
+ */
+void* nic_packet_prepend(NIC* nic, Packet** packet, uint16_t size);
+
+/**
+ * Make room for size bytes after the data, in the last segment or in a new one.
+ *
+ * @return the room, NULL if there is no buffer for it or the packet is shared
+ */
+void* nic_packet_append(NIC* nic, Packet* packet, uint16_t size);
+
+/**
+ * Copy data out of or into a packet from offset across its segments. Nothing
+ * is written into a shared packet (see nic_packet_unshare()).
+ *
+ * @return bytes copied
+ */
+uint32_t nic_packet_read(NIC* nic, Packet* packet, uint32_t offset, void* buf, uint32_t size);
+uint32_t nic_packet_write(NIC* nic, Packet* packet, uint32_t offset, const void* buf, uint32_t size);
+
 bool queue_push(NIC* nic, NICQueue* queue, Packet* packet);
 void* queue_pop(NIC* nic, NICQueue* queue);
+
+/**
+ * Push up to count packets with a single tail update.
+ *
+ * @return number of packets pushed (at most NIC_QUEUE_BURST_MAX). The caller keeps the rest
+ */
+uint32_t queue_push_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count);
+
+/**
+ * Pop up to count packets with a single head update.
+ *
+ * @return number of packets popped
+ */
+uint32_t queue_pop_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count);
+
+/**
+ * Look at up to count packets at the head without popping them.
+ * Only for a single consumer; queue_advance() pops them afterwards.
+ * A packet is NULL when the NIC owning it no longer exists.
+ *
+ * @return number of packets at the head
+ */
+uint32_t queue_peek(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count);
+void queue_advance(NIC* nic, NICQueue* queue, uint32_t count);
+
+/**
+ * Time stamp of the packet at the head, read by a producer. The consumer may
+ * pop it meanwhile, so the time may be of a packet queued later.
+ *
+ * @return Packet.time of the oldest packet, 0 if the queue is empty
+ */
+uint64_t queue_head_time(NIC* nic, NICQueue* queue);
+
 uint32_t queue_size(NICQueue* queue);
 bool queue_available(NICQueue* queue);
 bool queue_empty(NICQueue* queue);
 
 bool nic_has_rx(NIC* nic);
 Packet* nic_rx(NIC* nic);
+uint32_t nic_rx_burst(NIC* nic, Packet** packets, uint32_t count);
 uint32_t nic_rx_size(NIC* nic);
 
+/**
+ * Multi-queue rx/tx (NIC_F_MULTIQUEUE)
+ *
+ * Frames of a flow are received on the queue its RSS hash maps to, so every
+ * core of a VM can poll a queue pair of its own. nic_rx() and nic_tx() use
+ * the first queue pair.
+ *
+ * @param queue index of the queue pair, less than nic_queue_count()
+ */
+uint16_t nic_queue_count(NIC* nic);
+Packet* nic_rxq(NIC* nic, uint16_t queue);
+uint32_t nic_rxq_burst(NIC* nic, uint16_t queue, Packet** packets, uint32_t count);
+bool nic_txq(NIC* nic, uint16_t queue, Packet* packet);
+uint32_t nic_txq_burst(NIC* nic, uint16_t queue, Packet** packets, uint32_t count);
+
+/**
+ * Toeplitz hash of the IPv4/IPv6 addresses and TCP/UDP ports of a frame, as
+ * defined by Microsoft RSS with its default key
+ *
+ * @param frame Ethernet frame (an 802.1Q tag is skipped)
+ * @return 0 for frames which are not IP
+ */
+uint32_t nic_rss_hash(const uint8_t* frame, size_t size);
+
+/**
+ * Offload metadata
+ *
+ * Parse the Ethernet, IP and TCP/UDP headers in the first segment of a packet
+ * and set l3, l4 and l4_proto. Flags other than the offsets are kept.
+ *
+ * @return false if the packet is not IPv4 or IPv6
+ */
+bool nic_packet_parse(Packet* packet);
+
+/**
+ * Flow hash of a packet, computed once and kept in the packet
+ */
+uint32_t nic_packet_hash(Packet* packet);
+
+/**
+ * Complete a partial checksum: the Internet checksum of frame[csum_start, size),
+ * in which the checksum field at csum_start + csum_offset holds the sum to
+ * start with, is put in the field.
+ *
+ * @return false if the field is out of the frame
+ */
+bool nic_csum_complete(uint8_t* frame, size_t size, uint16_t csum_start, uint16_t csum_offset);
+
+/**
+ * Fill in the TCP/UDP checksum a packet asks the device for (PACKET_F_TX_CSUM)
+ * in software, for devices which can't, and clear the request.
+ *
+ * @return false if the request can't be done (not TCP/UDP or bad offsets)
+ */
+bool nic_packet_tx_csum(Packet* packet);
+
+/**
+ * Ask the device for the TCP/UDP checksum of a packet parsed by
+ * nic_packet_parse(): the pseudo header sum is put in the checksum field and
+ * PACKET_F_TX_CSUM is set. Stacks call it instead of summing the segment.
+ *
+ * @return false if the packet is not TCP/UDP or is an IP fragment
+ */
+bool nic_packet_csum_offload(Packet* packet);
+
+/**
+ * Segmentation offload in software
+ *
+ * A TCP frame asking for segmentation (PACKET_F_TX_GSO) is cut into segments
+ * of gso_size payload bytes, each with a copy of the Ethernet, IP and TCP
+ * headers whose lengths, IPv4 ID and checksum, TCP sequence number and flags
+ * are those of the segment. Segments ask for the TCP checksum
+ * (PACKET_F_TX_CSUM) and carry the metadata of the frame.
+ *
+ * @return number of segments, 0 if the frame can't be segmented
+ */
+uint16_t nic_packet_gso_count(Packet* packet);
+
+/**
+ * @return bytes the largest segment of a frame asking for segmentation takes
+ */
+size_t nic_packet_gso_size(Packet* packet);
+
+/**
+ * Write a segment of a frame asking for segmentation from the start of the
+ * buffer of another packet
+ *
+ * @param index of the segment, less than nic_packet_gso_count()
+ * @return false if the segment doesn't fit in the buffer
+ */
+bool nic_packet_gso_segment(Packet* packet, uint16_t index, Packet* segment);
+
+/**
+ * The queue pair a flow hash maps to
+ */
+uint16_t nic_rss_queue(NIC* nic, uint32_t hash);
+
 bool nic_has_srx(NIC* nic);
 Packet* nic_srx(NIC* nic);
 uint32_t nic_srx_size(NIC* nic);
 
 bool nic_tx(NIC* nic, Packet* packet);
 bool nic_try_tx(NIC* nic, Packet* packet);
+
+/**
+ * Transmit up to count packets.
+ * Unlike nic_tx(), packets which don't fit in the queue are not freed.
+ *
+ * @return number of packets queued
+ */
+uint32_t nic_tx_burst(NIC* nic, Packet** packets, uint32_t count);
 bool nic_tx_dup(NIC* nic, Packet* packet);
 bool nic_has_tx(NIC* nic);
 uint32_t nic_tx_size(NIC* nic);
@@ -149,12 +562,75 @@ bool nic_stx_dup(NIC* nic, Packet* packet);
 bool nic_has_stx(NIC* nic);
 uint32_t nic_stx_size(NIC* nic);
 
+/**
+ * Statistics block of the running core. Cores sharing an address space share
+ * a block like they share a pool cache, so counters are added atomically.
+ *
+ * @param offset statistics offset to trust (nic->stats or a private copy of it)
+ */
+NICStats* nic_stats(NIC* nic, uint32_t offset);
+
+/**
+ * Sum the statistics of every core. Traffic isn't stopped; each counter is
+ * read atomically but counters may be a few packets apart from each other.
+ *
+ * @param offset statistics offset to trust (nic->stats or a private copy of it)
+ */
+void nic_stats_snapshot(NIC* nic, uint32_t offset, NICStats* stats);
+
+/**
+ * Add a packet to the residency histogram
+ *
+ * @param time timer ticks at which the packet was queued (0: unknown, not counted)
+ * @param t current timer ticks
+ */
+void nic_stats_residency(NICCounters* counters, uint64_t time, uint64_t t);
+
 size_t nic_pool_used(NIC* nic);
 size_t nic_pool_free(NIC* nic);
 size_t nic_pool_total(NIC* nic);
 
+/**
+ * @return bytes of the buffers charged to the share of the NIC (0 if it has no quota)
+ */
+size_t nic_pool_charged(NIC* nic);
+
+/**
+ * Grow the pool by a block of buffers of a size class. The block must be
+ * mapped wherever the NIC is before it is given.
+ *
+ * @param pool layout the kernel trusts, updated together with the NIC's
+ * @param block NIC_POOL_EXTENT_SIZE aligned block above the NIC within 4GB of it
+ * @return index of the extent, -1 if the pool can't grow by the block
+ */
+int nic_pool_grow(NIC* nic, NICPool* pool, void* block, uint32_t size, int class);
+
+/**
+ * Take an extent out of the pool if none of its buffers is in use. The block
+ * may be unmapped and freed then.
+ *
+ * @return the block, NULL if the extent is in use or not in the pool
+ */
+void* nic_pool_shrink(NIC* nic, NICPool* pool, int index);
+
+/**
+ * Allocate a config entry of size bytes named name. Entries are found by an
+ * index of their names at the start of the config area (see NICConfigIndex).
+ *
+ * @return -1 name is too long or already allocated
+ * @return -2 no space to allocate
+ * @return otherwise key of the entry
+ */
 int32_t nic_config_alloc(NIC* nic, char* name, uint16_t size);
 void nic_config_free(NIC* nic, uint16_t key);
+
+/**
+ * Find the key of an entry in constant time.
+ *
+ * @return -1 name is too long
+ * @return -2 key of the name not found
+ * @return otherwise key of the name
+ */
 int32_t nic_config_key(NIC* nic, char* name);
 void* nic_config_get(NIC* nic, uint16_t key);
 uint16_t nic_config_size(NIC* nic, uint16_t key);
@@ -165,12 +641,12 @@ uint32_t nic_config_total(NIC* nic);
  * Initialize NIC memory map
  *
  * NIC metadata (magic, mac, ...)
- * Fast path rx queue
- * Fast path tx queue
+ * Fast path rx queues
+ * Fast path tx queues
  * Slow path rx queue
  * Slow path tx queue
- * Malloc bitmap
- * Malloc pool
+ * Pool caches
+ * Pool slabs
  *
  * @param base 2MBs aligned
  * @param size multiples of 2MBs
@@ -15,11 +15,25 @@
  * Packet data structure
  */
 
+#define PACKET_F_L3		(1 << 0)	///< l3 is valid
+#define PACKET_F_L4		(1 << 1)	///< l4 and l4_proto are valid
+#define PACKET_F_HASH		(1 << 2)	///< hash is valid
+#define PACKET_F_RX_CSUM	(1 << 3)	///< rx: the device verified the IP and TCP/UDP checksums
+#define PACKET_F_TX_CSUM	(1 << 4)	///< tx: the device fills in the TCP/UDP checksum, whose field holds the pseudo header sum (needs PACKET_F_L4)
+#define PACKET_F_TX_GSO		(1 << 5)	///< tx: the TCP frame is cut into segments of gso_size payload bytes (needs PACKET_F_L3 and PACKET_F_TX_CSUM)
+
 /**
  * Packet data structure
+ *
+ * Offload metadata (flags, hash, header offsets) is optional. Receivers fill
+ * it in as far as they know it; a packet fresh from the pool has none.
+ *
+ * A packet larger than a buffer is a chain of segments linked by next, each
+ * with data between its own start and end. time, VLAN and ref of the first
+ * segment are those of the whole packet.
  */
 typedef struct _Packet {
-	uint64_t	time;	    ///< epoch timestamp
+	uint64_t	time;	    ///< TSC when the packet was queued (rx or tx)
 
 	uint16_t	vlan_proto; ///< VLAN Protocol
 	uint16_t	vlan_tci;   ///< VLAN TCI
@@ -29,7 +43,17 @@ typedef struct _Packet {
 	uint16_t	end;	    ///< end offset
 
 	uint16_t	size;	    ///< size of allocated buffer
-	uint8_t		buffer[0];  ///< data buffer
+	volatile uint16_t ref;	    ///< number of queues the buffer is in, read-only while more than 1 (see nic_packet_unshare())
+	uint32_t	next;	    ///< NIC offset of the next segment (0: last segment)
+
+	uint32_t	hash;	    ///< Flow hash of nic_rss_hash() (PACKET_F_HASH)
+	uint8_t		flags;	    ///< PACKET_F_XXX
+	uint8_t		l3;	    ///< Network header offset from start (PACKET_F_L3)
+	uint8_t		l4;	    ///< Transport header offset from start (PACKET_F_L4)
+	uint8_t		l4_proto;   ///< IP protocol number of the transport header (PACKET_F_L4)
+	uint8_t		share;	    ///< Pool share the buffer is charged to (NIC_POOL_SHARE_NONE: none)
+	uint16_t	gso_size;   ///< TCP payload bytes per segment, the MSS (PACKET_F_TX_GSO)
+	uint8_t		buffer[0] __attribute__((__aligned__(8)));  ///< data buffer
 } Packet;
 
 #endif /*__PACKET_H__*/
@@ -0,0 +1,103 @@
+#ifndef __SHAPER_H__
+#define __SHAPER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file
+ * Hierarchical token bucket shaping.
+ *
+ * A bucket limits bandwidth and packet rate with a burst allowance and may have
+ * a parent bucket of the class it belongs to (VNIC, VM, NIC device). Traffic
+ * conforms while no bucket up the hierarchy is in debt; it is then charged to
+ * every one of them. A bucket may go into debt by the packets of one burst and
+ * pays it back before any more traffic conforms, so the long term rate stays exact.
+ *
+ * The pollers of several queue pairs share the bucket of their device, and
+ * the VNICs of a VM the bucket of the VM, so each bucket is locked while its
+ * tokens are refilled, checked or charged. The locks are taken one at a time
+ * up the hierarchy: tokens are never lost, but cores conforming at once may
+ * all be charged, which is paid back as a debt like a burst.
+ */
+
+#define TOKEN_BUCKET_BURST_TIME		100	///< Default burst allowance is 1/100 second of the rate
+#define TOKEN_BUCKET_MIN_BURST		65536	///< Minimum default burst allowance in bytes
+#define TOKEN_BUCKET_MIN_PACKET_BURST	32	///< Minimum default burst allowance in packets
+
+/**
+ * Token bucket
+ * Tokens are kept multiplied by the timer frequency so that refilling is exact.
+ */
+typedef struct _TokenBucket {
+	uint64_t	frequency;		///< Timer frequency per second
+	uint64_t	rate;			///< Bandwidth in bps (0: unlimited)
+	uint64_t	packet_rate;		///< Packet rate in pps (0: unlimited)
+	int64_t		depth;			///< Burst allowance in bits times frequency
+	int64_t		packet_depth;		///< Burst allowance in packets times frequency
+	int64_t		tokens;			///< Available bits times frequency, negative in debt
+	int64_t		packet_tokens;		///< Available packets times frequency, negative in debt
+	uint64_t	last;			///< Time tokens were added last
+	volatile uint8_t lock;			///< Held while the tokens are refilled, checked or charged
+	struct _TokenBucket* parent;		///< Bucket of the enclosing class, NULL for the root
+} TokenBucket;
+
+/**
+ * Initialize a token bucket. It starts full.
+ *
+ * @param bucket token bucket
+ * @param frequency timer frequency per second. 0 disables the limits
+ * @param rate bandwidth in bps (0: unlimited)
+ * @param burst burst allowance in bytes (0: default)
+ * @param packet_rate packet rate in pps (0: unlimited)
+ * @param packet_burst burst allowance in packets (0: default)
+ * @param parent bucket of the enclosing class or NULL
+ */
+void token_bucket_init(TokenBucket* bucket, uint64_t frequency, uint64_t rate, uint64_t burst,
+		uint64_t packet_rate, uint64_t packet_burst, TokenBucket* parent);
+
+/**
+ * Change the limits of a bucket without resetting it. Tokens above the new
+ * depth are dropped and a debt is kept, so the change doesn't let a burst through.
+ *
+ * @param bucket token bucket initialized by token_bucket_init()
+ * @param rate bandwidth in bps (0: unlimited)
+ * @param burst burst allowance in bytes (0: default)
+ * @param packet_rate packet rate in pps (0: unlimited)
+ * @param packet_burst burst allowance in packets (0: default)
+ */
+void token_bucket_update(TokenBucket* bucket, uint64_t rate, uint64_t burst, uint64_t packet_rate, uint64_t packet_burst);
+
+/**
+ * Check if traffic conforms to the bucket and every parent of it
+ *
+ * @param bucket token bucket
+ * @param t current time in timer ticks
+ *
+ * @return true if no bucket of the hierarchy is in debt
+ */
+bool token_bucket_conform(TokenBucket* bucket, uint64_t t);
+
+/**
+ * Charge traffic to the bucket and every parent of it
+ *
+ * @param bucket token bucket
+ * @param t current time in timer ticks
+ * @param bytes number of bytes
+ * @param packets number of packets
+ */
+void token_bucket_charge(TokenBucket* bucket, uint64_t t, uint64_t bytes, uint32_t packets);
+
+/**
+ * Charge traffic if it conforms
+ *
+ * @param bucket token bucket
+ * @param t current time in timer ticks
+ * @param bytes number of bytes
+ * @param packets number of packets
+ *
+ * @return true if the traffic conformed and was charged
+ */
+bool token_bucket_consume(TokenBucket* bucket, uint64_t t, uint64_t bytes, uint32_t packets);
+
+#endif /* __SHAPER_H__ */
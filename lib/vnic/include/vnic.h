@@ -2,9 +2,24 @@
 #define __VNIC_H__
 
 #include "nic.h"
+#include "shaper.h"
+#include "budget.h"
+#include "codel.h"
 
 #define _IFNAMSIZ		16
 #define MAX_VNIC_COUNT		8
+#define VNIC_BURST_SIZE		32	///< Number of packets staged by vnic_rx_stage() before they are flushed
+#define VNIC_TX_QUANTUM_SIZE	9216	///< Default bytes a VNIC may send per round of vnic_tx_schedule(), one jumbo frame
+
+#define VNIC_PRESSURE_QUEUE	(1 << 0)	///< Every rx queue is full (see vnic_rx_pressure())
+#define VNIC_PRESSURE_POOL	(1 << 1)	///< The pool has run out of buffers for received frames
+
+#define VNIC_POOL_LOW		8	///< A pool grows when less than 1/VNIC_POOL_LOW of the buffers of a class are free
+#define VNIC_MTU_DEFAULT	1500	///< Largest frame payload unless told (see VNIC_MTU)
+
+#define VNIC_TX_GSO_TCPV4	(1 << 0)	///< The transmitter segments TCP/IPv4 frames asking for it (PACKET_F_TX_GSO)
+#define VNIC_TX_GSO_TCPV6	(1 << 1)	///< The transmitter segments TCP/IPv6 frames asking for it
+#define VNIC_GSO_MAX_SEGMENTS	64		///< Most segments the VNIC cuts a frame into for a transmitter which can't
 
 /**
  * @file Virtual NIC
@@ -41,6 +56,25 @@ typedef enum {
 	VNIC_RX_ACCEPT,			///< List of accept MAC addresses to receive
 	VNIC_TX_ACCEPT_ALL,		///< To accept all packets to send
 	VNIC_TX_ACCEPT,			///< List of accept MAC addresses to send
+
+	VNIC_RX_QUEUE_FLAGS,		///< NIC_QUEUE_F_XXX of rx and slowpath rx queues (default single producer/consumer)
+	VNIC_TX_QUEUE_FLAGS,		///< NIC_QUEUE_F_XXX of tx and slowpath tx queues (default single producer/consumer)
+	VNIC_GROUP,			///< VNICs of the same group are mapped together and share received packets (default 0: none)
+	VNIC_QUEUE_COUNT,		///< Number of rx/tx queue pairs with NIC_F_MULTIQUEUE (default 1)
+	VNIC_RX_BURST,			///< Input burst allowance in bytes (default 1/100 second of the bandwidth)
+	VNIC_TX_BURST,			///< Output burst allowance in bytes (default 1/100 second of the bandwidth)
+	VNIC_RX_PACKET_RATE,		///< Input packet rate in pps (default 0: unlimited)
+	VNIC_TX_PACKET_RATE,		///< Output packet rate in pps (default 0: unlimited)
+	VNIC_TX_QUANTUM,		///< Bytes sent per round of Deficit Round Robin, the weight of the VNIC (default VNIC_TX_QUANTUM_SIZE)
+	VNIC_TX_PRIORITY,		///< Nonzero to be in the strict priority class, served before the others (default 0)
+	VNIC_BUDGET_MIN,		///< Least polling limit the budget adapts down to (default 0: VNIC_BUDGET, fixed)
+	VNIC_BUDGET_MAX,		///< Most polling limit the budget adapts up to (default 0: VNIC_BUDGET, fixed)
+	VNIC_RX_CODEL_TARGET,		///< Target sojourn time of rx queues in microseconds with NIC_F_CODEL (default CODEL_TARGET)
+	VNIC_RX_CODEL_INTERVAL,		///< CoDel interval of rx queues in microseconds with NIC_F_CODEL (default CODEL_INTERVAL)
+	VNIC_POOL_SHARED,		///< VNIC* holding the pool to allocate buffers from instead of its own (default NULL: own pool)
+	VNIC_POOL_QUOTA,		///< Most bytes of buffers allocated by the VNIC at once (default 0: unlimited)
+	VNIC_POOL_MAX_SIZE,		///< Most bytes the pool grows to by blocks of NIC_POOL_EXTENT_SIZE (default 0: VNIC_POOL_SIZE, fixed)
+	VNIC_MTU,			///< Largest payload of a frame sent or received in one buffer, above 2KB the pool keeps jumbo buffers (default VNIC_MTU_DEFAULT)
 } VNICAttributes;
 
 /**
@@ -60,6 +94,29 @@ typedef enum _VNICError {
 	VNIC_ERROR_UNSUPPORTED,		    ///<Unsupported operation were requested
 } VNICError;
 
+/**
+ * Attributes vnic_update() may change while traffic flows
+ */
+typedef struct _VNICConfig {
+	uint64_t	mac;			///< MAC address
+	uint64_t	flags;			///< NIC_F_XXX but NIC_F_MULTIQUEUE and NIC_F_SHARED_POOL
+	uint16_t	budget;			///< Polling limit
+	uint16_t	budget_min;		///< Least polling limit (0: budget)
+	uint16_t	budget_max;		///< Most polling limit (0: budget)
+	uint16_t	padding_head;		///< Leading padding of packet buffer
+	uint16_t	padding_tail;		///< Trailing padding of packet buffer
+	uint64_t	rx_bandwidth;		///< Input bandwidth in bps
+	uint64_t	tx_bandwidth;		///< Output bandwidth in bps
+	uint64_t	rx_burst;		///< Input burst allowance in bytes (0: default)
+	uint64_t	tx_burst;		///< Output burst allowance in bytes (0: default)
+	uint64_t	rx_packet_rate;		///< Input packet rate in pps (0: unlimited)
+	uint64_t	tx_packet_rate;		///< Output packet rate in pps (0: unlimited)
+	uint32_t	tx_quantum;		///< Bytes sent per round of Deficit Round Robin
+	uint8_t		tx_priority;		///< In the strict priority class
+	uint32_t	rx_codel_target;	///< Target sojourn time of rx queues in microseconds
+	uint32_t	rx_codel_interval;	///< CoDel interval of rx queues in microseconds
+} VNICConfig;
+
 /**
  * Virtual NIC
  */
@@ -69,6 +126,11 @@ typedef struct _VNIC {
 	uint32_t	nic_size;		    ///< Pool size of associated NIC (multiples of 2MB)
 	char		parent[MAX_NIC_NAME_LEN];   ///< Name of parent NICDevice
 	NICPool		pool;			    ///< Pool of this VNIC
+	NIC*		pool_nic;		    ///< NIC holding the pool, nic unless it is shared (see VNIC_POOL_SHARED)
+	uint8_t		pool_shares;		    ///< Shares of the pool given out, in the holder
+	uint64_t	pool_max;		    ///< Most bytes of nic_size and the extents of the pool
+	uint64_t	pool_idle[NIC_POOL_EXTENT_COUNT];   ///< Time since each extent has had all its buffers free (0: in use)
+	uint32_t	group;			    ///< VNICs of the same group share broadcast and multicast packets (0: none)
 
 	// Information
 	uint64_t	magic;			///< Magic
@@ -77,24 +139,15 @@ typedef struct _VNIC {
 	uint64_t	mac;			///< MAC Address. (copied from NIC)
 	uint16_t	vlan_proto; 		///< VLAN Protocol
 	uint16_t	vlan_tci;   		///< VLAN TCI
-	uint16_t	budget;			///< Polling limit
+	uint16_t	budget;			///< Polling limit, adapted by poll between its bounds
+	PollBudget	poll;			///< Budget controller
 	uint64_t	flags;				///< Flags
-
-	// Buffers
-	NICQueue	rx;			///< Rx queue
-	NICQueue	tx;			///< Tx queue
-	NICQueue	srx;			///< Rx Queue for slowpath
-	NICQueue	stx;			///< Tx Queue for slowpath
+	uint16_t	queue_count;		///< Number of rx/tx queue pairs (copied from NIC)
+	uint16_t	tx_queue;		///< Tx queue to serve first next time
+	uint8_t		tx_gso;			///< VNIC_TX_GSO_XXX of the device, set by the kernel. Other frames are segmented by the VNIC
 
 	// Statistics
-	uint64_t	input_bytes;		///< Total input bytes
-	uint64_t	input_packets;		///< Total input packets
-	uint64_t	input_drop_bytes;	///< Total dropped input bytes
-	uint64_t	input_drop_packets;	///< Total dropped input packets
-	uint64_t	output_bytes;		///< Total output bytes
-	uint64_t	output_packets;		///< Total output packets
-	uint64_t	output_drop_bytes;	///< Total dropped output bytes
-	uint64_t	output_drop_packets;	///< Total dropped output packets
+	uint32_t	stats;			///< Offset of the per-core statistics (copied from NIC, see vnic_stats())
 
 	uint16_t	padding_head;		///< Leading padding of packet buffer
 	uint16_t	padding_tail;		///< Trailing padding of packet buffer
@@ -102,12 +155,23 @@ typedef struct _VNIC {
 	// Constraint
 	uint64_t	rx_bandwidth;		///< Rx threshold
 	uint64_t	tx_bandwidth;		///< Tx threshold
-	uint64_t	rx_wait;		///< Amount of time to wait to adjust the rx bandwidth
-	uint64_t	rx_wait_grace;		///< Amount of time to wait to adjust the rx bandwidth gracefully
-	uint64_t	tx_wait;		///< Amount of time to wait to adjust the tx bandwidth
-	uint64_t	tx_wait_grace;		///< Amount of time to wait to adjust the tx bandwidth gracefully
-	uint64_t	rx_closed;		///< The next receivable frequency
-	uint64_t	tx_closed;		///< The next transmittable frequency
+	TokenBucket	rx_bucket;		///< Rx shaper. Its parent is set by the VM owning the VNIC
+	TokenBucket	tx_bucket;		///< Tx shaper. Its parent is set by the VM owning the VNIC
+	uint8_t		tx_priority;		///< In the strict priority class of vnic_tx_schedule()
+	uint32_t	tx_quantum;		///< Bytes added to the deficit each round
+	int64_t		tx_deficit;		///< Bytes which may be sent in this round
+	CoDel		rx_codel[NIC_MAX_QUEUE_COUNT];	///< AQM of each rx queue, applied with NIC_F_CODEL
+	volatile uint8_t rx_pressure;		///< VNIC_PRESSURE_POOL from a frame finding no buffer until one finds one again
+
+	// Configuration
+	VNICConfig	config;			///< Latest configuration, written by vnic_update()
+	volatile uint32_t config_version;	///< Version of config, odd while vnic_update() writes it
+	uint32_t	config_applied;		///< Version of config the fast path runs with
+
+	// Burst
+	Packet*		rx_burst[VNIC_BURST_SIZE];	///< Packets staged by vnic_rx_stage(), vnic_rx_stage2() and vnic_rx_fanout()
+	uint16_t	rx_burst_count;		///< Number of staged packets
+	volatile uint8_t rx_lock;		///< Held while staging or flushing by a device polled from several cores
 } VNIC;
 
 /**
@@ -119,6 +183,10 @@ void vnic__init_timer(uint64_t freq_per_sec);
 
 /**
  * Initialize VNIC
+ *
+ * With VNIC_POOL_SHARED the VNIC allocates from the pool of the holder VNIC,
+ * which must have been initialized first, have another ID, and outlive it.
+ * Both NICs must be registered for the VM to follow the buffers.
  *
  * @param vnic Virtual NIC
  * @param attrs Attributes used to initialize the VNIC.
@@ -151,6 +219,19 @@ void vnic_free_id(int id);
  */
 Packet* vnic_alloc(VNIC* vnic, size_t size);
 
+/**
+ * Allocate a buffer for a driver to receive a frame into, for vnic_rx_stage2()
+ * Buffers aren't given out while the pool is under pressure, so that the
+ * driver receives into its own buffers and the VM's are left to the frames
+ * copied to it.
+ *
+ * @param vnic Virtual NIC
+ * @param size buffer size
+ *
+ * @return newly created packet, NULL if the pool is out of buffers
+ */
+Packet* vnic_rx_alloc(VNIC* vnic, size_t size);
+
 /**
  * Free packet buffer
  *
@@ -160,15 +241,32 @@ Packet* vnic_alloc(VNIC* vnic, size_t size);
 bool vnic_free(VNIC* vnic, Packet* packet);
 
 /**
- * Update the attributes of the VNIC
+ * Update the attributes of the VNIC while traffic flows
+ *
+ * The new configuration is published as a versioned record. The fast path
+ * picks it up without locking the next time it receives or transmits for the
+ * VNIC, so traffic is neither stopped nor dropped. Shapers keep their state.
+ * Only one vnic_update() may run at a time for a VNIC.
+ *
+ * The attributes of VNICConfig may be changed. VNIC_DEV and VNIC_POOL_SIZE may
+ * be given unchanged; the queues, the pool, NIC_F_MULTIQUEUE and NIC_F_SHARED_POOL can't change.
  *
  * @param nic Virtual NIC
- * @param attrs attributes used to update the VNIC.
+ * @param attrs attributes to change, ending with VNIC_NONE
  *
- * @return VNIC_ERROR_NOERROR for success, error number for failure
+ * @return VNIC_ERROR_NOERROR for success, VNIC_ERROR_UNSUPPORTED for an attribute
+ * which can't be changed, VNIC_ERROR_ATTRIBUTE_INVALID for an invalid value
  */
 VNICError vnic_update(VNIC* nic, uint64_t* attrs);
 
+/**
+ * Snapshot of the statistics of the VNIC, summed over the cores writing them
+ *
+ * @param vnic Virtual NIC
+ * @param stats statistics to fill
+ */
+void vnic_stats(VNIC* vnic, NICStats* stats);
+
 // Fastpath Rx/Tx
 /**
  * Check if there is received data
@@ -182,6 +280,8 @@ bool vnic_has_rx(VNIC* vnic);
 /**
  * Receive a packet data
  * This function is mainly called to pass the packet received from NICDev to the VNIC
+ * With NIC_F_CODEL, packets are dropped by CoDel before they join a standing queue,
+ * here and in vnic_rx_burst(), vnic_rx_flush() and vnic_rx2().
 
  * @param vnic Virtual NIC
  * @param buf1 packet data
@@ -193,6 +293,136 @@ bool vnic_has_rx(VNIC* vnic);
  */
 VNICError vnic_rx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2);
 
+/**
+ * Receive a packet data without publishing it yet
+ * The packet is copied into the VNIC pool and staged. Staged packets are pushed
+ * to the rx queue at once by vnic_rx_flush() or when VNIC_BURST_SIZE packets are staged
+ *
+ * @param vnic Virtual NIC
+ * @param buf1 packet data
+ * @param size1 packet data length
+ * @param buf2 optional packet data
+ * @param size2 optional packet data length
+ *
+ * @return VNIC_ERROR_NOERROR for success, error number for failure
+ */
+VNICError vnic_rx_stage(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2);
+
+/**
+ * vnic_rx_stage() for drivers which know more of the frame than its data
+ *
+ * @param flags PACKET_F_RX_CSUM if the device verified the checksums
+ */
+VNICError vnic_rx_stage0(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2, uint8_t flags);
+
+/**
+ * Stage a packet which is already in the VNIC pool, without copying it
+ * Drivers use it for frames received directly into buffers of vnic_alloc()
+ * and may set PACKET_F_RX_CSUM in its flags
+ *
+ * @param vnic Virtual NIC
+ * @param packet packet allocated from the VNIC pool. It is freed if dropped
+ *
+ * @return VNIC_ERROR_NOERROR for success, error number for failure
+ */
+VNICError vnic_rx_stage2(VNIC* vnic, Packet* packet);
+
+/**
+ * Stage a packet data to several VNICs at once
+ * VNICs of the same group with the same paddings get one shared copy whose
+ * reference count is the number of them; the buffer goes back to the pool
+ * when every consumer has freed it. The others get a copy of their own.
+ *
+ * @param vnics destination VNICs
+ * @param count number of destination VNICs
+ * @param buf1 packet data
+ * @param size1 packet data length
+ * @param buf2 optional packet data
+ * @param size2 optional packet data length
+ *
+ * @return number of VNICs the packet is staged to
+ */
+uint32_t vnic_rx_fanout(VNIC** vnics, uint32_t count, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2);
+
+/**
+ * @param flags PACKET_F_RX_CSUM if the device verified the checksums
+ */
+uint32_t vnic_rx_fanout0(VNIC** vnics, uint32_t count, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2, uint8_t flags);
+
+/**
+ * Push the packets staged by vnic_rx_stage() to the rx queue
+ *
+ * @param vnic Virtual NIC
+ *
+ * @return number of packets received
+ */
+uint32_t vnic_rx_flush(VNIC* vnic);
+
+/**
+ * Receive packets with a single rx queue update
+ * Packets which don't fit in the rx queue are freed and counted as dropped
+ *
+ * @param vnic Virtual NIC
+ * @param packets packets allocated from the VNIC pool
+ * @param count number of packets
+ *
+ * @return number of packets received
+ */
+uint32_t vnic_rx_burst(VNIC* vnic, Packet** packets, uint32_t count);
+
+/**
+ * Backpressure of the VNIC toward the device receiving for it
+ * With VNIC_PRESSURE_QUEUE frames would be dropped as NIC_DROP_QUEUE_FULL, so
+ * the device may leave them in its own ring until the VM takes packets. With
+ * VNIC_PRESSURE_POOL the driver should stop refilling its ring with buffers of
+ * the VNIC (see vnic_rx_alloc()).
+ *
+ * @param vnic Virtual NIC
+ *
+ * @return VNIC_PRESSURE_XXX, 0 if the VNIC takes frames
+ */
+uint32_t vnic_rx_pressure(VNIC* vnic);
+
+/**
+ * Size class the pool of the VNIC should grow by: the one with the least
+ * share of its buffers free, if less than 1/VNIC_POOL_LOW of them or the pool
+ * is under pressure. A shared pool doesn't grow.
+ *
+ * @param vnic Virtual NIC
+ *
+ * @return size class, -1 if the pool has enough buffers or is as large as it may be
+ */
+int vnic_pool_grow_class(VNIC* vnic);
+
+/**
+ * Grow the pool of the VNIC by a block of NIC_POOL_EXTENT_SIZE, which the VM
+ * must have mapped already (see nic_pool_grow()).
+ *
+ * @param vnic Virtual NIC
+ * @param block block above the NIC
+ * @param class size class of vnic_pool_grow_class()
+ *
+ * @return false if the pool can't grow by the block
+ */
+bool vnic_pool_grow(VNIC* vnic, void* block, int class);
+
+/**
+ * Take an extent out of the pool of the VNIC if all its buffers have been
+ * free for idle microseconds. The block is to be unmapped from the VM before
+ * it is freed.
+ *
+ * @param vnic Virtual NIC
+ * @param idle microseconds
+ *
+ * @return the block taken out, NULL if none is idle
+ */
+void* vnic_pool_shrink(VNIC* vnic, uint64_t idle);
+
+/**
+ * @return bytes of nic_size and the blocks the pool has grown by
+ */
+uint64_t vnic_pool_size(VNIC* vnic);
+
 /**
  * Receive a Packet
  * This function is used to exchange data between VNICs
@@ -225,6 +455,52 @@ bool vnic_has_tx(VNIC* vnic);
  */
 VNICError vnic_tx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context);
 
+/**
+ * Sends up to count queued packets, popping them from the tx queue in bursts
+ * Packets which don't conform to the tx shaper stay queued
+ *
+ * @param vnic Virtual NIC
+ * @param count maximum number of packets to send. Number of packets sent on return
+ * @param transmitter Driver function that transmit packets
+ * @param transmitter_context Driver function context
+ *
+ * @return VNIC_ERROR_NOERROR for success,
+ * VNIC_ERROR_RESOURCE_NOT_AVAILABLE when there is nothing to send and
+ * VNIC_ERROR_OPERATION_FAILED when the transmitter failed
+ */
+VNICError vnic_tx_burst(VNIC* vnic, uint32_t* count, bool (*transmitter)(Packet*, void*), void* transmitter_context);
+
+/**
+ * Sends queued packets while they fit in the deficit of the VNIC (Deficit Round Robin)
+ * The quantum is added to the deficit first. A VNIC whose tx queues get empty loses its deficit
+ *
+ * @param vnic Virtual NIC
+ * @param count maximum number of packets to send. Number of packets sent on return
+ * @param transmitter Driver function that transmit packets
+ * @param transmitter_context Driver function context
+ *
+ * @return same as vnic_tx_burst()
+ */
+VNICError vnic_tx_drr(VNIC* vnic, uint32_t* count, bool (*transmitter)(Packet*, void*), void* transmitter_context);
+
+/**
+ * Sends queued packets of VNICs sharing a device
+ * VNICs of the strict priority class send up to their budget first, then the others get one
+ * round of Deficit Round Robin. Only the tx shapers bound the strict priority class.
+ * The budget of a VNIC adapts to its tx backlog between VNIC_BUDGET_MIN and VNIC_BUDGET_MAX.
+ *
+ * @param vnics VNICs of the device
+ * @param count number of VNICs
+ * @param round VNIC to start the round with. It is updated for the next call
+ * @param bucket tx shaper of the device charged by the transmitter, checked before each VNIC (optional)
+ * @param transmitter Driver function that transmit packets
+ * @param transmitter_context Driver function context
+ *
+ * @return number of packets sent
+ */
+uint32_t vnic_tx_schedule(VNIC** vnics, uint32_t count, uint16_t* round, TokenBucket* bucket,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context);
+
 // Slowpath Rx/Tx
 /**
  * Check if there is received slowpath data
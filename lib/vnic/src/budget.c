@@ -0,0 +1,45 @@
+#include <budget.h>
+
+uint16_t poll_budget_init(PollBudget* poll, uint16_t min, uint16_t max, uint16_t budget) {
+	poll->min = min ? : budget;
+	poll->max = max ? : budget;
+	if(poll->max < poll->min)
+		poll->max = poll->min;
+
+	if(budget < poll->min)
+		budget = poll->min;
+	else if(budget > poll->max)
+		budget = poll->max;
+
+	poll->average = (uint32_t)budget * POLL_BUDGET_SCALE;
+
+	return budget;
+}
+
+uint16_t poll_budget_update(PollBudget* poll, uint16_t budget, uint32_t work, uint32_t backlog) {
+	if(!poll_budget_adaptive(poll))
+		return budget;
+
+	if(work > budget)
+		work = budget;
+
+	poll->average += ((work * POLL_BUDGET_SCALE) >> POLL_BUDGET_SHIFT) - (poll->average >> POLL_BUDGET_SHIFT);
+
+	uint32_t next = budget;
+	if(work == budget && backlog > 0) {
+		// The budget held the queue back
+		next = (uint32_t)budget * 2;
+	} else {
+		// Twice the average work is left for bursts; a quarter of the excess goes each round
+		uint32_t target = poll->average * 2 / POLL_BUDGET_SCALE + 1;
+		if(next > target)
+			next -= (next - target + 3) / 4;
+	}
+
+	if(next < poll->min)
+		next = poll->min;
+	else if(next > poll->max)
+		next = poll->max;
+
+	return next;
+}
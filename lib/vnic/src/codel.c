@@ -0,0 +1,80 @@
+#include <codel.h>
+
+void codel_init(CoDel* codel, uint64_t target, uint64_t interval) {
+	codel->target = target;
+	codel->interval = interval;
+	codel->first_above = 0;
+	codel->drop_next = 0;
+	codel->count = 0;
+	codel->last_count = 0;
+	codel->dropping = false;
+}
+
+static uint64_t isqrt(uint64_t x) {
+	uint64_t root = 0;
+	uint64_t bit = (uint64_t)1 << 62;
+	while(bit > x)
+		bit >>= 2;
+
+	while(bit) {
+		if(x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+// Next drop is interval / sqrt(count) after t; the root is taken in 16.16 fixed point
+static uint64_t control_law(CoDel* codel, uint64_t t) {
+	return t + (codel->interval << 16) / isqrt((uint64_t)codel->count << 32);
+}
+
+bool codel_drop(CoDel* codel, uint64_t t, uint64_t sojourn, uint32_t backlog) {
+	if(codel->interval == 0)
+		return false;
+
+	// A single packet queued is no standing queue
+	bool ok_to_drop = false;
+	if(sojourn < codel->target || backlog <= 1) {
+		codel->first_above = 0;
+	} else if(codel->first_above == 0) {
+		codel->first_above = t + codel->interval;
+	} else if(t >= codel->first_above) {
+		ok_to_drop = true;
+	}
+
+	if(codel->dropping) {
+		if(!ok_to_drop) {
+			codel->dropping = false;
+			return false;
+		}
+
+		if(t < codel->drop_next)
+			return false;
+
+		codel->count++;
+		codel->drop_next = control_law(codel, codel->drop_next);
+
+		return true;
+	}
+
+	if(!ok_to_drop)
+		return false;
+
+	// Back to dropping soon after it stopped: go on at about the rate it stopped with
+	codel->dropping = true;
+	uint32_t delta = codel->count - codel->last_count;
+	if(delta > 1 && (int64_t)(t - codel->drop_next) < (int64_t)(16 * codel->interval))
+		codel->count = delta;
+	else
+		codel->count = 1;
+	codel->last_count = codel->count;
+	codel->drop_next = control_law(codel, t);
+
+	return true;
+}
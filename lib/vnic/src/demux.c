@@ -0,0 +1,144 @@
+#include <string.h>
+#include <demux.h>
+
+#define ETHER_BROADCAST		0xffffffffffff		///< MAC address is broadcast
+#define ETHER_MULTICAST		((uint64_t)1 << 40)	///< MAC address is multicast
+
+static inline uint64_t key_of(uint16_t vid, uint64_t mac) {
+	return (uint64_t)(vid & 0xfff) << 48 | (mac & 0xffffffffffff);
+}
+
+// Fibonacci hashing; the upper bits of the product mix every bit of the key
+static inline uint32_t slot_of(uint64_t key) {
+	return (key * 0x9e3779b97f4a7c15UL) >> (64 - VNIC_DEMUX_BITS);
+}
+
+void vnic_demux_init(VNICDemux* demux) {
+	memset(demux, 0, sizeof(VNICDemux));
+}
+
+bool vnic_demux_add(VNICDemux* demux, uint16_t vid, uint64_t mac, VNIC* vnic) {
+	if(demux->count >= VNIC_DEMUX_SIZE / 2)
+		return false;
+
+	uint64_t key = key_of(vid, mac);
+	uint32_t slot = slot_of(key);
+	while(demux->entries[slot].vnic) {
+		if(demux->entries[slot].key == key)
+			return false;
+
+		slot = (slot + 1) & (VNIC_DEMUX_SIZE - 1);
+	}
+
+	demux->entries[slot].key = key;
+	demux->entries[slot].vnic = vnic;
+	demux->count++;
+
+	return true;
+}
+
+static int find(VNICDemux* demux, uint64_t key) {
+	for(uint32_t slot = slot_of(key); demux->entries[slot].vnic; slot = (slot + 1) & (VNIC_DEMUX_SIZE - 1)) {
+		if(demux->entries[slot].key == key)
+			return slot;
+	}
+
+	return -1;
+}
+
+VNIC* vnic_demux_remove(VNICDemux* demux, uint16_t vid, uint64_t mac) {
+	int slot = find(demux, key_of(vid, mac));
+	if(slot < 0)
+		return NULL;
+
+	VNIC* vnic = demux->entries[slot].vnic;
+	demux->count--;
+
+	// Entries after the hole which can't be reached any more are moved into it
+	uint32_t hole = slot;
+	uint32_t next = hole;
+	while(true) {
+		demux->entries[hole].vnic = NULL;
+
+		while(true) {
+			next = (next + 1) & (VNIC_DEMUX_SIZE - 1);
+			if(!demux->entries[next].vnic)
+				return vnic;
+
+			// The entry stays unless its home slot is cyclically in (hole, next]
+			uint32_t home = slot_of(demux->entries[next].key);
+			if(((next - home) & (VNIC_DEMUX_SIZE - 1)) >= ((next - hole) & (VNIC_DEMUX_SIZE - 1)))
+				break;
+		}
+
+		demux->entries[hole] = demux->entries[next];
+		hole = next;
+	}
+}
+
+VNIC* vnic_demux_get(VNICDemux* demux, uint16_t vid, uint64_t mac) {
+	int slot = find(demux, key_of(vid, mac));
+
+	return slot < 0 ? NULL : demux->entries[slot].vnic;
+}
+
+void vnic_subscribers_build(VNICSubscribers* subscribers, VNIC** vnics, int count) {
+	int index = 0;
+	for(int i = 0; i < count; i++) {
+		if(vnics[i]->config.flags & NIC_F_PROMISC)
+			subscribers->vnics[index++] = vnics[i];
+	}
+	subscribers->promisc = index;
+
+	for(int i = 0; i < count; i++) {
+		uint64_t flags = vnics[i]->config.flags;
+		if(!(flags & NIC_F_PROMISC) && flags & NIC_F_MULTICAST)
+			subscribers->vnics[index++] = vnics[i];
+	}
+	subscribers->multicast = index;
+
+	for(int i = 0; i < count; i++) {
+		uint64_t flags = vnics[i]->config.flags;
+		if(!(flags & (NIC_F_PROMISC | NIC_F_MULTICAST)) && flags & NIC_F_BROADCAST)
+			subscribers->vnics[index++] = vnics[i];
+	}
+	subscribers->broadcast = index;
+}
+
+int vnic_demux_targets(VNICDemux* demux, VNICSubscribers* subscribers, uint16_t vid, uint64_t dmac,
+		VNIC** targets, bool* is_complete) {
+	*is_complete = false;
+
+	if(dmac & ETHER_MULTICAST) {
+		int count = dmac == ETHER_BROADCAST ? subscribers->broadcast : subscribers->multicast;
+		memcpy(targets, subscribers->vnics, count * sizeof(VNIC*));
+
+		return count;
+	}
+
+	int count = 0;
+	VNIC* vnic = vnic_demux_get(demux, vid, dmac);
+	if(vnic) {
+		targets[count++] = vnic;
+		*is_complete = true;
+	}
+
+	for(int i = 0; i < subscribers->promisc; i++) {
+		if(subscribers->vnics[i] != vnic)
+			targets[count++] = subscribers->vnics[i];
+	}
+
+	return count;
+}
+
+VNIC* vnic_rx_owner(VNIC** vnics, int count) {
+	for(int i = 0; i < count; i++) {
+		if(vnics[i]->config.flags & NIC_F_PROMISC)
+			return NULL;
+
+		if(i > 0 && (!vnics[0]->group || vnics[i]->group != vnics[0]->group))
+			return NULL;
+	}
+
+	return count ? vnics[0] : NULL;
+}
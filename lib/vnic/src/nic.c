@@ -5,8 +5,157 @@
 
 NIC* __nics[NIC_MAX_COUNT];
 int __nic_count;
+uint32_t __nic_generation;
+
+#define NIC_BLOCK_SHIFT		21	// 2MB
+#define NIC_BLOCK_TABLE_SIZE	(NIC_MAX_COUNT * (NIC_MAX_SIZE >> NIC_BLOCK_SHIFT) << 1)
+
+/*
+ * Registry of __nics: NIC by ID and NIC by 2MB block. Blocks are indexed by
+ * the low bits of the block number with linear probing; the table is kept
+ * at most half full. Blocks a pool has grown by are not in it, as
+ * applications aren't told when one goes to another NIC; they carry the NIC
+ * in their header instead.
+ *
+ * Whoever changes __nics bumps __nic_generation, and the registry is rebuilt
+ * whenever it was built for another generation. Applications get __nics
+ * written by the kernel before they start. A registry is never changed
+ * while it is published: the other one is built and then published in its
+ * place, so lookups on other cores see the old or the new one as a whole,
+ * unless __nics changes twice during one lookup.
+ */
+typedef struct {
+	uintptr_t	block;
+	NIC*		nic;
+} NICBlock;
+
+typedef struct {
+	uint32_t	generation;			///< __nic_generation it was built for
+	NIC*		ids[NIC_MAX_ID];
+	NICBlock	blocks[NIC_BLOCK_TABLE_SIZE];
+} NICRegistry;
+
+static NICRegistry nic_registries[2];
+static NICRegistry* volatile nic_registry;	///< Published registry, NULL until the first lookup
+static volatile uint8_t nic_registry_lock;	///< Held while a registry is built
+
+static uint32_t nic_block_count(NIC* nic) {
+	// The buffers of a shared pool are in the holder's blocks
+	if(nic->pool.owner != nic->id)
+		return 1;
+
+	NICSlab* slab = &nic->pool.slabs[NIC_POOL_CLASS_COUNT - 1];
+	uint64_t size = (uint64_t)slab->base + (uint64_t)slab->count * slab->size;
+	if(size > NIC_MAX_SIZE)
+		size = NIC_MAX_SIZE;
+
+	return ROUNDUP(size, 1 << NIC_BLOCK_SHIFT) >> NIC_BLOCK_SHIFT;
+}
+
+static void registry_add_block(NICRegistry* registry, NIC* nic, uintptr_t block) {
+	for(uint32_t j = 0; j < NIC_BLOCK_TABLE_SIZE; j++) {
+		NICBlock* entry = &registry->blocks[(block + j) % NIC_BLOCK_TABLE_SIZE];
+		if(entry->nic == NULL || entry->block == block) {
+			entry->block = block;
+			entry->nic = nic;
+			break;
+		}
+	}
+}
+
+static void registry_add(NICRegistry* registry, NIC* nic) {
+	if(nic->id < NIC_MAX_ID)
+		registry->ids[nic->id] = nic;
+
+	uint32_t count = nic_block_count(nic);
+	for(uint32_t i = 0; i < count; i++)
+		registry_add_block(registry, nic, ((uintptr_t)nic >> NIC_BLOCK_SHIFT) + i);
+}
+
+static NICRegistry* registry_build() {
+	lock_lock(&nic_registry_lock);
+
+	// Another thread may have built it meanwhile
+	NICRegistry* registry = nic_registry;
+	uint32_t generation = __nic_generation;
+	if(registry && registry->generation == generation) {
+		lock_unlock(&nic_registry_lock);
+		return registry;
+	}
+
+	// __nics changing while it is read leaves the registry a generation behind, to be built again
+	__sync_synchronize();
+	registry = registry == &nic_registries[0] ? &nic_registries[1] : &nic_registries[0];
+	memset(registry->ids, 0, sizeof(registry->ids));
+	memset(registry->blocks, 0, sizeof(registry->blocks));
+
+	int count = __nic_count;
+	for(int i = 0; i < count && i < NIC_MAX_COUNT; i++) {
+		NIC* nic = __nics[i];
+		if(nic)
+			registry_add(registry, nic);
+	}
+
+	registry->generation = generation;
+	__sync_synchronize();
+	nic_registry = registry;
+
+	lock_unlock(&nic_registry_lock);
+
+	return registry;
+}
+
+static inline NICRegistry* registry_sync() {
+	NICRegistry* registry = nic_registry;
+	if(!registry || registry->generation != __nic_generation)
+		registry = registry_build();
+
+	return registry;
+}
+
+bool nic_register(NIC* nic) {
+	if(__nic_count >= NIC_MAX_COUNT || nic->id >= NIC_MAX_ID)
+		return false;
+
+	__nics[__nic_count++] = nic;
+	__sync_fetch_and_add(&__nic_generation, 1);
+	registry_build();
+
+	return true;
+}
+
+void nic_unregister(NIC* nic) {
+	for(int i = 0; i < __nic_count; i++) {
+		if(__nics[i] == nic) {
+			__nics[i] = __nics[__nic_count - 1];
+			__nics[--__nic_count] = NULL;
+			break;
+		}
+	}
+
+	__sync_fetch_and_add(&__nic_generation, 1);
+	registry_build();
+}
 
 NIC* nic_find_by_packet(Packet* packet) {
+	NICRegistry* registry = registry_sync();
+
+	uintptr_t block = (uintptr_t)packet >> NIC_BLOCK_SHIFT;
+	for(uint32_t j = 0; j < NIC_BLOCK_TABLE_SIZE; j++) {
+		NICBlock* entry = &registry->blocks[(block + j) % NIC_BLOCK_TABLE_SIZE];
+		if(entry->nic == NULL)
+			break;
+
+		if(entry->block == block)
+			return entry->nic;
+	}
+
+	// Blocks a pool has grown by know their NIC
+	NICExtentHeader* extent = (void*)((uintptr_t)packet & ~(uintptr_t)(NIC_POOL_EXTENT_SIZE - 1));
+	if(extent->magic == NIC_MAGIC_EXTENT)
+		return extent->nic;
+
+	// NICs which are not registered are found by their magic
 	NIC* nic = (void*)((uintptr_t)packet & ~(uintptr_t)(0x200000 - 1)); // 2MB alignment
 	for(int i = 0; i < NIC_MAX_SIZE / 0x200000  - 1 && (uintptr_t)nic > 0; i++) {
 		if(nic->magic == NIC_MAGIC_HEADER)
@@ -27,184 +176,1378 @@ NIC* nic_get(int index) {
 }
 
 NIC* nic_get_by_id(uint32_t id) {
-	NIC* nic = NULL;
-	for(int i = 0; i < __nic_count; i++) {
-		if(__nics[i] && __nics[i]->id == id) {
-			nic =  __nics[i];
+	NICRegistry* registry = registry_sync();
+
+	return id < NIC_MAX_ID ? registry->ids[id] : NULL;
+}
+
+NIC* nic_pool_nic(NIC* nic) {
+	return nic->pool.owner == nic->id ? nic : nic_get_by_id(nic->pool.owner);
+}
+
+static inline bool pool_trylock(volatile uint8_t* lock) {
+	return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void pool_unlock(volatile uint8_t* lock) {
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline bool pool_lock(volatile uint8_t* lock, bool wait) {
+	while(!pool_trylock(lock)) {
+		if(!wait)
+			return false;
+
+		while(*lock)
+			asm volatile("pause");
+	}
+
+	return true;
+}
+
+/*
+ * Index of the running core picks its cache and statistics, looked up on
+ * every call as a thread may run on any core of its address space. The
+ * kernel puts the APIC ID of each core in IA32_TSC_AUX (Linux puts the CPU
+ * number there), which rdpid or rdtscp read in a few cycles. Without either,
+ * the APIC ID from cpuid, which is slow and traps in a guest, is looked up
+ * once and the cores of the address space share a cache. The cache lock keeps
+ * that, and a thread moving to another core meanwhile, correct.
+ */
+#define CORE_RDPID	1
+#define CORE_RDTSCP	2
+#define CORE_CPUID	3
+
+static int core_source;
+static int core_cpuid = -1;
+
+static int core_probe() {
+	uint32_t a = 0x07, b, c = 0, d;
+	asm volatile("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+	if(c & (1 << 22))
+		return CORE_RDPID;
+
+	a = 0x80000001;
+	c = 0;
+	asm volatile("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+	if(d & (1 << 27))
+		return CORE_RDTSCP;
+
+	a = 0x01;
+	c = 0;
+	asm volatile("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+	core_cpuid = (b >> 24) & 0xff;
+
+	return CORE_CPUID;
+}
+
+static inline int nic_core() {
+	if(core_source == 0)
+		core_source = core_probe();
+
+	uint64_t aux;
+	switch(core_source) {
+		case CORE_RDPID:
+			asm volatile("rdpid %0" : "=r"(aux));
+			break;
+		case CORE_RDTSCP:
+			asm volatile("rdtscp" : "=c"(aux) : : "rax", "rdx");
 			break;
+		default:
+			return core_cpuid;
+	}
+
+	return aux & 0xfff;	// Linux keeps the NUMA node above
+}
+
+static inline NICPoolCache* pool_cache(NIC* nic, NICPool* pool) {
+	return (NICPoolCache*)((void*)nic + pool->cache) + nic_core() % NIC_POOL_CACHE_COUNT;
+}
+
+static inline bool pool_valid(NICSlab* slab, uint32_t offset) {
+	return offset >= slab->base && offset < slab->base + slab->count * slab->size &&
+		(offset - slab->base) % slab->size == 0;
+}
+
+// Move up to count buffers from the free list of slab to buffers
+static uint32_t slab_get(NIC* nic, NICSlab* slab, NICSlab* layout, uint32_t* buffers, uint32_t count, bool wait) {
+	if(!pool_lock(&slab->lock, wait))
+		return 0;
+
+	uint32_t i;
+	uint32_t offset = slab->free;
+	for(i = 0; i < count && pool_valid(layout, offset); i++) {
+		buffers[i] = offset;
+		offset = *(uint32_t*)((void*)nic + offset);
+	}
+
+	slab->free = i < count ? 0 : offset;	// An invalid link drops the rest of the list
+	slab->free_count = i < count ? 0 : slab->free_count - i;
+
+	pool_unlock(&slab->lock);
+
+	return i;
+}
+
+static bool slab_put(NIC* nic, NICSlab* slab, uint32_t* buffers, uint32_t count, bool wait) {
+	for(uint32_t i = 0; i + 1 < count; i++)
+		*(uint32_t*)((void*)nic + buffers[i]) = buffers[i + 1];
+
+	if(!pool_lock(&slab->lock, wait))
+		return false;
+
+	*(uint32_t*)((void*)nic + buffers[count - 1]) = slab->free;
+	slab->free = buffers[0];
+	slab->free_count += count;
+
+	pool_unlock(&slab->lock);
+
+	return true;
+}
+
+static uint32_t slab_alloc(NIC* nic, NICPool* pool, int class, bool wait) {
+	NICSlab* layout = &pool->slabs[class];
+	NICSlab* slab = &nic->pool.slabs[class];
+	uint32_t offset;
+
+	NICPoolCache* cache = pool_cache(nic, pool);
+	if(layout->cache_size == 0 || !pool_trylock(&cache->lock))
+		return slab_get(nic, slab, layout, &offset, 1, wait) ? offset : 0;
+
+	uint32_t* buffers = cache->buffers[class];
+	uint32_t count = cache->count[class];
+	if(count > layout->cache_size)
+		count = 0;
+
+	if(count == 0)
+		count = slab_get(nic, slab, layout, buffers, (layout->cache_size + 1) / 2, wait);
+
+	offset = 0;
+	if(count > 0) {
+		offset = buffers[--count];
+		if(!pool_valid(layout, offset))
+			offset = 0;
+	}
+	cache->count[class] = count;
+
+	pool_unlock(&cache->lock);
+
+	return offset;
+}
+
+// Share the buffers allocated with pool are charged to
+static inline uint8_t pool_share(NICPool* pool) {
+	return pool->quota ? pool->share % NIC_POOL_SHARE_COUNT : NIC_POOL_SHARE_NONE;
+}
+
+// Charge size bytes to the share of pool, kept in the holder's pool
+static inline bool pool_charge(NIC* nic, NICPool* pool, uint32_t size) {
+	if(pool->quota == 0)
+		return true;
+
+	volatile uint32_t* charged = &nic->pool.charged[pool_share(pool)];
+	if(__atomic_add_fetch(charged, size, __ATOMIC_RELAXED) <= pool->quota)
+		return true;
+
+	__atomic_sub_fetch(charged, size, __ATOMIC_RELAXED);
+
+	return false;
+}
+
+static inline void pool_uncharge(NIC* nic, uint8_t share, uint32_t size) {
+	if(share < NIC_POOL_SHARE_COUNT)
+		__atomic_sub_fetch(&nic->pool.charged[share], size, __ATOMIC_RELAXED);
+}
+
+// Extents of a class are used once its slab and the cache of the core run out
+static uint32_t extent_alloc(NIC* nic, NICPool* pool, int class, bool wait) {
+	for(int i = 0; i < NIC_POOL_EXTENT_COUNT; i++) {
+		NICSlab* layout = &pool->extents[i];
+		if(layout->count == 0 || pool->extent_classes[i] != class)
+			continue;
+
+		uint32_t offset;
+		if(slab_get(nic, &nic->pool.extents[i], layout, &offset, 1, wait))
+			return offset;
+	}
+
+	return 0;
+}
+
+static void pool_retry(NIC* nic, NICPool* pool);
+
+Packet* nic_pool_get(NIC* nic, NICPool* pool, uint32_t size, bool wait) {
+	if(!wait)
+		pool_retry(nic, pool);
+
+	for(int class = 0; class < NIC_POOL_CLASS_COUNT; class++) {
+		NICSlab* layout = &pool->slabs[class];
+		if(layout->size < size)
+			continue;
+
+		// Larger classes cost more of the quota
+		if(!pool_charge(nic, pool, layout->size))
+			return NULL;
+
+		uint32_t offset = slab_alloc(nic, pool, class, wait);
+		if(offset == 0)
+			offset = extent_alloc(nic, pool, class, wait);
+		if(offset == 0) {
+			pool_uncharge(nic, pool_share(pool), layout->size);
+			continue;
 		}
+
+		Packet* packet = (void*)nic + offset;
+		packet->time = 0;
+		packet->start = 0;
+		packet->end = 0;
+		packet->size = layout->size - sizeof(Packet);
+		packet->ref = 1;
+		packet->next = 0;
+		packet->flags = 0;
+		packet->share = pool_share(pool);
+
+		return packet;
+	}
+
+	return NULL;
+}
+
+// Slab of the buffer at offset: a class, or NIC_POOL_CLASS_COUNT + the index of an extent
+static int pool_class(NICPool* pool, uint32_t offset) {
+	for(int class = 0; class < NIC_POOL_CLASS_COUNT; class++) {
+		if(pool_valid(&pool->slabs[class], offset))
+			return class;
+	}
+
+	for(int i = 0; i < NIC_POOL_EXTENT_COUNT; i++) {
+		if(pool->extents[i].count && pool_valid(&pool->extents[i], offset))
+			return NIC_POOL_CLASS_COUNT + i;
+	}
+
+	return -1;
+}
+
+static inline NICSlab* pool_slab(NICPool* pool, int class) {
+	return class < NIC_POOL_CLASS_COUNT ? &pool->slabs[class] : &pool->extents[class - NIC_POOL_CLASS_COUNT];
+}
+
+static bool slab_free(NIC* nic, NICPool* pool, int class, uint32_t offset, bool wait) {
+	if(class >= NIC_POOL_CLASS_COUNT)
+		return slab_put(nic, &nic->pool.extents[class - NIC_POOL_CLASS_COUNT], &offset, 1, wait);
+
+	NICSlab* layout = &pool->slabs[class];
+	NICSlab* slab = &nic->pool.slabs[class];
+
+	NICPoolCache* cache = pool_cache(nic, pool);
+	if(layout->cache_size == 0 || !pool_trylock(&cache->lock))
+		return slab_put(nic, slab, &offset, 1, wait);
+
+	uint32_t* buffers = cache->buffers[class];
+	uint32_t count = cache->count[class];
+	if(count > layout->cache_size)
+		count = 0;
+
+	// Give back the older half when the cache is full
+	if(count == layout->cache_size) {
+		uint32_t half = count / 2;
+		if(slab_put(nic, slab, buffers, half, wait)) {
+			count -= half;
+			memmove(buffers, buffers + half, count * sizeof(uint32_t));
+		}
+	}
+
+	bool result = true;
+	if(count < layout->cache_size)
+		buffers[count++] = offset;
+	else
+		result = slab_put(nic, slab, &offset, 1, wait);
+
+	cache->count[class] = count;
+
+	pool_unlock(&cache->lock);
+
+	return result;
+}
+
+/*
+ * Buffers whose free list was locked wait in the caller's copy of the layout.
+ * Only callers which don't wait defer buffers, and their copy isn't shared
+ * with the VM, so its lock is waited for.
+ */
+static bool pool_defer(NICPool* pool, uint32_t offset) {
+	pool_lock(&pool->deferred_lock, true);
+
+	bool result = pool->deferred_count < NIC_POOL_DEFERRED_SIZE;
+	if(result)
+		pool->deferred[pool->deferred_count++] = offset;
+
+	pool_unlock(&pool->deferred_lock);
+
+	return result;
+}
+
+// Put the deferred buffers whose free list is unlocked now
+static void pool_retry(NIC* nic, NICPool* pool) {
+	if(pool->deferred_count == 0 || !pool_trylock(&pool->deferred_lock))
+		return;
+
+	uint32_t count = 0;
+	for(uint32_t i = 0; i < pool->deferred_count && i < NIC_POOL_DEFERRED_SIZE; i++) {
+		uint32_t offset = pool->deferred[i];
+		int class = pool_class(pool, offset);
+		if(class >= 0 && !slab_free(nic, pool, class, offset, false))
+			pool->deferred[count++] = offset;
 	}
-	return nic;
+	pool->deferred_count = count;
+
+	pool_unlock(&pool->deferred_lock);
+}
+
+bool nic_pool_put(NIC* nic, NICPool* pool, Packet* packet, bool wait) {
+	uint32_t offset = (uintptr_t)packet - (uintptr_t)nic;
+	int class = pool_class(pool, offset);
+	if(class < 0)
+		return false;
+
+	// A shared packet goes back to the pool when its last reference is freed
+	if(packet->ref > 1 && __atomic_sub_fetch(&packet->ref, 1, __ATOMIC_ACQ_REL) != 0)
+		return true;
+
+	if(!wait)
+		pool_retry(nic, pool);
+
+	// Segments of a chained packet go with the head; the link is read before the buffer is reused
+	bool result = true;
+	for(int i = 0; i < NIC_PACKET_MAX_SEGMENTS && class >= 0; i++) {
+		Packet* segment = (void*)nic + offset;
+		uint32_t next = segment->next;
+		pool_uncharge(nic, segment->share, pool_slab(pool, class)->size);
+		if(!slab_free(nic, pool, class, offset, wait) && !pool_defer(pool, offset))
+			result = false;
+		if(next == 0)
+			break;
+
+		offset = next;
+		class = pool_class(pool, offset);
+	}
+
+	return result;
+}
+
+Packet* nic_pool_next(NIC* nic, NICPool* pool, Packet* packet) {
+	if(packet->next == 0 || pool_class(pool, packet->next) < 0)
+		return NULL;
+
+	return (void*)nic + packet->next;
+}
+
+uint32_t nic_pool_length(NIC* nic, NICPool* pool, Packet* packet) {
+	uint32_t length = 0;
+	for(int i = 0; packet && i < NIC_PACKET_MAX_SEGMENTS; i++) {
+		length += packet->end - packet->start;
+		packet = nic_pool_next(nic, pool, packet);
+	}
+
+	return length;
+}
+
+Packet* nic_pool_get_chain(NIC* nic, NICPool* pool, uint32_t size, uint16_t padding_head, uint16_t padding_tail, bool wait) {
+	Packet* head = NULL;
+	Packet* tail = NULL;
+	uint32_t left = size;
+	int count = 0;
+
+	// Segments of the smallest class, each leaving padding_tail free
+	do {
+		Packet* segment = count < NIC_PACKET_MAX_SEGMENTS ? nic_pool_get(nic, pool, pool->slabs[0].size, wait) : NULL;
+		if(!segment)
+			goto failed;
+
+		segment->start = head ? 0 : padding_head;
+		if(segment->start + padding_tail >= segment->size) {
+			nic_pool_put(nic, pool, segment, wait);
+			goto failed;
+		}
+
+		uint32_t room = segment->size - segment->start - padding_tail;
+		uint32_t len = left < room ? left : room;
+		segment->end = segment->start + len;
+		left -= len;
+
+		if(tail)
+			tail->next = (uintptr_t)segment - (uintptr_t)nic;
+		else
+			head = segment;
+		tail = segment;
+		count++;
+	} while(left > 0);
+
+	return head;
+
+failed:
+	if(head)
+		nic_pool_put(nic, pool, head, wait);
+
+	return NULL;
 }
 
 Packet* nic_alloc(NIC* nic, uint16_t size) {
-	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
-	uint32_t count = nic->pool.count;
-	void* pool = (void*)nic + nic->pool.pool;
+	NIC* holder = nic_pool_nic(nic);
+	if(!holder)
+		return NULL;
 
-	uint32_t size2 = sizeof(Packet) + nic->padding_head + size + nic->padding_tail;
-	uint8_t req = (ROUNDUP(size2, NIC_CHUNK_SIZE)) / NIC_CHUNK_SIZE;
-	uint32_t index = nic->pool.index;
+	return nic_pool_get(holder, &nic->pool, sizeof(Packet) + nic->padding_head + size + nic->padding_tail, true);
+}
 
-	lock_lock(&nic->pool.lock);
-
-	// Find tail
-	uint32_t idx = 0;
-	for(idx = index; idx <= count - req; idx++) {
-		for(uint32_t j = 0; j < req; j++) {
-			if(bitmap[idx + j] == 0) {
-				continue;
-			} else {
-				idx += j + bitmap[idx + j];
-				goto next;
-			}
+bool nic_free(Packet* packet) {
+	NIC* nic = nic_find_by_packet(packet);
+	if(nic == NULL)
+		return false;
+
+	return nic_pool_put(nic, &nic->pool, packet, true);
+}
+
+Packet* nic_alloc_chain(NIC* nic, uint32_t size) {
+	if(size <= 0xffff) {
+		Packet* packet = nic_alloc(nic, size);
+		if(packet) {
+			packet->start = nic->padding_head;
+			packet->end = packet->start + size;
+
+			return packet;
 		}
+	}
+
+	NIC* holder = nic_pool_nic(nic);
+	if(!holder)
+		return NULL;
+
+	return nic_pool_get_chain(holder, &nic->pool, size, nic->padding_head, nic->padding_tail, true);
+}
+
+Packet* nic_packet_next(NIC* nic, Packet* packet) {
+	NIC* holder = nic_pool_nic(nic);
 
-		goto found;
-next:
-		;
+	return holder ? nic_pool_next(holder, &nic->pool, packet) : NULL;
+}
+
+uint32_t nic_packet_length(NIC* nic, Packet* packet) {
+	NIC* holder = nic_pool_nic(nic);
+
+	return holder ? nic_pool_length(holder, &nic->pool, packet) : (uint32_t)(packet->end - packet->start);
+}
+
+void* nic_packet_prepend(NIC* nic, Packet** packet, uint16_t size) {
+	if(!nic_packet_unshare(nic, packet))
+		return NULL;
+
+	Packet* head = *packet;
+	if(head->start >= size) {
+		head->start -= size;
+
+		// Headers stay where they are, further from start
+		if(head->l4 + size > 0xff)
+			head->flags &= ~(PACKET_F_L3 | PACKET_F_L4 | PACKET_F_TX_CSUM);
+		head->l3 += size;
+		head->l4 += size;
+
+		return head->buffer + head->start;
 	}
 
-	// Find head
-	for(idx = 0; idx < index - req; idx++) {
-		for(uint32_t j = 0; j < req; j++) {
-			if(bitmap[idx + j] == 0) {
-				continue;
-			} else {
-				idx += j + bitmap[idx + j];
-				goto notfound;
-			}
+	int count = 0;
+	for(Packet* segment = head; segment && count <= NIC_PACKET_MAX_SEGMENTS; segment = nic_packet_next(nic, segment))
+		count++;
+	NIC* holder = nic_pool_nic(nic);
+	if(count >= NIC_PACKET_MAX_SEGMENTS || !holder)
+		return NULL;
+
+	// A new head with the data at its end leaves room for more headers in front of it
+	Packet* segment = nic_pool_get(holder, &nic->pool, sizeof(Packet) + size, true);
+	if(!segment)
+		return NULL;
+
+	segment->time = head->time;
+	segment->vlan_proto = head->vlan_proto;
+	segment->vlan_tci = head->vlan_tci;
+	segment->end = segment->size;
+	segment->start = segment->end - size;
+	segment->next = (uintptr_t)head - (uintptr_t)holder;
+
+	// Headers out of the first segment can't be offloaded
+	segment->flags = head->flags & ~(PACKET_F_L3 | PACKET_F_L4 | PACKET_F_TX_CSUM);
+	segment->hash = head->hash;
+
+	*packet = segment;
+
+	return segment->buffer + segment->start;
+}
+
+void* nic_packet_append(NIC* nic, Packet* packet, uint16_t size) {
+	if(packet->ref > 1)
+		return NULL;
+
+	Packet* tail = packet;
+	int count = 1;
+	for(Packet* next; count <= NIC_PACKET_MAX_SEGMENTS && (next = nic_packet_next(nic, tail)); tail = next)
+		count++;
+
+	if(tail->size - tail->end >= size) {
+		void* data = tail->buffer + tail->end;
+		tail->end += size;
+
+		return data;
+	}
+
+	NIC* holder = nic_pool_nic(nic);
+	if(count >= NIC_PACKET_MAX_SEGMENTS || !holder)
+		return NULL;
+
+	Packet* segment = nic_pool_get(holder, &nic->pool, sizeof(Packet) + size, true);
+	if(!segment)
+		return NULL;
+
+	segment->end = size;
+	tail->next = (uintptr_t)segment - (uintptr_t)holder;
+
+	return segment->buffer;
+}
+
+uint32_t nic_packet_read(NIC* nic, Packet* packet, uint32_t offset, void* buf, uint32_t size) {
+	uint32_t done = 0;
+	for(int i = 0; packet && i < NIC_PACKET_MAX_SEGMENTS && done < size; i++) {
+		uint32_t len = packet->end - packet->start;
+		if(offset < len) {
+			len -= offset;
+			if(len > size - done)
+				len = size - done;
+
+			memcpy(buf + done, packet->buffer + packet->start + offset, len);
+			done += len;
+			offset = 0;
+		} else {
+			offset -= len;
 		}
 
-		goto found;
-	}
+		packet = nic_packet_next(nic, packet);
+	}
+
+	return done;
+}
+
+uint32_t nic_packet_write(NIC* nic, Packet* packet, uint32_t offset, const void* buf, uint32_t size) {
+	if(packet->ref > 1)
+		return 0;
+
+	uint32_t done = 0;
+	for(int i = 0; packet && i < NIC_PACKET_MAX_SEGMENTS && done < size; i++) {
+		uint32_t len = packet->end - packet->start;
+		if(offset < len) {
+			len -= offset;
+			if(len > size - done)
+				len = size - done;
+
+			memcpy(packet->buffer + packet->start + offset, buf + done, len);
+			done += len;
+			offset = 0;
+		} else {
+			offset -= len;
+		}
+
+		packet = nic_packet_next(nic, packet);
+	}
+
+	return done;
+}
+
+// A copy of a packet, chained if it doesn't fit in a buffer
+static Packet* packet_dup(NIC* nic, Packet* packet) {
+	uint32_t len = nic_packet_length(nic, packet);
+
+	Packet* packet2 = nic_alloc_chain(nic, len);
+	if(!packet2)
+		return NULL;
+
+	packet2->hash = packet->hash;
+	packet2->flags = packet->flags;
+	packet2->l3 = packet->l3;
+	packet2->l4 = packet->l4;
+	packet2->l4_proto = packet->l4_proto;
+
+	uint32_t offset = 0;
+	for(int i = 0; packet && i < NIC_PACKET_MAX_SEGMENTS; i++) {
+		offset += nic_packet_write(nic, packet2, offset, packet->buffer + packet->start, packet->end - packet->start);
+		packet = nic_packet_next(nic, packet);
+	}
+
+	return packet2;
+}
+
+// The packet itself if it isn't shared, otherwise a copy with its metadata; the caller keeps its reference
+static Packet* packet_writable(NIC* nic, Packet* packet) {
+	if(packet->ref <= 1)
+		return packet;
+
+	Packet* copy = packet_dup(nic, packet);
+	if(!copy)
+		return NULL;
+
+	copy->time = packet->time;
+	copy->vlan_proto = packet->vlan_proto;
+	copy->vlan_tci = packet->vlan_tci;
+	copy->gso_size = packet->gso_size;
+
+	return copy;
+}
+
+bool nic_packet_unshare(NIC* nic, Packet** packet) {
+	Packet* copy = packet_writable(nic, *packet);
+	if(!copy)
+		return false;
+
+	if(copy != *packet) {
+		nic_free(*packet);
+		*packet = copy;
+	}
+
+	return true;
+}
+
+static inline uint64_t nic_time() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+NICStats* nic_stats(NIC* nic, uint32_t offset) {
+	return (NICStats*)((void*)nic + offset) + nic_core() % NIC_STATS_CORE_COUNT;
+}
+
+static inline void stats_add(uint64_t* counter, uint64_t value) {
+	__sync_fetch_and_add(counter, value);
+}
+
+static inline uint64_t stats_load(uint64_t* counter) {
+	return *(volatile uint64_t*)counter;
+}
+
+void nic_stats_residency(NICCounters* counters, uint64_t time, uint64_t t) {
+	if(time == 0)
+		return;
+
+	uint64_t ticks = t > time ? t - time : 0;
+	int bucket = ticks ? 63 - __builtin_clzll(ticks) : 0;
+	if(bucket >= NIC_STATS_HISTOGRAM_SIZE)
+		bucket = NIC_STATS_HISTOGRAM_SIZE - 1;
+
+	stats_add(&counters->residency[bucket], 1);
+}
+
+static void counters_sum(NICCounters* sum, NICCounters* counters) {
+	sum->packets += stats_load(&counters->packets);
+	sum->bytes += stats_load(&counters->bytes);
+	sum->drop_packets += stats_load(&counters->drop_packets);
+	sum->drop_bytes += stats_load(&counters->drop_bytes);
+	for(int i = 0; i < NIC_DROP_REASON_COUNT; i++)
+		sum->drops[i] += stats_load(&counters->drops[i]);
+	for(int i = 0; i < NIC_STATS_HISTOGRAM_SIZE; i++)
+		sum->residency[i] += stats_load(&counters->residency[i]);
+}
+
+void nic_stats_snapshot(NIC* nic, uint32_t offset, NICStats* stats) {
+	memset(stats, 0, sizeof(NICStats));
+
+	NICStats* cores = (NICStats*)((void*)nic + offset);
+	for(int i = 0; i < NIC_STATS_CORE_COUNT; i++) {
+		counters_sum(&stats->rx, &cores[i].rx);
+		counters_sum(&stats->tx, &cores[i].tx);
+	}
+}
+
+// Packets taken out of an rx queue
+static void rx_residency(NIC* nic, Packet** packets, uint32_t count) {
+	if(count == 0)
+		return;
+
+	NICCounters* counters = &nic_stats(nic, nic->stats)->rx;
+	uint64_t t = nic_time();
+	for(uint32_t i = 0; i < count; i++)
+		nic_stats_residency(counters, packets[i]->time, t);
+}
+
+static inline void tx_stamp(Packet** packets, uint32_t count) {
+	uint64_t t = nic_time();
+	for(uint32_t i = 0; i < count; i++)
+		packets[i]->time = t;
+}
+
+// nic_tx() frees packets which don't fit in the queue or can't be unshared
+static void tx_drop(NIC* nic, Packet* packet, NICDropReason reason) {
+	NICCounters* counters = &nic_stats(nic, nic->stats)->tx;
+	stats_add(&counters->drop_packets, 1);
+	stats_add(&counters->drop_bytes, nic_packet_length(nic, packet));
+	stats_add(&counters->drops[reason], 1);
+
+	nic_free(packet);
+}
+
+static inline uint32_t load_acquire(volatile uint32_t* index) {
+	return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(volatile uint32_t* index, uint32_t value) {
+	__atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t queue_entry(Packet* packet) {
+	NIC* nic = nic_find_by_packet(packet);
+	if(nic == NULL)
+		return 0;
+
+	return ((uint64_t)nic->id << 32) | (uint64_t)(uint32_t)((uintptr_t)packet - (uintptr_t)nic);
+}
+
+static inline Packet* queue_packet(NIC* nic, uint64_t entry) {
+	uint32_t id = (uint32_t)(entry >> 32);
+	uint32_t data = (uint32_t)entry;
+
+	if(nic->id != id) {
+		nic = nic_get_by_id(id);
+		if(nic == NULL)
+			return NULL;
+	}
+
+	return (void*)nic + data;
+}
+
+static inline uint32_t queue_free(uint32_t head, uint32_t tail, uint32_t size) {
+	return (head + size - tail - 1) % size;
+}
+
+uint32_t queue_push_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count) {
+	if(count > NIC_QUEUE_BURST_MAX)
+		count = NIC_QUEUE_BURST_MAX;
+
+	// Entries are made before any slot is reserved so that a reserved slot is always published
+	uint64_t entries[NIC_QUEUE_BURST_MAX];
+	for(uint32_t i = 0; i < count; i++) {
+		entries[i] = queue_entry(packets[i]);
+		if(entries[i] == 0) {
+			count = i;
+			break;
+		}
+	}
+
+	if(count == 0)
+		return 0;
+
+	volatile uint64_t* array = (void*)nic + queue->base;
+	uint32_t size = queue->size;
+	uint32_t tail;
+	uint32_t n;
+
+	if(queue->flags & NIC_QUEUE_F_MP) {
+		// Reserve slots, then publish the entries into them. The consumer zeroes
+		// a slot before it releases head, so a reserved slot is always empty
+		uint32_t next;
+		do {
+			tail = load_acquire(&queue->tail);
+			n = queue_free(load_acquire(&queue->head), tail, size);
+			if(n == 0)
+				return 0;
+			if(n > count)
+				n = count;
+			next = (tail + n) % size;
+		} while(!__atomic_compare_exchange_n(&queue->tail, &tail, next, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+		for(uint32_t i = 0; i < n; i++)
+			__atomic_store_n(&array[(tail + i) % size], entries[i], __ATOMIC_RELEASE);
+
+		return n;
+	}
+
+	tail = queue->tail;
+	n = queue_free(queue->head_cache, tail, size);
+	if(n < count) {
+		queue->head_cache = load_acquire(&queue->head);
+		n = queue_free(queue->head_cache, tail, size);
+	}
+	if(n > count)
+		n = count;
+
+	for(uint32_t i = 0; i < n; i++)
+		array[(tail + i) % size] = entries[i];
+
+	if(n)
+		store_release(&queue->tail, (tail + n) % size);
+
+	return n;
+}
+
+bool queue_push(NIC* nic, NICQueue* queue, Packet* packet) {
+	return queue_push_burst(nic, queue, &packet, 1) == 1;
+}
+
+uint32_t queue_peek(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count) {
+	volatile uint64_t* array = (void*)nic + queue->base;
+	uint32_t size = queue->size;
+	uint32_t head = queue->head;
+
+	uint32_t n = (queue->tail_cache + size - head) % size;
+	if(n < count) {
+		queue->tail_cache = load_acquire(&queue->tail);
+		n = (queue->tail_cache + size - head) % size;
+	}
+	if(n > count)
+		n = count;
+
+	for(uint32_t i = 0; i < n; i++) {
+		// A multi producer may have reserved the slot without publishing it yet
+		uint64_t entry = __atomic_load_n(&array[(head + i) % size], __ATOMIC_ACQUIRE);
+		if(entry == 0)
+			return i;
+
+		packets[i] = queue_packet(nic, entry);
+	}
+
+	return n;
+}
+
+void queue_advance(NIC* nic, NICQueue* queue, uint32_t count) {
+	if(count == 0)
+		return;
+
+	volatile uint64_t* array = (void*)nic + queue->base;
+	uint32_t size = queue->size;
+	uint32_t head = queue->head;
+
+	for(uint32_t i = 0; i < count; i++)
+		array[(head + i) % size] = 0;
+
+	store_release(&queue->head, (head + count) % size);
+}
+
+uint32_t queue_pop_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count) {
+	bool mc = queue->flags & NIC_QUEUE_F_MC;
+	if(mc)
+		lock_lock(&queue->rlock);
+
+	uint32_t n = queue_peek(nic, queue, packets, count);
+	queue_advance(nic, queue, n);
+
+	if(mc)
+		lock_unlock(&queue->rlock);
+
+	// Entries of NICs which are already gone are consumed but not returned
+	uint32_t j = 0;
+	for(uint32_t i = 0; i < n; i++) {
+		if(packets[i])
+			packets[j++] = packets[i];
+	}
+
+	return j;
+}
+
+void* queue_pop(NIC* nic, NICQueue* queue) {
+	Packet* packet;
+	do {
+		if(queue_pop_burst(nic, queue, &packet, 1) == 1)
+			return packet;
+	} while(!queue_empty(queue));	// Skip entries of NICs which are gone
+
+	return NULL;
+}
+
+uint64_t queue_head_time(NIC* nic, NICQueue* queue) {
+	volatile uint64_t* array = (void*)nic + queue->base;
+	uint32_t head = load_acquire(&queue->head);
+	if(head == load_acquire(&queue->tail))
+		return 0;
+
+	// Zero until a multi producer publishes it
+	uint64_t entry = __atomic_load_n(&array[head], __ATOMIC_ACQUIRE);
+	if(entry == 0)
+		return 0;
+
+	Packet* packet = queue_packet(nic, entry);
+
+	return packet ? packet->time : 0;
+}
+
+uint32_t queue_size(NICQueue* queue) {
+	uint32_t head = load_acquire(&queue->head);
+	uint32_t tail = load_acquire(&queue->tail);
+
+	if(tail >= head)
+		return tail - head;
+	else
+		return queue->size + tail - head;
+}
+
+bool queue_available(NICQueue* queue) {
+	return load_acquire(&queue->head) != (load_acquire(&queue->tail) + 1) % queue->size;
+}
+
+bool queue_empty(NICQueue* queue) {
+	return load_acquire(&queue->head) == load_acquire(&queue->tail);
+}
+
+bool nic_has_rx(NIC* nic) {
+	return !queue_empty(&nic->rxq[0]);
+}
+
+Packet* nic_rx(NIC* nic) {
+	return nic_rxq(nic, 0);
+}
+
+uint32_t nic_rx_burst(NIC* nic, Packet** packets, uint32_t count) {
+	return nic_rxq_burst(nic, 0, packets, count);
+}
+
+uint32_t nic_rx_size(NIC* nic) {
+	return queue_size(&nic->rxq[0]);
+}
+
+uint16_t nic_queue_count(NIC* nic) {
+	return nic->queue_count ? : 1;
+}
+
+Packet* nic_rxq(NIC* nic, uint16_t queue) {
+	Packet* packet = queue_pop(nic, &nic->rxq[queue]);
+	if(packet)
+		rx_residency(nic, &packet, 1);
+
+	return packet;
+}
+
+uint32_t nic_rxq_burst(NIC* nic, uint16_t queue, Packet** packets, uint32_t count) {
+	uint32_t n = queue_pop_burst(nic, &nic->rxq[queue], packets, count);
+	rx_residency(nic, packets, n);
+
+	return n;
+}
+
+bool nic_txq(NIC* nic, uint16_t queue, Packet* packet) {
+	if(!nic_packet_unshare(nic, &packet)) {
+		tx_drop(nic, packet, NIC_DROP_NO_MEMORY);
+		return false;
+	}
+
+	tx_stamp(&packet, 1);
+	if(!queue_push(nic, &nic->txq[queue], packet)) {
+		tx_drop(nic, packet, NIC_DROP_QUEUE_FULL);
+		return false;
+	}
+
+	return true;
+}
+
+uint32_t nic_txq_burst(NIC* nic, uint16_t queue, Packet** packets, uint32_t count) {
+	// Packets after one which can't be unshared are left to the caller
+	for(uint32_t i = 0; i < count; i++) {
+		if(!nic_packet_unshare(nic, &packets[i])) {
+			count = i;
+			break;
+		}
+	}
+
+	tx_stamp(packets, count);
+
+	uint32_t n = 0;
+	while(n < count) {
+		uint32_t pushed = queue_push_burst(nic, &nic->txq[queue], packets + n, count - n);
+		if(pushed == 0)
+			break;
+
+		n += pushed;
+	}
+
+	return n;
+}
+
+// Default key of Microsoft RSS; 40 bytes cover the 36 byte IPv6 4-tuple
+static const uint8_t rss_key[40] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static uint32_t toeplitz(const uint8_t* data, size_t size) {
+	uint32_t hash = 0;
+	uint32_t window = (uint32_t)rss_key[0] << 24 | (uint32_t)rss_key[1] << 16 | (uint32_t)rss_key[2] << 8 | rss_key[3];
+
+	for(size_t i = 0; i < size; i++) {
+		for(int bit = 7; bit >= 0; bit--) {
+			if(data[i] & (1 << bit))
+				hash ^= window;
+
+			window = window << 1 | ((rss_key[i + 4] >> bit) & 1);
+		}
+	}
+
+	return hash;
+}
+
+uint32_t nic_rss_hash(const uint8_t* frame, size_t size) {
+	uint8_t tuple[36];
+	size_t len;
+
+	size_t offset = 12;
+	if(size < offset + 2)
+		return 0;
+
+	uint16_t type = (uint16_t)frame[offset] << 8 | frame[offset + 1];
+	if(type == 0x8100) {
+		offset += 4;
+		if(size < offset + 2)
+			return 0;
+
+		type = (uint16_t)frame[offset] << 8 | frame[offset + 1];
+	}
+	offset += 2;
+
+	const uint8_t* ip = frame + offset;
+	size -= offset;
+
+	uint8_t protocol;
+	size_t ports;
+	if(type == 0x0800) {
+		if(size < 20)
+			return 0;
+
+		memcpy(tuple, ip + 12, 8);
+		len = 8;
+		protocol = ip[9];
+		ports = (ip[0] & 0x0f) * 4;
+
+		// Fragments but the first have no ports and the first is hashed like them
+		if(((uint16_t)ip[6] << 8 | ip[7]) & 0x3fff)
+			return toeplitz(tuple, len);
+	} else if(type == 0x86dd) {
+		if(size < 40)
+			return 0;
+
+		memcpy(tuple, ip + 8, 32);
+		len = 32;
+		protocol = ip[6];
+		ports = 40;
+	} else {
+		return 0;
+	}
+
+	if((protocol == 6 || protocol == 17) && size >= ports + 4) {
+		memcpy(tuple + len, ip + ports, 4);
+		len += 4;
+	}
+
+	return toeplitz(tuple, len);
+}
+
+uint16_t nic_rss_queue(NIC* nic, uint32_t hash) {
+	if(nic->queue_count <= 1)
+		return 0;
+
+	return ((uint64_t)hash * nic->queue_count) >> 32;
+}
+
+bool nic_packet_parse(Packet* packet) {
+	packet->flags &= ~(PACKET_F_L3 | PACKET_F_L4);
+
+	const uint8_t* frame = packet->buffer + packet->start;
+	size_t size = packet->end > packet->start ? packet->end - packet->start : 0;
+
+	size_t offset = 12;
+	if(size < offset + 2)
+		return false;
+
+	uint16_t type = (uint16_t)frame[offset] << 8 | frame[offset + 1];
+	if(type == 0x8100) {
+		offset += 4;
+		if(size < offset + 2)
+			return false;
+
+		type = (uint16_t)frame[offset] << 8 | frame[offset + 1];
+	}
+	offset += 2;
+
+	const uint8_t* ip = frame + offset;
+	size_t l4;
+	uint8_t protocol;
+	if(type == 0x0800) {
+		if(size < offset + 20)
+			return false;
+
+		l4 = offset + (ip[0] & 0x0f) * 4;
+		protocol = ip[9];
+
+		// Fragments but the first have no transport header
+		if(((uint16_t)ip[6] << 8 | ip[7]) & 0x1fff)
+			l4 = size;
+	} else if(type == 0x86dd) {
+		if(size < offset + 40)
+			return false;
+
+		l4 = offset + 40;
+		protocol = ip[6];
+	} else {
+		return false;
+	}
+
+	packet->l3 = offset;
+	packet->flags |= PACKET_F_L3;
+
+	if(l4 < size && l4 <= 0xff) {
+		packet->l4 = l4;
+		packet->l4_proto = protocol;
+		packet->flags |= PACKET_F_L4;
+	}
+
+	return true;
+}
+
+uint32_t nic_packet_hash(Packet* packet) {
+	if(!(packet->flags & PACKET_F_HASH)) {
+		size_t size = packet->end > packet->start ? packet->end - packet->start : 0;
+		packet->hash = nic_rss_hash(packet->buffer + packet->start, size);
+		packet->flags |= PACKET_F_HASH;
+	}
+
+	return packet->hash;
+}
+
+bool nic_csum_complete(uint8_t* frame, size_t size, uint16_t csum_start, uint16_t csum_offset) {
+	if((size_t)csum_start + csum_offset + 2 > size)
+		return false;
+
+	// The sum of little endian words is the byte swapped sum of big endian ones
+	const uint8_t* data = frame + csum_start;
+	size_t len = size - csum_start;
+	uint64_t sum = 0;
+	for(; len >= 4; data += 4, len -= 4) {
+		uint32_t word;
+		memcpy(&word, data, 4);
+		sum += word;
+	}
+	if(len >= 2) {
+		uint16_t word;
+		memcpy(&word, data, 2);
+		sum += word;
+		data += 2;
+		len -= 2;
+	}
+	if(len)
+		sum += *data;
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	uint16_t csum = ~sum;
+	memcpy(frame + csum_start + csum_offset, &csum, 2);
+
+	return true;
+}
+
+bool nic_packet_tx_csum(Packet* packet) {
+	if(!(packet->flags & PACKET_F_TX_CSUM))
+		return true;
+
+	packet->flags &= ~PACKET_F_TX_CSUM;
+	if(!(packet->flags & PACKET_F_L4) || packet->end > packet->size || packet->start > packet->end)
+		return false;
+
+	uint16_t offset;
+	if(packet->l4_proto == 6)
+		offset = 16;
+	else if(packet->l4_proto == 17)
+		offset = 6;
+	else
+		return false;
+
+	uint8_t* frame = packet->buffer + packet->start;
+	if(!nic_csum_complete(frame, packet->end - packet->start, packet->l4, offset))
+		return false;
+
+	// A UDP checksum of 0 means there is none
+	uint8_t* csum = frame + packet->l4 + offset;
+	if(packet->l4_proto == 17 && csum[0] == 0 && csum[1] == 0)
+		csum[0] = csum[1] = 0xff;
 
-notfound:
-	// Not found
-	lock_unlock(&nic->pool.lock);
-	return NULL;
+	return true;
+}
 
-found:
-	nic->pool.index = idx + req;
-	for(uint32_t k = 0; k < req; k++) {
-		bitmap[idx + k] = req - k;
-	}
+static inline uint16_t load16(const uint8_t* p) {
+	return (uint16_t)p[0] << 8 | p[1];
+}
 
-	nic->pool.used += req;
+static inline void store16(uint8_t* p, uint16_t value) {
+	p[0] = value >> 8;
+	p[1] = value;
+}
 
-	lock_unlock(&nic->pool.lock);
+// Folded sum of the pseudo header of a TCP/UDP segment of size bytes
+static uint16_t pseudo_sum(const uint8_t* ip, uint8_t protocol, size_t size) {
+	uint32_t sum = protocol + size;
+	if(ip[0] >> 4 == 4) {
+		for(int i = 12; i < 20; i += 2)
+			sum += load16(ip + i);
+	} else {
+		for(int i = 8; i < 40; i += 2)
+			sum += load16(ip + i);
+	}
 
-	Packet* packet = pool + (idx * NIC_CHUNK_SIZE);
-	packet->time = 0;
-	packet->start = 0;
-	packet->end = 0;
-	packet->size = (req * NIC_CHUNK_SIZE) - sizeof(Packet);
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
 
-	return packet;
+	return sum;
 }
 
-bool nic_free(Packet* packet) {
-	NIC* nic = nic_find_by_packet(packet);
-	if(nic == NULL)
+bool nic_packet_csum_offload(Packet* packet) {
+	if(!(packet->flags & PACKET_F_L3) || !(packet->flags & PACKET_F_L4) || packet->end > packet->size || packet->start > packet->end)
 		return false;
 
-	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
-	uint32_t count = nic->pool.count;
-	void* pool = (void*)nic + nic->pool.pool;
+	uint16_t offset;
+	if(packet->l4_proto == 6)
+		offset = 16;
+	else if(packet->l4_proto == 17)
+		offset = 6;
+	else
+		return false;
 
-	uint32_t idx = ((uintptr_t)packet - (uintptr_t)pool) / NIC_CHUNK_SIZE;
-	if(idx >= count)
+	uint8_t* frame = packet->buffer + packet->start;
+	size_t size = packet->end - packet->start;
+	if((size_t)packet->l4 + offset + 2 > size)
 		return false;
 
-	uint8_t req = bitmap[idx];
-	if(idx + req > count)
+	// A datagram is summed over all of its fragments, which the device doesn't see together
+	const uint8_t* ip = frame + packet->l3;
+	if(ip[0] >> 4 == 4 && load16(ip + 6) & 0x3fff)
 		return false;
 
-	for(uint32_t i = idx + req - 1; i > idx; i--) {
-		bitmap[i] = 0;
-	}
-	bitmap[idx] = 0;	// if idx is zero, it for loop will never end
+	// Lengths come from the IP header, as a chain goes on past the first buffer
+	size_t ip_len = packet->l4 - packet->l3;
+	size_t len = ip[0] >> 4 == 4 ? load16(ip + 2) : load16(ip + 4) + 40;
+	if(len < ip_len)
+		return false;
 
-	lock_lock(&nic->pool.lock);
-	nic->pool.used -= req;
-	lock_unlock(&nic->pool.lock);
+	store16(frame + packet->l4 + offset, pseudo_sum(ip, packet->l4_proto, len - ip_len));
+	packet->flags |= PACKET_F_TX_CSUM;
 
 	return true;
 }
 
-bool queue_push(NIC* nic, NICQueue* queue, Packet* packet) {
-	NIC* nic2 = nic_find_by_packet(packet);
-	if(nic2 == NULL)
+/*
+ * Frame asking for segmentation. The VM may change it under us, so its
+ * metadata is taken once.
+ */
+typedef struct {
+	const uint8_t*	frame;
+	size_t		size;
+	size_t		header;		// Length of the Ethernet, IP and TCP headers
+	uint16_t	gso_size;
+	uint8_t		l3;
+	uint8_t		l4;
+} GSOFrame;
+
+static bool gso_frame(Packet* packet, GSOFrame* gso) {
+	uint16_t start = packet->start;
+	uint16_t end = packet->end;
+	gso->gso_size = packet->gso_size;
+	gso->l3 = packet->l3;
+	gso->l4 = packet->l4;
+
+	uint8_t flags = packet->flags;
+	if(!(flags & PACKET_F_TX_GSO) || !(flags & PACKET_F_L3) || !(flags & PACKET_F_L4) ||
+			packet->l4_proto != 6 || gso->gso_size == 0 || end > packet->size || start > end)
 		return false;
 
-	uint64_t* array = (void*)nic + queue->base;
-	uint32_t next = (queue->tail + 1) % queue->size;
-	if(queue->head != next) {
-		array[queue->tail] = ((uint64_t)nic2->id << 32) | (uint64_t)(uint32_t)((uintptr_t)packet - (uintptr_t)nic2);
-		queue->tail = next;
-
-		return true;
-	} else {
+	gso->frame = packet->buffer + start;
+	gso->size = end - start;
+	if(gso->l3 >= gso->l4 || (size_t)gso->l4 + 20 > gso->size)
 		return false;
-	}
-}
 
-void* queue_pop(NIC* nic, NICQueue* queue) {
-	uint64_t* array = (void*)nic + queue->base;
+	uint8_t version = gso->frame[gso->l3] >> 4;
+	uint8_t ip_len = gso->l4 - gso->l3;
+	if((version != 4 || ip_len < 20) && (version != 6 || ip_len < 40))
+		return false;
 
-	if(queue->head != queue->tail) {
-		uint64_t tmp = array[queue->head];
-		uint32_t id = (uint32_t)(tmp >> 32);
-		uint32_t data = (uint32_t)tmp;
+	gso->header = gso->l4 + (gso->frame[gso->l4 + 12] >> 4) * 4;
 
-		array[queue->head] = 0;
+	return gso->header >= (size_t)gso->l4 + 20 && gso->header <= gso->size;
+}
 
-		queue->head = (queue->head + 1) % queue->size;
+uint16_t nic_packet_gso_count(Packet* packet) {
+	GSOFrame gso;
+	if(!gso_frame(packet, &gso))
+		return 0;
 
+	size_t payload = gso.size - gso.header;
+	if(payload <= gso.gso_size)
+		return 1;
 
-		if(nic->id == id) {
-			return (void*)nic + data;
-		} else {
-			nic = nic_get_by_id(id);
-			if(nic != NULL)
-				return (void*)nic + data;
-			else
-				return NULL;
-		}
-	} else {
-		return NULL;
-	}
+	return (payload + gso.gso_size - 1) / gso.gso_size;
 }
 
-uint32_t queue_size(NICQueue* queue) {
-	if(queue->tail >= queue->head)
-		return queue->tail - queue->head;
-	else
-		return queue->size + queue->tail - queue->head;
-}
+size_t nic_packet_gso_size(Packet* packet) {
+	GSOFrame gso;
+	if(!gso_frame(packet, &gso))
+		return 0;
 
-bool queue_available(NICQueue* queue) {
-	return queue->head != (queue->tail + 1) % queue->size;
+	return gso.header + gso.gso_size;
 }
 
-bool queue_empty(NICQueue* queue) {
-	return queue->head == queue->tail;
-}
+bool nic_packet_gso_segment(Packet* packet, uint16_t index, Packet* segment) {
+	GSOFrame gso;
+	if(!gso_frame(packet, &gso))
+		return false;
 
-bool nic_has_rx(NIC* nic) {
-	return !queue_empty(&nic->rx);
-}
+	size_t payload = gso.size - gso.header;
+	size_t offset = (size_t)index * gso.gso_size;
+	if(index > 0 && offset >= payload)
+		return false;
 
-Packet* nic_rx(NIC* nic) {
-	lock_lock(&nic->rx.rlock);
-	Packet* packet = queue_pop(nic, &nic->rx);
-	lock_unlock(&nic->rx.rlock);
+	size_t len = payload - offset < gso.gso_size ? payload - offset : gso.gso_size;
+	if(segment->start > segment->size || gso.header + len > (size_t)(segment->size - segment->start))
+		return false;
 
-	return packet;
-}
+	uint8_t* data = segment->buffer + segment->start;
+	memcpy(data, gso.frame, gso.header);
+	memcpy(data + gso.header, gso.frame + gso.header + offset, len);
+	segment->end = segment->start + gso.header + len;
+
+	uint8_t* ip = data + gso.l3;
+	if(ip[0] >> 4 == 4) {
+		store16(ip + 2, gso.header - gso.l3 + len);
+		store16(ip + 4, load16(ip + 4) + index);
+		ip[10] = ip[11] = 0;
+		nic_csum_complete(ip, gso.l4 - gso.l3, 0, 10);
+	} else {
+		store16(ip + 4, gso.header - gso.l3 - 40 + len);
+	}
 
-uint32_t nic_rx_size(NIC* nic) {
-	return queue_size(&nic->rx);
+	// FIN and PSH end the last segment, CWR starts the first
+	uint8_t* tcp = data + gso.l4;
+	uint32_t seq = ((uint32_t)load16(tcp + 4) << 16 | load16(tcp + 6)) + offset;
+	store16(tcp + 4, seq >> 16);
+	store16(tcp + 6, seq);
+	if(offset + len < payload)
+		tcp[13] &= ~(0x01 | 0x08);
+	if(index > 0)
+		tcp[13] &= ~0x80;
+
+	store16(tcp + 16, pseudo_sum(ip, 6, gso.header - gso.l4 + len));
+
+	segment->time = packet->time;
+	segment->vlan_proto = packet->vlan_proto;
+	segment->vlan_tci = packet->vlan_tci;
+	segment->hash = packet->hash;
+	segment->flags = (packet->flags & PACKET_F_HASH) | PACKET_F_L3 | PACKET_F_L4 | PACKET_F_TX_CSUM;
+	segment->l3 = gso.l3;
+	segment->l4 = gso.l4;
+	segment->l4_proto = 6;
+
+	return true;
 }
 
 bool nic_has_srx(NIC* nic) {
@@ -212,11 +1555,7 @@ bool nic_has_srx(NIC* nic) {
 }
 
 Packet* nic_srx(NIC* nic) {
-	lock_lock(&nic->srx.rlock);
-	Packet* packet = queue_pop(nic, &nic->srx);
-	lock_unlock(&nic->srx.rlock);
-
-	return packet;
+	return queue_pop(nic, &nic->srx);
 }
 
 uint32_t nic_srx_size(NIC* nic) {
@@ -224,121 +1563,108 @@ uint32_t nic_srx_size(NIC* nic) {
 }
 
 bool nic_has_tx(NIC* nic) {
-	return !queue_empty(&nic->tx);
+	return !queue_empty(&nic->txq[0]);
 }
 
 bool nic_tx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
-	if(!queue_push(nic, &nic->tx, packet)) {
-		lock_unlock(&nic->tx.wlock);
+	return nic_txq(nic, 0, packet);
+}
+
+uint32_t nic_tx_burst(NIC* nic, Packet** packets, uint32_t count) {
+	return nic_txq_burst(nic, 0, packets, count);
+}
+
+/*
+ * Queue a packet, or the copy of a shared one. The caller keeps its packet
+ * unless it returns true, so a shared packet only loses the caller's
+ * reference once the copy is queued.
+ */
+static bool try_push(NIC* nic, NICQueue* queue, Packet* packet, bool stamp) {
+	if(!queue_available(queue))
+		return false;
+
+	Packet* writable = packet_writable(nic, packet);
+	if(!writable)
+		return false;
+
+	if(stamp)
+		tx_stamp(&writable, 1);
+
+	if(!queue_push(nic, queue, writable)) {
+		if(writable != packet)
+			nic_free(writable);
 
-		nic_free(packet);
 		return false;
-	} else {
-		lock_unlock(&nic->tx.wlock);
-		return true;
 	}
+
+	if(writable != packet)
+		nic_free(packet);
+
+	return true;
 }
 
 bool nic_try_tx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
-	bool result = queue_push(nic, &nic->tx, packet);
-	lock_unlock(&nic->tx.wlock);
-
-	return result;
+	return try_push(nic, &nic->txq[0], packet, true);
 }
 
 bool nic_tx_dup(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
-	if(!queue_available(&nic->tx)) {
-		lock_unlock(&nic->tx.wlock);
+	if(!queue_available(&nic->txq[0]))
 		return false;
-	}
 
-	int len = packet->end - packet->start;
-
-	Packet* packet2 = nic_alloc(nic, len);
-	if(!packet2) {
-		lock_unlock(&nic->tx.wlock);
+	Packet* packet2 = packet_dup(nic, packet);
+	if(!packet2)
 		return false;
-	}
 
-	packet2->time = packet->time;
-	packet2->end = packet2->start + len;
-	memcpy(packet2->buffer + packet2->start, packet->buffer + packet->start, len);
-
-	if(!queue_push(nic, &nic->tx, packet)) {
-		lock_unlock(&nic->tx.wlock);
-
-		nic_free(packet);
+	tx_stamp(&packet2, 1);
+	if(!queue_push(nic, &nic->txq[0], packet2)) {
+		nic_free(packet2);
 		return false;
-	} else {
-		lock_unlock(&nic->tx.wlock);
-		return true;
 	}
+
+	return true;
 }
 
 bool nic_tx_available(NIC* nic) {
-	return queue_available(&nic->tx);
+	return queue_available(&nic->txq[0]);
 }
 
 uint32_t nic_tx_size(NIC* nic) {
-	return queue_size(&nic->tx);
+	return queue_size(&nic->txq[0]);
 }
 
 bool nic_stx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
-	if(!queue_push(nic, &nic->stx, packet)) {
-		lock_unlock(&nic->stx.wlock);
+	if(!nic_packet_unshare(nic, &packet) || !queue_push(nic, &nic->stx, packet)) {
 		nic_free(packet);
-
 		return false;
-	} else {
-		lock_unlock(&nic->stx.wlock);
-		return true;
 	}
+
+	return true;
 }
 
 bool nic_try_stx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
-	bool result = queue_push(nic, &nic->stx, packet);
-	lock_unlock(&nic->stx.wlock);
-
-	return result;
+	return try_push(nic, &nic->stx, packet, false);
 }
 
 bool nic_stx_dup(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
-	if(!queue_available(&nic->stx)) {
-		lock_unlock(&nic->stx.wlock);
+	if(!queue_available(&nic->stx))
 		return false;
-	}
 
-	int len = packet->end - packet->start;
-
-	Packet* packet2 = nic_alloc(nic, len);
-	if(!packet2) {
-		lock_unlock(&nic->stx.wlock);
+	Packet* packet2 = packet_dup(nic, packet);
+	if(!packet2)
 		return false;
-	}
 
 	packet2->time = packet->time;
-	packet2->end = packet2->start + len;
-	memcpy(packet2->buffer + packet2->start, packet->buffer + packet->start, len);
-
-	if(!queue_push(nic, &nic->stx, packet)) {
-		lock_unlock(&nic->stx.wlock);
-		nic_free(packet);
 
+	if(!queue_push(nic, &nic->stx, packet2)) {
+		nic_free(packet2);
 		return false;
-	} else {
-		lock_unlock(&nic->stx.wlock);
-		return true;
 	}
+
+	return true;
 }
 
 bool nic_has_stx(NIC* nic) {
-	return queue_available(&nic->stx);
+	return !queue_empty(&nic->stx);
 }
 
 uint32_t nic_stx_size(NIC* nic) {
@@ -346,15 +1672,264 @@ uint32_t nic_stx_size(NIC* nic) {
 }
 
 size_t nic_pool_used(NIC* nic) {
-	return nic->pool.used * NIC_CHUNK_SIZE;
+	return nic_pool_total(nic) - nic_pool_free(nic);
 }
 
 size_t nic_pool_free(NIC* nic) {
-	return (nic->pool.count - nic->pool.used) * NIC_CHUNK_SIZE;
+	nic = nic_pool_nic(nic);
+	if(!nic)
+		return 0;
+
+	size_t size = 0;
+	for(int class = 0; class < NIC_POOL_CLASS_COUNT; class++) {
+		NICSlab* slab = &nic->pool.slabs[class];
+		uint32_t count = slab->free_count;
+
+		NICPoolCache* caches = (void*)nic + nic->pool.cache;
+		for(int i = 0; i < NIC_POOL_CACHE_COUNT; i++)
+			count += caches[i].count[class];
+
+		size += (size_t)count * slab->size;
+	}
+
+	for(int i = 0; i < NIC_POOL_EXTENT_COUNT; i++) {
+		NICSlab* slab = &nic->pool.extents[i];
+		if(slab->count)
+			size += (size_t)slab->free_count * slab->size;
+	}
+
+	return size;
 }
 
 size_t nic_pool_total(NIC* nic) {
-	return nic->pool.count * NIC_CHUNK_SIZE;
+	nic = nic_pool_nic(nic);
+	if(!nic)
+		return 0;
+
+	size_t size = 0;
+	for(int class = 0; class < NIC_POOL_CLASS_COUNT; class++)
+		size += (size_t)nic->pool.slabs[class].count * nic->pool.slabs[class].size;
+
+	for(int i = 0; i < NIC_POOL_EXTENT_COUNT; i++)
+		size += (size_t)nic->pool.extents[i].count * nic->pool.extents[i].size;
+
+	return size;
+}
+
+int nic_pool_grow(NIC* nic, NICPool* pool, void* block, uint32_t size, int class) {
+	uint64_t base = (uintptr_t)block - (uintptr_t)nic;
+	if(class < 0 || class >= NIC_POOL_CLASS_COUNT || (uintptr_t)block <= (uintptr_t)nic ||
+			base + size > UINT32_MAX || (uintptr_t)block % NIC_POOL_EXTENT_SIZE != 0 || size <= NIC_CHUNK_SIZE)
+		return -1;
+
+	int index;
+	for(index = 0; index < NIC_POOL_EXTENT_COUNT && pool->extents[index].count; index++);
+	if(index == NIC_POOL_EXTENT_COUNT)
+		return -1;
+
+	NICExtentHeader* header = block;
+	header->magic = NIC_MAGIC_EXTENT;
+	header->nic = nic;
+
+	NICSlab slab = {
+		.base = base + NIC_CHUNK_SIZE,
+		.size = pool->slabs[class].size,
+	};
+	slab.count = (size - NIC_CHUNK_SIZE) / slab.size;
+	if(slab.count == 0)
+		return -1;
+
+	for(uint32_t i = 0; i < slab.count; i++) {
+		uint32_t offset = slab.base + i * slab.size;
+		*(uint32_t*)((void*)nic + offset) = i + 1 < slab.count ? offset + slab.size : 0;
+	}
+	slab.free = slab.base;
+	slab.free_count = slab.count;
+
+	// The layout is complete before the NIC's one says the extent is there
+	pool->extents[index] = slab;
+	pool->extent_classes[index] = class;
+	nic->pool.extent_classes[index] = class;
+	nic->pool.extents[index].base = slab.base;
+	nic->pool.extents[index].size = slab.size;
+	nic->pool.extents[index].cache_size = 0;
+	nic->pool.extents[index].free = slab.free;
+	nic->pool.extents[index].free_count = slab.free_count;
+	nic->pool.extents[index].lock = 0;
+	asm volatile("" ::: "memory");
+	nic->pool.extents[index].count = slab.count;
+
+	return index;
+}
+
+void* nic_pool_shrink(NIC* nic, NICPool* pool, int index) {
+	if(index < 0 || index >= NIC_POOL_EXTENT_COUNT || pool->extents[index].count == 0)
+		return NULL;
+
+	// The VM may hold the lock; try again later then
+	NICSlab* slab = &nic->pool.extents[index];
+	if(!pool_lock(&slab->lock, false))
+		return NULL;
+
+	if(slab->free_count != pool->extents[index].count) {
+		pool_unlock(&slab->lock);
+		return NULL;
+	}
+
+	slab->count = 0;
+	slab->free = 0;
+	slab->free_count = 0;
+	pool_unlock(&slab->lock);
+
+	NICExtentHeader* header = (void*)nic + pool->extents[index].base - NIC_CHUNK_SIZE;
+	header->magic = 0;
+	pool->extents[index].count = 0;
+
+	return header;
+}
+
+size_t nic_pool_charged(NIC* nic) {
+	NIC* holder = nic_pool_nic(nic);
+	if(!holder || nic->pool.quota == 0)
+		return 0;
+
+	return holder->pool.charged[pool_share(&nic->pool)];
+}
+
+#define CONFIG_INDEX_WORDS	(sizeof(NICConfigIndex) / sizeof(uint32_t))
+
+static inline NICConfigIndex* config_index(NIC* nic) {
+	return (NICConfigIndex*)nic->config_head;
+}
+
+static inline uint32_t* config_entry(NIC* nic, uint16_t key) {
+	return (uint32_t*)nic->config_head + key;
+}
+
+static inline uint32_t config_words(NIC* nic) {
+	return ((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head) / sizeof(uint32_t);
+}
+
+// FNV-1a of the name; len is its length with the terminating null
+static uint32_t config_hash(const char* name, int* len) {
+	uint32_t hash = 2166136261U;
+	const char* c = name;
+	for(; *c != '\0'; c++)
+		hash = (hash ^ (uint8_t)*c) * 16777619U;
+
+	*len = c - name + 1;
+
+	return hash;
+}
+
+/*
+ * Probe the index for the name
+ *
+ * @param free the first empty or freed slot on the way, where the name would go
+ * @return slot of the name, -1 if it is not in the index
+ */
+static int config_lookup(NIC* nic, const char* name, int len, uint32_t hash, int* free) {
+	NICConfigIndex* index = config_index(nic);
+	uint32_t tag = hash & 0xffff0000;
+
+	*free = -1;
+	for(int i = 0; i < NIC_CONFIG_INDEX_SIZE; i++) {
+		int slot = (hash + i) & (NIC_CONFIG_INDEX_SIZE - 1);
+		uint32_t value = index->slots[slot];
+
+		if(value == 0) {
+			if(*free < 0)
+				*free = slot;
+
+			return -1;
+		}
+
+		if(value == NIC_CONFIG_DELETED) {
+			if(*free < 0)
+				*free = slot;
+
+			continue;
+		}
+
+		if((value & 0xffff0000) != tag)
+			continue;
+
+		uint32_t* entry = config_entry(nic, value & 0xffff);
+		if((*entry >> 16) == (uint32_t)len && memcmp(name, entry + 1, len) == 0)
+			return slot;
+	}
+
+	return -1;
+}
+
+// Build the index again from the entries to clear the freed slots
+static void config_rehash(NIC* nic) {
+	NICConfigIndex* index = config_index(nic);
+	memset(index->slots, 0, sizeof(index->slots));
+	index->deleted = 0;
+
+	for(uint32_t key = CONFIG_INDEX_WORDS; key < index->tail; ) {
+		uint32_t* entry = config_entry(nic, key);
+		if(*entry == 0) {
+			key++;
+			continue;
+		}
+
+		int len;
+		uint32_t hash = config_hash((const char*)(entry + 1), &len);
+		int slot = hash & (NIC_CONFIG_INDEX_SIZE - 1);
+		while(index->slots[slot] != 0)
+			slot = (slot + 1) & (NIC_CONFIG_INDEX_SIZE - 1);
+
+		index->slots[slot] = (hash & 0xffff0000) | key;
+		key += *entry & 0xffff;
+	}
+}
+
+/*
+ * Find req free words. They are taken from the end of the entries, and from
+ * the holes freed entries left only when it runs out.
+ *
+ * @return key of the words, -1 if there is no space
+ */
+static int32_t config_reserve(NIC* nic, uint32_t req) {
+	NICConfigIndex* index = config_index(nic);
+	uint32_t words = config_words(nic);
+
+	if(index->tail + req <= words) {
+		uint32_t key = index->tail;
+		index->tail += req;
+
+		return key;
+	}
+
+	for(uint32_t key = CONFIG_INDEX_WORDS; key < index->tail; ) {
+		uint32_t* entry = config_entry(nic, key);
+		if(*entry != 0) {
+			key += *entry & 0xffff;
+			continue;
+		}
+
+		uint32_t end = key;
+		while(end < index->tail && end - key < req && *config_entry(nic, end) == 0)
+			end++;
+
+		if(end - key == req)
+			return key;
+
+		if(end == index->tail) {
+			if(key + req > words)
+				return -1;
+
+			index->tail = key + req;
+
+			return key;
+		}
+
+		key = end;
+	}
+
+	return -1;
 }
 
 /**
@@ -363,111 +1938,110 @@ size_t nic_pool_total(NIC* nic) {
  * block_count: uint16_t
  * name: 4 bytes rounded string length
  * blocks
- * @return -1 key length is too long
- * @return -2 already allocated
- * @return -3 no space to allocate
- * @return 0 ~ 2^16 - 1 key
  */
 int32_t nic_config_alloc(NIC* nic, char* name, uint16_t size) {
-	int len = strlen(name) + 1;
+	int len;
+	uint32_t hash = config_hash(name, &len);
 	if(len > 255)
 		return -1;
-	
-	uint32_t req = 1 + ((len + sizeof(uint32_t) - 1) / sizeof(uint32_t)) + (((uint32_t)size + sizeof(uint32_t) - 1) / sizeof(uint32_t)); // heder + round(name) + round(blocks)
-	
-	// Check name is already allocated
-	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
-		uint16_t len2 = *p >> 16;
-		uint16_t count2 = *p & 0xffff;
-		
-		if(*p == 0) {
-			p++;
-		} else {
-			if(len2 == len && strncmp(name, (const char*)(p + 1), len - 1) == 0) {
-				return -1;
-			}
-			
-			p += count2;
-		}
-	}
-	
-	// Check available space
-	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
-		if(*p == 0) {
-			bool found = true;
-			for(int i = 0; i < req; i++) {
-				if(p >= (uint32_t*)nic->config_tail) {
-					return -2;
-				}
-				
-				if(p[i] != 0) {
-					p += i - 1;
-					found = false;
-					break;
-				}
-			}
-			
-			if(found) {
-				*p = (uint32_t)len << 16 | req;
-				memcpy(p + 1, name, len);
-				return ((uintptr_t)p - (uintptr_t)nic->config_head) / sizeof(uint32_t);
-			}
-			
-			p++;
-		} else {
-			p += *p & 0xffff;
-		}
+
+	NICConfigIndex* index = config_index(nic);
+	if(index->tail == 0)
+		index->tail = CONFIG_INDEX_WORDS;
+
+	int free;
+	if(config_lookup(nic, name, len, hash, &free) >= 0)
+		return -1;
+
+	if(index->count >= NIC_CONFIG_INDEX_LOAD)
+		return -2;
+
+	// Probes get long with freed slots
+	if(index->count + index->deleted >= NIC_CONFIG_INDEX_LOAD) {
+		config_rehash(nic);
+		config_lookup(nic, name, len, hash, &free);
 	}
-	
-	return -2;
+
+	uint32_t req = 1 + ((len + sizeof(uint32_t) - 1) / sizeof(uint32_t)) + (((uint32_t)size + sizeof(uint32_t) - 1) / sizeof(uint32_t)); // heder + round(name) + round(blocks)
+	int32_t key = config_reserve(nic, req);
+	if(key < 0)
+		return -2;
+
+	uint32_t* entry = config_entry(nic, key);
+	*entry = (uint32_t)len << 16 | req;
+	memcpy(entry + 1, name, len);
+
+	if(index->slots[free] == NIC_CONFIG_DELETED)
+		index->deleted--;
+
+	index->slots[free] = (hash & 0xffff0000) | key;
+	index->count++;
+	index->used += req;
+
+	return key;
 }
 
 void nic_config_free(NIC* nic, uint16_t key) {
-	uint16_t count = (uint16_t)nic->config_head[key] & 0xffff;
-	
-	for(int i = count - 1; i >= 0; i--) {
-		nic->config_head[key + i] = 0;
+	NICConfigIndex* index = config_index(nic);
+	if(key < CONFIG_INDEX_WORDS || key >= index->tail)
+		return;
+
+	uint32_t* entry = config_entry(nic, key);
+	uint16_t count = *entry & 0xffff;
+	if(count == 0)
+		return;
+
+	int len;
+	uint32_t hash = config_hash((const char*)(entry + 1), &len);
+	for(int i = 0; i < NIC_CONFIG_INDEX_SIZE; i++) {
+		int slot = (hash + i) & (NIC_CONFIG_INDEX_SIZE - 1);
+		if(index->slots[slot] == 0)
+			break;
+
+		if(index->slots[slot] == NIC_CONFIG_DELETED || (index->slots[slot] & 0xffff) != key)
+			continue;
+
+		// The end of a probe sequence needs no mark
+		if(index->slots[(slot + 1) & (NIC_CONFIG_INDEX_SIZE - 1)] == 0) {
+			index->slots[slot] = 0;
+		} else {
+			index->slots[slot] = NIC_CONFIG_DELETED;
+			index->deleted++;
+		}
+		index->count--;
+		break;
 	}
+
+	index->used -= count;
+	if(key + count == index->tail)
+		index->tail = key;
+
+	memset(entry, 0, count * sizeof(uint32_t));
 }
 
-/**
- *
- * @return -1 key length is too long
- * @return -2 key of the name not found
- * @return otherwise key of the name
- */
 int32_t nic_config_key(NIC* nic, char* name) {
-	int len = strlen(name) + 1;
+	int len;
+	uint32_t hash = config_hash(name, &len);
 	if(len > 255)
 		return -1;
-	
-	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
-		if(*p == 0) {
-			p++;
-		} else {
-			uint16_t len2 = *p >> 16;
-			uint16_t count2 = *p & 0xffff;
-			
-			if(len2 == len && strncmp(name, (const char*)(p + 1), len - 1) == 0) {
-				return ((uintptr_t)p - (uintptr_t)nic->config_head) / sizeof(uint32_t);
-			}
-			
-			p += count2;
-		}
-	}
 
-	return -2;
+	int free;
+	int slot = config_lookup(nic, name, len, hash, &free);
+	if(slot < 0)
+		return -2;
+
+	return config_index(nic)->slots[slot] & 0xffff;
 }
 
 void* nic_config_get(NIC* nic, uint16_t key) {
-	uint32_t* header = (uint32_t*)&nic->config_head[key];
+	uint32_t* header = config_entry(nic, key);
 	uint16_t len = *header >> 16;
 	
 	return header + 1 + (len + sizeof(uint32_t) - 1) / sizeof(uint32_t);
 }
 
 uint16_t nic_config_size(NIC* nic, uint16_t key) {
-	uint32_t* header = (uint32_t*)&nic->config_head[key];
+	uint32_t* header = config_entry(nic, key);
 	uint16_t len = *header >> 16;
 	uint16_t count = *header & 0xffff;
 	
@@ -475,22 +2049,11 @@ uint16_t nic_config_size(NIC* nic, uint16_t key) {
 }
 
 uint32_t nic_config_available(NIC* nic) {
-	uint32_t count = 0;
-	
-	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
-		if(*p == 0) {
-			p++;
-			count++;
-		} else {
-			p += *p & 0xffff;
-		}
-	}
-
-	return count * sizeof(uint32_t);
+	return (config_words(nic) - CONFIG_INDEX_WORDS - config_index(nic)->used) * sizeof(uint32_t);
 }
 
 uint32_t nic_config_total(NIC* nic) {
-	return (uint32_t)((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head);
+	return (config_words(nic) - CONFIG_INDEX_WORDS) * sizeof(uint32_t);
 }
 
 #if TEST
@@ -554,9 +2117,9 @@ static void dump(NIC* nic) {
 	printf("padding_head: %d\n", nic->padding_head);
 	printf("padding_tail: %d\n", nic->padding_tail);
 	printf("rx queue\n");
-	print_queue(&nic->rx);
+	print_queue(&nic->rxq[0]);
 	printf("tx queue\n");
-	print_queue(&nic->tx);
+	print_queue(&nic->txq[0]);
 	printf("srx queue\n");
 	print_queue(&nic->srx);
 	printf("tx slow_queue\n");
@@ -628,10 +2191,10 @@ void fail(const char* format, ...) {
 	
 	/*
 	printf("* rx\n");
-	dump_queue(vnic, &vnic->rx);
+	dump_queue(vnic, &vnic->rxq[0]);
 	
 	printf("* tx\n");
-	dump_queue(vnic, &vnic->tx);
+	dump_queue(vnic, &vnic->txq[0]);
 	
 	printf("* srx\n");
 	dump_queue(vnic, &vnic->srx)
@@ -863,21 +2426,21 @@ int main(int argc, char** argv) {
 	
 
 	printf("rx queue: push full: ");
-	for(i = 0; i < vnic->rx.size - 1; i++) {
+	for(i = 0; i < vnic->rxq[0].size - 1; i++) {
 		ps[i] = vnic_alloc(vnic, 0);
 		if(ps[i] == NULL)
 			fail("cannot alloc packet: count: %d", i);
 		
 		if(!vnic_driver_rx2(vnic, ps[i]))
-			fail("cannot push rx: count: %d, queue size: %d", i, vnic->rx.size);
+			fail("cannot push rx: count: %d, queue size: %d", i, vnic->rxq[0].size);
 	}
 	
 	if(vnic_driver_has_rx(vnic))
 		fail("vnic_driver_has_rx must return false");
 	
 	size = vnic_rx_size(vnic);
-	if(size != vnic->rx.size - 1)
-		fail("vnic_rx_size must return %d but %d", vnic->rx.size - 1, size);
+	if(size != vnic->rxq[0].size - 1)
+		fail("vnic_rx_size must return %d but %d", vnic->rxq[0].size - 1, size);
 	
 	if(!vnic_has_rx(vnic))
 		fail("vnic_has_rx must return true");
@@ -894,7 +2457,7 @@ int main(int argc, char** argv) {
 		fail("packet allocation failed");
 	
 	if(vnic_driver_rx2(vnic, p1))
-		fail("push overflow: count: %d, queue size: %d", i, vnic->rx.size);
+		fail("push overflow: count: %d, queue size: %d", i, vnic->rxq[0].size);
 	
 	int used2 = bitmap_used(vnic);
 	if(used != used2)
@@ -904,8 +2467,8 @@ int main(int argc, char** argv) {
 		fail("vnic_driver_has_rx must return false");
 	
 	size = vnic_rx_size(vnic);
-	if(size != vnic->rx.size - 1)
-		fail("vnic_rx_size must return %d but %d", vnic->rx.size - 1, size);
+	if(size != vnic->rxq[0].size - 1)
+		fail("vnic_rx_size must return %d but %d", vnic->rxq[0].size - 1, size);
 	
 	if(!vnic_has_rx(vnic))
 		fail("vnic_has_rx must return true");
@@ -914,7 +2477,7 @@ int main(int argc, char** argv) {
 	
 
 	printf("rx queue: pop: ");
-	for(i = 0; i < vnic->rx.size - 1; i++) {
+	for(i = 0; i < vnic->rxq[0].size - 1; i++) {
 		Packet* p1 = vnic_rx(vnic);
 		if(p1 != ps[i])
 			fail("worong pointer returned: %p, expected: %p", p1, (void*)(uintptr_t)i);
@@ -1187,7 +2750,7 @@ int main(int argc, char** argv) {
 
 
 	printf("tx queue: tx full: ");
-	for(i = 0; i < vnic->tx.size - 1; i++) {
+	for(i = 0; i < vnic->txq[0].size - 1; i++) {
 		ps[i] = vnic_alloc(vnic, 0);
 		if(ps[i] == NULL)
 			fail("cannot alloc packet: count: %d", i + 1);
@@ -1197,8 +2760,8 @@ int main(int argc, char** argv) {
 	}
 
 	size = vnic_tx_size(vnic);
-	if(size != vnic->tx.size - 1)
-		fail("vnic_tx_size must be %d: %d", vnic->tx.size - 1, size);
+	if(size != vnic->txq[0].size - 1)
+		fail("vnic_tx_size must be %d: %d", vnic->txq[0].size - 1, size);
 	
 	if(vnic_has_tx(vnic))
 		fail("vnic_has_tx must be false");
@@ -1240,8 +2803,8 @@ int main(int argc, char** argv) {
 		fail("packet allocated on overflow %d != %d", used, used2);
 
 	size = vnic_tx_size(vnic);
-	if(size != vnic->tx.size - 1)
-		fail("vnic_tx_size must be %d: %d", vnic->tx.size - 1, size);
+	if(size != vnic->txq[0].size - 1)
+		fail("vnic_tx_size must be %d: %d", vnic->txq[0].size - 1, size);
 	
 	if(vnic_has_tx(vnic))
 		fail("vnic_has_tx must be false");
@@ -1253,7 +2816,7 @@ int main(int argc, char** argv) {
 	
 	
 	printf("tx queue: send all: ");
-	for(i = 0; i < vnic->tx.size - 1; i++) {
+	for(i = 0; i < vnic->txq[0].size - 1; i++) {
 		p1 = vnic_driver_tx(vnic);
 		if(p1 != ps[i])
 			fail("wrong pointer returned: %p != %p", ps[i], p1);
@@ -0,0 +1,118 @@
+#include <shaper.h>
+#include <lock.h>
+
+static void set_limits(TokenBucket* bucket, uint64_t rate, uint64_t burst, uint64_t packet_rate, uint64_t packet_burst) {
+	if(bucket->frequency == 0)
+		rate = packet_rate = 0;
+
+	if(burst == 0) {
+		burst = rate / 8 / TOKEN_BUCKET_BURST_TIME;
+		if(burst < TOKEN_BUCKET_MIN_BURST)
+			burst = TOKEN_BUCKET_MIN_BURST;
+	}
+
+	if(packet_burst == 0) {
+		packet_burst = packet_rate / TOKEN_BUCKET_BURST_TIME;
+		if(packet_burst < TOKEN_BUCKET_MIN_PACKET_BURST)
+			packet_burst = TOKEN_BUCKET_MIN_PACKET_BURST;
+	}
+
+	bucket->rate = rate;
+	bucket->packet_rate = packet_rate;
+	bucket->depth = burst * 8 * bucket->frequency;
+	bucket->packet_depth = packet_burst * bucket->frequency;
+}
+
+void token_bucket_init(TokenBucket* bucket, uint64_t frequency, uint64_t rate, uint64_t burst,
+		uint64_t packet_rate, uint64_t packet_burst, TokenBucket* parent) {
+	bucket->frequency = frequency;
+	set_limits(bucket, rate, burst, packet_rate, packet_burst);
+	bucket->tokens = bucket->depth;
+	bucket->packet_tokens = bucket->packet_depth;
+	bucket->last = 0;
+	bucket->parent = parent;
+	lock_init(&bucket->lock);
+}
+
+void token_bucket_update(TokenBucket* bucket, uint64_t rate, uint64_t burst, uint64_t packet_rate, uint64_t packet_burst) {
+	// A bucket which was unlimited starts full
+	lock_lock(&bucket->lock);
+
+	bool full = bucket->rate == 0;
+	bool packet_full = bucket->packet_rate == 0;
+
+	set_limits(bucket, rate, burst, packet_rate, packet_burst);
+
+	if(full || bucket->tokens > bucket->depth)
+		bucket->tokens = bucket->depth;
+
+	if(packet_full || bucket->packet_tokens > bucket->packet_depth)
+		bucket->packet_tokens = bucket->packet_depth;
+
+	lock_unlock(&bucket->lock);
+}
+
+static void fill(int64_t* tokens, int64_t depth, uint64_t rate, uint64_t elapsed) {
+	if(*tokens >= depth)
+		return;
+
+	// elapsed * rate doesn't overflow while it is less than the room
+	uint64_t room = depth - *tokens;
+	if(elapsed > room / rate)
+		*tokens = depth;
+	else
+		*tokens += elapsed * rate;
+}
+
+static void refill(TokenBucket* bucket, uint64_t t) {
+	if(t <= bucket->last)
+		return;
+
+	uint64_t elapsed = t - bucket->last;
+	bucket->last = t;
+
+	if(bucket->rate)
+		fill(&bucket->tokens, bucket->depth, bucket->rate, elapsed);
+
+	if(bucket->packet_rate)
+		fill(&bucket->packet_tokens, bucket->packet_depth, bucket->packet_rate, elapsed);
+}
+
+bool token_bucket_conform(TokenBucket* bucket, uint64_t t) {
+	for(; bucket; bucket = bucket->parent) {
+		lock_lock(&bucket->lock);
+		refill(bucket, t);
+
+		bool debt = (bucket->rate && bucket->tokens < 0) || (bucket->packet_rate && bucket->packet_tokens < 0);
+		lock_unlock(&bucket->lock);
+
+		if(debt)
+			return false;
+	}
+
+	return true;
+}
+
+void token_bucket_charge(TokenBucket* bucket, uint64_t t, uint64_t bytes, uint32_t packets) {
+	for(; bucket; bucket = bucket->parent) {
+		lock_lock(&bucket->lock);
+		refill(bucket, t);
+
+		if(bucket->rate)
+			bucket->tokens -= bytes * 8 * bucket->frequency;
+
+		if(bucket->packet_rate)
+			bucket->packet_tokens -= packets * bucket->frequency;
+
+		lock_unlock(&bucket->lock);
+	}
+}
+
+bool token_bucket_consume(TokenBucket* bucket, uint64_t t, uint64_t bytes, uint32_t packets) {
+	if(!token_bucket_conform(bucket, t))
+		return false;
+
+	token_bucket_charge(bucket, t, bytes, packets);
+
+	return true;
+}
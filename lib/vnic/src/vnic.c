@@ -3,7 +3,7 @@
 #include <vnic.h>
 #include <nic.h>
 
-#define ID_BUFFER_SIZE (128 * MAX_VNIC_COUNT / 8)
+#define ID_BUFFER_SIZE (NIC_MAX_ID / 8)
 static uint8_t id_map[ID_BUFFER_SIZE];
 
 static uint64_t TIMER_FREQUENCY_PER_SEC;
@@ -56,6 +56,75 @@ static uint64_t get_value(uint64_t* attrs, uint64_t key) {
 	return (uint64_t)-1;
 }
 
+static uint64_t get_value_or(uint64_t* attrs, uint64_t key, uint64_t value) {
+	for(int i = 0; attrs[i * 2] != VNIC_NONE; i++) {
+		if(attrs[i * 2] == key)
+			return attrs[i * 2 + 1];
+	}
+	return value;
+}
+
+static void queue_init(NICQueue* queue, uint32_t base, uint32_t size, uint32_t flags) {
+	queue->base = base;
+	queue->size = size;
+	queue->flags = flags;
+	queue->tail = 0;
+	queue->head_cache = 0;
+	queue->head = 0;
+	queue->tail_cache = 0;
+	queue->rlock = 0;
+}
+
+/*
+ * Buffer size of each size class and its share of the pool in eighths.
+ * The smallest class takes what the others leave, the jumbo class' share too
+ * when the NIC receives neither jumbo nor chained frames.
+ */
+static const struct {
+	uint32_t	size;
+	uint32_t	share;
+} pool_classes[NIC_POOL_CLASS_COUNT] = {
+	{ 2048, 4 },
+	{ 4096, 2 },
+	{ 9216, 2 },	// Jumbo frame
+};
+
+#define POOL_CLASS_JUMBO	(NIC_POOL_CLASS_COUNT - 1)
+
+static uint32_t pool_init(void* base, NICPool* pool, uint64_t size, bool jumbo) {
+	uint32_t counts[NIC_POOL_CLASS_COUNT];
+	uint64_t left = size;
+	for(int class = NIC_POOL_CLASS_COUNT - 1; class > 0; class--) {
+		uint32_t share = class == POOL_CLASS_JUMBO && !jumbo ? 0 : pool_classes[class].share;
+		counts[class] = size * share / 8 / pool_classes[class].size;
+		left -= (uint64_t)counts[class] * pool_classes[class].size;
+	}
+	counts[0] = left / pool_classes[0].size;
+
+	uint32_t index = pool->pool;
+	uint32_t total = 0;
+	for(int class = 0; class < NIC_POOL_CLASS_COUNT; class++) {
+		NICSlab* slab = &pool->slabs[class];
+		slab->base = index;
+		slab->size = pool_classes[class].size;
+		slab->count = counts[class];
+		slab->cache_size = slab->count / 16 < NIC_POOL_CACHE_SIZE ? slab->count / 16 : NIC_POOL_CACHE_SIZE;
+		slab->free = slab->count ? slab->base : 0;
+		slab->free_count = slab->count;
+		slab->lock = 0;
+
+		for(uint32_t i = 0; i < slab->count; i++) {
+			uint32_t offset = slab->base + i * slab->size;
+			*(uint32_t*)(base + offset) = i + 1 < slab->count ? offset + slab->size : 0;
+		}
+
+		index += slab->count * slab->size;
+		total += slab->count;
+	}
+
+	return total;
+}
+
 static VNICError has_mandatory(uint64_t* attrs) {
 	uint8_t used[VNIC__MAND_END] = {0,};
 
@@ -85,7 +154,7 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 	if(get_value(attrs, VNIC_POOL_SIZE) % 0x200000 != 0)
 		return VNIC_ERROR_INVALID_POOLSIZE;
 
-	int index = sizeof(NIC);
+	uint64_t index = sizeof(NIC);
 
 	NIC* nic = base;
 	nic->magic = NIC_MAGIC_HEADER;
@@ -97,409 +166,1262 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 	nic->padding_head = get_value(attrs, VNIC_PADDING_HEAD);
 	nic->padding_tail = get_value(attrs, VNIC_PADDING_TAIL);
 
-	nic->rx.base = index;
-	nic->rx.head = 0;
-	nic->rx.tail = 0;
-	nic->rx.size = get_value(attrs, VNIC_RX_QUEUE_SIZE);
-	nic->rx.rlock = 0;
-	nic->rx.wlock = 0;
-
-	index += nic->rx.size * sizeof(uint64_t);
-	index = ROUNDUP(index, 8);
-	nic->tx.base = index;
-	nic->tx.head = 0;
-	nic->tx.tail = 0;
-	nic->tx.size = get_value(attrs, VNIC_TX_QUEUE_SIZE);
-	nic->tx.rlock = 0;
-	nic->tx.wlock = 0;
-
-	index += nic->tx.size * sizeof(uint64_t);
-	index = ROUNDUP(index, 8);
-	nic->srx.base = index;
-	nic->srx.head = 0;
-	nic->srx.tail = 0;
-	nic->srx.size = get_value(attrs, VNIC_SLOW_RX_QUEUE_SIZE);
-	nic->srx.rlock = 0;
-	nic->srx.wlock = 0;
+	uint32_t rx_flags = get_value_or(attrs, VNIC_RX_QUEUE_FLAGS, 0);
+	uint32_t tx_flags = get_value_or(attrs, VNIC_TX_QUEUE_FLAGS, 0);
+
+	uint64_t queue_count = nic->flags & NIC_F_MULTIQUEUE ? get_value_or(attrs, VNIC_QUEUE_COUNT, 1) : 1;
+	if(queue_count == 0 || queue_count > NIC_MAX_QUEUE_COUNT)
+		return VNIC_ERROR_ATTRIBUTE_INVALID;
+
+	nic->queue_count = queue_count;
+	memset(nic->rxq, 0, sizeof(nic->rxq));
+	memset(nic->txq, 0, sizeof(nic->txq));
+
+	for(uint64_t i = 0; i < queue_count; i++) {
+		queue_init(&nic->rxq[i], index, get_value(attrs, VNIC_RX_QUEUE_SIZE), rx_flags);
+		index += nic->rxq[i].size * sizeof(uint64_t);
+		index = ROUNDUP(index, NIC_CACHE_LINE_SIZE);
+	}
 
+	for(uint64_t i = 0; i < queue_count; i++) {
+		queue_init(&nic->txq[i], index, get_value(attrs, VNIC_TX_QUEUE_SIZE), tx_flags);
+		index += nic->txq[i].size * sizeof(uint64_t);
+		index = ROUNDUP(index, NIC_CACHE_LINE_SIZE);
+	}
+
+	queue_init(&nic->srx, index, get_value(attrs, VNIC_SLOW_RX_QUEUE_SIZE), rx_flags);
 	index += nic->srx.size * sizeof(uint64_t);
-	index = ROUNDUP(index, 8);
-	nic->stx.base = index;
-	nic->stx.head = 0;
-	nic->stx.tail = 0;
-	nic->stx.size = get_value(attrs, VNIC_SLOW_TX_QUEUE_SIZE);
-	nic->stx.rlock = 0;
-	nic->stx.wlock = 0;
+	index = ROUNDUP(index, NIC_CACHE_LINE_SIZE);
+
+	queue_init(&nic->stx, index, get_value(attrs, VNIC_SLOW_TX_QUEUE_SIZE), tx_flags);
 	index += nic->stx.size * sizeof(uint64_t);
-	index = ROUNDUP(index, 8);
+	index = ROUNDUP(index, NIC_CACHE_LINE_SIZE);
 
 	uint64_t poolsize = get_value(attrs, VNIC_POOL_SIZE);
-	#define BITMAP_SIZE (poolsize - index) / NIC_CHUNK_SIZE;
 
-	nic->pool.bitmap = index;
-	index += BITMAP_SIZE;
+	nic->pool.cache = index;
+	index += NIC_POOL_CACHE_COUNT * sizeof(NICPoolCache);
+	index = ROUNDUP(index, NIC_CACHE_LINE_SIZE);
+
+	nic->stats = index;
+	index += NIC_STATS_CORE_COUNT * sizeof(NICStats);
 	index = ROUNDUP(index, NIC_CHUNK_SIZE);
-	if(index + NIC_CHUNK_SIZE > poolsize) return VNIC_ERROR_NO_MEMORY;
+	if(index >= poolsize) return VNIC_ERROR_NO_MEMORY;
+
+	// Jumbo buffers are kept only for the NICs which may receive frames they fit
+	bool jumbo = (nic->flags & NIC_F_CHAIN) || get_value_or(attrs, VNIC_MTU, VNIC_MTU_DEFAULT) > pool_classes[0].size;
 
 	nic->pool.pool = index;
-	nic->pool.count = BITMAP_SIZE;
-	nic->pool.index = 0;
-	nic->pool.used = 0;
-	nic->pool.lock = 0;
+	if(pool_init(base, &nic->pool, poolsize - index, jumbo) == 0) return VNIC_ERROR_NO_MEMORY;
 
 	nic->config = 0;
 
 	memset(nic->config_head, 0, (size_t)((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head));
-	memset(base + nic->pool.bitmap, 0, nic->pool.count);
+	memset(base + nic->rxq[0].base, 0, nic->pool.cache - nic->rxq[0].base);	// Empty queue entries are zero
+	memset(base + nic->pool.cache, 0, NIC_POOL_CACHE_COUNT * sizeof(NICPoolCache));
+	memset(base + nic->stats, 0, NIC_STATS_CORE_COUNT * sizeof(NICStats));
 
 	return VNIC_ERROR_NOERROR;
 }
 
+static inline uint64_t usec_ticks(uint64_t usec) {
+	return usec * TIMER_FREQUENCY_PER_SEC / 1000000;
+}
+
+static void rx_codel_init(VNIC* vnic, uint64_t target, uint64_t interval) {
+	for(int i = 0; i < NIC_MAX_QUEUE_COUNT; i++)
+		codel_init(&vnic->rx_codel[i], usec_ticks(target), usec_ticks(interval));
+}
+
 bool vnic_init(VNIC* vnic, uint64_t* attrs) {
+	// The pool is shared with the holder only, which has an ID of its own
+	VNIC* shared = (VNIC*)get_value_or(attrs, VNIC_POOL_SHARED, 0);
+	if(shared && (shared->pool_nic != shared->nic || shared->id == vnic->id ||
+			shared->pool_shares >= NIC_POOL_SHARE_COUNT))
+		return false;
+
+	uint64_t quota = get_value_or(attrs, VNIC_POOL_QUOTA, 0);
+	if(quota > UINT32_MAX)
+		return false;
+
+	// The pool grows from its size, and a shared one doesn't
+	uint64_t max = get_value_or(attrs, VNIC_POOL_MAX_SIZE, 0);
+	if(max && (max < vnic->nic_size || shared))
+		return false;
+
 	if(nic_init(vnic->nic, attrs) != VNIC_ERROR_NOERROR)
 		return false;
 
+	// The own pool of a VNIC sharing another one is left unused
+	NICPool* pool = &vnic->nic->pool;
+	if(shared) {
+		*pool = shared->pool;
+		pool->share = shared->pool_shares++;
+	} else {
+		pool->owner = vnic->id;
+		pool->share = 0;
+	}
+	pool->quota = quota;
+	memset((void*)pool->charged, 0, sizeof(pool->charged));
+	memset(pool->extents, 0, sizeof(pool->extents));
+	memset(pool->extent_classes, 0, sizeof(pool->extent_classes));
+	vnic->pool_nic = shared ? shared->nic : vnic->nic;
+	vnic->pool_shares = 1;
+	vnic->pool_max = max ? : vnic->nic_size;
+	memset(vnic->pool_idle, 0, sizeof(vnic->pool_idle));
+
 	strncpy(vnic->parent, (char*)get_value(attrs, VNIC_DEV), MAX_NIC_NAME_LEN);
 	vnic->nic->id = vnic->id;
 	vnic->budget = get_value(attrs, VNIC_BUDGET) ? : 32;
+	vnic->budget = poll_budget_init(&vnic->poll, get_value_or(attrs, VNIC_BUDGET_MIN, 0),
+			get_value_or(attrs, VNIC_BUDGET_MAX, 0), vnic->budget);
 	vnic->magic = vnic->nic->magic;
 	vnic->mac = vnic->nic->mac;
 	vnic->flags = vnic->nic->flags;
-	vnic->pool.bitmap = vnic->nic->pool.bitmap;
-	vnic->pool.count = vnic->nic->pool.count;
-	vnic->pool.pool = vnic->nic->pool.pool;
+	vnic->pool = vnic->nic->pool;
+	vnic->pool.deferred_count = 0;
+	vnic->pool.deferred_lock = 0;
+	vnic->stats = vnic->nic->stats;
+	vnic->group = get_value_or(attrs, VNIC_GROUP, 0);
+	vnic->queue_count = vnic->nic->queue_count;
+	vnic->tx_queue = 0;
 
 	vnic->rx_bandwidth = vnic->nic->rx_bandwidth;
 	vnic->tx_bandwidth = vnic->nic->tx_bandwidth;
 	vnic->padding_head = vnic->nic->padding_head;
 	vnic->padding_tail = vnic->nic->padding_tail;
 
-	vnic->rx = vnic->nic->rx;
-	vnic->tx = vnic->nic->tx;
-	vnic->srx = vnic->nic->srx;
-	vnic->stx = vnic->nic->stx;
-
-	vnic->rx_closed = vnic->tx_closed = timer_frequency();
-	vnic->rx_wait = TIMER_FREQUENCY_PER_SEC * 8 / vnic->rx_bandwidth;
-	vnic->rx_wait_grace = TIMER_FREQUENCY_PER_SEC / 100;
-	vnic->tx_wait = TIMER_FREQUENCY_PER_SEC * 8 / vnic->tx_bandwidth;
-	vnic->tx_wait_grace = TIMER_FREQUENCY_PER_SEC / 1000;
+	token_bucket_init(&vnic->rx_bucket, TIMER_FREQUENCY_PER_SEC, vnic->rx_bandwidth, get_value_or(attrs, VNIC_RX_BURST, 0),
+			get_value_or(attrs, VNIC_RX_PACKET_RATE, 0), 0, NULL);
+	token_bucket_init(&vnic->tx_bucket, TIMER_FREQUENCY_PER_SEC, vnic->tx_bandwidth, get_value_or(attrs, VNIC_TX_BURST, 0),
+			get_value_or(attrs, VNIC_TX_PACKET_RATE, 0), 0, NULL);
+	vnic->tx_priority = !!get_value_or(attrs, VNIC_TX_PRIORITY, 0);
+	vnic->tx_quantum = get_value_or(attrs, VNIC_TX_QUANTUM, 0) ? : VNIC_TX_QUANTUM_SIZE;
+	vnic->tx_deficit = 0;
+	rx_codel_init(vnic, get_value_or(attrs, VNIC_RX_CODEL_TARGET, CODEL_TARGET),
+			get_value_or(attrs, VNIC_RX_CODEL_INTERVAL, CODEL_INTERVAL));
+	vnic->rx_pressure = 0;
+
+	VNICConfig* config = &vnic->config;
+	config->mac = vnic->mac;
+	config->flags = vnic->flags;
+	config->budget = vnic->budget;
+	config->budget_min = get_value_or(attrs, VNIC_BUDGET_MIN, 0);
+	config->budget_max = get_value_or(attrs, VNIC_BUDGET_MAX, 0);
+	config->padding_head = vnic->padding_head;
+	config->padding_tail = vnic->padding_tail;
+	config->rx_bandwidth = vnic->rx_bandwidth;
+	config->tx_bandwidth = vnic->tx_bandwidth;
+	config->rx_burst = get_value_or(attrs, VNIC_RX_BURST, 0);
+	config->tx_burst = get_value_or(attrs, VNIC_TX_BURST, 0);
+	config->rx_packet_rate = get_value_or(attrs, VNIC_RX_PACKET_RATE, 0);
+	config->tx_packet_rate = get_value_or(attrs, VNIC_TX_PACKET_RATE, 0);
+	config->tx_quantum = vnic->tx_quantum;
+	config->tx_priority = vnic->tx_priority;
+	config->rx_codel_target = get_value_or(attrs, VNIC_RX_CODEL_TARGET, CODEL_TARGET);
+	config->rx_codel_interval = get_value_or(attrs, VNIC_RX_CODEL_INTERVAL, CODEL_INTERVAL);
+	vnic->config_version = 0;
+	vnic->config_applied = 0;
+
+	vnic->rx_burst_count = 0;
+	lock_init(&vnic->rx_lock);
 
 	return true;
 }
 
 VNICError vnic_update(VNIC* vnic, uint64_t* attrs) {
-	// TODO impl
-	return VNIC_ERROR_UNSUPPORTED;
+	VNICConfig config = vnic->config;
+	uint64_t pool_max = vnic->pool_max;
+
+	for(int i = 0; attrs[i] != VNIC_NONE; i += 2) {
+		uint64_t value = attrs[i + 1];
+		switch(attrs[i]) {
+			case VNIC_BUDGET:
+				if(value == 0 || value > UINT16_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				config.budget = value;
+				break;
+			case VNIC_BUDGET_MIN:
+			case VNIC_BUDGET_MAX:
+				if(value > UINT16_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				if(attrs[i] == VNIC_BUDGET_MIN)
+					config.budget_min = value;
+				else
+					config.budget_max = value;
+				break;
+			case VNIC_MAC:
+				if(value & ~0xffffffffffffL)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				config.mac = value;
+				break;
+			case VNIC_FLAGS:
+				if((value ^ vnic->flags) & (NIC_F_MULTIQUEUE | NIC_F_SHARED_POOL))
+					return VNIC_ERROR_UNSUPPORTED;
+				config.flags = value;
+				break;
+			case VNIC_PADDING_HEAD:
+			case VNIC_PADDING_TAIL:
+				if(value > UINT16_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				if(attrs[i] == VNIC_PADDING_HEAD)
+					config.padding_head = value;
+				else
+					config.padding_tail = value;
+				break;
+			case VNIC_RX_BANDWIDTH:
+				config.rx_bandwidth = value;
+				break;
+			case VNIC_TX_BANDWIDTH:
+				config.tx_bandwidth = value;
+				break;
+			case VNIC_RX_BURST:
+				config.rx_burst = value;
+				break;
+			case VNIC_TX_BURST:
+				config.tx_burst = value;
+				break;
+			case VNIC_RX_PACKET_RATE:
+				config.rx_packet_rate = value;
+				break;
+			case VNIC_TX_PACKET_RATE:
+				config.tx_packet_rate = value;
+				break;
+			case VNIC_TX_QUANTUM:
+				config.tx_quantum = value ? : VNIC_TX_QUANTUM_SIZE;
+				break;
+			case VNIC_TX_PRIORITY:
+				config.tx_priority = !!value;
+				break;
+			case VNIC_RX_CODEL_TARGET:
+			case VNIC_RX_CODEL_INTERVAL:
+				if(value > UINT32_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				if(attrs[i] == VNIC_RX_CODEL_TARGET)
+					config.rx_codel_target = value;
+				else
+					config.rx_codel_interval = value;
+				break;
+			case VNIC_DEV:
+				if(strncmp(vnic->parent, (char*)value, MAX_NIC_NAME_LEN) != 0)
+					return VNIC_ERROR_UNSUPPORTED;
+				break;
+			case VNIC_POOL_SIZE:
+				// The pool is mapped to the VM as it is
+				if(value != vnic->nic_size)
+					return VNIC_ERROR_UNSUPPORTED;
+				break;
+			case VNIC_POOL_MAX_SIZE:
+				// Extents beyond the size are given back as they become idle
+				if(value && value < vnic->nic_size)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				pool_max = value ? : vnic->nic_size;
+				break;
+			default:
+				return VNIC_ERROR_UNSUPPORTED;
+		}
+	}
+
+	// Odd while the record is written; the fast path doesn't pick it up then
+	vnic->config_version++;
+	asm volatile("" ::: "memory");
+	vnic->config = config;
+	asm volatile("" ::: "memory");
+	vnic->config_version++;
+
+	// Read by the manager core only, which grows and shrinks the pool
+	vnic->pool_max = pool_max;
+
+	return VNIC_ERROR_NOERROR;
+}
+
+static void config_apply(VNIC* vnic) {
+	uint32_t version = vnic->config_version;
+	if(version & 1)
+		return;
+
+	asm volatile("" ::: "memory");
+	VNICConfig config = vnic->config;
+	asm volatile("" ::: "memory");
+	if(vnic->config_version != version)
+		return;
+
+	// CoDel starts over when it is turned on or its parameters change
+	if((config.flags & ~vnic->flags & NIC_F_CODEL) || usec_ticks(config.rx_codel_target) != vnic->rx_codel[0].target ||
+			usec_ticks(config.rx_codel_interval) != vnic->rx_codel[0].interval)
+		rx_codel_init(vnic, config.rx_codel_target, config.rx_codel_interval);
+
+	vnic->mac = vnic->nic->mac = config.mac;
+	vnic->flags = vnic->nic->flags = config.flags;
+	vnic->budget = poll_budget_init(&vnic->poll, config.budget_min, config.budget_max, config.budget);
+	vnic->padding_head = vnic->nic->padding_head = config.padding_head;
+	vnic->padding_tail = vnic->nic->padding_tail = config.padding_tail;
+	vnic->rx_bandwidth = vnic->nic->rx_bandwidth = config.rx_bandwidth;
+	vnic->tx_bandwidth = vnic->nic->tx_bandwidth = config.tx_bandwidth;
+	token_bucket_update(&vnic->rx_bucket, config.rx_bandwidth, config.rx_burst, config.rx_packet_rate, 0);
+	token_bucket_update(&vnic->tx_bucket, config.tx_bandwidth, config.tx_burst, config.tx_packet_rate, 0);
+	vnic->tx_quantum = config.tx_quantum;
+	vnic->tx_priority = config.tx_priority;
+	if(vnic->tx_deficit > vnic->tx_quantum)
+		vnic->tx_deficit = vnic->tx_quantum;
+
+	vnic->config_applied = version;
+}
+
+// Called by the fast path before it uses the configuration
+static inline void config_sync(VNIC* vnic) {
+	if(vnic->config_version != vnic->config_applied)
+		config_apply(vnic);
+}
+
+void vnic_stats(VNIC* vnic, NICStats* stats) {
+	nic_stats_snapshot(vnic->nic, vnic->stats, stats);
 }
 
 Packet* vnic_alloc(VNIC* vnic, size_t size) {
-	if(!lock_trylock(&vnic->nic->pool.lock))
+	// Never wait for a lock the VM could be holding
+	return nic_pool_get(vnic->pool_nic, &vnic->pool, sizeof(Packet) + vnic->padding_head + size + vnic->padding_tail, false);
+}
+
+Packet* vnic_rx_alloc(VNIC* vnic, size_t size) {
+	if(vnic->rx_pressure & VNIC_PRESSURE_POOL)
 		return NULL;
 
-	uint8_t* bitmap = (void*)vnic->nic + vnic->pool.bitmap;
-	uint32_t count = vnic->pool.count;
-	void* pool = (void*)vnic->nic + vnic->pool.pool;
+	Packet* packet = vnic_alloc(vnic, size);
+	if(!packet)
+		vnic->rx_pressure = VNIC_PRESSURE_POOL;
 
-	uint32_t packet_size = sizeof(Packet) + vnic->padding_head + size + vnic->padding_tail;
-	uint8_t req = (ROUNDUP(packet_size, NIC_CHUNK_SIZE)) / NIC_CHUNK_SIZE;
-	uint32_t index = vnic->nic->pool.index;
+	return packet;
+}
 
-	// Find tail
-	uint32_t idx = 0;
-	for(idx = index; idx <= count - req; idx++) {
-		for(uint32_t j = 0; j < req; j++) {
-			uint32_t pos = idx + j; // base + i
-			if(bitmap[pos] == 0) {
-				continue;
-			} else {
-				// another packet uses it. jump to the end of packet chunk
-				idx += j + bitmap[pos];
-				goto next;
-			}
+bool vnic_free(VNIC* vnic, Packet* packet) {
+	NIC* nic = nic_find_by_packet(packet);
+	if(!nic || vnic->pool_nic->id != nic->id)
+		return false;
+
+	// Buffers whose free list the VM holds are put later
+	return nic_pool_put(vnic->pool_nic, &vnic->pool, packet, false);
+}
+
+static inline NICStats* stats(VNIC* vnic) {
+	return nic_stats(vnic->nic, vnic->stats);
+}
+
+static void rx_account(VNIC* vnic, uint64_t t, uint64_t bytes, uint32_t packets) {
+	token_bucket_charge(&vnic->rx_bucket, t, bytes, packets);
+
+	NICCounters* counters = &stats(vnic)->rx;
+	__sync_fetch_and_add(&counters->packets, packets);
+	__sync_fetch_and_add(&counters->bytes, bytes);
+}
+
+static void drop(NICCounters* counters, uint64_t bytes, uint32_t packets, NICDropReason reason) {
+	__sync_fetch_and_add(&counters->drop_packets, packets);
+	__sync_fetch_and_add(&counters->drop_bytes, bytes);
+	__sync_fetch_and_add(&counters->drops[reason], packets);
+}
+
+// Running out of buffers is signalled to the device until a frame gets one again
+static void rx_drop(VNIC* vnic, uint64_t bytes, uint32_t packets, NICDropReason reason) {
+	drop(&stats(vnic)->rx, bytes, packets, reason);
+
+	if(reason == NIC_DROP_NO_MEMORY && !(vnic->rx_pressure & VNIC_PRESSURE_POOL))
+		vnic->rx_pressure = VNIC_PRESSURE_POOL;
+}
+
+static void tx_account(VNIC* vnic, uint64_t packet_size) {
+	NICCounters* counters = &stats(vnic)->tx;
+	__sync_fetch_and_add(&counters->packets, 1);
+	__sync_fetch_and_add(&counters->bytes, packet_size);
+}
+
+static void tx_drop(VNIC* vnic, uint64_t packet_size, NICDropReason reason) {
+	drop(&stats(vnic)->tx, packet_size, 1, reason);
+}
+
+// Copy data into the segments of a chain from offset
+static void chain_write(VNIC* vnic, Packet* packet, size_t offset, uint8_t* buf, size_t size) {
+	for(int i = 0; packet && i < NIC_PACKET_MAX_SEGMENTS && size > 0; i++) {
+		size_t len = packet->end - packet->start;
+		if(offset < len) {
+			len -= offset;
+			if(len > size)
+				len = size;
+
+			memcpy(packet->buffer + packet->start + offset, buf, len);
+			buf += len;
+			size -= len;
+			offset = 0;
+		} else {
+			offset -= len;
 		}
 
-		goto found;
-next:
-		idx -= 1; // for loop increases idx for next loop
+		packet = nic_pool_next(vnic->pool_nic, &vnic->pool, packet);
 	}
+}
 
-	// Find head
-	for(idx = 0; idx < index - req; idx++) {
-		for(uint32_t j = 0; j < req; j++) {
-			if(bitmap[idx + j] == 0) {
-				continue;
-			} else {
-				idx += j + bitmap[idx + j];
-				goto notfound;
-			}
+// Packets are stamped once received for the residency histogram and their headers parsed
+static Packet* rx_copy(VNIC* vnic, uint64_t t, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2, uint8_t flags) {
+	Packet* packet = vnic_alloc(vnic, size1 + size2);
+	if(packet) {
+		memcpy(packet->buffer + packet->start, buf1, size1);
+		if(size2)
+			memcpy(packet->buffer + packet->start + size1, buf2, size2);
+		packet->end = packet->start + size1 + size2;
+	} else {
+		// Frames no buffer has room for are chained for VMs taking chains
+		if(!(vnic->flags & NIC_F_CHAIN))
+			return NULL;
+
+		packet = nic_pool_get_chain(vnic->pool_nic, &vnic->pool, size1 + size2, vnic->padding_head, vnic->padding_tail, false);
+		if(!packet)
+			return NULL;
+
+		chain_write(vnic, packet, 0, buf1, size1);
+		chain_write(vnic, packet, size1, buf2, size2);
+	}
+
+	if(vnic->rx_pressure & VNIC_PRESSURE_POOL)
+		vnic->rx_pressure = 0;
+
+	packet->time = t;
+	packet->flags = flags & PACKET_F_RX_CSUM;
+	nic_packet_parse(packet);
+
+	return packet;
+}
+
+// Segments are only followed in the pool of the VNIC, whose layout the kernel trusts
+static uint64_t packet_length(VNIC* vnic, Packet* packet) {
+	if(!packet->next || nic_find_by_packet(packet) != vnic->pool_nic)
+		return packet->end - packet->start;
+
+	return nic_pool_length(vnic->pool_nic, &vnic->pool, packet);
+}
+
+/*
+ * Transmitters take contiguous frames, so a chain is copied into a single
+ * buffer of the VNIC and freed. So is a frame still shared by rx queues of
+ * its group (ref > 1), as transmitters may write to it, like virtio tagging
+ * VLANs.
+ *
+ * @return NULL if the packet is dropped
+ */
+static Packet* tx_linearize(VNIC* vnic, Packet* packet, uint64_t packet_size) {
+	bool shared = packet->ref > 1;
+	if(!packet->next && !shared)
+		return packet;
+
+	// Chains of other NICs can't be followed safely
+	if(packet->next && nic_find_by_packet(packet) != vnic->pool_nic) {
+		tx_drop(vnic, packet_size, NIC_DROP_FILTERED);
+		nic_free(packet);
+		return NULL;
+	}
+
+	Packet* packet2 = vnic_alloc(vnic, packet_size);
+	if(packet2) {
+		packet2->time = packet->time;
+		packet2->vlan_proto = packet->vlan_proto;
+		packet2->vlan_tci = packet->vlan_tci;
+		packet2->hash = packet->hash;
+		packet2->flags = packet->flags;
+		packet2->l3 = packet->l3;
+		packet2->l4 = packet->l4;
+		packet2->l4_proto = packet->l4_proto;
+		packet2->gso_size = packet->gso_size;
+		packet2->end = packet2->start;
+
+		Packet* segment = packet;
+		for(int i = 0; segment && i < NIC_PACKET_MAX_SEGMENTS; i++) {
+			// The VM may change the chain under us
+			uint16_t len = segment->end > segment->start && segment->end <= segment->size ? segment->end - segment->start : 0;
+			if(len > packet2->size - packet2->end)
+				len = packet2->size - packet2->end;
+
+			memcpy(packet2->buffer + packet2->end, segment->buffer + segment->start, len);
+			packet2->end += len;
+			segment = nic_pool_next(vnic->pool_nic, &vnic->pool, segment);
 		}
+	}
+
+	// A shared frame may be in the pool of another VNIC of the group
+	if(shared)
+		nic_free(packet);
+	else
+		nic_pool_put(vnic->pool_nic, &vnic->pool, packet, false);
+	if(!packet2)
+		tx_drop(vnic, packet_size, NIC_DROP_NO_MEMORY);
 
-		goto found;
+	return packet2;
+}
+
+/*
+ * Frames asking for segmentation the transmitter can't do (tx_gso) are cut
+ * into segments in buffers of the VNIC, which are given to it in order.
+ *
+ * @return 1 if sent, 0 if the transmitter failed, -1 if the frame is dropped
+ */
+static int tx_transmit(VNIC* vnic, Packet* packet, uint64_t packet_size, uint8_t tx_gso,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	if(!(packet->flags & PACKET_F_TX_GSO))
+		return transmitter(packet, transmitter_context) ? 1 : 0;
+
+	uint16_t count = nic_packet_gso_count(packet);
+	if(count == 0 || count > VNIC_GSO_MAX_SEGMENTS) {
+		nic_free(packet);
+		tx_drop(vnic, packet_size, NIC_DROP_FILTERED);
+		return -1;
 	}
 
-notfound:
-	// Not found
-	lock_unlock(&vnic->nic->pool.lock);
-	return NULL;
+	if(count == 1)
+		packet->flags &= ~PACKET_F_TX_GSO;
+
+	uint8_t version = packet->buffer[packet->start + packet->l3] >> 4;
+	if(count == 1 || tx_gso & (version == 4 ? VNIC_TX_GSO_TCPV4 : VNIC_TX_GSO_TCPV6))
+		return transmitter(packet, transmitter_context) ? 1 : 0;
+
+	Packet* segments[VNIC_GSO_MAX_SEGMENTS];
+	NICDropReason reason = NIC_DROP_NO_MEMORY;
+	size_t size = nic_packet_gso_size(packet);
+	uint16_t i;
+	for(i = 0; i < count; i++) {
+		segments[i] = vnic_alloc(vnic, size);
+		if(!segments[i])
+			break;
+
+		// The VM may have changed the frame since it was counted
+		if(!nic_packet_gso_segment(packet, i, segments[i])) {
+			reason = NIC_DROP_FILTERED;
+			nic_free(segments[i]);
+			break;
+		}
+	}
+
+	nic_free(packet);
 
-found:
-	vnic->nic->pool.index = idx + req;
-	for(uint32_t k = 0; k < req; k++) {
-		bitmap[idx + k] = req - k;
+	if(i < count) {
+		while(i > 0)
+			nic_free(segments[--i]);
+
+		tx_drop(vnic, packet_size, reason);
+		return -1;
 	}
 
-	vnic->nic->pool.used += req;
+	// The failed segment is consumed by the transmitter, the rest are not sent
+	for(i = 0; i < count; i++) {
+		if(!transmitter(segments[i], transmitter_context)) {
+			while(++i < count)
+				nic_free(segments[i]);
 
-	lock_unlock(&vnic->nic->pool.lock);
+			return 0;
+		}
+	}
 
-	Packet* packet = pool + (idx * NIC_CHUNK_SIZE);
-	packet->time = 0;
-	packet->start = 0;
-	packet->end = 0;
-	packet->size = (req * NIC_CHUNK_SIZE) - sizeof(Packet);
+	return 1;
+}
 
-	return packet;
+// Frames of a flow go to the same queue pair
+static NICQueue* rx_queue(VNIC* vnic, Packet* packet) {
+	if(vnic->queue_count <= 1)
+		return &vnic->nic->rxq[0];
+
+	uint32_t hash = nic_packet_hash(packet);
+	return &vnic->nic->rxq[((uint64_t)hash * vnic->queue_count) >> 32];
 }
 
-bool vnic_free(VNIC* vnic, Packet* packet) {
-	NIC* nic = nic_find_by_packet(packet);
-	if(!nic || vnic->nic->id != nic->id)
+// CoDel takes the sojourn time of the oldest packet of the queue a packet is to join
+static bool rx_codel(VNIC* vnic, NICQueue* queue, uint64_t t) {
+	if(!(vnic->flags & NIC_F_CODEL))
 		return false;
 
-	uint8_t* bitmap = (void*)vnic->nic + vnic->pool.bitmap;
-	uint32_t count = vnic->pool.count;
-	void* pool = (void*)vnic + vnic->pool.pool;
+	uint64_t head = queue_head_time(vnic->nic, queue);
+	uint64_t sojourn = head && t > head ? t - head : 0;
 
-	uint32_t idx = ((uintptr_t)packet - (uintptr_t)pool) / NIC_CHUNK_SIZE;
-	if(idx >= count)
-		return false;
+	return codel_drop(&vnic->rx_codel[queue - vnic->nic->rxq], t, sojourn, queue_size(queue));
+}
 
-	uint8_t req = bitmap[idx];
-	if(idx + req > count)
-		return false;
+VNICError vnic_rx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
+	config_sync(vnic);
 
-	for(uint32_t i = idx + req - 1; i >= idx; i--)
-		bitmap[i] = 0;
+	const uint64_t t = timer_frequency();
+	const size_t size = size1 + size2;
+	NICDropReason reason = NIC_DROP_RATE_LIMITED;
+	if(!token_bucket_conform(&vnic->rx_bucket, t))
+		goto drop;
 
-	lock_lock(&vnic->nic->pool.lock);
-	vnic->nic->pool.used -= req;
-	lock_unlock(&vnic->nic->pool.lock);
+	reason = NIC_DROP_QUEUE_FULL;
+	if(vnic->queue_count <= 1 && !queue_available(&vnic->nic->rxq[0]))
+		goto drop;
 
-	return true;
+	reason = NIC_DROP_NO_MEMORY;
+	Packet* packet = rx_copy(vnic, t, buf1, size1, buf2, size2, 0);
+	if(!packet)
+		goto drop;
+
+	NICQueue* queue = rx_queue(vnic, packet);
+	reason = rx_codel(vnic, queue, t) ? NIC_DROP_AQM : NIC_DROP_QUEUE_FULL;
+	if(reason == NIC_DROP_AQM || !queue_push(vnic->nic, queue, packet)) {
+		nic_free(packet);
+		goto drop;
+	}
+
+	rx_account(vnic, t, size, 1);
+	return VNIC_ERROR_NOERROR;
+
+drop:
+	rx_drop(vnic, size, 1, reason);
+	return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 }
 
-VNICError vnic_rx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
+static void rx_stage(VNIC* vnic, Packet* packet) {
+	vnic->rx_burst[vnic->rx_burst_count++] = packet;
+	if(vnic->rx_burst_count >= VNIC_BURST_SIZE)
+		vnic_rx_flush(vnic);
+}
+
+VNICError vnic_rx_stage(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
+	return vnic_rx_stage0(vnic, buf1, size1, buf2, size2, 0);
+}
+
+VNICError vnic_rx_stage0(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2, uint8_t flags) {
+	config_sync(vnic);
+
 	const uint64_t t = timer_frequency();
 	const size_t size = size1 + size2;
-	if(vnic->rx_closed - vnic->rx_wait_grace > t) // TODO
-		return -1;
+	NICDropReason reason = NIC_DROP_RATE_LIMITED;
+	if(!token_bucket_conform(&vnic->rx_bucket, t))
+		goto drop;
+
+	// Frames which can't be pushed at the next flush aren't worth a copy
+	reason = NIC_DROP_QUEUE_FULL;
+	if(vnic->queue_count <= 1 && !queue_available(&vnic->nic->rxq[0]))
+		goto drop;
+
+	reason = NIC_DROP_NO_MEMORY;
+	Packet* packet = rx_copy(vnic, t, buf1, size1, buf2, size2, flags);
+	if(!packet)
+		goto drop;
+
+	rx_stage(vnic, packet);
+	return VNIC_ERROR_NOERROR;
+
+drop:
+	rx_drop(vnic, size, 1, reason);
+	return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+}
 
-	if(!lock_trylock(&vnic->nic->rx.wlock))
+VNICError vnic_rx_stage2(VNIC* vnic, Packet* packet) {
+	config_sync(vnic);
+
+	const uint64_t t = timer_frequency();
+	if(!token_bucket_conform(&vnic->rx_bucket, t)) {
+		rx_drop(vnic, packet_length(vnic, packet), 1, NIC_DROP_RATE_LIMITED);
+		vnic_free(vnic, packet);
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+	}
+
+	packet->time = t;
+	packet->flags &= PACKET_F_RX_CSUM;
+	nic_packet_parse(packet);
+	rx_stage(vnic, packet);
+
+	return VNIC_ERROR_NOERROR;
+}
+
+static bool rx_shareable(VNIC* vnic, VNIC* vnic2) {
+	return vnic->group != 0 && vnic->group == vnic2->group &&
+		vnic->padding_head == vnic2->padding_head && vnic->padding_tail == vnic2->padding_tail;
+}
+
+uint32_t vnic_rx_fanout(VNIC** vnics, uint32_t count, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
+	return vnic_rx_fanout0(vnics, count, buf1, size1, buf2, size2, 0);
+}
+
+uint32_t vnic_rx_fanout0(VNIC** vnics, uint32_t count, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2, uint8_t flags) {
+	const uint64_t t = timer_frequency();
+	const size_t size = size1 + size2;
+
+	VNIC* targets[count];
+	uint32_t targets_count = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		config_sync(vnics[i]);
+		if(!token_bucket_conform(&vnics[i]->rx_bucket, t)) {
+			rx_drop(vnics[i], size, 1, NIC_DROP_RATE_LIMITED);
+			continue;
+		}
+
+		targets[targets_count++] = vnics[i];
+	}
+
+	uint32_t staged = 0;
+	for(uint32_t i = 0; i < targets_count; i++) {
+		if(!targets[i])
+			continue;
+
+		// Take the VNICs sharing a copy with this one out of the list
+		VNIC* group[count];
+		group[0] = targets[i];
+		uint32_t group_count = 1;
+		for(uint32_t j = i + 1; j < targets_count; j++) {
+			if(targets[j] && rx_shareable(group[0], targets[j])) {
+				group[group_count++] = targets[j];
+				targets[j] = NULL;
+			}
+		}
+
+		// Any pool of the group can hold the copy
+		Packet* packet = NULL;
+		for(uint32_t j = 0; j < group_count && !packet; j++)
+			packet = rx_copy(group[j], t, buf1, size1, buf2, size2, flags);
 
-	vnic->rx.head = vnic->nic->rx.head;
-	if(queue_available(&vnic->rx)) {
-		Packet* packet = vnic_alloc(vnic, size);
 		if(!packet) {
-			lock_unlock(&vnic->nic->rx.wlock);
-			goto drop;
+			for(uint32_t j = 0; j < group_count; j++)
+				rx_drop(group[j], size, 1, NIC_DROP_NO_MEMORY);
+			continue;
 		}
 
-		memcpy(packet->buffer + packet->start, buf1, size1);
-		if(size2)
-			memcpy(packet->buffer + packet->start + size1, buf2, size2);
-		packet->end = packet->start + size;
+		packet->ref = group_count;
+		for(uint32_t j = 0; j < group_count; j++)
+			rx_stage(group[j], packet);
 
-		if(queue_push(vnic->nic, &vnic->rx, packet)) {
-			vnic->nic->rx.tail = vnic->rx.tail;
-			lock_unlock(&vnic->nic->rx.wlock);
+		staged += group_count;
+	}
 
-			if(vnic->rx_closed > t)
-				vnic->rx_closed += vnic->rx_wait * size;
-			else
-				vnic->rx_closed = t + vnic->rx_wait * size;
+	return staged;
+}
 
-			vnic->input_packets += 1;
-			vnic->input_bytes += size;
-			return VNIC_ERROR_NOERROR;
-		} else {
-			lock_unlock(&vnic->nic->rx.wlock);
-			nic_free(packet);
-			goto drop;
+uint32_t vnic_rx_flush(VNIC* vnic) {
+	uint32_t count = vnic->rx_burst_count;
+	if(count == 0)
+		return 0;
+
+	vnic->rx_burst_count = 0;
+	return vnic_rx_burst(vnic, vnic->rx_burst, count);
+}
+
+static uint32_t rx_push(VNIC* vnic, NICQueue* queue, Packet** packets, uint32_t count, uint64_t t) {
+	if(vnic->flags & NIC_F_CODEL) {
+		uint32_t kept = 0;
+		uint64_t bytes = 0;
+		for(uint32_t i = 0; i < count; i++) {
+			if(rx_codel(vnic, queue, t)) {
+				bytes += packet_length(vnic, packets[i]);
+				nic_free(packets[i]);
+			} else {
+				packets[kept++] = packets[i];
+			}
 		}
-	} else {
-		lock_unlock(&vnic->nic->rx.wlock);
-		goto drop;
+
+		if(kept < count)
+			rx_drop(vnic, bytes, count - kept, NIC_DROP_AQM);
+		count = kept;
 	}
 
-drop:
-	vnic->input_drop_packets += 1;
-	vnic->input_drop_bytes += size;
-	return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+	uint32_t received = 0;
+	while(received < count) {
+		uint32_t pushed = queue_push_burst(vnic->nic, queue, packets + received, count - received);
+		if(pushed == 0)
+			break;
+
+		received += pushed;
+	}
+
+	uint64_t bytes = 0;
+	for(uint32_t i = 0; i < received; i++)
+		bytes += packet_length(vnic, packets[i]);
+
+	rx_account(vnic, t, bytes, received);
+
+	if(received == count)
+		return received;
+
+	bytes = 0;
+	for(uint32_t i = received; i < count; i++) {
+		bytes += packet_length(vnic, packets[i]);
+		nic_free(packets[i]);
+	}
+
+	rx_drop(vnic, bytes, count - received, NIC_DROP_QUEUE_FULL);
+
+	return received;
+}
+
+uint32_t vnic_rx_burst(VNIC* vnic, Packet** packets, uint32_t count) {
+	const uint64_t t = timer_frequency();
+
+	if(vnic->queue_count <= 1)
+		return rx_push(vnic, &vnic->nic->rxq[0], packets, count, t);
+
+	// Split the burst by queue keeping the order of each flow
+	NICQueue* queues[count];
+	for(uint32_t i = 0; i < count; i++)
+		queues[i] = rx_queue(vnic, packets[i]);
+
+	uint32_t received = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		NICQueue* queue = queues[i];
+		if(!queue)
+			continue;
+
+		Packet* burst[count];
+		uint32_t n = 0;
+		for(uint32_t j = i; j < count; j++) {
+			if(queues[j] == queue) {
+				burst[n++] = packets[j];
+				queues[j] = NULL;
+			}
+		}
+
+		received += rx_push(vnic, queue, burst, n, t);
+	}
+
+	return received;
+}
+
+uint32_t vnic_rx_pressure(VNIC* vnic) {
+	uint32_t pressure = vnic->rx_pressure;
+
+	uint16_t count = vnic->queue_count > 1 ? vnic->queue_count : 1;
+	for(uint16_t i = 0; i < count; i++) {
+		if(queue_available(&vnic->nic->rxq[i]))
+			return pressure;
+	}
+
+	return pressure | VNIC_PRESSURE_QUEUE;
+}
+
+uint64_t vnic_pool_size(VNIC* vnic) {
+	uint64_t size = vnic->nic_size;
+	for(int i = 0; i < NIC_POOL_EXTENT_COUNT; i++) {
+		if(vnic->pool.extents[i].count)
+			size += NIC_POOL_EXTENT_SIZE;
+	}
+
+	return size;
+}
+
+int vnic_pool_grow_class(VNIC* vnic) {
+	if((vnic->flags & NIC_F_SHARED_POOL) || vnic_pool_size(vnic) + NIC_POOL_EXTENT_SIZE > vnic->pool_max)
+		return -1;
+
+	// Counts in the NIC are only a hint; the VM may write them
+	NICPoolCache* caches = (void*)vnic->nic + vnic->pool.cache;
+	int least = -1;
+	uint64_t least_free = 0;
+	uint64_t least_count = 1;
+	for(int class = 0; class < NIC_POOL_CLASS_COUNT; class++) {
+		uint64_t count = vnic->pool.slabs[class].count;
+		uint64_t free = vnic->nic->pool.slabs[class].free_count;
+		for(int i = 0; i < NIC_POOL_CACHE_COUNT; i++)
+			free += caches[i].count[class];
+
+		for(int i = 0; i < NIC_POOL_EXTENT_COUNT; i++) {
+			if(vnic->pool.extents[i].count && vnic->pool.extent_classes[i] == class) {
+				count += vnic->pool.extents[i].count;
+				free += vnic->nic->pool.extents[i].free_count;
+			}
+		}
+
+		if(count == 0)
+			continue;
+
+		if(free > count)
+			free = count;
+
+		if(least < 0 || free * least_count < least_free * count) {
+			least = class;
+			least_free = free;
+			least_count = count;
+		}
+	}
+
+	if(least_free * VNIC_POOL_LOW >= least_count && !(vnic->rx_pressure & VNIC_PRESSURE_POOL))
+		return -1;
+
+	return least;
+}
+
+bool vnic_pool_grow(VNIC* vnic, void* block, int class) {
+	if((vnic->flags & NIC_F_SHARED_POOL) || vnic_pool_size(vnic) + NIC_POOL_EXTENT_SIZE > vnic->pool_max)
+		return false;
+
+	int index = nic_pool_grow(vnic->nic, &vnic->pool, block, NIC_POOL_EXTENT_SIZE, class);
+	if(index < 0)
+		return false;
+
+	vnic->pool_idle[index] = 0;
+
+	return true;
+}
+
+void* vnic_pool_shrink(VNIC* vnic, uint64_t idle) {
+	uint64_t t = timer_frequency();
+	for(int i = 0; i < NIC_POOL_EXTENT_COUNT; i++) {
+		NICSlab* slab = &vnic->pool.extents[i];
+		if(slab->count == 0)
+			continue;
+
+		if(vnic->nic->pool.extents[i].free_count != slab->count) {
+			vnic->pool_idle[i] = 0;
+			continue;
+		}
+
+		if(vnic->pool_idle[i] == 0) {
+			vnic->pool_idle[i] = t;
+			continue;
+		}
+
+		if(t - vnic->pool_idle[i] < usec_ticks(idle))
+			continue;
+
+		void* block = nic_pool_shrink(vnic->nic, &vnic->pool, i);
+		if(block) {
+			vnic->pool_idle[i] = 0;
+			return block;
+		}
+	}
+
+	return NULL;
 }
 
 VNICError vnic_rx2(VNIC* vnic, Packet* packet) {
 	// For VNICs belonging to the same VM: exchanging is done by putting packets in the queue
 	// For VNICs not in the same VM: packets are replicated for exchange
+	config_sync(vnic);
+
 	uint64_t t = timer_frequency();
-	if(vnic->rx_closed - vnic->rx_wait_grace > t)
-		goto drop;
-	if(!lock_trylock(&vnic->nic->rx.wlock))
+	uint64_t size = packet_length(vnic, packet);
+	NICDropReason reason = NIC_DROP_RATE_LIMITED;
+	if(!token_bucket_conform(&vnic->rx_bucket, t))
 		goto drop;
 
-	vnic->rx.head = vnic->nic->rx.head;
-	if(queue_push(vnic->nic, &vnic->rx, packet)) {
-		vnic->nic->rx.tail = vnic->rx.tail;
-		lock_unlock(&vnic->nic->rx.wlock);
-
-		if(vnic->rx_closed > t)
-			vnic->rx_closed += vnic->rx_wait * (packet->end - packet->start);
-		else
-			vnic->rx_closed = t + vnic->rx_wait * (packet->end - packet->start);
-
-		vnic->input_packets += 1;
-		vnic->input_bytes += packet->end - packet->start;
-		return VNIC_ERROR_NOERROR;
-	} else {
-		lock_unlock(&vnic->nic->rx.wlock);
+	packet->time = t;
+	NICQueue* queue = rx_queue(vnic, packet);
+	reason = rx_codel(vnic, queue, t) ? NIC_DROP_AQM : NIC_DROP_QUEUE_FULL;
+	if(reason == NIC_DROP_AQM || !queue_push(vnic->nic, queue, packet)) {
 		nic_free(packet);
 		goto drop;
 	}
 
+	rx_account(vnic, t, size, 1);
+	return VNIC_ERROR_NOERROR;
+
 drop:
-	vnic->input_drop_packets += 1;
-	vnic->input_drop_bytes += packet->end - packet->start;
+	rx_drop(vnic, size, 1, reason);
 	return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 }
 
 bool vnic_has_srx(VNIC* vnic) {
-	vnic->srx.head = vnic->nic->srx.head;
-	return queue_available(&vnic->srx);
+	return !queue_empty(&vnic->nic->srx);
 }
 
 bool vnic_srx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
-	if(!lock_trylock(&vnic->nic->srx.wlock))
+	if(!queue_available(&vnic->nic->srx))
 		return false;
 
 	size_t size = size1 + size2;
-	vnic->srx.head = vnic->nic->srx.head;
-	if(queue_available(&vnic->srx)) {
-		Packet* packet = vnic_alloc(vnic, size);
-		if(packet == NULL) {
-			lock_unlock(&vnic->nic->srx.wlock);
-			return false;
-		}
+	Packet* packet = vnic_alloc(vnic, size);
+	if(packet == NULL)
+		return false;
 
-		memcpy(packet->buffer + packet->start, buf1, size1);
+	memcpy(packet->buffer + packet->start, buf1, size1);
+	if(size2)
 		memcpy(packet->buffer + packet->start + size1, buf2, size2);
 
-		packet->end = packet->start + size;
+	packet->end = packet->start + size;
 
-		if(queue_push(vnic->nic, &vnic->srx, packet)) {
-			vnic->nic->srx.tail = vnic->srx.tail;
-			lock_unlock(&vnic->nic->srx.wlock);
-			return true;
-		} else {
-			lock_unlock(&vnic->nic->srx.wlock);
-			nic_free(packet);
-			return false;
-		}
-	} else {
-		lock_unlock(&vnic->nic->srx.wlock);
+	if(!queue_push(vnic->nic, &vnic->nic->srx, packet)) {
+		nic_free(packet);
 		return false;
 	}
+
+	return true;
 }
 
 bool vnic_srx2(VNIC* vnic, Packet* packet) {
-	if(!lock_trylock(&vnic->nic->srx.wlock))
-		return false;
-	vnic->srx.head = vnic->nic->srx.head;
-	if(queue_push(vnic->nic, &vnic->srx, packet)) {
-		vnic->nic->srx.tail = vnic->srx.tail;
-		lock_unlock(&vnic->nic->srx.wlock);
-		return true;
-	} else {
-		lock_unlock(&vnic->nic->srx.wlock);
+	if(!queue_push(vnic->nic, &vnic->nic->srx, packet)) {
 		nic_free(packet);
 		return false;
 	}
+
+	return true;
 }
 
 bool vnic_has_tx(VNIC* vnic) {
-	vnic->tx.tail = vnic->nic->tx.tail;
-	return !queue_empty(&vnic->tx);
+	for(uint16_t i = 0; i < vnic->queue_count; i++) {
+		if(!queue_empty(&vnic->nic->txq[i]))
+			return true;
+	}
+
+	return false;
+}
+
+static uint32_t tx_backlog(VNIC* vnic) {
+	uint32_t backlog = 0;
+	for(uint16_t i = 0; i < vnic->queue_count; i++)
+		backlog += queue_size(&vnic->nic->txq[i]);
+
+	return backlog;
+}
+
+// Queues are served round robin, starting next time after the last one served
+static NICQueue* tx_queue(VNIC* vnic, uint16_t i) {
+	uint16_t queue = (vnic->tx_queue + i) % vnic->queue_count;
+	return &vnic->nic->txq[queue];
 }
 
 VNICError vnic_tx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	config_sync(vnic);
+
 	if(!vnic_has_tx(vnic))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
 	uint64_t t = timer_frequency();
-	if(vnic->tx_closed - vnic->tx_wait_grace > t)
-		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
-
-	if(!lock_trylock(&vnic->nic->tx.rlock))
+	if(!token_bucket_conform(&vnic->tx_bucket, t))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
-	bool transmitted	= false;
+	bool transmitted = false;
 
-	vnic->tx.tail		= vnic->nic->tx.tail;
-	Packet* packet		= queue_pop(vnic->nic, &vnic->tx);
-	vnic->nic->tx.head	= vnic->tx.head;
+	Packet* packet = NULL;
+	for(uint16_t i = 0; i < vnic->queue_count && !packet; i++) {
+		packet = queue_pop(vnic->nic, tx_queue(vnic, i));
+		if(packet)
+			vnic->tx_queue = (vnic->tx_queue + i + 1) % vnic->queue_count;
+	}
 
 	if(packet) {
-		uint64_t packet_size = packet->end - packet->start;
-		if(vnic->tx_closed > t)
-			vnic->tx_closed += vnic->tx_wait * packet_size;
-		else
-			vnic->tx_closed = t + vnic->tx_wait * packet_size;
-
-		transmitted = transmitter(packet, transmitter_context);
-		if(transmitted) {
-			vnic->output_packets += 1;
-			vnic->output_bytes += packet_size;
-		} else {
-			vnic->output_drop_packets += 1;
-			vnic->output_drop_bytes += packet_size;
+		uint64_t packet_size = packet_length(vnic, packet);
+		nic_stats_residency(&stats(vnic)->tx, packet->time, t);
+
+		packet = tx_linearize(vnic, packet, packet_size);
+		if(packet) {
+			int sent = tx_transmit(vnic, packet, packet_size, vnic->tx_gso, transmitter, transmitter_context);
+			transmitted = sent > 0;
+			if(transmitted) {
+				token_bucket_charge(&vnic->tx_bucket, t, packet_size, 1);
+				tx_account(vnic, packet_size);
+			} else if(sent == 0) {
+				tx_drop(vnic, packet_size, NIC_DROP_QUEUE_FULL);
+			}
 		}
 	}
 
-	lock_unlock(&vnic->nic->tx.rlock);
 	return transmitted ? VNIC_ERROR_NOERROR : VNIC_ERROR_OPERATION_FAILED;
 }
 
-bool vnic_has_stx(VNIC* vnic) {
-	vnic->stx.tail = vnic->nic->stx.tail;
-	return !queue_empty(&vnic->stx);
+/*
+ * Send up to budget packets of a queue while they conform to the tx shaper
+ * and fit in the deficit if there is one
+ *
+ * @return false if the transmitter failed
+ */
+static bool tx_burst(VNIC* vnic, NICQueue* queue, uint32_t budget, uint32_t* count, uint64_t t, int64_t* deficit,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	Packet* packets[VNIC_BURST_SIZE];
+	NICCounters* counters = &stats(vnic)->tx;
+	uint32_t sent = *count;
+	uint64_t bytes = 0;
+	bool failed = false;
+	bool limited = false;
+
+	while(budget > 0 && !failed && !limited) {
+		uint32_t n = queue_peek(vnic->nic, queue, packets, budget < VNIC_BURST_SIZE ? budget : VNIC_BURST_SIZE);
+		if(n == 0)
+			break;
+
+		uint32_t i;
+		for(i = 0; i < n && !failed; i++) {
+			Packet* packet = packets[i];
+			if(!packet)
+				continue;
+
+			// Packets out of the rate stay queued
+			if(!token_bucket_conform(&vnic->tx_bucket, t)) {
+				limited = true;
+				break;
+			}
+
+			uint64_t packet_size = packet_length(vnic, packet);
+			if(deficit && (int64_t)packet_size > *deficit) {
+				limited = true;
+				break;
+			}
+
+			if(deficit)
+				*deficit -= packet_size;
+
+			nic_stats_residency(counters, packet->time, t);
+
+			packet = tx_linearize(vnic, packet, packet_size);
+			if(!packet)
+				continue;
+
+			int sent = tx_transmit(vnic, packet, packet_size, vnic->tx_gso, transmitter, transmitter_context);
+			if(sent > 0) {
+				token_bucket_charge(&vnic->tx_bucket, t, packet_size, 1);
+				bytes += packet_size;
+				(*count)++;
+			} else if(sent == 0) {
+				// The failed packet is consumed; the rest of the burst stays queued
+				tx_drop(vnic, packet_size, NIC_DROP_QUEUE_FULL);
+				failed = true;
+			}
+		}
+
+		queue_advance(vnic->nic, queue, i);
+		budget -= i;
+	}
+
+	__sync_fetch_and_add(&counters->packets, *count - sent);
+	__sync_fetch_and_add(&counters->bytes, bytes);
+
+	return !failed;
 }
 
-VNICError vnic_stx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
-	if(!vnic_has_stx(vnic))
+static VNICError tx(VNIC* vnic, uint32_t* count, int64_t* deficit, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	config_sync(vnic);
+
+	uint32_t budget = *count;
+	*count = 0;
+
+	if(!vnic_has_tx(vnic))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
-	if(!lock_trylock(&vnic->nic->stx.rlock))
+	uint64_t t = timer_frequency();
+	if(!token_bucket_conform(&vnic->tx_bucket, t))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
-	bool transmitted	= false;
+	bool failed = false;
 
-	vnic->stx.tail		= vnic->nic->stx.tail;
-	Packet* packet		= queue_pop(vnic->nic, &vnic->stx);
-	vnic->nic->stx.head	= vnic->stx.head;
+	// The budget is shared by the queues; each gets its fair part first
+	uint16_t queue_count = vnic->queue_count;
+	for(uint16_t i = 0; i < queue_count && !failed && *count < budget; i++) {
+		uint32_t share = budget / queue_count + (budget % queue_count != 0);
+		if(share > budget - *count)
+			share = budget - *count;
 
-	if(packet) {
-		uint64_t packet_size = packet->end - packet->start;
+		failed = !tx_burst(vnic, tx_queue(vnic, i), share, count, t, deficit, transmitter, transmitter_context);
+	}
 
-		transmitted = transmitter(packet, transmitter_context);
-		if(transmitted) {
-			vnic->output_packets += 1;
-			vnic->output_bytes += packet_size;
-		} else {
-			vnic->output_drop_packets += 1;
-			vnic->output_drop_bytes += packet_size;
+	for(uint16_t i = 0; i < queue_count && !failed && *count < budget; i++)
+		failed = !tx_burst(vnic, tx_queue(vnic, i), budget - *count, count, t, deficit, transmitter, transmitter_context);
+
+	vnic->tx_queue = (vnic->tx_queue + 1) % queue_count;
+
+	if(failed)
+		return VNIC_ERROR_OPERATION_FAILED;
+
+	return *count ? VNIC_ERROR_NOERROR : VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+}
+
+VNICError vnic_tx_burst(VNIC* vnic, uint32_t* count, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	return tx(vnic, count, NULL, transmitter, transmitter_context);
+}
+
+VNICError vnic_tx_drr(VNIC* vnic, uint32_t* count, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	config_sync(vnic);
+
+	if(!vnic_has_tx(vnic)) {
+		*count = 0;
+		vnic->tx_deficit = 0;
+		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+	}
+
+	vnic->tx_deficit += vnic->tx_quantum;
+
+	VNICError ret = tx(vnic, count, &vnic->tx_deficit, transmitter, transmitter_context);
+
+	// Deficit isn't saved up while the VNIC is idle or over its rate
+	if(!vnic_has_tx(vnic))
+		vnic->tx_deficit = 0;
+	else if(vnic->tx_deficit > vnic->tx_quantum && !token_bucket_conform(&vnic->tx_bucket, timer_frequency()))
+		vnic->tx_deficit = vnic->tx_quantum;
+
+	return ret;
+}
+
+uint32_t vnic_tx_schedule(VNIC** vnics, uint32_t count, uint16_t* round, TokenBucket* bucket,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	if(count == 0)
+		return 0;
+
+	const uint64_t t = timer_frequency();
+	uint32_t sent = 0;
+
+	for(uint32_t i = 0; i < count; i++) {
+		VNIC* vnic = vnics[i];
+		config_sync(vnic);
+		if(!vnic->tx_priority)
+			continue;
+
+		if(bucket && !token_bucket_conform(bucket, t))
+			return sent;
+
+		uint32_t n = vnic->budget;
+		VNICError ret = vnic_tx_burst(vnic, &n, transmitter, transmitter_context);
+		sent += n;
+
+		if(poll_budget_adaptive(&vnic->poll))
+			vnic->budget = poll_budget_update(&vnic->poll, vnic->budget, n, tx_backlog(vnic));
+
+		if(ret == VNIC_ERROR_OPERATION_FAILED)
+			return sent;
+	}
+
+	uint16_t first = *round % count;
+	for(uint32_t i = 0; i < count; i++) {
+		uint16_t index = (first + i) % count;
+		VNIC* vnic = vnics[index];
+		if(vnic->tx_priority)
+			continue;
+
+		// The round goes on from this VNIC next time
+		if(bucket && !token_bucket_conform(bucket, t)) {
+			*round = index;
+			return sent;
+		}
+
+		uint32_t n = (uint32_t)-1;
+		VNICError ret = vnic_tx_drr(vnic, &n, transmitter, transmitter_context);
+		sent += n;
+
+		if(ret == VNIC_ERROR_OPERATION_FAILED) {
+			*round = (index + 1) % count;
+			return sent;
+		}
+	}
+
+	*round = (first + 1) % count;
+
+	return sent;
+}
+
+bool vnic_has_stx(VNIC* vnic) {
+	return !queue_empty(&vnic->nic->stx);
+}
+
+VNICError vnic_stx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	if(!vnic_has_stx(vnic))
+		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+
+	bool transmitted = false;
+
+	Packet* packet = queue_pop(vnic->nic, &vnic->nic->stx);
+	if(packet) {
+		uint64_t packet_size = packet_length(vnic, packet);
+
+		packet = tx_linearize(vnic, packet, packet_size);
+		if(packet) {
+			// The slow path doesn't know the device
+			int sent = tx_transmit(vnic, packet, packet_size, 0, transmitter, transmitter_context);
+			transmitted = sent > 0;
+			if(transmitted)
+				tx_account(vnic, packet_size);
+			else if(sent == 0)
+				tx_drop(vnic, packet_size, NIC_DROP_QUEUE_FULL);
 		}
 	}
 
-	lock_unlock(&vnic->nic->stx.rlock);
 	return transmitted ? VNIC_ERROR_NOERROR : VNIC_ERROR_OPERATION_FAILED;
 }
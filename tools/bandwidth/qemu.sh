@@ -0,0 +1,161 @@
+#!/bin/bash
+
+# Throughput of multiqueue virtio-net, run on localhost with no external network.
+# PacketNgin boots in QEMU on a host only multiqueue tap device. An echo VM per
+# queue pair answers a Client of its own, so each pair carries a flow. Frames
+# up to 9000 bytes are received through mergeable receive buffers.
+#
+# Each ring layout is run on a device of its own: legacy split rings through
+# port I/O, split rings through the modern MMIO interface, and packed rings.
+
+help() {
+  echo "Usage: $0 [OPTIONS]"
+  echo ""
+  echo "        OPTIONS   : -h help"
+  echo "                    -q queue pairs"
+  echo "                    -s packet sizes (\"64 1500 9000\")"
+  echo "                    -r rings (\"legacy split packed\")"
+  echo "                    -c count"
+  echo "                    -i image"
+  echo "                    -d debug"
+}
+
+ROOT=$(cd $(dirname $0)/../.. && pwd)
+
+# Default value
+QUEUES=4
+SIZES="64 1500 9000"
+RINGS="legacy split packed"
+COUNT=10
+IMAGE="$ROOT/system.img"
+TAP="pntap0"
+HOST="192.168.100.1"
+MANAGER="192.168.100.254"
+
+while getopts "hq:s:r:c:i:d" opt
+do
+  case $opt in
+    h)
+      help
+      exit
+      ;;
+    q)
+      QUEUES=$OPTARG
+      ;;
+    s)
+      SIZES=$OPTARG
+      ;;
+    r)
+      RINGS=$OPTARG
+      ;;
+    c)
+      COUNT=$OPTARG
+      ;;
+    i)
+      IMAGE=$OPTARG
+      ;;
+    d)
+      set -x
+      ;;
+    ?)
+      help
+      exit
+      ;;
+  esac
+done
+
+cleanup() {
+    [ -n "$QEMU_PID" ] && sudo kill $QEMU_PID 2> /dev/null
+    [ -n "$CONNECT_PID" ] && kill $CONNECT_PID 2> /dev/null
+    sudo ip link delete $TAP 2> /dev/null
+}
+trap cleanup EXIT
+
+# Host only: the tap device has an address but no bridge to an uplink
+sudo ip tuntap add dev $TAP mode tap multi_queue user $(id -un) || exit 1
+sudo ip addr add $HOST/24 dev $TAP
+sudo ip link set $TAP mtu 9000 up
+
+# Device options of each ring layout
+ring_params() {
+  case $1 in
+    legacy) echo "disable-modern=on" ;;
+    split)  echo "disable-legacy=on,packed=off" ;;
+    packed) echo "disable-legacy=on,packed=on" ;;
+  esac
+}
+
+# A core for the manager and pair 0, one for each other pair, and one for each echo VM
+CORES=$((2 * QUEUES))
+export PATH="$ROOT/bin/console:$PATH"
+make -C $ROOT/examples/echo all > /dev/null || exit 1
+make -C $(dirname $0) all > /dev/null || exit 1
+rm -f rings.log
+
+for RING in $RINGS; do
+    sudo qemu-system-x86_64 $($ROOT/bin/qemu-params) -m 2048 -M pc -smp $CORES \
+        -netdev tap,id=net0,ifname=$TAP,script=no,downscript=no,queues=$QUEUES \
+        -device virtio-net-pci,netdev=net0,mq=on,mrg_rxbuf=on,vectors=$((2 * QUEUES + 2)),$(ring_params $RING) \
+        -drive file=$IMAGE,if=virtio -display none -serial file:qemu.log \
+        --no-shutdown --no-reboot &
+    QEMU_PID=$!
+
+    echo "[TEST] Waiting for PacketNgin at $MANAGER with $RING rings"
+    for i in $(seq 60); do
+        ping -c 1 -W 1 $MANAGER > /dev/null && break
+    done
+
+    # Memory the driver posts for receive and the rings it uses
+    grep "receive buffers\|rings" qemu.log
+
+    connect $MANAGER &
+    CONNECT_PID=$!
+    sleep 1
+
+    # VMs are steered to the queue pairs by their IDs
+    for i in $(seq 0 $((QUEUES - 1))); do
+        VMID=$(create -c 1 -m 0xc00000 -s 0x800000 -n dev=eth0,pool=0x400000 -a 192.168.100.$((10 + i)) | sed -n 2p)
+        upload $VMID $ROOT/examples/echo/main
+        start $VMID
+    done
+    sleep 1
+
+    for SIZE in $SIZES; do
+        echo "[TEST] Throughput of $QUEUES queue pairs, $SIZE bytes, $RING rings"
+        CLIENTS=""
+        for i in $(seq 0 $((QUEUES - 1))); do
+            java -cp $(dirname $0)/bin Client 1 $SIZE 192.168.100.$((10 + i)) 7 $COUNT > client_$i.log &
+            CLIENTS="$CLIENTS $!"
+        done
+        wait $CLIENTS
+
+        TOTAL=0
+        for i in $(seq 0 $((QUEUES - 1))); do
+            RX=$(grep "^Avg" client_$i.log | awk '{print $3}' | tr -d ',')
+            echo "Queue pair $i: ${RX:-0} pps"
+            TOTAL=$((TOTAL + ${RX:-0}))
+        done
+        echo "Total: $TOTAL pps ($((TOTAL * SIZE * 8)) bps)"
+        echo "$RING $SIZE $TOTAL" >> rings.log
+    done
+
+    kill $CONNECT_PID 2> /dev/null
+    sudo kill $QEMU_PID 2> /dev/null
+    wait $QEMU_PID 2> /dev/null
+    QEMU_PID=""
+    CONNECT_PID=""
+done
+
+# Packets per second of each ring layout side by side
+echo "[TEST] Rings compared (pps)"
+printf "%-8s" "size"
+for RING in $RINGS; do printf "%12s" $RING; done
+echo
+for SIZE in $SIZES; do
+    printf "%-8s" $SIZE
+    for RING in $RINGS; do
+        printf "%12s" $(awk -v r=$RING -v s=$SIZE '$1 == r && $2 == s { print $3 }' rings.log)
+    done
+    echo
+done
+rm -f rings.log
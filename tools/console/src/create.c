@@ -68,7 +68,8 @@ static int vm_create(int argc, char* argv[]) {
 				// Suboptions for NIC
 				enum {
 					EMPTY, MAC, DEV, IBUF, OBUF, IBAND, OBAND, HPAD, TPAD, POOL,
-					INHERITMAC, NOARP, PROMISC, BROADCAST, MULTICAST, MULTIQUEUE,
+					INHERITMAC, NOARP, PROMISC, BROADCAST, MULTICAST, MULTIQUEUE, CHAIN, CODEL, SHARED_POOL, POOL_MAX, MTU,
+					BUDGET_MIN, BUDGET_MAX, CODEL_TARGET, CODEL_INTERVAL, POOL_QUOTA,
 				};
 
 				const char* token[] = {
@@ -88,6 +89,16 @@ static int vm_create(int argc, char* argv[]) {
 					[BROADCAST] = "broadcast",
 					[MULTICAST] = "multicast",
 					[MULTIQUEUE] = "multiqueue",
+					[CHAIN] = "chain",
+					[CODEL] = "codel",
+					[SHARED_POOL] = "shared_pool",
+					[POOL_MAX] = "pool_max",
+					[MTU] = "mtu",
+					[BUDGET_MIN] = "budget_min",
+					[BUDGET_MAX] = "budget_max",
+					[CODEL_TARGET] = "codel_target",
+					[CODEL_INTERVAL] = "codel_interval",
+					[POOL_QUOTA] = "pool_quota",
 					NULL,
 				};
 
@@ -149,6 +160,34 @@ static int vm_create(int argc, char* argv[]) {
 							if(!is_uint32(value)) goto failure;
 							nic->pool_size = strtoul(value, NULL, 16);
 							break;
+						case POOL_MAX:
+							if(!is_uint32(value)) goto failure;
+							nic->pool_max = strtoul(value, NULL, 16);
+							break;
+						case MTU:
+							if(!is_uint16(value)) goto failure;
+							nic->mtu = strtoul(value, NULL, 0);
+							break;
+						case BUDGET_MIN:
+							if(!is_uint16(value)) goto failure;
+							nic->budget_min = strtoul(value, NULL, 0);
+							break;
+						case BUDGET_MAX:
+							if(!is_uint16(value)) goto failure;
+							nic->budget_max = strtoul(value, NULL, 0);
+							break;
+						case CODEL_TARGET:
+							if(!is_uint32(value)) goto failure;
+							nic->codel_target = strtoul(value, NULL, 0);
+							break;
+						case CODEL_INTERVAL:
+							if(!is_uint32(value)) goto failure;
+							nic->codel_interval = strtoul(value, NULL, 0);
+							break;
+						case POOL_QUOTA:
+							if(!is_uint32(value)) goto failure;
+							nic->pool_quota = strtoul(value, NULL, 16);
+							break;
 						case INHERITMAC:
 							if(!strcmp("on", value)) {
 								nic->flags |= NICSPEC_F_INHERITMAC;
@@ -197,6 +236,30 @@ static int vm_create(int argc, char* argv[]) {
 								nic->flags ^= NICSPEC_F_MULTIQUEUE;
 							} else goto failure;
 							break;
+						case CHAIN:
+							if(!strcmp("on", value)) {
+								nic->flags |= NICSPEC_F_CHAIN;
+							} else if(!strcmp("off", value)) {
+								nic->flags |= NICSPEC_F_CHAIN;
+								nic->flags ^= NICSPEC_F_CHAIN;
+							} else goto failure;
+							break;
+						case CODEL:
+							if(!strcmp("on", value)) {
+								nic->flags |= NICSPEC_F_CODEL;
+							} else if(!strcmp("off", value)) {
+								nic->flags |= NICSPEC_F_CODEL;
+								nic->flags ^= NICSPEC_F_CODEL;
+							} else goto failure;
+							break;
+						case SHARED_POOL:
+							if(!strcmp("on", value)) {
+								nic->flags |= NICSPEC_F_SHARED_POOL;
+							} else if(!strcmp("off", value)) {
+								nic->flags |= NICSPEC_F_SHARED_POOL;
+								nic->flags ^= NICSPEC_F_SHARED_POOL;
+							} else goto failure;
+							break;
 						default:
 							goto failure;
 							break;
@@ -231,6 +231,12 @@ static rx_handler_result_t dispatcher_handle_frame(struct sk_buff** pskb)
 	BUG_ON(!nic_device);
 
 	int res = nicdev_rx(nic_device, eth, ETH_HLEN + skb->len);
+
+	// Frames come one at a time with no end of poll, so each is delivered as it is staged.
+	// VLAN devices share the rx queue of the parent
+	for(NICDevice* dev = nic_device; dev; dev = dev->next)
+		nicdev_rx_flush(dev);
+
 	if(res == NICDEV_PROCESS_COMPLETE) {
 		kfree_skb(skb);
 		return RX_HANDLER_CONSUMED;